@@ -1,5 +1,6 @@
 #include <opaque.h>
 #include <string.h>
+#include <stdlib.h>
 #include "utils.c"
 
 static const uint8_t OPAQUE_CONTEXT[]="SASL OPAQUE Mechanism";
@@ -144,6 +145,11 @@ static int opaque_setpass(void *glob_context __attribute__((unused)),
       //fprintf(stderr,"idU: \"%s\"(%d), idS: \"%s\"(%d)\n", ids.idU, ids.idU_len, ids.idS, ids.idS_len);
 
       r = opaque_Register((uint8_t*)pass, passlen, NULL, &ids, rec, NULL);
+      if(r==OPAQUE_BUSY) {
+        sparams->utils->seterror(sparams->utils->conn, 0, "OPAQUE: hardening memory budget exhausted, try again later");
+        r = SASL_TRYAGAIN;
+        goto end;
+      }
       if(r) {
         sparams->utils->seterror(sparams->utils->conn, 0, "Error registering with opaque");
         goto end;
@@ -438,6 +444,17 @@ static sasl_server_plug_t opaque_server_plugins[] = {
     }
 };
 
+/* reads an unsigned number from the options of the mechanism, def if not set */
+static unsigned long get_opt_ulong(const sasl_utils_t *utils, const char *option, const unsigned long def) {
+    const char *val = NULL;
+    if (utils->getopt == NULL ||
+        utils->getopt(utils->getopt_context, "OPAQUE", option, &val, NULL) != SASL_OK ||
+        val == NULL || *val == 0) {
+      return def;
+    }
+    return strtoul(val, NULL, 10);
+}
+
 int sasl_server_plug_init(const sasl_utils_t *utils,
 			 int maxversion,
 			 int *out_version,
@@ -449,6 +466,16 @@ int sasl_server_plug_init(const sasl_utils_t *utils,
       return SASL_BADVERS;
     }
 
+    /* limit the memory of concurrent setpass calls, see opaque_SetHardenBudget() */
+    const unsigned long budget = get_opt_ulong(utils, "opaque_harden_budget_mib", 0);
+    if (budget > 0 &&
+        opaque_SetHardenBudget((size_t) budget << 20,
+                               (unsigned) get_opt_ulong(utils, "opaque_harden_queue", 0),
+                               (uint32_t) get_opt_ulong(utils, "opaque_harden_timeout_ms", 0)) != 0) {
+      utils->seterror(utils->conn, 0, "OPAQUE: invalid opaque_harden_budget_mib");
+      return SASL_BADPARAM;
+    }
+
     *out_version = SASL_SERVER_PLUG_VERSION;
     *pluglist = opaque_server_plugins;
     *plugcount = 1;
@@ -674,6 +701,11 @@ static int opaque_client_mech_step2(context_t *ctx,
   result = opaque_RecoverCredentials((uint8_t*) serverin, ctx->client_sec,
                                      OPAQUE_CONTEXT, OPAQUE_CONTEXT_BYTES, &ids,
                                      ctx->sk, (uint8_t*)ctx->out_buf, NULL);
+  if(result==OPAQUE_BUSY) {
+    SETERROR(params->utils, "OPAQUE hardening memory budget exhausted, try again later\n");
+    result = SASL_TRYAGAIN;
+    goto cleanup;
+  }
   if(result) {
     SETERROR(params->utils, "Failed to recover OPAQUE credentials\n");
     result = SASL_BADAUTH;
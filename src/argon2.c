@@ -0,0 +1,768 @@
+/*
+    @copyright 2018-21, opaque@ctrlc.hu
+    This file is part of libopaque.
+
+    libopaque is free software: you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public License
+    as published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    libopaque is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libopaque. If not, see <http://www.gnu.org/licenses/>.
+
+    This file implements Argon2id as specified by RFC 9106 with more
+    than one lane. libsodium only implements a single lane, which keeps
+    one core busy while the others idle. Here the lanes of a slice are
+    filled concurrently, one thread each, started once per hardening,
+    the threads meet at the end of every slice since the next slice may
+    reference any lane.
+    BLAKE2b is taken from libsodium, only the compression of the memory
+    blocks (the BlaMka permutation) is implemented here, portable and
+    with avx2 on x86_64 cpus that have it, see argon2_select().
+*/
+
+#include "argon2.h"
+#include "common.h"
+#include <sodium.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if _WIN32 == 1 || _WIN64 == 1
+#include <malloc.h>
+#endif
+
+#if (_WIN32 == 1 || _WIN64 == 1 || defined __EMSCRIPTEN__) && !defined ARGON2_NOTHREADS
+#define ARGON2_NOTHREADS 1
+#endif
+#ifndef ARGON2_NOTHREADS
+#include <pthread.h>
+#endif
+
+#define ARGON2_VERSION 0x13
+#define ARGON2_TYPE_ID 2
+#define ARGON2_SYNC_POINTS 4
+#define ARGON2_BLOCK_WORDS 128
+#define ARGON2_BLOCK_SIZE (ARGON2_BLOCK_WORDS * 8)
+#define ARGON2_PREHASH_BYTES 64
+#define ARGON2_MAX_LANES 255
+
+typedef struct {
+  uint64_t v[ARGON2_BLOCK_WORDS];
+} Argon2_Block;
+
+typedef struct {
+  Argon2_Block *memory;
+  uint32_t passes;
+  uint32_t lanes;
+  uint32_t lane_length;
+  uint32_t segment_length;
+  uint32_t memory_blocks;
+} Argon2_Instance;
+
+static void store32(uint8_t *p, const uint32_t v) {
+  p[0] = (uint8_t) v;
+  p[1] = (uint8_t) (v >> 8);
+  p[2] = (uint8_t) (v >> 16);
+  p[3] = (uint8_t) (v >> 24);
+}
+
+static void update32(crypto_generichash_blake2b_state *st, const uint32_t v) {
+  uint8_t b[4];
+  store32(b, v);
+  crypto_generichash_blake2b_update(st, b, sizeof b);
+}
+
+/*
+ * H' - the variable-length hash function of section 3.3 of RFC 9106
+ *   if T <= 64
+ *       H'^T(A) = H^T(LE32(T)||A)
+ *   else
+ *       r = ceil(T/32)-2
+ *       V_1 = H^(64)(LE32(T)||A)
+ *       V_2 = H^(64)(V_1)
+ *       ...
+ *       V_r = H^(64)(V_{r-1})
+ *       V_{r+1} = H^(T-32*r)(V_{r})
+ *       H'^T(X) = W_1 || W_2 || ... || W_r || V_{r+1}
+ * A is given as the two parts a and b.
+ */
+static void hprime(uint8_t *out, const uint32_t outlen,
+                   const uint8_t *a, const size_t a_len,
+                   const uint8_t *b, const size_t b_len) {
+  crypto_generichash_blake2b_state st;
+  const size_t first = (outlen <= 64) ? outlen : 64;
+  uint8_t v[64];
+  crypto_generichash_blake2b_init(&st, NULL, 0, first);
+  update32(&st, outlen);
+  crypto_generichash_blake2b_update(&st, a, a_len);
+  crypto_generichash_blake2b_update(&st, b, b_len);
+  if(outlen <= 64) {
+    crypto_generichash_blake2b_final(&st, out, outlen);
+    return;
+  }
+  crypto_generichash_blake2b_final(&st, v, sizeof v);
+  const uint32_t r = (outlen + 31) / 32 - 2;
+  uint32_t i;
+  for(i=1;i<r;i++) {
+    memcpy(out, v, 32);
+    out += 32;
+    crypto_generichash_blake2b(v, sizeof v, v, sizeof v, NULL, 0);
+  }
+  memcpy(out, v, 32);
+  out += 32;
+  crypto_generichash_blake2b(out, outlen - 32 * r, v, sizeof v, NULL, 0);
+  sodium_memzero(v, sizeof v);
+}
+
+static inline uint64_t rotr64(const uint64_t x, const unsigned n) {
+  return (x >> n) | (x << (64 - n));
+}
+
+// the multiplication hardened G of BLAKE2b (BlaMka), section 3.6
+static inline uint64_t fBlaMka(const uint64_t x, const uint64_t y) {
+  const uint64_t m = UINT64_C(0xffffffff);
+  return x + y + 2 * ((x & m) * (y & m));
+}
+
+#define GB(a, b, c, d)                  \
+  do {                                  \
+    a = fBlaMka(a, b);                  \
+    d = rotr64(d ^ a, 32);              \
+    c = fBlaMka(c, d);                  \
+    b = rotr64(b ^ c, 24);              \
+    a = fBlaMka(a, b);                  \
+    d = rotr64(d ^ a, 16);              \
+    c = fBlaMka(c, d);                  \
+    b = rotr64(b ^ c, 63);              \
+  } while(0)
+
+#define ROUND(v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14, v15) \
+  do {                                  \
+    GB(v0, v4, v8, v12);                \
+    GB(v1, v5, v9, v13);                \
+    GB(v2, v6, v10, v14);               \
+    GB(v3, v7, v11, v15);               \
+    GB(v0, v5, v10, v15);               \
+    GB(v1, v6, v11, v12);               \
+    GB(v2, v7, v8, v13);                \
+    GB(v3, v4, v9, v14);                \
+  } while(0)
+
+/*
+ * the compression function G of section 3.5, next = G(prev, ref), or
+ * since version 1.3 in the passes after the first next ^= G(prev, ref)
+ */
+// work holds R and Z, it is wiped by the caller once per segment
+static void fill_block_ref(const Argon2_Block *prev, const Argon2_Block *ref,
+                       Argon2_Block *next, const int with_xor,
+                       Argon2_Block work[2]) {
+  Argon2_Block *R = &work[0], *Z = &work[1];
+  unsigned i;
+  for(i=0;i<ARGON2_BLOCK_WORDS;i++) R->v[i] = prev->v[i] ^ ref->v[i];
+  memcpy(Z, R, sizeof *Z);
+  if(with_xor) {
+    for(i=0;i<ARGON2_BLOCK_WORDS;i++) Z->v[i] ^= next->v[i];
+  }
+  // P on the rows of 16 words
+  for(i=0;i<8;i++) {
+    uint64_t *v = &R->v[16 * i];
+    ROUND(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7],
+          v[8], v[9], v[10], v[11], v[12], v[13], v[14], v[15]);
+  }
+  // P on the columns of pairs of words
+  for(i=0;i<8;i++) {
+    uint64_t *v = &R->v[2 * i];
+    ROUND(v[0], v[1], v[16], v[17], v[32], v[33], v[48], v[49],
+          v[64], v[65], v[80], v[81], v[96], v[97], v[112], v[113]);
+  }
+  for(i=0;i<ARGON2_BLOCK_WORDS;i++) next->v[i] = Z->v[i] ^ R->v[i];
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ARGON2_HAVE_AVX2 1
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+/*
+ * the same permutation on four words per register: a row of 16 words
+ * is held by A0..D1 as in the reference implementation of argon2, the
+ * diagonal step permutes the words inside (round 1) or across (round
+ * 2) the registers.
+ */
+#define ROTR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10, \
+                                                          3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define ROTR16(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9, \
+                                                          2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define ROTR63(x) _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+// a = a + b + 2 * lo(a) * lo(b), d = (d ^ a) >>> r
+#define GB_HALF(a, b, d, ROT)                               \
+  do {                                                      \
+    __m256i ml = _mm256_mul_epu32(a, b);                    \
+    ml = _mm256_add_epi64(ml, ml);                          \
+    a = _mm256_add_epi64(a, _mm256_add_epi64(b, ml));       \
+    d = ROT(_mm256_xor_si256(d, a));                        \
+  } while(0)
+
+#define G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1) \
+  do {                                          \
+    GB_HALF(A0, B0, D0, ROTR32);                \
+    GB_HALF(A1, B1, D1, ROTR32);                \
+    GB_HALF(C0, D0, B0, ROTR24);                \
+    GB_HALF(C1, D1, B1, ROTR24);                \
+  } while(0)
+
+#define G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1) \
+  do {                                          \
+    GB_HALF(A0, B0, D0, ROTR16);                \
+    GB_HALF(A1, B1, D1, ROTR16);                \
+    GB_HALF(C0, D0, B0, ROTR63);                \
+    GB_HALF(C1, D1, B1, ROTR63);                \
+  } while(0)
+
+#define DIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1)                 \
+  do {                                                                \
+    B0 = _mm256_permute4x64_epi64(B0, _MM_SHUFFLE(0, 3, 2, 1));       \
+    C0 = _mm256_permute4x64_epi64(C0, _MM_SHUFFLE(1, 0, 3, 2));       \
+    D0 = _mm256_permute4x64_epi64(D0, _MM_SHUFFLE(2, 1, 0, 3));       \
+    B1 = _mm256_permute4x64_epi64(B1, _MM_SHUFFLE(0, 3, 2, 1));       \
+    C1 = _mm256_permute4x64_epi64(C1, _MM_SHUFFLE(1, 0, 3, 2));       \
+    D1 = _mm256_permute4x64_epi64(D1, _MM_SHUFFLE(2, 1, 0, 3));       \
+  } while(0)
+
+#define UNDIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1)               \
+  do {                                                                \
+    B0 = _mm256_permute4x64_epi64(B0, _MM_SHUFFLE(2, 1, 0, 3));       \
+    C0 = _mm256_permute4x64_epi64(C0, _MM_SHUFFLE(1, 0, 3, 2));       \
+    D0 = _mm256_permute4x64_epi64(D0, _MM_SHUFFLE(0, 3, 2, 1));       \
+    B1 = _mm256_permute4x64_epi64(B1, _MM_SHUFFLE(2, 1, 0, 3));       \
+    C1 = _mm256_permute4x64_epi64(C1, _MM_SHUFFLE(1, 0, 3, 2));       \
+    D1 = _mm256_permute4x64_epi64(D1, _MM_SHUFFLE(0, 3, 2, 1));       \
+  } while(0)
+
+#define DIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1)                 \
+  do {                                                                \
+    __m256i t1 = _mm256_blend_epi32(B0, B1, 0xCC);                    \
+    __m256i t2 = _mm256_blend_epi32(B0, B1, 0x33);                    \
+    B1 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));       \
+    B0 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1));       \
+    t1 = C0; C0 = C1; C1 = t1;                                        \
+    t1 = _mm256_blend_epi32(D0, D1, 0xCC);                            \
+    t2 = _mm256_blend_epi32(D0, D1, 0x33);                            \
+    D0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));       \
+    D1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1));       \
+  } while(0)
+
+#define UNDIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1)               \
+  do {                                                                \
+    __m256i t1 = _mm256_blend_epi32(B0, B1, 0xCC);                    \
+    __m256i t2 = _mm256_blend_epi32(B0, B1, 0x33);                    \
+    B0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));       \
+    B1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1));       \
+    t1 = C0; C0 = C1; C1 = t1;                                        \
+    t1 = _mm256_blend_epi32(D0, D1, 0x33);                            \
+    t2 = _mm256_blend_epi32(D0, D1, 0xCC);                            \
+    D0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));       \
+    D1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1));       \
+  } while(0)
+
+#define ROUND_1(A0, A1, B0, B1, C0, C1, D0, D1)         \
+  do {                                                  \
+    G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    DIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1);      \
+    G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    UNDIAGONALIZE_1(A0, B0, C0, D0, A1, B1, C1, D1);    \
+  } while(0)
+
+#define ROUND_2(A0, A1, B0, B1, C0, C1, D0, D1)         \
+  do {                                                  \
+    G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    DIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1);      \
+    G1_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    G2_AVX2(A0, A1, B0, B1, C0, C1, D0, D1);            \
+    UNDIAGONALIZE_2(A0, A1, B0, B1, C0, C1, D0, D1);    \
+  } while(0)
+
+// fill_block_ref() with avx2, work is 32 byte aligned
+AVX2 static void fill_block_avx2(const Argon2_Block *prev, const Argon2_Block *ref,
+                                 Argon2_Block *next, const int with_xor,
+                                 Argon2_Block work[2]) {
+  __m256i *R = (__m256i *) work[0].v, *Z = (__m256i *) work[1].v;
+  unsigned i;
+  for(i=0;i<32;i++) {
+    R[i] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) prev->v + i),
+                            _mm256_loadu_si256((const __m256i *) ref->v + i));
+    Z[i] = with_xor ? _mm256_xor_si256(R[i], _mm256_loadu_si256((const __m256i *) next->v + i)) : R[i];
+  }
+  for(i=0;i<4;i++) {
+    ROUND_1(R[8 * i + 0], R[8 * i + 4], R[8 * i + 1], R[8 * i + 5],
+            R[8 * i + 2], R[8 * i + 6], R[8 * i + 3], R[8 * i + 7]);
+  }
+  for(i=0;i<4;i++) {
+    ROUND_2(R[ 0 + i], R[ 4 + i], R[ 8 + i], R[12 + i],
+            R[16 + i], R[20 + i], R[24 + i], R[28 + i]);
+  }
+  for(i=0;i<32;i++) {
+    _mm256_storeu_si256((__m256i *) next->v + i, _mm256_xor_si256(R[i], Z[i]));
+  }
+}
+#endif // avx2
+
+typedef void (*fill_block_fn)(const Argon2_Block *prev, const Argon2_Block *ref,
+                              Argon2_Block *next, const int with_xor,
+                              Argon2_Block work[2]);
+static fill_block_fn fill_block = fill_block_ref;
+static int selected = 0;
+
+void argon2_select(const uint32_t cpu) {
+  fill_block_fn fn = fill_block_ref;
+#ifdef ARGON2_HAVE_AVX2
+  if(cpu & OPAQUE_CPU_AVX2) fn = fill_block_avx2;
+#else
+  (void) cpu;
+#endif
+  __atomic_store_n(&fill_block, fn, __ATOMIC_RELAXED);
+  __atomic_store_n(&selected, 1, __ATOMIC_RELEASE);
+}
+
+// without opaque_init() the block function is selected on first use
+static fill_block_fn get_fill_block(void) {
+  if(!__atomic_load_n(&selected, __ATOMIC_ACQUIRE)) argon2_select(opaque_cpu_features());
+  return __atomic_load_n(&fill_block, __ATOMIC_RELAXED);
+}
+
+// the pseudo-random values of the data-independent addressing, 3.4.1.2
+static void next_addresses(const fill_block_fn fill, Argon2_Block *address, Argon2_Block *input,
+                           const Argon2_Block *zero, Argon2_Block work[2]) {
+  input->v[6]++;
+  fill(zero, input, address, 0, work);
+  fill(zero, address, address, 0, work);
+}
+
+/*
+ * maps J1 to the index of the reference block in its lane, 3.4.2:
+ * the blocks that may be referenced are those of the last three
+ * segments (or of the ones finished so far in the first pass), in the
+ * own lane also those of the current segment, but never the previous
+ * block.
+ */
+static uint32_t index_alpha(const Argon2_Instance *instance,
+                            const uint32_t pass, const uint32_t slice,
+                            const uint32_t index, const uint32_t J1,
+                            const int same_lane) {
+  uint32_t area;
+  if(pass == 0) {
+    if(slice == 0) {
+      area = index - 1;
+    } else if(same_lane) {
+      area = slice * instance->segment_length + index - 1;
+    } else {
+      area = slice * instance->segment_length - ((index == 0) ? 1 : 0);
+    }
+  } else {
+    if(same_lane) {
+      area = instance->lane_length - instance->segment_length + index - 1;
+    } else {
+      area = instance->lane_length - instance->segment_length - ((index == 0) ? 1 : 0);
+    }
+  }
+  uint64_t x = J1;
+  x = (x * x) >> 32;
+  const uint32_t relative = area - 1 - (uint32_t) (((uint64_t) area * x) >> 32);
+  uint32_t start = 0;
+  if(pass != 0 && slice != ARGON2_SYNC_POINTS - 1) start = (slice + 1) * instance->segment_length;
+  return (uint32_t) (((uint64_t) start + relative) % instance->lane_length);
+}
+
+// the addressing state of a segment being filled, 3.4.1.2
+typedef struct {
+  Argon2_Block address, input, zero;
+  _Alignas(32) Argon2_Block work[2];
+} Argon2_Segment;
+
+// prepares filling a segment, returns the index of its first block
+static uint32_t segment_init(const Argon2_Instance *instance, const fill_block_fn fill,
+                             const uint32_t pass, const uint32_t slice,
+                             const uint32_t lane, Argon2_Segment *seg) {
+  // argon2id is data-independent in the first half of the first pass
+  const int independent = (pass == 0 && slice < ARGON2_SYNC_POINTS / 2);
+  if(independent) {
+    memset(&seg->zero, 0, sizeof seg->zero);
+    memset(&seg->input, 0, sizeof seg->input);
+    seg->input.v[0] = pass;
+    seg->input.v[1] = lane;
+    seg->input.v[2] = slice;
+    seg->input.v[3] = instance->memory_blocks;
+    seg->input.v[4] = instance->passes;
+    seg->input.v[5] = ARGON2_TYPE_ID;
+  }
+  // the first two blocks of each lane are derived from H0
+  if(pass == 0 && slice == 0) {
+    if(independent) next_addresses(fill, &seg->address, &seg->input, &seg->zero, seg->work);
+    return 2;
+  }
+  return 0;
+}
+
+// fills the blocks begin..end-1 of a segment prepared by segment_init(), 3.4
+static void segment_fill(const Argon2_Instance *instance, const fill_block_fn fill,
+                         const uint32_t pass, const uint32_t slice,
+                         const uint32_t lane, Argon2_Segment *seg,
+                         const uint32_t begin, const uint32_t end) {
+  const int independent = (pass == 0 && slice < ARGON2_SYNC_POINTS / 2);
+  uint32_t i = begin;
+  uint32_t curr = lane * instance->lane_length + slice * instance->segment_length + i;
+  uint32_t prev = (curr % instance->lane_length == 0) ? curr + instance->lane_length - 1 : curr - 1;
+  for(;i<end;i++, curr++, prev++) {
+    // the previous block of the first block of a lane is its last one
+    if(curr % instance->lane_length == 1) prev = curr - 1;
+    uint64_t rand;
+    if(independent) {
+      if(i % ARGON2_BLOCK_WORDS == 0) next_addresses(fill, &seg->address, &seg->input, &seg->zero, seg->work);
+      rand = seg->address.v[i % ARGON2_BLOCK_WORDS];
+    } else {
+      rand = instance->memory[prev].v[0];
+    }
+    // J2 selects the lane, in the first slice only the own lane
+    uint32_t ref_lane = (uint32_t) ((rand >> 32) % instance->lanes);
+    if(pass == 0 && slice == 0) ref_lane = lane;
+    const uint32_t ref_index = index_alpha(instance, pass, slice, i, (uint32_t) rand, ref_lane == lane);
+    fill(&instance->memory[prev],
+         &instance->memory[(size_t) instance->lane_length * ref_lane + ref_index],
+         &instance->memory[curr], pass != 0, seg->work);
+  }
+}
+
+// fills one segment of one lane
+static void fill_segment(const Argon2_Instance *instance,
+                         const uint32_t pass, const uint32_t slice,
+                         const uint32_t lane) {
+  const fill_block_fn fill = get_fill_block();
+  Argon2_Segment seg;
+  const uint32_t first = segment_init(instance, fill, pass, slice, lane, &seg);
+  segment_fill(instance, fill, pass, slice, lane, &seg, first, instance->segment_length);
+  sodium_memzero(&seg, sizeof seg);
+}
+
+// fills the segments of a slice that belong to worker w of n, the
+// lanes are dealt out round robin
+static void fill_lanes(const Argon2_Instance *instance, const uint32_t pass, const uint32_t slice,
+                       const uint32_t w, const uint32_t n) {
+  uint32_t l;
+  for(l=w;l<instance->lanes;l+=n) fill_segment(instance, pass, slice, l);
+}
+
+#ifndef ARGON2_NOTHREADS
+/*
+ * the workers of one argon2id() call. They are started once and fill
+ * their lanes of every slice of every pass, the next slice may
+ * reference any lane, so all of them meet at a barrier after each
+ * slice.
+ */
+typedef struct {
+  const Argon2_Instance *instance;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t workers;      // the calling thread and the started threads
+  uint32_t arrived;      // at the current barrier
+  uint64_t generation;   // of the barrier, counts the passed ones
+  int go;                // workers is final
+} Argon2_Fill;
+
+typedef struct {
+  Argon2_Fill *fill;
+  uint32_t w;
+} Argon2_Worker;
+
+static void fill_barrier(Argon2_Fill *f) {
+  pthread_mutex_lock(&f->lock);
+  const uint64_t generation = f->generation;
+  if(++f->arrived == f->workers) {
+    f->arrived = 0;
+    f->generation++;
+    pthread_cond_broadcast(&f->cond);
+  } else {
+    while(generation == f->generation) pthread_cond_wait(&f->cond, &f->lock);
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+// worker w fills its lanes of all slices, the calling thread is worker 0
+static void fill_worker(Argon2_Fill *f, const uint32_t w) {
+  uint32_t pass, slice;
+  for(pass=0;pass<f->instance->passes;pass++) {
+    for(slice=0;slice<ARGON2_SYNC_POINTS;slice++) {
+      fill_lanes(f->instance, pass, slice, w, f->workers);
+      fill_barrier(f);
+    }
+  }
+}
+
+static void *fill_thread(void *arg) {
+  const Argon2_Worker *worker = (const Argon2_Worker *) arg;
+  Argon2_Fill *f = worker->fill;
+  // the number of workers is known once all threads are started
+  pthread_mutex_lock(&f->lock);
+  while(!f->go) pthread_cond_wait(&f->cond, &f->lock);
+  pthread_mutex_unlock(&f->lock);
+  fill_worker(f, worker->w);
+  return NULL;
+}
+#endif
+
+// fills all blocks, the lanes of each slice concurrently if there is
+// more than one
+static void fill_memory(const Argon2_Instance *instance) {
+#ifndef ARGON2_NOTHREADS
+  if(instance->lanes > 1) {
+    pthread_t threads[ARGON2_MAX_LANES];
+    Argon2_Worker workers[ARGON2_MAX_LANES];
+    Argon2_Fill f;
+    uint32_t t, started = 0;
+    f.instance = instance;
+    f.arrived = 0;
+    f.generation = 0;
+    f.go = 0;
+    pthread_mutex_init(&f.lock, NULL);
+    pthread_cond_init(&f.cond, NULL);
+    // a thread per lane besides the calling one. if a thread cannot be
+    // started the lanes are dealt out to the fewer workers, the result
+    // is the same, only slower.
+    for(t=1;t<instance->lanes;t++) {
+      workers[t].fill = &f;
+      workers[t].w = t;
+      if(0 != pthread_create(&threads[t], NULL, fill_thread, &workers[t])) break;
+      started++;
+    }
+    pthread_mutex_lock(&f.lock);
+    f.workers = started + 1;
+    f.go = 1;
+    pthread_cond_broadcast(&f.cond);
+    pthread_mutex_unlock(&f.lock);
+    fill_worker(&f, 0);
+    for(t=1;t<=started;t++) pthread_join(threads[t], NULL);
+    pthread_cond_destroy(&f.cond);
+    pthread_mutex_destroy(&f.lock);
+    return;
+  }
+#endif
+  uint32_t pass, slice;
+  for(pass=0;pass<instance->passes;pass++) {
+    for(slice=0;slice<ARGON2_SYNC_POINTS;slice++) {
+      fill_lanes(instance, pass, slice, 0, 1);
+    }
+  }
+}
+
+// the blocks are aligned to cache lines, like libsodium does, otherwise
+// every other vector load straddles two lines
+static void *alloc_aligned(const size_t size) {
+#if _WIN32 == 1 || _WIN64 == 1
+  return _aligned_malloc(size, 64);
+#else
+  void *p;
+  if(0 != posix_memalign(&p, 64, size)) return NULL;
+  return p;
+#endif
+}
+
+static void free_aligned(void *p) {
+#if _WIN32 == 1 || _WIN64 == 1
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+/*
+ * a hardening in progress: the blocks are filled in the order of the
+ * specification one segment after the other, the lanes of a slice do
+ * not depend on each other so this gives the same result as filling
+ * them concurrently.
+ */
+struct Argon2_State {
+  Argon2_Segment seg;          // of the segment being filled
+  Argon2_Instance instance;
+  size_t memory_size;
+  int own_memory;              // allocated by argon2id_start()
+  uint32_t outlen;
+  uint32_t pass, slice, lane;  // the segment being filled
+  uint32_t index;              // its next block, 0 if not started
+  int done;
+};
+
+Argon2_State *argon2id_start(const uint32_t outlen,
+                             const uint8_t *pwd, const uint32_t pwdlen,
+                             const uint8_t *salt, const uint32_t saltlen,
+                             const uint8_t *secret, const uint32_t secretlen,
+                             const uint8_t *ad, const uint32_t adlen,
+                             const uint32_t t_cost, const uint32_t m_cost,
+                             const uint32_t lanes,
+                             void *memory, const size_t memory_len) {
+  if(outlen < crypto_generichash_blake2b_BYTES_MIN) return NULL;
+  if(t_cost < 1 || lanes < 1 || lanes > ARGON2_MAX_LANES) return NULL;
+  if(m_cost < 2 * ARGON2_SYNC_POINTS * lanes) return NULL;
+
+  Argon2_State *st = alloc_aligned(sizeof *st);
+  if(st == NULL) return NULL;
+  memset(st, 0, sizeof *st);
+  Argon2_Instance *instance = &st->instance;
+  // m' = 4 * p * floor(m / 4p)
+  instance->segment_length = m_cost / (lanes * ARGON2_SYNC_POINTS);
+  instance->memory_blocks = instance->segment_length * lanes * ARGON2_SYNC_POINTS;
+  instance->lane_length = instance->segment_length * ARGON2_SYNC_POINTS;
+  instance->lanes = lanes;
+  instance->passes = t_cost;
+  st->outlen = outlen;
+  if((size_t) instance->memory_blocks > SIZE_MAX / sizeof(Argon2_Block)) {
+    free_aligned(st);
+    return NULL;
+  }
+  st->memory_size = (size_t) instance->memory_blocks * sizeof(Argon2_Block);
+  if(memory != NULL) {
+    if(memory_len < st->memory_size) {
+      free_aligned(st);
+      return NULL;
+    }
+    instance->memory = (Argon2_Block *) memory;
+  } else {
+    instance->memory = alloc_aligned(st->memory_size);
+    if(instance->memory == NULL) {
+      free_aligned(st);
+      return NULL;
+    }
+    st->own_memory = 1;
+  }
+
+  // H0 = H^(64)(LE32(p) || LE32(T) || LE32(m) || LE32(t) || LE32(v) ||
+  //              LE32(y) || LE32(length(P)) || P || LE32(length(S)) || S ||
+  //              LE32(length(K)) || K || LE32(length(X)) || X)
+  uint8_t h0[ARGON2_PREHASH_BYTES], ctr[8];
+  crypto_generichash_blake2b_state hs;
+  crypto_generichash_blake2b_init(&hs, NULL, 0, sizeof h0);
+  update32(&hs, lanes);
+  update32(&hs, outlen);
+  update32(&hs, m_cost);
+  update32(&hs, t_cost);
+  update32(&hs, ARGON2_VERSION);
+  update32(&hs, ARGON2_TYPE_ID);
+  update32(&hs, pwdlen);
+  crypto_generichash_blake2b_update(&hs, pwd, pwdlen);
+  update32(&hs, saltlen);
+  crypto_generichash_blake2b_update(&hs, salt, saltlen);
+  update32(&hs, secretlen);
+  if(secretlen > 0) crypto_generichash_blake2b_update(&hs, secret, secretlen);
+  update32(&hs, adlen);
+  if(adlen > 0) crypto_generichash_blake2b_update(&hs, ad, adlen);
+  crypto_generichash_blake2b_final(&hs, h0, sizeof h0);
+
+  // B[i][0] = H'^(1024)(H0 || LE32(0) || LE32(i))
+  // B[i][1] = H'^(1024)(H0 || LE32(1) || LE32(i))
+  uint8_t blockbytes[ARGON2_BLOCK_SIZE];
+  uint32_t l, j, w;
+  for(l=0;l<lanes;l++) {
+    for(j=0;j<2;j++) {
+      store32(ctr, j);
+      store32(ctr + 4, l);
+      hprime(blockbytes, sizeof blockbytes, h0, sizeof h0, ctr, sizeof ctr);
+      Argon2_Block *b = &instance->memory[(size_t) l * instance->lane_length + j];
+      for(w=0;w<ARGON2_BLOCK_WORDS;w++) {
+        uint64_t v = 0;
+        int k;
+        for(k=7;k>=0;k--) v = (v << 8) | blockbytes[8 * w + k];
+        b->v[w] = v;
+      }
+    }
+  }
+  sodium_memzero(h0, sizeof h0);
+  sodium_memzero(blockbytes, sizeof blockbytes);
+  return st;
+}
+
+int argon2id_step(Argon2_State *st, uint64_t blocks) {
+  const Argon2_Instance *instance = &st->instance;
+  const fill_block_fn fill = get_fill_block();
+  while(!st->done && blocks > 0) {
+    if(st->index == 0) {
+      st->index = segment_init(instance, fill, st->pass, st->slice, st->lane, &st->seg);
+    }
+    uint32_t end = instance->segment_length;
+    if(blocks < end - st->index) end = st->index + (uint32_t) blocks;
+    segment_fill(instance, fill, st->pass, st->slice, st->lane, &st->seg, st->index, end);
+    blocks -= end - st->index;
+    st->index = end;
+    if(st->index < instance->segment_length) break;
+    // the segment is finished, on to the next lane, slice or pass
+    sodium_memzero(&st->seg, sizeof st->seg);
+    st->index = 0;
+    if(++st->lane < instance->lanes) continue;
+    st->lane = 0;
+    if(++st->slice < ARGON2_SYNC_POINTS) continue;
+    st->slice = 0;
+    if(++st->pass < instance->passes) continue;
+    st->done = 1;
+  }
+  return st->done;
+}
+
+void argon2id_abort(Argon2_State *st) {
+  if(st == NULL) return;
+  sodium_memzero(st->instance.memory, st->memory_size);
+  if(st->own_memory) free_aligned(st->instance.memory);
+  sodium_memzero(st, sizeof *st);
+  free_aligned(st);
+}
+
+int argon2id_finish(Argon2_State *st, uint8_t *out) {
+  const Argon2_Instance *instance = &st->instance;
+  // whatever argon2id_step() left
+  while(!argon2id_step(st, UINT64_MAX));
+
+  // C = B[0][q-1] XOR B[1][q-1] XOR ... XOR B[p-1][q-1]
+  Argon2_Block final;
+  uint8_t blockbytes[ARGON2_BLOCK_SIZE];
+  uint32_t l, w;
+  memcpy(&final, &instance->memory[instance->lane_length - 1], sizeof final);
+  for(l=1;l<instance->lanes;l++) {
+    const Argon2_Block *b = &instance->memory[(size_t) l * instance->lane_length + instance->lane_length - 1];
+    for(w=0;w<ARGON2_BLOCK_WORDS;w++) final.v[w] ^= b->v[w];
+  }
+  for(w=0;w<ARGON2_BLOCK_WORDS;w++) {
+    int k;
+    for(k=0;k<8;k++) blockbytes[8 * w + k] = (uint8_t) (final.v[w] >> (8 * k));
+  }
+  // Tag = H'^(T)(C)
+  hprime(out, st->outlen, blockbytes, sizeof blockbytes, NULL, 0);
+
+  sodium_memzero(&final, sizeof final);
+  sodium_memzero(blockbytes, sizeof blockbytes);
+  argon2id_abort(st);
+  return 0;
+}
+
+int argon2id(uint8_t *out, const uint32_t outlen,
+             const uint8_t *pwd, const uint32_t pwdlen,
+             const uint8_t *salt, const uint32_t saltlen,
+             const uint8_t *secret, const uint32_t secretlen,
+             const uint8_t *ad, const uint32_t adlen,
+             const uint32_t t_cost, const uint32_t m_cost,
+             const uint32_t lanes,
+             void *memory, const size_t memory_len) {
+  Argon2_State *st = argon2id_start(outlen, pwd, pwdlen, salt, saltlen, secret, secretlen,
+                                    ad, adlen, t_cost, m_cost, lanes, memory, memory_len);
+  if(st == NULL) return -1;
+  // all at once, with the lanes on their own threads
+  fill_memory(&st->instance);
+  st->done = 1;
+  return argon2id_finish(st, out);
+}
@@ -0,0 +1,126 @@
+/*
+    @copyright 2018-21, opaque@ctrlc.hu
+    This file is part of libopaque.
+
+    libopaque is free software: you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public License
+    as published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    libopaque is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libopaque. If not, see <http://www.gnu.org/licenses/>.
+
+    internal interface to the multi-lane Argon2id of argon2.c, not part
+    of the public api of libopaque.
+*/
+
+#ifndef ARGON2_H
+#define ARGON2_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Selects the block function for the features of the cpu, a bitmask
+ * of OPAQUE_CPU_* from opaque_cpu_features(). Called by opaque_init(),
+ * otherwise on first use with the features of the running cpu.
+ */
+void argon2_select(const uint32_t cpu);
+
+/**
+ * Argon2id version 1.3 as specified by RFC 9106, with any number of
+ * lanes (the parallelism p). The lanes are filled by one thread each,
+ * started once for the call, the output only depends on the
+ * parameters, not on how the lanes were scheduled.
+ *
+ * With one lane and without secret and ad the output is the same as
+ * that of crypto_pwhash_argon2id() with opslimit t_cost and memlimit
+ * m_cost*1024.
+ *
+ * The memory is allocated for the call, or taken from the caller, who
+ * can reuse it for many calls without faulting it in every time. Either
+ * way the used memory is wiped before returning.
+ *
+ * @param [out] out - the tag
+ * @param [in] outlen - length of out, at least 16
+ * @param [in] pwd - the password
+ * @param [in] pwdlen - length of pwd
+ * @param [in] salt - the salt
+ * @param [in] saltlen - length of salt
+ * @param [in] secret - optional secret value, may be NULL
+ * @param [in] secretlen - length of secret
+ * @param [in] ad - optional associated data, may be NULL
+ * @param [in] adlen - length of ad
+ * @param [in] t_cost - number of passes, at least 1
+ * @param [in] m_cost - memory in KiB, at least 8*lanes
+ * @param [in] lanes - the parallelism, 1 to 255
+ * @param [in] memory - memory for the blocks, 8 byte aligned and best
+ * 64, or NULL to allocate it
+ * @param [in] memory_len - length of memory, at least m_cost KiB
+ * @return 0 on success, -1 on invalid parameters or if the memory
+ * could not be allocated
+ */
+int argon2id(uint8_t *out, const uint32_t outlen,
+             const uint8_t *pwd, const uint32_t pwdlen,
+             const uint8_t *salt, const uint32_t saltlen,
+             const uint8_t *secret, const uint32_t secretlen,
+             const uint8_t *ad, const uint32_t adlen,
+             const uint32_t t_cost, const uint32_t m_cost,
+             const uint32_t lanes,
+             void *memory, const size_t memory_len);
+
+/**
+ * A hardening that is computed step by step, for hosts that cannot
+ * block for the whole duration of argon2id(). The lanes are filled one
+ * after the other on the calling thread, the output is the same as
+ * that of argon2id() with the same parameters.
+ */
+typedef struct Argon2_State Argon2_State;
+
+/**
+ * Starts a hardening, the parameters are those of argon2id(). The
+ * inputs are only read here, the memory of the caller must stay valid
+ * until argon2id_finish() or argon2id_abort().
+ *
+ * @return the state, or NULL on invalid parameters or if memory could
+ * not be allocated
+ */
+Argon2_State *argon2id_start(const uint32_t outlen,
+                             const uint8_t *pwd, const uint32_t pwdlen,
+                             const uint8_t *salt, const uint32_t saltlen,
+                             const uint8_t *secret, const uint32_t secretlen,
+                             const uint8_t *ad, const uint32_t adlen,
+                             const uint32_t t_cost, const uint32_t m_cost,
+                             const uint32_t lanes,
+                             void *memory, const size_t memory_len);
+
+/**
+ * Fills at most the given number of memory blocks of 1KiB.
+ *
+ * @param [in] st - the hardening
+ * @param [in] blocks - the number of blocks to fill
+ * @return 1 if all blocks are filled, 0 if there are more
+ */
+int argon2id_step(Argon2_State *st, uint64_t blocks);
+
+/**
+ * Fills the blocks that are left, writes the tag, and wipes and frees
+ * the state.
+ *
+ * @param [in] st - the hardening
+ * @param [out] out - the tag, of the length given to argon2id_start()
+ * @return 0
+ */
+int argon2id_finish(Argon2_State *st, uint8_t *out);
+
+/**
+ * Wipes and frees the state of an unfinished hardening, NULL is ignored.
+ */
+void argon2id_abort(Argon2_State *st);
+
+#endif // ARGON2_H
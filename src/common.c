@@ -1,4 +1,10 @@
 #include "common.h"
+#include <stdlib.h>
+#if _WIN32 == 1 || _WIN64 == 1
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
 
 #if (defined TRACE || defined CFRG_TEST_VEC)
 void dump(const uint8_t *p, const size_t len, const char* msg) {
@@ -10,6 +16,56 @@ void dump(const uint8_t *p, const size_t len, const char* msg) {
 }
 #endif // TRACE
 
+// set once the features are probed, so that 0 can be cached as well
+#define OPAQUE_CPU_PROBED (1u<<31)
+
+// may run concurrently in several threads, they all store the same value
+uint32_t opaque_cpu_features(void) {
+  static uint32_t features = 0;
+  uint32_t r = __atomic_load_n(&features, __ATOMIC_RELAXED);
+  if(r == 0) {
+    r = OPAQUE_CPU_PROBED;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.1")) r |= OPAQUE_CPU_SSE41;
+    if(__builtin_cpu_supports("avx2")) r |= OPAQUE_CPU_AVX2;
+    if(__builtin_cpu_supports("avx512f")) r |= OPAQUE_CPU_AVX512F;
+    if(__builtin_cpu_supports("sha")) r |= OPAQUE_CPU_SHA;
+#endif
+    __atomic_store_n(&features, r, __ATOMIC_RELAXED);
+  }
+  return r & ~OPAQUE_CPU_PROBED;
+}
+
+// the critical sections under these locks are a few copies, a waiter
+// spins a while and then gives up its time slice, so that it does not
+// burn the slice of a preempted holder on a busy or single cpu host
+#define SPIN_PAUSES 64
+
+void opaque_spin_lock(atomic_flag *lock) {
+  unsigned spins = 0;
+  while(atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+    if(spins < SPIN_PAUSES) {
+      spins++;
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+      __builtin_ia32_pause();
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+      __asm__ __volatile__("yield");
+#endif
+    } else {
+#if _WIN32 == 1 || _WIN64 == 1
+      SwitchToThread();
+#elif !defined __EMSCRIPTEN__
+      sched_yield();
+#endif
+    }
+  }
+}
+
+void opaque_spin_unlock(atomic_flag *lock) {
+  atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
 #ifdef NORANDOM
 void a_randombytes(void* const buf, const size_t len) {
   size_t i;
@@ -21,8 +77,288 @@ void a_randomscalar(uint8_t* buf) {
   a_randombytes(tmp, 64);
   crypto_core_ristretto255_scalar_reduce(buf, tmp);
 }
+#else // NORANDOM
+
+/*
+ * A per-thread fast key erasure DRBG, so that the hot paths do not do
+ * a syscall for each random value: the thread state is seeded with 32
+ * bytes from the OS, each refill of the buffer is a chacha20 keystream
+ * whose first 32 bytes replace the key, and the bytes handed out are
+ * wiped from the buffer. After DRBG_RESEED bytes the state is reseeded.
+ *
+ * A forked child must never repeat the output of its parent. On linux
+ * a process wide generation number lives in a page marked
+ * MADV_WIPEONFORK, a child sees it zeroed, picks a new one, and every
+ * thread state seeded under another generation is reseeded. Elsewhere
+ * the pid is compared on each call.
+ */
+#if _WIN32 == 1 || _WIN64 == 1
+#define DRBG_NOFORK 1
+#endif
+#if _WIN32 == 1 || _WIN64 == 1 || defined __EMSCRIPTEN__
+#define DRBG_NOKEY 1
+#else
+#include <pthread.h>
+#endif
+#ifndef DRBG_NOFORK
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define DRBG_BUFBYTES 512
+#define DRBG_RESEED (1UL<<20)
+
+typedef struct {
+  uint64_t gen;          // generation the state was seeded under, 0 if unseeded
+  long pid;
+  size_t pos;            // first unused byte in buf
+  size_t left;           // bytes to hand out before reseeding
+  uint8_t key[crypto_stream_chacha20_KEYBYTES];
+  uint8_t buf[DRBG_BUFBYTES];
+} Drbg_State;
+
+static _Thread_local Drbg_State drbg;
+
+#ifdef MADV_WIPEONFORK
+static uint64_t *drbg_genpage = NULL;
+
+// returns the current generation, or 0 if fork detection by
+// MADV_WIPEONFORK is not available
+static uint64_t drbg_generation(void) {
+  uint64_t *page = __atomic_load_n(&drbg_genpage, __ATOMIC_ACQUIRE);
+  if(page==NULL) {
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    page = mmap(NULL, (size_t) pagesize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(page==MAP_FAILED) return 0;
+    if(0!=madvise(page, (size_t) pagesize, MADV_WIPEONFORK)) {
+      munmap(page, (size_t) pagesize);
+      return 0;
+    }
+    uint64_t *expected=NULL;
+    if(!__atomic_compare_exchange_n(&drbg_genpage, &expected, page, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      // another thread was faster
+      munmap(page, (size_t) pagesize);
+      page=expected;
+    }
+  }
+  uint64_t gen = __atomic_load_n(page, __ATOMIC_ACQUIRE);
+  if(gen==0) {
+    // first use in this process, or the page got wiped by a fork
+    uint64_t fresh;
+    do randombytes_buf(&fresh, sizeof fresh); while(fresh==0);
+    if(!__atomic_compare_exchange_n(page, &gen, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return gen;
+    }
+    gen=fresh;
+  }
+  return gen;
+}
+#endif // MADV_WIPEONFORK
+
+#ifndef DRBG_NOKEY
+// the state is wiped and unlocked when its thread exits, so that no
+// key is left in released memory and locked pages do not pile up
+// against RLIMIT_MEMLOCK in servers that start many threads
+static pthread_key_t drbg_key;
+static pthread_once_t drbg_once = PTHREAD_ONCE_INIT;
+static int drbg_key_ok = 0;
+
+static void drbg_destroy(void *state) {
+  sodium_memzero(state, sizeof(Drbg_State));
+  sodium_munlock(state, sizeof(Drbg_State));
+}
+
+static void drbg_key_init(void) {
+  drbg_key_ok = (0==pthread_key_create(&drbg_key, drbg_destroy));
+}
+#endif // DRBG_NOKEY
+
+static void drbg_refill(void) {
+  static const uint8_t nonce[crypto_stream_chacha20_NONCEBYTES]={0};
+  crypto_stream_chacha20(drbg.buf, sizeof drbg.buf, nonce, drbg.key);
+  memcpy(drbg.key, drbg.buf, sizeof drbg.key);
+  sodium_memzero(drbg.buf, sizeof drbg.key);
+  drbg.pos=sizeof drbg.key;
+}
+
+static void drbg_check(const size_t len) {
+  uint64_t gen=1;
+#ifndef DRBG_NOFORK
+  long pid=0;
+#ifdef MADV_WIPEONFORK
+  gen=drbg_generation();
+  if(gen==0)
+#endif
+  {
+    gen=1;
+    pid=(long) getpid();
+  }
+  if(drbg.gen==gen && drbg.pid==pid && drbg.left>=len) return;
+  drbg.pid=pid;
+#else
+  if(drbg.gen==gen && drbg.left>=len) return;
+#endif
+  if(drbg.gen==0) {
+    // best effort, the state lives as long as the thread
+    (void) sodium_mlock(&drbg, sizeof drbg);
+#ifndef DRBG_NOKEY
+    pthread_once(&drbg_once, drbg_key_init);
+    if(drbg_key_ok) (void) pthread_setspecific(drbg_key, &drbg);
+#endif
+  }
+  randombytes_buf(drbg.key, sizeof drbg.key);
+  drbg.gen=gen;
+  drbg.left=DRBG_RESEED;
+  drbg_refill();
+}
+
+void opaque_randombytes(void* const buf, const size_t len) {
+  uint8_t *out = (uint8_t*) buf;
+  size_t n, left = len;
+
+  drbg_check(len);
+  drbg.left = (len < drbg.left) ? drbg.left - len : 0;
+
+  if(len > DRBG_BUFBYTES/2) {
+    // long outputs are a keystream under a key taken from the buffer
+    static const uint8_t nonce[crypto_stream_chacha20_NONCEBYTES]={0};
+    uint8_t subkey[crypto_stream_chacha20_KEYBYTES];
+    opaque_randombytes(subkey, sizeof subkey);
+    crypto_stream_chacha20(out, len, nonce, subkey);
+    sodium_memzero(subkey, sizeof subkey);
+    return;
+  }
+
+  while(left>0) {
+    if(drbg.pos==DRBG_BUFBYTES) drbg_refill();
+    n = DRBG_BUFBYTES - drbg.pos;
+    if(n>left) n=left;
+    memcpy(out, drbg.buf+drbg.pos, n);
+    sodium_memzero(drbg.buf+drbg.pos, n);
+    drbg.pos+=n;
+    out+=n;
+    left-=n;
+  }
+}
+
+void opaque_randomscalar(uint8_t* buf) {
+  uint8_t tmp[crypto_core_ristretto255_NONREDUCEDSCALARBYTES];
+  do {
+    opaque_randombytes(tmp, sizeof tmp);
+    crypto_core_ristretto255_scalar_reduce(buf, tmp);
+  } while(sodium_is_zero(buf, crypto_core_ristretto255_SCALARBYTES));
+  sodium_memzero(tmp, sizeof tmp);
+}
 #endif // NORANDOM
 
+void* opaque_locked_alloc(const size_t len, const size_t align) {
+  // sodium_malloc() needs an initialized libsodium, calling
+  // sodium_init() more than once is harmless
+  if(sodium_init() < 0) return NULL;
+  if(len > SIZE_MAX - (align-1)) return NULL;
+  // sodium_malloc() places the end of the allocation at a page boundary,
+  // rounding the size keeps the start aligned
+  return sodium_malloc((len + align-1) & ~(align-1));
+}
+
+/*
+ * Sensitive temporaries of the protocol functions are not locked one
+ * by one on the stack, which costs a mlock/munlock syscall pair each
+ * and counts against RLIMIT_MEMLOCK for every concurrent call. Instead
+ * every thread allocates one arena with sodium_malloc() on first use,
+ * which is locked once and surrounded by guard pages, and carves the
+ * temporaries from it. Allocations are released in reverse order,
+ * wiped on release, and the arena is freed when the thread exits.
+ * Requests that do not fit fall back to single locked allocations.
+ */
+#ifndef NOARENA
+#include <pthread.h>
+
+#define SCRATCH_BYTES (64*1024)
+#define SCRATCH_ALIGN(len) (((len)+15) & ~(size_t)15)
+
+typedef struct {
+  uint8_t *base;
+  size_t top;      // first free byte
+  size_t live;     // number of unreleased allocations
+} Scratch_Arena;
+
+static _Thread_local Scratch_Arena scratch;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static int scratch_key_ok = 0;
+
+static void scratch_destroy(void *base) {
+  sodium_free(base);
+}
+
+static void scratch_key_init(void) {
+  scratch_key_ok = (0==pthread_key_create(&scratch_key, scratch_destroy));
+}
+
+static int scratch_init(void) {
+  pthread_once(&scratch_once, scratch_key_init);
+  // without the key the arena would leak when the thread exits
+  if(!scratch_key_ok) return -1;
+  uint8_t *base = opaque_locked_alloc(SCRATCH_BYTES, 16);
+  if(base==NULL) return -1;
+  if(0!=pthread_setspecific(scratch_key, base)) {
+    sodium_free(base);
+    return -1;
+  }
+  // sodium_malloc() fills the memory with garbage, the arena hands out
+  // zeroed memory
+  sodium_memzero(base, SCRATCH_BYTES);
+  scratch.base=base;
+  scratch.top=0;
+  scratch.live=0;
+  return 0;
+}
+
+static int in_scratch(const uint8_t *p) {
+  return scratch.base!=NULL && p>=scratch.base && p<scratch.base+SCRATCH_BYTES;
+}
+#endif // NOARENA
+
+void* opaque_scratch_alloc(const size_t len) {
+#ifndef NOARENA
+  if(scratch.base!=NULL || 0==scratch_init()) {
+    const size_t alen = SCRATCH_ALIGN(len);
+    if(alen <= SCRATCH_BYTES - scratch.top) {
+      uint8_t *p = scratch.base + scratch.top;
+      scratch.top+=alen;
+      scratch.live++;
+      return p;
+    }
+  }
+#endif
+  uint8_t *p = calloc(1, len);
+  if(p==NULL) return NULL;
+  if(-1==sodium_mlock(p, len)) {
+    free(p);
+    return NULL;
+  }
+  return p;
+}
+
+void opaque_scratch_free(void *const p, const size_t len) {
+  if(p==NULL) return;
+#ifndef NOARENA
+  if(in_scratch(p)) {
+    sodium_memzero(p, len);
+    if((uint8_t*)p + SCRATCH_ALIGN(len) == scratch.base + scratch.top) {
+      scratch.top = (size_t) ((uint8_t*)p - scratch.base);
+    }
+    // allocations released out of order leave a hole until all are released
+    if(--scratch.live==0) scratch.top=0;
+    return;
+  }
+#endif
+  // also wipes it
+  sodium_munlock(p, len);
+  free(p);
+}
+
 #ifdef __EMSCRIPTEN__
 
 /*
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <sodium.h>
 #include <string.h>
+#include <stdatomic.h>
 
 //#define TRACE 1
 //#define NORANDOM 1
@@ -23,8 +24,38 @@ void a_randombytes(void* const buf, const size_t len);
 void a_randomscalar(uint8_t* buf);
 #define crypto_core_ristretto255_scalar_random a_randomscalar
 #define randombytes a_randombytes
+#else
+// per-thread buffered chacha20 drbg, see common.c
+void opaque_randombytes(void* const buf, const size_t len);
+void opaque_randomscalar(uint8_t* buf);
+#define crypto_core_ristretto255_scalar_random opaque_randomscalar
+#define randombytes opaque_randombytes
 #endif
 
+// sensitive temporaries are carved from a per-thread locked arena, or
+// with NOARENA locked one allocation at a time, see common.c
+#if (_WIN32 == 1 || _WIN64 == 1 || defined __EMSCRIPTEN__) && !defined NOARENA
+#define NOARENA 1
+#endif
+void* opaque_scratch_alloc(const size_t len);
+void opaque_scratch_free(void *const p, const size_t len);
+
+// a sodium_malloc() allocation, locked and between guard pages, of len
+// rounded up to align, a power of two, see common.c
+void* opaque_locked_alloc(const size_t len, const size_t align);
+
+// cpu features relevant to the kernels of libopaque, probed once, see
+// opaque_init()
+#define OPAQUE_CPU_SSE41   (1u<<0)
+#define OPAQUE_CPU_AVX2    (1u<<1)
+#define OPAQUE_CPU_AVX512F (1u<<2)
+#define OPAQUE_CPU_SHA     (1u<<3)
+uint32_t opaque_cpu_features(void);
+
+// a lock for short critical sections, spins and then yields, see common.c
+void opaque_spin_lock(atomic_flag *lock);
+void opaque_spin_unlock(atomic_flag *lock);
+
 #ifdef __EMSCRIPTEN__
 // Per
 // https://emscripten.org/docs/compiling/Building-Projects.html#detecting-emscripten-in-preprocessor,
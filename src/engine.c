@@ -0,0 +1,430 @@
+/*
+    @copyright 2018-21, opaque@ctrlc.hu
+    This file is part of libopaque.
+
+    libopaque is free software: you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public License
+    as published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    libopaque is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libopaque. If not, see <http://www.gnu.org/licenses/>.
+
+    This file implements the server engine: a pool of worker threads
+    that answer credential requests with
+    opaque_CreateCredentialResponseBatch(). Every worker has its own
+    bounded deque, submissions are spread over the deques round-robin,
+    a worker takes the oldest jobs of its own deque in batches and
+    steals the newest ones of the others when its own is empty. Idle
+    workers sleep on one condition variable. Completed jobs are handed
+    to a callback on the worker thread, or queued for the caller who
+    waits on an eventfd (a pipe outside of linux). Without threads,
+    on windows and emscripten, jobs are answered at once on submission.
+*/
+
+#include "opaque.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#if (_WIN32 == 1 || _WIN64 == 1 || defined __EMSCRIPTEN__) && !defined ENGINE_NOTHREADS
+#define ENGINE_NOTHREADS 1
+#endif
+#ifndef ENGINE_NOTHREADS
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+// jobs answered by one call of opaque_CreateCredentialResponseBatch(),
+// two rounds of the four lanes of the multi-buffer sha-512
+#define ENGINE_BATCH 8
+#define ENGINE_MAX_WORKERS 256
+
+// the state of a worker, in locked memory as it holds the records and
+// session keys of the batch in flight
+typedef struct {
+  struct Opaque_ServerEngine *engine;
+  unsigned index;
+#ifndef ENGINE_NOTHREADS
+  pthread_t thread;
+  int started;
+#endif
+  uint8_t pub[ENGINE_BATCH][OPAQUE_USER_SESSION_PUBLIC_LEN];
+  uint8_t rec[ENGINE_BATCH][OPAQUE_USER_RECORD_LEN];
+  Opaque_Ids ids[ENGINE_BATCH];
+  uint8_t resp[ENGINE_BATCH][OPAQUE_SERVER_SESSION_LEN];
+  uint8_t sk[ENGINE_BATCH][OPAQUE_SHARED_SECRETBYTES];
+  uint8_t authU[ENGINE_BATCH][crypto_auth_hmacsha512_BYTES];
+  int ret[ENGINE_BATCH];
+} Engine_Worker;
+
+#ifndef ENGINE_NOTHREADS
+// the deque of a worker, a ring of pointers to the jobs, each on its
+// own cache line so that workers do not contend for them
+typedef struct {
+  _Alignas(64) atomic_flag lock;
+  size_t head;     // oldest job, taken by the owner
+  size_t tail;     // next free slot, jobs are stolen from below it
+  Opaque_EngineJob **job;
+} Engine_Deque;
+#endif
+
+struct Opaque_ServerEngine {
+  uint8_t *ctx;
+  uint16_t ctx_len;
+  void (*done)(Opaque_EngineJob *job, void *arg);
+  void *arg;
+  unsigned workers;
+  Engine_Worker *worker;
+  size_t worker_len;
+  // completed jobs waiting for opaque_ServerEngineCollect()
+  atomic_flag done_lock;
+  Opaque_EngineJob *done_head, **done_tail;
+#ifndef ENGINE_NOTHREADS
+  Engine_Deque *deque;
+  size_t mask;              // the size of each deque minus one
+  atomic_size_t next;       // the deque of the next submission
+  atomic_size_t pending;    // submitted jobs not yet taken by a worker
+  atomic_uint sleepers;     // workers waiting on cond
+  atomic_int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd[2];                // readable while jobs are completed, both
+                            // the same eventfd on linux
+#endif
+};
+
+#ifndef ENGINE_NOTHREADS
+static void engine_notify(Opaque_ServerEngine *e) {
+  // a full pipe or an eventfd at its limit is readable already
+#ifdef __linux__
+  const uint64_t one = 1;
+#else
+  const uint8_t one = 1;
+#endif
+  ssize_t r = write(e->fd[1], &one, sizeof one);
+  (void) r;
+}
+
+static void engine_drain(Opaque_ServerEngine *e) {
+  uint64_t buf[8];
+  while(read(e->fd[0], buf, sizeof buf) > 0);
+}
+#endif
+
+// answers n jobs with one batch
+static void engine_run(Engine_Worker *w, Opaque_EngineJob **jobs, const size_t n) {
+  const Opaque_ServerEngine *e = w->engine;
+  size_t i;
+  for(i=0;i<n;i++) {
+    memcpy(w->pub[i], jobs[i]->ke1, OPAQUE_USER_SESSION_PUBLIC_LEN);
+    memcpy(w->rec[i], jobs[i]->rec, OPAQUE_USER_RECORD_LEN);
+    w->ids[i] = jobs[i]->ids;
+  }
+  // the status of every job is in ret, also if the batch failed as a whole
+  (void) opaque_CreateCredentialResponseBatch(n, w->pub[0], w->rec[0], w->ids, e->ctx, e->ctx_len,
+                                              w->resp[0], w->sk[0], w->authU[0], w->ret);
+  for(i=0;i<n;i++) {
+    memcpy(jobs[i]->ke2, w->resp[i], OPAQUE_SERVER_SESSION_LEN);
+    memcpy(jobs[i]->sk, w->sk[i], OPAQUE_SHARED_SECRETBYTES);
+    memcpy(jobs[i]->authU, w->authU[i], crypto_auth_hmacsha512_BYTES);
+    jobs[i]->ret = w->ret[i];
+  }
+  sodium_memzero(w->rec, n * OPAQUE_USER_RECORD_LEN);
+  sodium_memzero(w->sk, n * OPAQUE_SHARED_SECRETBYTES);
+  sodium_memzero(w->authU, n * crypto_auth_hmacsha512_BYTES);
+}
+
+static void engine_complete(Opaque_ServerEngine *e, Opaque_EngineJob **jobs, const size_t n) {
+  size_t i;
+  if(e->done!=NULL) {
+    for(i=0;i<n;i++) e->done(jobs[i], e->arg);
+    return;
+  }
+  for(i=0;i+1<n;i++) jobs[i]->next = jobs[i+1];
+  jobs[n-1]->next = NULL;
+  opaque_spin_lock(&e->done_lock);
+  *e->done_tail = jobs[0];
+  e->done_tail = &jobs[n-1]->next;
+  opaque_spin_unlock(&e->done_lock);
+#ifndef ENGINE_NOTHREADS
+  engine_notify(e);
+#endif
+}
+
+#ifndef ENGINE_NOTHREADS
+// the owner takes the oldest jobs of its deque
+static size_t deque_take(Engine_Deque *d, Opaque_EngineJob **jobs, const size_t max, const size_t mask) {
+  size_t n = 0;
+  opaque_spin_lock(&d->lock);
+  while(n<max && d->head!=d->tail) jobs[n++] = d->job[d->head++ & mask];
+  opaque_spin_unlock(&d->lock);
+  return n;
+}
+
+// thieves take the newest half of the jobs of another deque, leaving
+// the owner the ones it would take next
+static size_t deque_steal(Engine_Deque *d, Opaque_EngineJob **jobs, const size_t max, const size_t mask) {
+  size_t n = 0;
+  opaque_spin_lock(&d->lock);
+  size_t m = (d->tail - d->head + 1) / 2;
+  if(m>max) m=max;
+  while(n<m) jobs[n++] = d->job[--d->tail & mask];
+  opaque_spin_unlock(&d->lock);
+  return n;
+}
+
+static int deque_push(Engine_Deque *d, Opaque_EngineJob *job, const size_t mask) {
+  int ret = -1;
+  opaque_spin_lock(&d->lock);
+  if(d->tail - d->head <= mask) {
+    d->job[d->tail++ & mask] = job;
+    ret = 0;
+  }
+  opaque_spin_unlock(&d->lock);
+  return ret;
+}
+
+static void *engine_worker(void *arg) {
+  Engine_Worker *w = (Engine_Worker *) arg;
+  Opaque_ServerEngine *e = w->engine;
+  Opaque_EngineJob *jobs[ENGINE_BATCH];
+  unsigned i;
+
+  // set up the scratch arena and the drbg of this thread before the
+  // first request arrives
+  uint8_t *warm = opaque_scratch_alloc(OPAQUE_SHARED_SECRETBYTES);
+  if(warm!=NULL) {
+    randombytes(warm, OPAQUE_SHARED_SECRETBYTES);
+    opaque_scratch_free(warm, OPAQUE_SHARED_SECRETBYTES);
+  }
+
+  for(;;) {
+    size_t n = deque_take(&e->deque[w->index], jobs, ENGINE_BATCH, e->mask);
+    for(i=1;n==0 && i<e->workers;i++) {
+      n = deque_steal(&e->deque[(w->index + i) % e->workers], jobs, ENGINE_BATCH, e->mask);
+    }
+    if(n>0) {
+      atomic_fetch_sub(&e->pending, n);
+      engine_run(w, jobs, n);
+      engine_complete(e, jobs, n);
+      continue;
+    }
+
+    // nothing to do, pending counts the jobs before they are pushed, so
+    // a worker that sees it non-zero finds them soon
+    pthread_mutex_lock(&e->lock);
+    atomic_fetch_add(&e->sleepers, 1);
+    while(atomic_load(&e->pending)==0 && !atomic_load(&e->stop)) {
+      pthread_cond_wait(&e->cond, &e->lock);
+    }
+    atomic_fetch_sub(&e->sleepers, 1);
+    const int stop = atomic_load(&e->stop) && atomic_load(&e->pending)==0;
+    pthread_mutex_unlock(&e->lock);
+    if(stop) break;
+  }
+  return NULL;
+}
+
+static unsigned online_cpus(void) {
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n<1) return 1;
+  if(n>ENGINE_MAX_WORKERS) return ENGINE_MAX_WORKERS;
+  return (unsigned) n;
+}
+#endif // ENGINE_NOTHREADS
+
+Opaque_ServerEngine* opaque_CreateServerEngine(const unsigned workers, const size_t queue,
+                                               const uint8_t *ctx, const uint16_t ctx_len,
+                                               void (*done)(Opaque_EngineJob *job, void *arg),
+                                               void *arg) {
+  if(workers>ENGINE_MAX_WORKERS || queue==0 || queue>SIZE_MAX/2/sizeof(Opaque_EngineJob*)) return NULL;
+  Opaque_ServerEngine *e = calloc(1, sizeof *e);
+  if(e==NULL) return NULL;
+  e->ctx = malloc(ctx_len ? ctx_len : 1);
+  if(e->ctx==NULL) {
+    free(e);
+    return NULL;
+  }
+  if(ctx_len>0) memcpy(e->ctx, ctx, ctx_len);
+  e->ctx_len = ctx_len;
+  e->done = done;
+  e->arg = arg;
+  atomic_flag_clear(&e->done_lock);
+  e->done_head = NULL;
+  e->done_tail = &e->done_head;
+
+#ifdef ENGINE_NOTHREADS
+  (void) workers;
+  e->workers = 1;
+#else
+  e->workers = (workers==0) ? online_cpus() : workers;
+  e->fd[0] = e->fd[1] = -1;
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->cond, NULL);
+#endif
+
+  e->worker_len = e->workers * sizeof(Engine_Worker);
+  e->worker = opaque_locked_alloc(e->worker_len, 64);
+  if(e->worker==NULL) {
+    opaque_DestroyServerEngine(e);
+    return NULL;
+  }
+  sodium_memzero(e->worker, e->worker_len);
+
+  unsigned i;
+  for(i=0;i<e->workers;i++) {
+    e->worker[i].engine = e;
+    e->worker[i].index = i;
+  }
+
+#ifndef ENGINE_NOTHREADS
+  size_t size = 1;
+  while(size < queue) size <<= 1;
+  e->mask = size - 1;
+  atomic_init(&e->next, 0);
+  atomic_init(&e->pending, 0);
+  atomic_init(&e->sleepers, 0);
+  atomic_init(&e->stop, 0);
+  if(0!=posix_memalign((void**) &e->deque, 64, e->workers * sizeof(Engine_Deque))) {
+    e->deque = NULL;
+    opaque_DestroyServerEngine(e);
+    return NULL;
+  }
+  for(i=0;i<e->workers;i++) {
+    atomic_flag_clear(&e->deque[i].lock);
+    e->deque[i].head = e->deque[i].tail = 0;
+    e->deque[i].job = NULL;
+  }
+  for(i=0;i<e->workers;i++) {
+    e->deque[i].job = malloc(size * sizeof(Opaque_EngineJob*));
+    if(e->deque[i].job==NULL) {
+      opaque_DestroyServerEngine(e);
+      return NULL;
+    }
+  }
+  if(done==NULL) {
+#ifdef __linux__
+    e->fd[0] = e->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(e->fd[0]==-1) {
+#else
+    if(0!=pipe(e->fd) ||
+       -1==fcntl(e->fd[0], F_SETFL, O_NONBLOCK) || -1==fcntl(e->fd[1], F_SETFL, O_NONBLOCK)) {
+#endif
+      opaque_DestroyServerEngine(e);
+      return NULL;
+    }
+  }
+  for(i=0;i<e->workers;i++) {
+    e->worker[i].started = (0==pthread_create(&e->worker[i].thread, NULL, engine_worker, &e->worker[i]));
+    if(!e->worker[i].started) {
+      opaque_DestroyServerEngine(e);
+      return NULL;
+    }
+  }
+#endif
+  return e;
+}
+
+int opaque_ServerEngineSubmit(Opaque_ServerEngine *e, Opaque_EngineJob *job) {
+#ifdef ENGINE_NOTHREADS
+  engine_run(&e->worker[0], &job, 1);
+  engine_complete(e, &job, 1);
+  return 0;
+#else
+  // counted before the push, see engine_worker()
+  atomic_fetch_add(&e->pending, 1);
+  const size_t first = atomic_fetch_add_explicit(&e->next, 1, memory_order_relaxed);
+  unsigned i;
+  for(i=0;i<e->workers;i++) {
+    if(0==deque_push(&e->deque[(first + i) % e->workers], job, e->mask)) break;
+  }
+  if(i==e->workers) {
+    atomic_fetch_sub(&e->pending, 1);
+    return OPAQUE_BUSY;
+  }
+  if(atomic_load(&e->sleepers)>0) {
+    pthread_mutex_lock(&e->lock);
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+  }
+  return 0;
+#endif
+}
+
+int opaque_ServerEngineFd(const Opaque_ServerEngine *e) {
+#ifdef ENGINE_NOTHREADS
+  (void) e;
+  return -1;
+#else
+  return e->fd[0];
+#endif
+}
+
+size_t opaque_ServerEngineCollect(Opaque_ServerEngine *e, Opaque_EngineJob **jobs, const size_t max,
+                                  const int timeout_ms) {
+  if(e->done!=NULL || max==0) return 0;
+#ifndef ENGINE_NOTHREADS
+  if(timeout_ms!=0) {
+    struct pollfd pfd = { e->fd[0], POLLIN, 0 };
+    poll(&pfd, 1, timeout_ms);
+  }
+  // drained before the jobs are taken, a job completed meanwhile
+  // makes the fd readable again
+  engine_drain(e);
+#else
+  (void) timeout_ms;
+#endif
+  size_t n = 0;
+  opaque_spin_lock(&e->done_lock);
+  while(n<max && e->done_head!=NULL) {
+    jobs[n] = e->done_head;
+    e->done_head = e->done_head->next;
+    jobs[n++]->next = NULL;
+  }
+  if(e->done_head==NULL) e->done_tail = &e->done_head;
+#ifndef ENGINE_NOTHREADS
+  else engine_notify(e);
+#endif
+  opaque_spin_unlock(&e->done_lock);
+  return n;
+}
+
+void opaque_DestroyServerEngine(Opaque_ServerEngine *e) {
+  if(e==NULL) return;
+#ifndef ENGINE_NOTHREADS
+  unsigned i;
+  // the workers finish the queued jobs before they stop
+  pthread_mutex_lock(&e->lock);
+  atomic_store(&e->stop, 1);
+  pthread_cond_broadcast(&e->cond);
+  pthread_mutex_unlock(&e->lock);
+  for(i=0;e->worker!=NULL && i<e->workers;i++) {
+    if(e->worker[i].started) pthread_join(e->worker[i].thread, NULL);
+  }
+  pthread_cond_destroy(&e->cond);
+  pthread_mutex_destroy(&e->lock);
+  if(e->fd[0]!=-1) close(e->fd[0]);
+  if(e->fd[1]!=-1 && e->fd[1]!=e->fd[0]) close(e->fd[1]);
+  if(e->deque!=NULL) {
+    for(i=0;i<e->workers;i++) free(e->deque[i].job);
+    free(e->deque);
+  }
+#endif
+  // sodium_free() also wipes the batches
+  if(e->worker!=NULL) sodium_free(e->worker);
+  free(e->ctx);
+  free(e);
+}
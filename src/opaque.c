@@ -24,7 +24,21 @@
 #else
 #include <arpa/inet.h>
 #endif
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#if _WIN32 == 1 || _WIN64 == 1
+#include <process.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#endif
 #include "common.h"
+#include "ristretto255.h"
+#include "sha512mb.h"
+#include "argon2.h"
 #ifdef CFRG_TEST_VEC
 #include "tests/cfrg_test_vector_decl.h"
 #endif
@@ -41,6 +55,10 @@
 #define OPAQUE_ENVELOPE_BYTES (OPAQUE_ENVELOPE_NONCEBYTES + crypto_auth_hmacsha512_BYTES)
 #define OPAQUE_HMAC_SHA512_BYTES 64
 #define OPAQUE_HMAC_SHA512_KEYBYTES 64
+// max number of sessions processed together by the batch functions
+#define OPAQUE_BATCH_CHUNK 32
+// number of sessions of a batch whose hashes run in lockstep
+#define OPAQUE_MB_LANES 8
 
 typedef struct {
   uint8_t nonce[OPAQUE_ENVELOPE_NONCEBYTES];
@@ -86,12 +104,36 @@ typedef struct {
   uint8_t auth[crypto_auth_hmacsha512_BYTES];
 } __attribute((packed)) Opaque_ServerSession;
 
+// the per-session random values of the server
+typedef struct {
+  uint8_t masking_nonce[32];
+  uint8_t nonceS[OPAQUE_NONCE_BYTES];
+  uint8_t x_s[crypto_scalarmult_SCALARBYTES];
+  uint8_t X_s[crypto_scalarmult_BYTES];
+} __attribute((packed)) Opaque_ServerEphemeral;
+
+// state between opaque_CreateCredentialResponseBegin() and
+// opaque_CreateCredentialResponseFinish()
+typedef struct {
+  Opaque_ServerEphemeral eph;
+  uint8_t ke1[OPAQUE_USER_SESSION_PUBLIC_LEN];
+} __attribute((packed)) Opaque_ServerPending;
+
 typedef struct {
   uint8_t blind[crypto_core_ristretto255_SCALARBYTES];
   uint16_t pwdU_len;
   uint8_t pwdU[];
 } Opaque_RegisterUserSec;
 
+// the secret of the client between opaque_FinalizeRequestLogin() and
+// opaque_RecoverCredentialsRegistered(): the result of the hardening
+// of the registration, and the login that follows it
+typedef struct {
+  uint8_t y[crypto_hash_sha512_BYTES];
+  uint8_t rwdU[OPAQUE_RWDU_BYTES];
+  uint8_t session[];    // Opaque_UserSession_Secret
+} __attribute((packed)) Opaque_RegisterLoginSec;
+
 typedef struct {
   uint8_t Z[crypto_core_ristretto255_BYTES];
   uint8_t pkS[crypto_scalarmult_BYTES];
@@ -119,6 +161,81 @@ static void opaque_hmacsha512(const uint8_t key[OPAQUE_HMAC_SHA512_KEYBYTES],
   sodium_memzero(&st,sizeof st);
 }
 
+// same as crypto_kdf_hkdf_sha512_expand(), but the prk is given as an
+// hmac state already keyed with it, which can be cached and reused
+// instead of hashing the prk into the inner and outer pads for every
+// output block. the info is the concatenation of info and ctx, ctx can
+// be NULL.
+static void hkdf_expand_keyed(uint8_t *out, const size_t out_len,
+                              const uint8_t *info, const size_t info_len,
+                              const uint8_t *ctx, const size_t ctx_len,
+                              const crypto_auth_hmacsha512_state *keyed) {
+  crypto_auth_hmacsha512_state st;
+  uint8_t tmp[crypto_auth_hmacsha512_BYTES];
+  uint8_t counter = 1;
+  size_t i;
+  for(i=0;i<out_len;i+=crypto_auth_hmacsha512_BYTES,counter++) {
+    memcpy(&st, keyed, sizeof st);
+    if(i!=0) crypto_auth_hmacsha512_update(&st, &out[i-crypto_auth_hmacsha512_BYTES], crypto_auth_hmacsha512_BYTES);
+    crypto_auth_hmacsha512_update(&st, info, info_len);
+    if(ctx!=NULL) crypto_auth_hmacsha512_update(&st, ctx, ctx_len);
+    crypto_auth_hmacsha512_update(&st, &counter, 1);
+    if(out_len-i>=crypto_auth_hmacsha512_BYTES) {
+      crypto_auth_hmacsha512_final(&st, &out[i]);
+    } else {
+      crypto_auth_hmacsha512_final(&st, tmp);
+      memcpy(&out[i], tmp, out_len-i);
+    }
+  }
+  sodium_memzero(tmp,sizeof tmp);
+  sodium_memzero(&st,sizeof st);
+}
+
+// one output of hkdf_expand_multi()
+typedef struct {
+  uint8_t *out;         // NULL skips this output
+  size_t out_len;
+  const void *info;
+  size_t info_len;
+  const uint8_t *ctx;   // appended to info, can be NULL
+  size_t ctx_len;
+} Hkdf_Output;
+
+// derives all outputs from one prk, like calling
+// crypto_kdf_hkdf_sha512_expand() for each of them, but the inner and
+// outer pads are hashed only once by keying the hmac state in keyed,
+// which the caller provides in protected memory and can reuse for
+// later outputs. keyed is not initialized if prk is NULL.
+static void hkdf_expand_multi(const uint8_t prk[crypto_kdf_hkdf_sha512_KEYBYTES],
+                              crypto_auth_hmacsha512_state *keyed,
+                              const Hkdf_Output *outs, const size_t n) {
+  if(prk!=NULL) crypto_auth_hmacsha512_init(keyed, prk, crypto_kdf_hkdf_sha512_KEYBYTES);
+  size_t i;
+  for(i=0;i<n;i++) {
+    if(outs[i].out==NULL) continue;
+    hkdf_expand_keyed(outs[i].out, outs[i].out_len,
+                      outs[i].info, outs[i].info_len,
+                      outs[i].ctx, outs[i].ctx_len, keyed);
+  }
+}
+
+// HkdfLabel of the irtf cfrg draft with a constant label
+// struct {
+//   uint16 length = Length;
+//   opaque label<8..255> = "OPAQUE-" + Label;
+//   opaque context<0..255> = Context;
+// } HkdfLabel;
+// the context itself is passed as the ctx of an Hkdf_Output
+#define HKDF_LABEL(name, length, str, ctx_len)                      \
+  static const struct {                                             \
+    uint8_t len[2];                                                 \
+    uint8_t label_len;                                              \
+    uint8_t label[sizeof("OPAQUE-" str)-1];                         \
+    uint8_t context_len;                                            \
+  } __attribute((packed)) name = {                                  \
+    { (length)>>8, (length)&0xff }, sizeof("OPAQUE-" str)-1,        \
+    "OPAQUE-" str, (ctx_len) }
+
 /**
  * This function generates an OPRF private key.
  *
@@ -137,110 +254,634 @@ static void oprf_KeyGen(uint8_t kU[crypto_core_ristretto255_SCALARBYTES]) {
 #endif
 }
 
-/**
- * This function computes the OPRF output using input x, N, and domain separation
- * tag info.
- *
- * This is the Finalize OPRF function defined in the RFC.
+// the decoded hardening descriptor, see opaque_HardenParams()
+typedef struct {
+  uint8_t alg;
+  uint8_t lanes;                 // argon2id
+  unsigned long long opslimit;   // argon2id
+  size_t memlimit;               // the memory of one hardening, of every alg
+  uint8_t log2_n;                // scrypt
+  uint16_t r;                    // scrypt
+  uint32_t p;                    // scrypt
+  const Opaque_HardenMHF *mhf;   // registered with opaque_SetHardenMHF()
+  const uint8_t *args;           // the descriptor after alg, for mhf
+} Harden_Params;
+
+// the functions registered by opaque_SetHardenMHF(), indexed by alg - OPAQUE_HARDEN_CUSTOM
+static _Atomic(const Opaque_HardenMHF*) harden_mhfs[OPAQUE_HARDEN_IDENTITY - OPAQUE_HARDEN_CUSTOM];
+
+static int argon2id_decode(const uint8_t *harden, Harden_Params *params) {
+  params->lanes = harden[1];
+  params->opslimit = ((unsigned long long) harden[2] << 8) | harden[3];
+  const uint32_t memlimit_kib = ((uint32_t) harden[4] << 24) | ((uint32_t) harden[5] << 16) |
+                                ((uint32_t) harden[6] << 8) | harden[7];
+  if(params->lanes==0) return -1;
+  if(params->opslimit < crypto_pwhash_OPSLIMIT_MIN) return -1;
+  // memlimit_kib * 1024 must not overflow a size_t on 32 bit platforms
+  if((uint64_t) memlimit_kib * 1024 > crypto_pwhash_MEMLIMIT_MAX) return -1;
+  params->memlimit = (size_t) memlimit_kib * 1024;
+  if(params->memlimit < crypto_pwhash_MEMLIMIT_MIN) return -1;
+  // argon2 needs at least two blocks of 1KiB per lane and slice
+  if(memlimit_kib < 8 * (uint32_t) params->lanes) return -1;
+  return 0;
+}
+
+static int scrypt_decode(const uint8_t *harden, Harden_Params *params) {
+#ifdef SODIUM_LIBRARY_MINIMAL
+  // a minimal build of libsodium comes without scrypt
+  (void) harden;
+  (void) params;
+  return -1;
+#else
+  params->log2_n = harden[1];
+  params->r = (uint16_t) ((harden[2] << 8) | harden[3]);
+  params->p = ((uint32_t) harden[4] << 24) | ((uint32_t) harden[5] << 16) |
+              ((uint32_t) harden[6] << 8) | harden[7];
+  if(params->log2_n==0 || params->r==0 || params->p==0) return -1;
+  // the limits of RFC 7914: p ≤ ((2^32-1) * hLen) / MFLen and N < 2^(128 * r / 8)
+  if((uint64_t) params->r * params->p >= (1U << 30)) return -1;
+  if(params->log2_n >= 16 * (uint32_t) params->r) return -1;
+  // V has N blocks of 128*r bytes, B has p of them
+  if(params->log2_n > 40) return -1;
+  const uint64_t v = ((uint64_t) 128 * params->r) << params->log2_n;
+  if(v < crypto_pwhash_MEMLIMIT_MIN || v > crypto_pwhash_MEMLIMIT_MAX) return -1;
+  const uint64_t total = v + (uint64_t) 128 * params->r * params->p;
+  if(total > SIZE_MAX) return -1;
+  params->memlimit = (size_t) total;
+  return 0;
+#endif
+}
+
+static int harden_decode(const uint8_t *harden, Harden_Params *params) {
+  if(harden==NULL) {
+    params->alg = OPAQUE_HARDEN_ARGON2ID;
+    params->lanes = 1;
+    params->opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE;
+    params->memlimit = crypto_pwhash_MEMLIMIT_INTERACTIVE;
+    return 0;
+  }
+  params->alg = harden[0];
+  params->args = harden + 1;
+  switch(params->alg) {
+  case OPAQUE_HARDEN_ARGON2ID: return argon2id_decode(harden, params);
+  case OPAQUE_HARDEN_SCRYPT: return scrypt_decode(harden, params);
+  case OPAQUE_HARDEN_IDENTITY:
+#ifdef OPAQUE_BENCHMARK
+    params->memlimit = 0;
+    return 0;
+#else
+    return -1;
+#endif
+  }
+  if(params->alg < OPAQUE_HARDEN_CUSTOM) return -1;
+  params->mhf = atomic_load(&harden_mhfs[params->alg - OPAQUE_HARDEN_CUSTOM]);
+  if(params->mhf==NULL) return -1;
+  return params->mhf->check(params->args, &params->memlimit);
+}
+
+int opaque_SetHardenMHF(const uint8_t alg, const Opaque_HardenMHF *mhf) {
+  if(alg < OPAQUE_HARDEN_CUSTOM || alg >= OPAQUE_HARDEN_IDENTITY) return -1;
+  if(mhf!=NULL && (mhf->check==NULL || mhf->hash==NULL)) return -1;
+  atomic_store(&harden_mhfs[alg - OPAQUE_HARDEN_CUSTOM], mhf);
+  return 0;
+}
+
+// memory for the hardening reused across calls, see opaque_CreateHardenCtx()
+struct Opaque_HardenCtx {
+  atomic_flag busy;
+  uint8_t *memory;
+  size_t size;     // usable for the hardening
+  size_t mapped;   // allocated, rounded up to the page size
+};
+
+// the context used by harden_hash() in this thread, set by opaque_SetHardenCtx()
+static _Thread_local Opaque_HardenCtx *harden_ctx = NULL;
+
+Opaque_HardenCtx* opaque_CreateHardenCtx(const size_t memlimit, const int flags) {
+  if(memlimit < crypto_pwhash_MEMLIMIT_MIN || memlimit > crypto_pwhash_MEMLIMIT_MAX) return NULL;
+  Opaque_HardenCtx *ctx = malloc(sizeof *ctx);
+  if(ctx==NULL) return NULL;
+  atomic_flag_clear(&ctx->busy);
+  ctx->size = memlimit / 1024 * 1024;
+  ctx->memory = NULL;
+#if _WIN32 == 1 || _WIN64 == 1
+  (void) flags;
+  ctx->mapped = ctx->size;
+  ctx->memory = VirtualAlloc(NULL, ctx->mapped, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if(ctx->memory==NULL) {
+    free(ctx);
+    return NULL;
+  }
+#else
+#ifdef MAP_HUGETLB
+  // explicit huge pages of 2MiB only exist if the admin reserved some,
+  // otherwise transparent huge pages are asked for below
+  if(flags & OPAQUE_HARDEN_HUGEPAGES) {
+    ctx->mapped = (ctx->size + (2<<20) - 1) & ~(size_t) ((2<<20) - 1);
+    void *p = mmap(NULL, ctx->mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if(p!=MAP_FAILED) ctx->memory = p;
+  }
+#endif
+  if(ctx->memory==NULL) {
+    const size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    ctx->mapped = (ctx->size + pagesize - 1) / pagesize * pagesize;
+    void *p = mmap(NULL, ctx->mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p==MAP_FAILED) {
+      free(ctx);
+      return NULL;
+    }
+    ctx->memory = p;
+#ifdef MADV_HUGEPAGE
+    if(flags & OPAQUE_HARDEN_HUGEPAGES) madvise(ctx->memory, ctx->mapped, MADV_HUGEPAGE);
+#endif
+  }
+#ifdef MADV_DONTDUMP
+  // keep the blocks, which derive from passwords, out of core dumps
+  madvise(ctx->memory, ctx->mapped, MADV_DONTDUMP);
+#endif
+#endif
+  // fault in every page now instead of during the first hardening
+  memset(ctx->memory, 0, ctx->mapped);
+  return ctx;
+}
+
+void opaque_SetHardenCtx(Opaque_HardenCtx *ctx) {
+  harden_ctx = ctx;
+}
+
+void opaque_DestroyHardenCtx(Opaque_HardenCtx *ctx) {
+  if(ctx==NULL) return;
+  if(harden_ctx==ctx) harden_ctx=NULL;
+  // argon2id() wipes the memory after every use, this is just in case
+  sodium_memzero(ctx->memory, ctx->mapped);
+#if _WIN32 == 1 || _WIN64 == 1
+  VirtualFree(ctx->memory, 0, MEM_RELEASE);
+#else
+  munmap(ctx->memory, ctx->mapped);
+#endif
+  free(ctx);
+}
+
+// the context of this thread if it fits the parameters and is not in
+// use by another thread, NULL otherwise
+static Opaque_HardenCtx *harden_ctx_acquire(const Harden_Params *params) {
+  Opaque_HardenCtx *ctx = harden_ctx;
+  if(ctx==NULL || params->memlimit > ctx->size) return NULL;
+  if(atomic_flag_test_and_set_explicit(&ctx->busy, memory_order_acquire)) return NULL;
+  return ctx;
+}
+
+static void harden_ctx_release(Opaque_HardenCtx *ctx) {
+  if(ctx!=NULL) atomic_flag_clear_explicit(&ctx->busy, memory_order_release);
+}
+
+// the process wide limit on the memory of concurrent hardenings, see
+// opaque_SetHardenBudget()
+static struct {
+#if _WIN32 == 1 || _WIN64 == 1
+  SRWLOCK lock;
+  CONDITION_VARIABLE cond;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+  size_t budget;        // in bytes, 0 if not limited
+  size_t used;          // reserved by running hardenings
+  unsigned queue;       // hardenings allowed to wait for the budget
+  unsigned waiting;
+  uint32_t timeout_ms;  // 0 waits as long as it takes
+} harden_budget = {
+#if _WIN32 == 1 || _WIN64 == 1
+  SRWLOCK_INIT, CONDITION_VARIABLE_INIT,
+#else
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+#endif
+  0, 0, 0, 0, 0
+};
+
+#if _WIN32 == 1 || _WIN64 == 1
+static void budget_lock(void) { AcquireSRWLockExclusive(&harden_budget.lock); }
+static void budget_unlock(void) { ReleaseSRWLockExclusive(&harden_budget.lock); }
+static void budget_wake(void) { WakeAllConditionVariable(&harden_budget.cond); }
+static uint64_t budget_now_ms(void) { return GetTickCount64(); }
+#else
+static void budget_lock(void) { pthread_mutex_lock(&harden_budget.lock); }
+static void budget_unlock(void) { pthread_mutex_unlock(&harden_budget.lock); }
+static void budget_wake(void) { pthread_cond_broadcast(&harden_budget.cond); }
+// the clock of pthread_cond_timedwait()
+static uint64_t budget_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+#endif
+
+// waits for a release with the lock held, until deadline or without
+// limit if deadline is 0. returns -1 if the deadline has passed
+static int budget_wait(const uint64_t deadline) {
+  if(deadline==0) {
+#if _WIN32 == 1 || _WIN64 == 1
+    SleepConditionVariableSRW(&harden_budget.cond, &harden_budget.lock, INFINITE, 0);
+#else
+    pthread_cond_wait(&harden_budget.cond, &harden_budget.lock);
+#endif
+    return 0;
+  }
+  const uint64_t now = budget_now_ms();
+  if(now >= deadline) return -1;
+#if _WIN32 == 1 || _WIN64 == 1
+  SleepConditionVariableSRW(&harden_budget.cond, &harden_budget.lock, (DWORD) (deadline - now), 0);
+#else
+  const struct timespec ts = { (time_t) (deadline / 1000), (long) (deadline % 1000) * 1000000 };
+  pthread_cond_timedwait(&harden_budget.cond, &harden_budget.lock, &ts);
+#endif
+  // woken up or timed out, the caller checks the budget and calls again
+  return 0;
+}
+
+/*
+ * Reserves memlimit bytes of the budget for a hardening. If the budget
+ * is used up, waits in the queue if wait is set and there is room in
+ * it. reserved is what harden_budget_release() gives back, 0 if no
+ * budget was set.
  *
- * @param [in] x - a value used to compute OPRF (for OPAQUE, this is pwdU, the
- * user's password)
- * @param [in] x_len - the length of param x in bytes
- * @param [in] N - a serialized OPRF group element, a byte array of fixed length,
- * an output of oprf_Unblind
- * @param [in] info - a domain separation tag
- * @param [in] info_len - the length of param info in bytes
- * @param [out] y - an OPRF output
- * @return The function returns 0 if everything is correct.
+ * returns 0 on success, OPAQUE_BUSY if the queue is full or the wait
+ * timed out, -1 if memlimit alone exceeds the budget.
  */
-static int oprf_Finalize(const uint8_t *x, const uint16_t x_len,
-                         const uint8_t N[crypto_core_ristretto255_BYTES],
-                         uint8_t rwdU[OPAQUE_RWDU_BYTES]) {
+static int harden_budget_acquire(const size_t memlimit, const int wait, size_t *reserved) {
+  int ret = 0, queued = 0;
+  uint64_t deadline = 0;
+  *reserved = 0;
+  budget_lock();
+  while(harden_budget.budget!=0 && harden_budget.used + memlimit > harden_budget.budget) {
+    if(memlimit > harden_budget.budget) {
+      ret = -1;
+      break;
+    }
+    if(!queued) {
+      if(!wait || harden_budget.waiting >= harden_budget.queue) {
+        ret = OPAQUE_BUSY;
+        break;
+      }
+      harden_budget.waiting++;
+      queued = 1;
+      if(harden_budget.timeout_ms!=0) deadline = budget_now_ms() + harden_budget.timeout_ms;
+    }
+    if(0!=budget_wait(deadline)) {
+      ret = OPAQUE_BUSY;
+      break;
+    }
+  }
+  if(queued) harden_budget.waiting--;
+  if(ret==0 && harden_budget.budget!=0) {
+    harden_budget.used += memlimit;
+    *reserved = memlimit;
+  }
+  budget_unlock();
+  return ret;
+}
+
+static void harden_budget_release(const size_t reserved) {
+  if(reserved==0) return;
+  budget_lock();
+  harden_budget.used -= reserved;
+  budget_wake();
+  budget_unlock();
+}
+
+int opaque_SetHardenBudget(const size_t budget, const unsigned queue, const uint32_t timeout_ms) {
+  if(budget!=0 && budget < crypto_pwhash_MEMLIMIT_MIN) return -1;
+  budget_lock();
+  harden_budget.budget = budget;
+  harden_budget.queue = queue;
+  harden_budget.timeout_ms = timeout_ms;
+  // waiting hardenings might fit now, or not at all anymore
+  budget_wake();
+  budget_unlock();
+  return 0;
+}
+
+size_t opaque_HardenBudgetUsed(void) {
+  budget_lock();
+  const size_t used = harden_budget.used;
+  budget_unlock();
+  return used;
+}
+
+// the hardening in memory allocated for this call
+static int harden_compute(const Harden_Params *params,
+                          const uint8_t y[crypto_hash_sha512_BYTES],
+                          uint8_t out[crypto_hash_sha512_BYTES]) {
+  // salt - according to the irtf draft this could be all zeroes
+  const uint8_t salt[crypto_pwhash_SALTBYTES]={0};
+  int ret;
+  if(params->alg==OPAQUE_HARDEN_ARGON2ID && params->lanes==1) {
+    ret = crypto_pwhash(out, crypto_hash_sha512_BYTES,
+                        (const char*) y, crypto_hash_sha512_BYTES, salt,
+                        params->opslimit, params->memlimit,
+                        crypto_pwhash_ALG_ARGON2ID13);
+  } else if(params->alg==OPAQUE_HARDEN_ARGON2ID) {
+    ret = argon2id(out, crypto_hash_sha512_BYTES, y, crypto_hash_sha512_BYTES,
+                   salt, sizeof salt, NULL, 0, NULL, 0,
+                   (uint32_t) params->opslimit, (uint32_t) (params->memlimit / 1024),
+                   params->lanes, NULL, 0);
+#ifndef SODIUM_LIBRARY_MINIMAL
+  } else if(params->alg==OPAQUE_HARDEN_SCRYPT) {
+    const uint8_t scrypt_salt[crypto_pwhash_scryptsalsa208sha256_SALTBYTES]={0};
+    ret = crypto_pwhash_scryptsalsa208sha256_ll(y, crypto_hash_sha512_BYTES,
+                                                scrypt_salt, sizeof scrypt_salt,
+                                                (uint64_t) 1 << params->log2_n, params->r, params->p,
+                                                out, crypto_hash_sha512_BYTES);
+#endif
+  } else {
+    ret = params->mhf->hash(params->args, y, out);
+  }
+  return ret;
+}
+
+/*
+ * Harden(y, params) with an all zero salt. Argon2id with one lane is
+ * what libsodium implements, in reused memory argon2.c is not
+ * measurably faster at it. With more lanes argon2.c fills them
+ * concurrently, in the memory of the context of this thread if it is
+ * large enough and not used by another thread. Both give the same
+ * output for the same parameters. Without a context the
+ * memory is taken from the budget, waiting for it if wait is set, which
+ * can fail with OPAQUE_BUSY. fresh skips both the context and the
+ * budget, for the calibration.
+ */
+static int harden_hash(const Harden_Params *params, const int wait, const int fresh,
+                       const uint8_t y[crypto_hash_sha512_BYTES],
+                       uint8_t out[crypto_hash_sha512_BYTES]) {
+  if(fresh) return harden_compute(params, y, out);
+#ifdef OPAQUE_BENCHMARK
+  if(params->alg==OPAQUE_HARDEN_IDENTITY) {
+    memcpy(out, y, crypto_hash_sha512_BYTES);
+    return 0;
+  }
+#endif
+  if(params->alg==OPAQUE_HARDEN_ARGON2ID && params->lanes>1) {
+    Opaque_HardenCtx *ctx = harden_ctx_acquire(params);
+    if(ctx!=NULL) {
+      // salt - according to the irtf draft this could be all zeroes
+      const uint8_t salt[crypto_pwhash_SALTBYTES]={0};
+      // argon2id() wipes the used memory before returning
+      const int ret = argon2id(out, crypto_hash_sha512_BYTES, y, crypto_hash_sha512_BYTES,
+                               salt, sizeof salt, NULL, 0, NULL, 0,
+                               (uint32_t) params->opslimit, (uint32_t) (params->memlimit / 1024),
+                               params->lanes, ctx->memory, ctx->size);
+      harden_ctx_release(ctx);
+      return ret;
+    }
+  }
+  // only memory allocated for this call counts against the budget
+  size_t reserved;
+  int ret = harden_budget_acquire(params->memlimit, wait, &reserved);
+  if(ret!=0) return ret;
+  ret = harden_compute(params, y, out);
+  harden_budget_release(reserved);
+  return ret;
+}
+
+int opaque_HardenParams(const uint32_t opslimit, const size_t memlimit, const uint8_t lanes,
+                        uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN]) {
+  if(opslimit > 0xffff || (uint64_t) memlimit / 1024 > UINT32_MAX) return -1;
+  const uint32_t memlimit_kib = (uint32_t) (memlimit / 1024);
+  uint8_t tmp[OPAQUE_HARDEN_PARAMS_LEN] = {
+    OPAQUE_HARDEN_ARGON2ID, lanes, (uint8_t) (opslimit >> 8), (uint8_t) opslimit,
+    (uint8_t) (memlimit_kib >> 24), (uint8_t) (memlimit_kib >> 16),
+    (uint8_t) (memlimit_kib >> 8), (uint8_t) memlimit_kib
+  };
+  Harden_Params params;
+  if(0!=harden_decode(tmp, &params)) return -1;
+  memcpy(harden, tmp, sizeof tmp);
+  return 0;
+}
+
+int opaque_HardenParamsScrypt(const uint8_t log2_n, const uint16_t r, const uint32_t p,
+                              uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN]) {
+  uint8_t tmp[OPAQUE_HARDEN_PARAMS_LEN] = {
+    OPAQUE_HARDEN_SCRYPT, log2_n, (uint8_t) (r >> 8), (uint8_t) r,
+    (uint8_t) (p >> 24), (uint8_t) (p >> 16), (uint8_t) (p >> 8), (uint8_t) p
+  };
+  Harden_Params params;
+  if(0!=harden_decode(tmp, &params)) return -1;
+  memcpy(harden, tmp, sizeof tmp);
+  return 0;
+}
+
+int opaque_HardenParamsGet(const uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN], uint32_t *opslimit, size_t *memlimit,
+                           uint8_t *lanes) {
+  Harden_Params params;
+  if(0!=harden_decode(harden, &params) || params.alg!=OPAQUE_HARDEN_ARGON2ID) return -1;
+  *opslimit = (uint32_t) params.opslimit;
+  *memlimit = params.memlimit;
+  *lanes = params.lanes;
+  return 0;
+}
+
+// the wall time in seconds of one hardening, or -1 if it failed
+static double harden_time(const unsigned long long opslimit, const size_t memlimit, const uint8_t lanes) {
+  const Harden_Params params = { .alg = OPAQUE_HARDEN_ARGON2ID, .lanes = lanes,
+                                 .opslimit = opslimit, .memlimit = memlimit };
+  uint8_t out[crypto_hash_sha512_BYTES], in[crypto_hash_sha512_BYTES]={0};
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  // not in the context of the thread nor against the budget, the
+  // parameters are for hardenings in fresh memory
+  if(0!=harden_hash(&params, 1, 1, in, out)) return -1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (double) (t1.tv_sec - t0.tv_sec) + (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int opaque_CalibrateHarden(const uint32_t target_ms, const size_t memlimit_max, const uint8_t lanes,
+                           uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN]) {
+  if(sodium_init() < 0 || lanes==0) return -1;
+  const double target = target_ms / 1000.0;
+  size_t memlimit = memlimit_max;
+  if(memlimit > crypto_pwhash_MEMLIMIT_MAX) memlimit = crypto_pwhash_MEMLIMIT_MAX;
+  if((uint64_t) memlimit / 1024 > UINT32_MAX) memlimit = (size_t) UINT32_MAX * 1024;
+  memlimit = memlimit / 1024 * 1024;
+  const size_t memlimit_min = (crypto_pwhash_MEMLIMIT_MIN > 8192 * (size_t) lanes)
+                              ? crypto_pwhash_MEMLIMIT_MIN : 8192 * (size_t) lanes;
+  if(memlimit < memlimit_min) return -1;
+
+  // first the most memory a single pass fits into the target, the time
+  // of a pass is about linear in the memory. every hardening allocates
+  // and faults in fresh memory, the fastest of two runs is measured.
+  double t1;
+  while(1) {
+    double t = harden_time(1, memlimit, lanes);
+    t1 = harden_time(1, memlimit, lanes);
+    if(t < 0 || t1 < 0) return -1;
+    if(t < t1) t1 = t;
+    if(t1 <= target) break;
+    if(memlimit == memlimit_min) return -1;
+    // aim a bit lower, and at least halve the memory when far off
+    size_t next = (size_t) ((double) memlimit * target / t1 * 0.9) / 1024 * 1024;
+    if(next > memlimit / 2 && t1 > 2 * target) next = memlimit / 2 / 1024 * 1024;
+    if(next >= memlimit) next = memlimit - 1024;
+    if(next < memlimit_min) next = memlimit_min;
+    memlimit = next;
+  }
+
+  // then as many passes over that memory as fit
+  double ops = target / t1;
+  uint32_t opslimit = (ops > 0xffff) ? 0xffff : (ops < 1) ? 1 : (uint32_t) ops;
+  while(opslimit > 1) {
+    const double t = harden_time(opslimit, memlimit, lanes);
+    if(t < 0) return -1;
+    if(t <= target) break;
+    const uint32_t next = (uint32_t) (opslimit * target / t);
+    opslimit = (next < opslimit) ? ((next < 1) ? 1 : next) : opslimit - 1;
+  }
+
+  return opaque_HardenParams(opslimit, memlimit, lanes, harden);
+}
+
+// y = Finalize(x, N), the first half of oprf_Finalize()
+static void oprf_finalize_y(const uint8_t *x, const uint16_t x_len,
+                            const uint8_t N[crypto_core_ristretto255_BYTES],
+                            crypto_hash_sha512_state *state,
+                            uint8_t y[crypto_hash_sha512_BYTES]) {
   // according to paper: hash(pwd||H0^k)
   // acccording to voprf IRTF CFRG specification: hash(htons(len(pwd))||pwd||
   //                                              htons(len(H0_k))||H0_k|||
   //                                              htons(len("Finalize-"VOPRF"-\x00\x00\x01"))||"Finalize-"VOPRF"-\x00\x00\x01")
-  crypto_hash_sha512_state state;
-  if(-1==sodium_mlock(&state,sizeof state)) {
-    return -1;
-  }
-  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_init(state);
   // pwd
   uint16_t size=htons(x_len);
-  crypto_hash_sha512_update(&state, (uint8_t*) &size, 2);
-  crypto_hash_sha512_update(&state, x, x_len);
+  crypto_hash_sha512_update(state, (uint8_t*) &size, 2);
+  crypto_hash_sha512_update(state, x, x_len);
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(x,x_len,"finalize input");
 #endif
   // H0_k
   size=htons(crypto_core_ristretto255_BYTES);
-  crypto_hash_sha512_update(&state, (uint8_t*) &size, 2);
-  crypto_hash_sha512_update(&state, N, crypto_core_ristretto255_BYTES);
+  crypto_hash_sha512_update(state, (uint8_t*) &size, 2);
+  crypto_hash_sha512_update(state, N, crypto_core_ristretto255_BYTES);
   //const uint8_t DST[]="Finalize-"VOPRF"-\x00\x00\x01";
   const uint8_t DST[]="Finalize";
   const uint8_t DST_size=sizeof DST -1;
   //size=htons(DST_size);
   //crypto_hash_sha512_update(&state, (uint8_t*) &size, 2);
-  crypto_hash_sha512_update(&state, DST, DST_size);
+  crypto_hash_sha512_update(state, DST, DST_size);
 
-  // - concat(y, Harden(y, params))
-  uint8_t concated[2*crypto_hash_sha512_BYTES];
-  uint8_t *y=concated, *hardened=concated+crypto_hash_sha512_BYTES;
-  if(-1==sodium_mlock(&concated,sizeof concated)) {
-    sodium_munlock(&state, sizeof state);
-    return -1;
-  }
-  crypto_hash_sha512_final(&state, y);
-  sodium_munlock(&state, sizeof state);
+  crypto_hash_sha512_final(state, y);
 
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump((uint8_t*) y, crypto_hash_sha512_BYTES, "output ");
 #endif
+}
 
-#ifdef CFRG_TEST_VEC
-  // testvectors use identity as MHF
-  memcpy(hardened, y, crypto_hash_sha512_BYTES);
-#else
-  // salt - according to the irtf draft this could be all zeroes
-  uint8_t salt[crypto_pwhash_SALTBYTES]={0};
-  if (crypto_pwhash(hardened, crypto_hash_sha512_BYTES,
-                    (const char*) y, crypto_hash_sha512_BYTES, salt,
-                    crypto_pwhash_OPSLIMIT_INTERACTIVE,
-                    crypto_pwhash_MEMLIMIT_INTERACTIVE,
-                    crypto_pwhash_ALG_DEFAULT) != 0) {
-    /* out of memory */
-    sodium_munlock(concated, sizeof(concated));
-    return -1;
-  }
-#endif
+// randomized_pwd = Extract("", concat(y, Harden(y, params))), the last
+// step of oprf_Finalize()
+static void oprf_finalize_rwd(const uint8_t concated[2*crypto_hash_sha512_BYTES],
+                              uint8_t rwdU[OPAQUE_RWDU_BYTES]) {
 #if (defined TRACE|| defined CFRG_TEST_VEC)
-  dump(concated, sizeof concated, "concated");
+  dump(concated, 2*crypto_hash_sha512_BYTES, "concated");
 #endif
-  crypto_kdf_hkdf_sha512_extract(rwdU, NULL, 0, concated, sizeof concated);
-  sodium_munlock(concated, sizeof(concated));
+  crypto_kdf_hkdf_sha512_extract(rwdU, NULL, 0, concated, 2*crypto_hash_sha512_BYTES);
 
 #if (defined TRACE|| defined CFRG_TEST_VEC)
   dump((uint8_t*) rwdU, OPAQUE_RWDU_BYTES, "rwdU ");
 #endif
+}
+
+/**
+ * This function computes the OPRF output using input x, N, and domain separation
+ * tag info.
+ *
+ * This is the Finalize OPRF function defined in the RFC.
+ *
+ * @param [in] x - a value used to compute OPRF (for OPAQUE, this is pwdU, the
+ * user's password)
+ * @param [in] x_len - the length of param x in bytes
+ * @param [in] N - a serialized OPRF group element, a byte array of fixed length,
+ * an output of oprf_Unblind
+ * @param [in] info - a domain separation tag
+ * @param [in] info_len - the length of param info in bytes
+ * @param [in] harden - the hardening descriptor, NULL for the defaults
+ * @param [out] y - an OPRF output
+ * @return The function returns 0 if everything is correct.
+ */
+static int oprf_Finalize(const uint8_t *x, const uint16_t x_len,
+                         const uint8_t N[crypto_core_ristretto255_BYTES],
+                         const uint8_t *harden,
+                         uint8_t rwdU[OPAQUE_RWDU_BYTES]) {
+  Harden_Params params;
+  if(0!=harden_decode(harden, &params)) return -1;
+  struct {
+    crypto_hash_sha512_state state;
+    // - concat(y, Harden(y, params))
+    uint8_t concated[2*crypto_hash_sha512_BYTES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  uint8_t *y=s->concated, *hardened=s->concated+crypto_hash_sha512_BYTES;
+  oprf_finalize_y(x, x_len, N, &s->state, y);
 
+#ifdef CFRG_TEST_VEC
+  // testvectors use identity as MHF
+  memcpy(hardened, y, crypto_hash_sha512_BYTES);
+#else
+  const int ret = harden_hash(&params, 1, 0, y, hardened);
+  if (ret != 0) {
+    /* out of memory, or OPAQUE_BUSY */
+    opaque_scratch_free(s, sizeof *s);
+    return ret;
+  }
+#endif
+  oprf_finalize_rwd(s->concated, rwdU);
+  opaque_scratch_free(s, sizeof *s);
   return 0;
 }
 
+/*
+ * SHA-512 state after absorbing Z_pad = I2OSP(0, r_in_bytes). Z_pad is
+ * exactly one SHA-512 block, so b_0 can continue from this midstate
+ * instead of compressing the zero block again on every call. It is
+ * computed by libsodium on first use, the layout of the state is
+ * libsodium's business.
+ */
+static crypto_hash_sha512_state z_pad_state;
+static atomic_int z_pad_ready = 0;
+static atomic_flag z_pad_lock = ATOMIC_FLAG_INIT;
+
+static const crypto_hash_sha512_state *z_pad(void) {
+  if(!atomic_load_explicit(&z_pad_ready, memory_order_acquire)) {
+    opaque_spin_lock(&z_pad_lock);
+    if(!atomic_load_explicit(&z_pad_ready, memory_order_relaxed)) {
+      const uint8_t zeroes[128]={0};
+      crypto_hash_sha512_init(&z_pad_state);
+      crypto_hash_sha512_update(&z_pad_state, zeroes, sizeof zeroes);
+      atomic_store_explicit(&z_pad_ready, 1, memory_order_release);
+    }
+    opaque_spin_unlock(&z_pad_lock);
+  }
+  return &z_pad_state;
+}
+
+/*
+ * starts msg_prime of expand_message_xmd() with Z_pad || msg, callers
+ * can absorb further parts of msg into the state before expanding it,
+ * so msg never has to be assembled in one buffer
+ */
+static void xmd_start(crypto_hash_sha512_state *state, const uint8_t *msg, const size_t msg_len) {
+  memcpy(state, z_pad(), sizeof *state);
+  crypto_hash_sha512_update(state, msg, msg_len);
+}
+
 /* expand_loop
  10.    b_i = H(strxor(b_0, b_(i - 1)) || I2OSP(i, 1) || DST_prime)
+
+ blk holds DST_prime at offset crypto_hash_sha512_BYTES+1 already, only
+ the xored block and the counter are updated before hashing it in one go
  */
-static void expand_loop(const uint8_t *b_0, const uint8_t *b_i, const uint8_t i, const uint8_t *dst_prime, const uint8_t dst_prime_len, uint8_t *b_ii) {
-  uint8_t xored[crypto_hash_sha512_BYTES];
+static void expand_loop(const uint8_t *b_0, const uint8_t *b_i, const uint8_t i, uint8_t *blk, const size_t blk_len, uint8_t *b_ii) {
   unsigned j;
-  for(j=0;j<sizeof xored;j++) xored[j]=b_0[j]^b_i[j];
-  // 8.  b_1 = H(b_0 || I2OSP(1, 1) || DST_prime)
-  crypto_hash_sha512_state state;
-  crypto_hash_sha512_init(&state);
-  crypto_hash_sha512_update(&state, xored, sizeof xored);
-  crypto_hash_sha512_update(&state,(uint8_t*) &i, 1);
-  crypto_hash_sha512_update(&state, dst_prime, dst_prime_len);
-  crypto_hash_sha512_final(&state, b_ii);
-  sodium_memzero(&state,sizeof state);
+  for(j=0;j<crypto_hash_sha512_BYTES;j++) blk[j]=b_0[j]^b_i[j];
+  blk[crypto_hash_sha512_BYTES]=i;
+  crypto_hash_sha512(b_ii, blk, blk_len);
 }
 
 /*
@@ -276,63 +917,55 @@ static void expand_loop(const uint8_t *b_0, const uint8_t *b_i, const uint8_t i,
  * 10.    b_i = H(strxor(b_0, b_(i - 1)) || I2OSP(i, 1) || DST_prime)
  * 11. uniform_bytes = b_1 || ... || b_ell
  * 12. return substr(uniform_bytes, 0, len_in_bytes)
+ *
+ * msg is streamed: msg_state has absorbed Z_pad || msg already, see
+ * xmd_start(), it is wiped when done.
  */
-static int expand_message_xmd(const uint8_t *msg, const uint8_t msg_len, const uint8_t *dst, const uint8_t dst_len, const uint8_t len_in_bytes, uint8_t *uniform_bytes) {
+static int expand_message_xmd(crypto_hash_sha512_state *msg_state, const uint8_t *dst, const uint8_t dst_len, const uint8_t len_in_bytes, uint8_t *uniform_bytes) {
   // 1.  ell = ceil(len_in_bytes / b_in_bytes)
   const uint8_t ell = (len_in_bytes + crypto_hash_sha512_BYTES-1) / crypto_hash_sha512_BYTES;
 #ifdef TRACE
   fprintf(stderr, "ell %d\n", ell);
-  dump(msg, msg_len, "msg");
   dump(dst, dst_len, "dst");
 #endif
 
   // 2.  ABORT if ell > 255
-  if(ell>255) return -1;
+  if(ell>255) {
+    sodium_memzero(msg_state, sizeof *msg_state);
+    return -1;
+  }
+  // b_1 ... b_ell all hash b || I2OSP(i, 1) || DST_prime, DST_prime is
+  // put once behind the slots for the block and the counter
+  uint8_t blk[crypto_hash_sha512_BYTES + 1 + 255 + 1],
+    *dst_prime = blk + crypto_hash_sha512_BYTES + 1;
   // 3.  DST_prime = DST || I2OSP(len(DST), 1)
-  uint8_t dst_prime[dst_len+1];
+  const size_t dst_prime_len = (size_t) dst_len + 1;
   memcpy(dst_prime, dst, dst_len);
   dst_prime[dst_len] = dst_len;
+  const size_t blk_len = crypto_hash_sha512_BYTES + 1 + dst_prime_len;
 #ifdef TRACE
-  dump(dst_prime, sizeof dst_prime, "dst_prime");
+  dump(dst_prime, dst_prime_len, "dst_prime");
 #endif
   // 4.  Z_pad = I2OSP(0, r_in_bytes)
-  //const uint8_t r_in_bytes = 128; // for sha512
-  uint8_t z_pad[128 /*r_in_bytes*/] = {0}; // supress gcc error: variable-sized object may not be initialized
-#ifdef TRACE
-  dump(z_pad, sizeof z_pad, "z_pad");
-#endif
+  // absorbed already in msg_state, starting from z_pad()
   // 5.  l_i_b_str = I2OSP(len_in_bytes, 2)
-  const uint16_t l_i_b = htons(len_in_bytes);
-  const uint8_t *l_i_b_str = (uint8_t*) &l_i_b;
   // 6.  msg_prime = Z_pad || msg || l_i_b_str || I2OSP(0, 1) || DST_prime
-  uint8_t msg_prime[sizeof z_pad + msg_len + sizeof l_i_b + 1 + sizeof dst_prime],
-    *ptr = msg_prime;
-  memcpy(ptr, z_pad, sizeof z_pad);
-  ptr += sizeof z_pad;
-  memcpy(ptr, msg, msg_len);
-  ptr += msg_len;
-  memcpy(ptr, l_i_b_str, sizeof l_i_b);
-  ptr += sizeof l_i_b;
-  *ptr = 0;
-  ptr++;
-  memcpy(ptr, dst_prime, sizeof dst_prime);
-#ifdef TRACE
-  dump(msg_prime, sizeof msg_prime, "msg_prime");
-#endif
+  // msg_prime is not assembled, its parts are hashed in place
+  const uint8_t l_i_b_str[3] = { 0, len_in_bytes, 0 };
   // 7.  b_0 = H(msg_prime)
   uint8_t b_0[crypto_hash_sha512_BYTES];
-  crypto_hash_sha512(b_0, msg_prime, sizeof msg_prime);
+  crypto_hash_sha512_update(msg_state, l_i_b_str, sizeof l_i_b_str);
+  crypto_hash_sha512_update(msg_state, dst_prime, dst_prime_len);
+  crypto_hash_sha512_final(msg_state, b_0);
+  sodium_memzero(msg_state, sizeof *msg_state);
 #ifdef TRACE
   dump(b_0, sizeof b_0, "b_0");
 #endif
   // 8.  b_1 = H(b_0 || I2OSP(1, 1) || DST_prime)
   uint8_t b_i[crypto_hash_sha512_BYTES];
-  crypto_hash_sha512_state state;
-  crypto_hash_sha512_init(&state);
-  crypto_hash_sha512_update(&state, b_0, sizeof b_0);
-  crypto_hash_sha512_update(&state,(uint8_t*) &"\x01", 1);
-  crypto_hash_sha512_update(&state, dst_prime, sizeof dst_prime);
-  crypto_hash_sha512_final(&state, b_i);
+  memcpy(blk, b_0, sizeof b_0);
+  blk[crypto_hash_sha512_BYTES]=1;
+  crypto_hash_sha512(b_i, blk, blk_len);
 #ifdef TRACE
   dump(b_i, sizeof b_i, "b_1");
 #endif
@@ -349,18 +982,19 @@ static int expand_message_xmd(const uint8_t *msg, const uint8_t msg_len, const u
     // 11. uniform_bytes = b_1 || ... || b_ell
     // 12. return substr(uniform_bytes, 0, len_in_bytes)
     // 10.    b_i = H(strxor(b_0, b_(i - 1)) || I2OSP(i, 1) || DST_prime)
-    expand_loop(b_0, b_i, i, dst_prime, sizeof dst_prime, b_ii);
+    expand_loop(b_0, b_i, i, blk, blk_len, b_ii);
     clen = (left>sizeof b_ii)?sizeof b_ii:left;
     memcpy(out, b_ii, clen);
     out+=clen;
     left-=clen;
     // unrolled next iteration so we don't have to swap b_i and b_ii
-    expand_loop(b_0, b_ii, i+1, dst_prime, sizeof dst_prime, b_i);
+    expand_loop(b_0, b_ii, i+1, blk, blk_len, b_i);
     clen = (left>sizeof b_i)?sizeof b_i:left;
     memcpy(out, b_i, clen);
     out+=clen;
     left-=clen;
   }
+  sodium_memzero(blk, crypto_hash_sha512_BYTES);
   return 0;
 }
 
@@ -372,44 +1006,51 @@ static int expand_message_xmd(const uint8_t *msg, const uint8_t msg_len, const u
  * 2. P = ristretto255_map(uniform_bytes)
  * 3. return P
  */
-static int voprf_hash_to_group(const uint8_t *msg, const uint8_t msg_len, uint8_t p[crypto_core_ristretto255_BYTES]) {
+static int voprf_hash_to_group(const uint8_t *msg, const uint16_t msg_len, uint8_t p[crypto_core_ristretto255_BYTES]) {
   const uint8_t dst[] = "HashToGroup-"VOPRF"-\x00\x00\x01";
   const uint8_t dst_len = (sizeof dst) - 1;
-  uint8_t uniform_bytes[crypto_core_ristretto255_HASHBYTES]={0};
-  if(0!=sodium_mlock(uniform_bytes,sizeof uniform_bytes)) {
-    return -1;
-  }
-  if(0!=expand_message_xmd(msg, msg_len, dst, dst_len, crypto_core_ristretto255_HASHBYTES, uniform_bytes)) {
-    sodium_munlock(uniform_bytes,sizeof uniform_bytes);
+#ifdef TRACE
+  dump(msg, msg_len, "msg");
+#endif
+  struct {
+    crypto_hash_sha512_state msg_state;
+    uint8_t uniform_bytes[crypto_core_ristretto255_HASHBYTES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  xmd_start(&s->msg_state, msg, msg_len);
+  if(0!=expand_message_xmd(&s->msg_state, dst, dst_len, sizeof s->uniform_bytes, s->uniform_bytes)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(uniform_bytes, sizeof uniform_bytes, "uniform_bytes");
+  dump(s->uniform_bytes, sizeof s->uniform_bytes, "uniform_bytes");
 #endif
-  crypto_core_ristretto255_from_hash(p, uniform_bytes);
-  sodium_munlock(uniform_bytes,sizeof uniform_bytes);
+  crypto_core_ristretto255_from_hash(p, s->uniform_bytes);
+  opaque_scratch_free(s, sizeof *s);
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(p, crypto_core_ristretto255_BYTES, "hashed-to-curve");
 #endif
   return 0;
 }
 
-static int voprf_hash_to_scalar(const uint8_t *msg, const uint8_t msg_len, const uint8_t *dst, const uint8_t dst_len, uint8_t p[crypto_core_ristretto255_SCALARBYTES]) {
+// msg_state has absorbed Z_pad || msg, see xmd_start(), it is wiped
+static int voprf_hash_to_scalar(crypto_hash_sha512_state *msg_state, const uint8_t *dst, const uint8_t dst_len, uint8_t p[crypto_core_ristretto255_SCALARBYTES]) {
   //const uint8_t dst[] = "HashToScalar-"VOPRF"-\x00\x00\x01";
   //const uint8_t dst_len = (sizeof dst) - 1;
-  uint8_t uniform_bytes[crypto_core_ristretto255_HASHBYTES]={0};
-  if(0!=sodium_mlock(uniform_bytes,sizeof uniform_bytes)) {
+  uint8_t *uniform_bytes = opaque_scratch_alloc(crypto_core_ristretto255_HASHBYTES);
+  if(uniform_bytes==NULL) {
+    sodium_memzero(msg_state, sizeof *msg_state);
     return -1;
   }
-  if(0!=expand_message_xmd(msg, msg_len, dst, dst_len, crypto_core_ristretto255_HASHBYTES, uniform_bytes)) {
-    sodium_munlock(uniform_bytes,sizeof uniform_bytes);
+  if(0!=expand_message_xmd(msg_state, dst, dst_len, crypto_core_ristretto255_HASHBYTES, uniform_bytes)) {
+    opaque_scratch_free(uniform_bytes, crypto_core_ristretto255_HASHBYTES);
     return -1;
   }
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(uniform_bytes, sizeof uniform_bytes, "uniform_bytes");
+  dump(uniform_bytes, crypto_core_ristretto255_HASHBYTES, "uniform_bytes");
 #endif
   crypto_core_ristretto255_scalar_reduce(p, uniform_bytes);
-  sodium_munlock(uniform_bytes,sizeof uniform_bytes);
+  opaque_scratch_free(uniform_bytes, crypto_core_ristretto255_HASHBYTES);
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(p, crypto_core_ristretto255_BYTES, "hashed-to-scalar");
 #endif
@@ -418,25 +1059,38 @@ static int voprf_hash_to_scalar(const uint8_t *msg, const uint8_t msg_len, const
 
 static int deriveKeyPair(const uint8_t *seed, const size_t seed_len, const uint8_t *info, const uint16_t info_len, uint8_t skS[crypto_core_ristretto255_SCALARBYTES], uint8_t pkS[crypto_core_ristretto255_BYTES]) {
   const uint8_t ctx[] = "DeriveKeyPair"VOPRF"-\x00\x00\x01";
-  uint8_t hashinput[seed_len + 2 + info_len + 1], *ptr= hashinput;
-  memcpy(ptr,seed,seed_len);
-  ptr+=seed_len;
-  *((uint16_t*) ptr)=htons(info_len);
-  ptr+=2;
-  memcpy(ptr,info,info_len);
-  ptr+=info_len;
-  ptr[0]=0;
+  // the input is seed || I2OSP(len(info), 2) || info || I2OSP(counter, 1),
+  // everything before the counter is absorbed only once
+  struct {
+    crypto_hash_sha512_state prefix;
+    crypto_hash_sha512_state msg_state;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  const uint8_t info_len_be[2] = { info_len >> 8, info_len & 0xff };
+  xmd_start(&s->prefix, seed, seed_len);
+  crypto_hash_sha512_update(&s->prefix, info_len_be, sizeof info_len_be);
+  crypto_hash_sha512_update(&s->prefix, info, info_len);
+  uint8_t counter=0;
   memset(skS,0,crypto_core_ristretto255_SCALARBYTES);
   int i;
   while(1) {
-    if(ptr[0]>16) return 1; // DeriveKeyPairError
+    if(counter>16) { // DeriveKeyPairError
+      opaque_scratch_free(s, sizeof *s);
+      return 1;
+    }
     for(i=crypto_core_ristretto255_SCALARBYTES/sizeof(uint32_t);i>0;i--) {
       if((((uint32_t*)skS)[i-1])!=0) break;
     }
     if(i!=0) break;
-    if(0!=voprf_hash_to_scalar(hashinput,sizeof hashinput, ctx, sizeof ctx -1,skS)) return -1;
-    ptr[0]++;
+    memcpy(&s->msg_state, &s->prefix, sizeof s->msg_state);
+    crypto_hash_sha512_update(&s->msg_state, &counter, 1);
+    if(0!=voprf_hash_to_scalar(&s->msg_state, ctx, sizeof ctx -1,skS)) {
+      opaque_scratch_free(s, sizeof *s);
+      return -1;
+    }
+    counter++;
   }
+  opaque_scratch_free(s, sizeof *s);
 
   // P_u := g^p_u
   crypto_scalarmult_ristretto255_base(pkS, skS);
@@ -445,40 +1099,39 @@ static int deriveKeyPair(const uint8_t *seed, const size_t seed_len, const uint8
 
 static int prf(const uint8_t *pwdU, const uint16_t pwdU_len,
                const uint8_t kU[crypto_core_ristretto255_SCALARBYTES],
+               const uint8_t *harden,
                uint8_t rwdU[OPAQUE_RWDU_BYTES]) {
   // F_k(pwd) = H(pwd, (H0(pwd))^k) for key k ∈ Z_q
-  uint8_t H0[crypto_core_ristretto255_BYTES];
-  if(0!=sodium_mlock(H0,sizeof H0)) {
+  struct {
+    uint8_t H0[crypto_core_ristretto255_BYTES];
+    uint8_t N[crypto_core_ristretto255_BYTES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  // sets α := (H^0(pw))^r
+  if(0!=voprf_hash_to_group(pwdU, pwdU_len, s->H0)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  // sets α := (H^0(pw))^r
-  if(0!=voprf_hash_to_group(pwdU, pwdU_len, H0)) return -1;
 #ifdef TRACE
-  dump(H0,sizeof H0, "H0");
+  dump(s->H0,sizeof s->H0, "H0");
 #endif
 
   // H0 ^ k
-  uint8_t N[crypto_core_ristretto255_BYTES];
-  if(0!=sodium_mlock(N,sizeof N)) {
-    sodium_munlock(H0,sizeof H0);
-    return -1;
-  }
-  if (crypto_scalarmult_ristretto255(N, kU, H0) != 0) {
-    sodium_munlock(H0,sizeof H0);
-    sodium_munlock(N,sizeof N);
+  if (crypto_scalarmult_ristretto255(s->N, kU, s->H0) != 0) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(H0,sizeof H0);
 #ifdef TRACE
-  dump(N, sizeof N, "N");
+  dump(s->N, sizeof s->N, "N");
 #endif
 
   // 2. rwdU = Finalize(pwdU, N, "OPAQUE01")
-  if(0!=oprf_Finalize(pwdU, pwdU_len, N, rwdU)) {
-    sodium_munlock(N,sizeof N);
-    return -1;
+  const int ret = oprf_Finalize(pwdU, pwdU_len, s->N, harden, rwdU);
+  if(0!=ret) {
+    opaque_scratch_free(s, sizeof *s);
+    return ret;
   }
-  sodium_munlock(N,sizeof N);
+  opaque_scratch_free(s, sizeof *s);
 
   return 0;
 }
@@ -503,14 +1156,15 @@ static int oprf_Blind(const uint8_t *x, const uint16_t x_len,
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(x, x_len, "input");
 #endif
-  uint8_t H0[crypto_core_ristretto255_BYTES];
-  if(0!=sodium_mlock(H0,sizeof H0)) {
+  uint8_t *H0 = opaque_scratch_alloc(crypto_core_ristretto255_BYTES);
+  if(H0==NULL) return -1;
+  // sets α := (H^0(pw))^r
+  if(0!=voprf_hash_to_group(x, x_len, H0)) {
+    opaque_scratch_free(H0, crypto_core_ristretto255_BYTES);
     return -1;
   }
-  // sets α := (H^0(pw))^r
-  if(0!=voprf_hash_to_group(x, x_len, H0)) return -1;
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(H0,sizeof H0, "H0 ");
+  dump(H0, crypto_core_ristretto255_BYTES, "H0 ");
 #endif
 
   // U picks r
@@ -528,10 +1182,10 @@ static int oprf_Blind(const uint8_t *x, const uint16_t x_len,
 #endif
   // H^0(pw)^r
   if (crypto_scalarmult_ristretto255(blinded, r, H0) != 0) {
-    sodium_munlock(H0,sizeof H0);
+    opaque_scratch_free(H0, crypto_core_ristretto255_BYTES);
     return -1;
   }
-  sodium_munlock(H0,sizeof H0);
+  opaque_scratch_free(H0, crypto_core_ristretto255_BYTES);
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(blinded, crypto_core_ristretto255_BYTES, "blinded");
 #endif
@@ -584,105 +1238,81 @@ static int oprf_Unblind(const uint8_t r[crypto_core_ristretto255_SCALARBYTES],
 
   // (b) Computes rw := H(pw, β^1/r );
   // invert r = 1/r
-  uint8_t ir[crypto_core_ristretto255_SCALARBYTES];
-  if(-1==sodium_mlock(ir, sizeof ir)) return -1;
+  uint8_t *ir = opaque_scratch_alloc(crypto_core_ristretto255_SCALARBYTES);
+  if(ir==NULL) return -1;
   if (crypto_core_ristretto255_scalar_invert(ir, r) != 0) {
-    sodium_munlock(ir, sizeof ir);
+    opaque_scratch_free(ir, crypto_core_ristretto255_SCALARBYTES);
     return -1;
   }
 #ifdef TRACE
-  dump((uint8_t*) ir, sizeof ir, "r^-1 ");
+  dump((uint8_t*) ir, crypto_core_ristretto255_SCALARBYTES, "r^-1 ");
 #endif
 
   // H0 = β^(1/r)
   // beta^(1/r) = h(pwd)^k
   if (crypto_scalarmult_ristretto255(N, ir, Z) != 0) {
-    sodium_munlock(ir, sizeof ir);
+    opaque_scratch_free(ir, crypto_core_ristretto255_SCALARBYTES);
     return -1;
   }
 #ifdef TRACE
   dump((uint8_t*) N, crypto_core_ristretto255_BYTES, "N ");
 #endif
 
-  sodium_munlock(ir, sizeof ir);
+  opaque_scratch_free(ir, crypto_core_ristretto255_SCALARBYTES);
   return 0;
 }
 
-static void hkdf_expand_label(uint8_t* res, const uint8_t secret[crypto_kdf_hkdf_sha512_KEYBYTES], const char *label, const char transcript[crypto_hash_sha512_BYTES], const size_t len) {
-  // construct a hkdf label
-  // struct {
-  //   uint16 length = Length;
-  //   opaque label<8..255> = "OPAQUE-" + Label;
-  //   opaque context<0..255> = Context;
-  // } HkdfLabel;
-  const size_t llen = strlen((const char*) label);
-  uint8_t hkdflabel[2+2+7/*"OPAQUE-"*/+llen+(transcript!=NULL?crypto_hash_sha512_BYTES:0)];
-
-  *((uint16_t*) hkdflabel)=htons(len);
-
-  uint8_t *ptr=hkdflabel+2;
-  *(ptr)=(7+llen);
-  ptr+=1;
-
-  memcpy(ptr,"OPAQUE-",7);
-  ptr+=7;
-
-  memcpy(ptr,label,llen);
-  ptr+=llen;
-
-  if(transcript!=NULL) {
-    *(ptr)=crypto_hash_sha512_BYTES;
-    ptr+=1;
-    memcpy(ptr, transcript, crypto_hash_sha512_BYTES);
-  } else {
-    *(ptr)=0;
-  }
-
-#if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(hkdflabel, sizeof(hkdflabel), "expanded label");
-  if(transcript!=NULL) dump((const uint8_t*) transcript,crypto_hash_sha512_BYTES, "transcript: ");
-#endif
-
-  crypto_kdf_hkdf_sha512_expand(res, len, (const char*) hkdflabel, sizeof(hkdflabel), secret);
-}
-
 // derive keys according to irtf cfrg draft
 static int derive_keys(Opaque_Keys* keys, const uint8_t ikm[crypto_scalarmult_BYTES * 3], const char info[crypto_hash_sha512_BYTES]) {
-  uint8_t prk[64];
-  if(-1==sodium_mlock(prk, sizeof prk)) return -1;
+  struct {
+    uint8_t prk[64];
+    uint8_t handshake_secret[OPAQUE_HANDSHAKE_SECRETBYTES];
+    crypto_auth_hmacsha512_state keyed;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
 #ifdef TRACE
   dump(ikm, crypto_scalarmult_BYTES*3, "ikm ");
   dump((uint8_t*) info, crypto_hash_sha512_BYTES, "info ");
 #endif
   // 1. prk = HKDF-Extract(salt=0, IKM)
-  crypto_kdf_hkdf_sha512_extract(prk, NULL, 0, ikm, crypto_scalarmult_BYTES*3);
+  crypto_kdf_hkdf_sha512_extract(s->prk, NULL, 0, ikm, crypto_scalarmult_BYTES*3);
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(prk, sizeof prk, "prk");
-#endif
-
-  // 2. handshake_secret = Derive-Secret(., "handshake secret", info)
-  uint8_t handshake_secret[OPAQUE_HANDSHAKE_SECRETBYTES];
-  if(-1==sodium_mlock(handshake_secret, sizeof handshake_secret)) {
-    sodium_munlock(prk,sizeof(prk));
-    return -1;
-  }
-  const char handshake_secret_label[]="HandshakeSecret";
-  hkdf_expand_label(handshake_secret, prk, handshake_secret_label, info, sizeof(handshake_secret));
-
-  // 3. keys->sk         = Derive-Secret(., "session secret", info)
-  const char session_key_label[]="SessionKey";
-  hkdf_expand_label(keys->sk, prk, session_key_label, info, OPAQUE_SHARED_SECRETBYTES);
-  sodium_munlock(prk,sizeof(prk));
-
-  // 4. Km2 = Derive-Secret(handshake_secret, "ServerMAC", "")
-  //Km2 = HKDF-Expand-Label(handshake_secret, "server mac", "", Hash.length)
-  const char server_mac_label[]="ServerMAC";
-  hkdf_expand_label(keys->km2, handshake_secret, server_mac_label, NULL, OPAQUE_HMAC_SHA512_KEYBYTES);
-  // 5. Km3 = Derive-Secret(handshake_secret, "ClientMAC", "")
-  //Km3 = HKDF-Expand-Label(handshake_secret, "client mac", "", Hash.length)
-  const char client_mac_label[]="ClientMAC";
-  hkdf_expand_label(keys->km3, handshake_secret, client_mac_label, NULL, OPAQUE_HMAC_SHA512_KEYBYTES);
-  sodium_munlock(handshake_secret, sizeof handshake_secret);
+  dump(s->prk, sizeof s->prk, "prk");
+#endif
+
+  HKDF_LABEL(handshake_secret_label, OPAQUE_HANDSHAKE_SECRETBYTES, "HandshakeSecret", crypto_hash_sha512_BYTES);
+  HKDF_LABEL(session_key_label, OPAQUE_SHARED_SECRETBYTES, "SessionKey", crypto_hash_sha512_BYTES);
+  HKDF_LABEL(server_mac_label, OPAQUE_HMAC_SHA512_KEYBYTES, "ServerMAC", 0);
+  HKDF_LABEL(client_mac_label, OPAQUE_HMAC_SHA512_KEYBYTES, "ClientMAC", 0);
+  const Hkdf_Output from_prk[] = {
+    // 2. handshake_secret = Derive-Secret(., "handshake secret", info)
+    { s->handshake_secret, sizeof s->handshake_secret,
+      &handshake_secret_label, sizeof handshake_secret_label,
+      (const uint8_t*) info, crypto_hash_sha512_BYTES },
+    // 3. keys->sk         = Derive-Secret(., "session secret", info)
+    { keys->sk, OPAQUE_SHARED_SECRETBYTES,
+      &session_key_label, sizeof session_key_label,
+      (const uint8_t*) info, crypto_hash_sha512_BYTES },
+  };
+  const Hkdf_Output from_handshake_secret[] = {
+    // 4. Km2 = Derive-Secret(handshake_secret, "ServerMAC", "")
+    //Km2 = HKDF-Expand-Label(handshake_secret, "server mac", "", Hash.length)
+    { keys->km2, OPAQUE_HMAC_SHA512_KEYBYTES,
+      &server_mac_label, sizeof server_mac_label, NULL, 0 },
+    // 5. Km3 = Derive-Secret(handshake_secret, "ClientMAC", "")
+    //Km3 = HKDF-Expand-Label(handshake_secret, "client mac", "", Hash.length)
+    { keys->km3, OPAQUE_HMAC_SHA512_KEYBYTES,
+      &client_mac_label, sizeof client_mac_label, NULL, 0 },
+  };
+#if (defined TRACE || defined CFRG_TEST_VEC)
+  dump((const uint8_t*) &handshake_secret_label, sizeof handshake_secret_label, "expanded label");
+  dump((const uint8_t*) &session_key_label, sizeof session_key_label, "expanded label");
+  dump((const uint8_t*) info,crypto_hash_sha512_BYTES, "transcript: ");
+#endif
+  hkdf_expand_multi(s->prk, &s->keyed, from_prk, sizeof from_prk / sizeof from_prk[0]);
+  hkdf_expand_multi(s->handshake_secret, &s->keyed, from_handshake_secret,
+                    sizeof from_handshake_secret / sizeof from_handshake_secret[0]);
+  opaque_scratch_free(s, sizeof *s);
 #ifdef TRACE
   dump(keys->sk, OPAQUE_SHARED_SECRETBYTES, "keys->sk");
   dump(keys->km2, OPAQUE_HMAC_SHA512_KEYBYTES, "keys->km2");
@@ -691,10 +1321,107 @@ static int derive_keys(Opaque_Keys* keys, const uint8_t ikm[crypto_scalarmult_BY
   return 0;
 }
 
-/** if one of the peers ID is missing, set it to the peers public key */
-static void fix_ids(const uint8_t pkU[crypto_scalarmult_BYTES],
-                    const uint8_t pkS[crypto_scalarmult_BYTES],
-                    const Opaque_Ids *ids_in,
+// hkdf_expand_keyed() for m lanes, all outputs and infos have the same
+// length, out_len must be a multiple of the hash size. st is space for
+// m hmac states.
+static void hkdf_expand_keyed_mb(const size_t m,
+                                 uint8_t *const out[], const size_t out_len,
+                                 const uint8_t *const info[], const size_t info_len,
+                                 const uint8_t *const ctx[], const size_t ctx_len,
+                                 const crypto_auth_hmacsha512_state *const keyed[],
+                                 crypto_auth_hmacsha512_state *const st[]) {
+  const uint8_t *prev[OPAQUE_MB_LANES], *counters[OPAQUE_MB_LANES];
+  uint8_t *blk[OPAQUE_MB_LANES];
+  uint8_t counter = 1;
+  size_t i, j;
+  for(i=0;i<out_len;i+=crypto_auth_hmacsha512_BYTES,counter++) {
+    for(j=0;j<m;j++) {
+      memcpy(st[j], keyed[j], sizeof *st[j]);
+      prev[j] = (i!=0) ? &out[j][i-crypto_auth_hmacsha512_BYTES] : NULL;
+      counters[j] = &counter;
+      blk[j] = &out[j][i];
+    }
+    if(i!=0) hmacsha512mb_update(m, st, prev, crypto_auth_hmacsha512_BYTES);
+    hmacsha512mb_update(m, st, info, info_len);
+    if(ctx!=NULL) hmacsha512mb_update(m, st, ctx, ctx_len);
+    hmacsha512mb_update(m, st, counters, 1);
+    hmacsha512mb_final(m, st, blk);
+  }
+}
+
+// derive_keys() for m sessions in lockstep
+static int derive_keys_mb(const size_t m,
+                          Opaque_Keys *const keys[],
+                          const uint8_t *const ikm[],
+                          const uint8_t *const info[]) {
+  struct {
+    uint8_t prk[OPAQUE_MB_LANES][64];
+    uint8_t handshake_secret[OPAQUE_MB_LANES][OPAQUE_HANDSHAKE_SECRETBYTES];
+    crypto_auth_hmacsha512_state keyed[OPAQUE_MB_LANES];
+    crypto_auth_hmacsha512_state st[OPAQUE_MB_LANES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+
+  crypto_auth_hmacsha512_state *keyed[OPAQUE_MB_LANES], *st[OPAQUE_MB_LANES];
+  uint8_t *prk[OPAQUE_MB_LANES], *hs[OPAQUE_MB_LANES], *out[OPAQUE_MB_LANES], *out2[OPAQUE_MB_LANES];
+  const uint8_t *label[OPAQUE_MB_LANES], *label2[OPAQUE_MB_LANES];
+  size_t j;
+  for(j=0;j<m;j++) {
+    keyed[j] = &s->keyed[j];
+    st[j] = &s->st[j];
+    prk[j] = s->prk[j];
+    hs[j] = s->handshake_secret[j];
+  }
+
+  // 1. prk = HKDF-Extract(salt=0, IKM), the hmac keyed with the empty
+  // salt is the same for all
+  crypto_auth_hmacsha512_init(st[0], NULL, 0);
+  for(j=1;j<m;j++) memcpy(st[j], st[0], sizeof *st[j]);
+  hmacsha512mb_update(m, st, ikm, crypto_scalarmult_BYTES*3);
+  hmacsha512mb_final(m, st, prk);
+
+  HKDF_LABEL(handshake_secret_label, OPAQUE_HANDSHAKE_SECRETBYTES, "HandshakeSecret", crypto_hash_sha512_BYTES);
+  HKDF_LABEL(session_key_label, OPAQUE_SHARED_SECRETBYTES, "SessionKey", crypto_hash_sha512_BYTES);
+  HKDF_LABEL(server_mac_label, OPAQUE_HMAC_SHA512_KEYBYTES, "ServerMAC", 0);
+  HKDF_LABEL(client_mac_label, OPAQUE_HMAC_SHA512_KEYBYTES, "ClientMAC", 0);
+
+  hmacsha512mb_init(m, keyed, (const uint8_t *const *) prk, crypto_kdf_hkdf_sha512_KEYBYTES);
+  // 2. handshake_secret = Derive-Secret(., "handshake secret", info)
+  for(j=0;j<m;j++) label[j] = (const uint8_t*) &handshake_secret_label;
+  hkdf_expand_keyed_mb(m, hs, OPAQUE_HANDSHAKE_SECRETBYTES, label, sizeof handshake_secret_label,
+                       info, crypto_hash_sha512_BYTES,
+                       (const crypto_auth_hmacsha512_state *const *) keyed, st);
+  // 3. keys->sk         = Derive-Secret(., "session secret", info)
+  for(j=0;j<m;j++) {
+    label[j] = (const uint8_t*) &session_key_label;
+    out[j] = keys[j]->sk;
+  }
+  hkdf_expand_keyed_mb(m, out, OPAQUE_SHARED_SECRETBYTES, label, sizeof session_key_label,
+                       info, crypto_hash_sha512_BYTES,
+                       (const crypto_auth_hmacsha512_state *const *) keyed, st);
+
+  hmacsha512mb_init(m, keyed, (const uint8_t *const *) hs, OPAQUE_HANDSHAKE_SECRETBYTES);
+  for(j=0;j<m;j++) {
+    label[j] = (const uint8_t*) &server_mac_label;
+    label2[j] = (const uint8_t*) &client_mac_label;
+    out[j] = keys[j]->km2;
+    out2[j] = keys[j]->km3;
+  }
+  // 4. Km2 = Derive-Secret(handshake_secret, "ServerMAC", "")
+  hkdf_expand_keyed_mb(m, out, OPAQUE_HMAC_SHA512_KEYBYTES, label, sizeof server_mac_label,
+                       NULL, 0, (const crypto_auth_hmacsha512_state *const *) keyed, st);
+  // 5. Km3 = Derive-Secret(handshake_secret, "ClientMAC", "")
+  hkdf_expand_keyed_mb(m, out2, OPAQUE_HMAC_SHA512_KEYBYTES, label2, sizeof client_mac_label,
+                       NULL, 0, (const crypto_auth_hmacsha512_state *const *) keyed, st);
+
+  opaque_scratch_free(s, sizeof *s);
+  return 0;
+}
+
+/** if one of the peers ID is missing, set it to the peers public key */
+static void fix_ids(const uint8_t pkU[crypto_scalarmult_BYTES],
+                    const uint8_t pkS[crypto_scalarmult_BYTES],
+                    const Opaque_Ids *ids_in,
                     Opaque_Ids *ids_out) {
   if(ids_in->idS==NULL || ids_in->idS_len==0) {
     ids_out->idS=(uint8_t*)pkS;
@@ -712,61 +1439,74 @@ static void fix_ids(const uint8_t pkU[crypto_scalarmult_BYTES],
   }
 }
 
-static void calc_preamble(char preamble[crypto_hash_sha512_BYTES],
-                          crypto_hash_sha512_state *state,
-                          const uint8_t pkU[crypto_scalarmult_BYTES],
-                          const uint8_t pkS[crypto_scalarmult_BYTES],
-                          const uint8_t ke1[OPAQUE_USER_SESSION_PUBLIC_LEN],
-                          const Opaque_ServerSession *ke2,
-                          const uint8_t *ctx, const uint16_t ctx_len,
-                          const Opaque_Ids *ids0) {
-  crypto_hash_sha512_init(state);
-
-  Opaque_Ids ids;
-  fix_ids(pkU, pkS, ids0, &ids);
-
-#ifdef TRACE
-  fprintf(stderr,"calc preamble\n");
-  dump(ids.idU, ids.idU_len,"idU ");
-  dump(ids.idS, ids.idS_len,"idS ");
-  dump(pkU, crypto_scalarmult_BYTES, "pkU");
-  dump(pkS,crypto_scalarmult_BYTES, "pkS");
-  dump(ke1, OPAQUE_USER_SESSION_PUBLIC_LEN, "ke1");
-  dump(ctx, ctx_len, "ctx");
-  dump((uint8_t*)ke2,
-       /* credential_response */
-       /*Z*/ crypto_core_ristretto255_BYTES +
-       /*masking_nonce*/ 32+
-       /*masked_response*/ crypto_scalarmult_BYTES+sizeof(Opaque_Envelope)+
-       /*nonceS*/OPAQUE_NONCE_BYTES+
-       /*X_s*/crypto_scalarmult_BYTES, "ke2");
-#endif
-
+/**
+ * initializes the preamble hash state with the prefix that only
+ * depends on the protocol and the context string:
+ *   "RFCXXXX", I2OSP(len(context), 2), context
+ *
+ * the resulting state can be cached and copied for each session that
+ * shares the same context (see opaque_CreateServerContext())
+ */
+static void preamble_init(crypto_hash_sha512_state *state,
+                          const uint8_t *ctx, const uint16_t ctx_len) {
   //1. preamble = hash("RFCXXXX",
   // note the spec it self does not say hash here, but
   // https://github.com/cfrg/draft-irtf-cfrg-opaque/pull/147
   // and later uses all hash this value
   const uint8_t rfc[]="RFCXXXX";
   const uint8_t rfc_len=sizeof rfc -1;
+  crypto_hash_sha512_init(state);
   crypto_hash_sha512_update(state, rfc, rfc_len);
 
+#ifdef TRACE
+  dump(ctx, ctx_len, "ctx");
+#endif
+
   //                   I2OSP(len(context), 2), context,
   uint16_t len = htons(ctx_len);
   crypto_hash_sha512_update(state, (uint8_t*) &len, 2);
   crypto_hash_sha512_update(state, ctx, ctx_len);
+}
 
+// absorbs I2OSP(len(client_identity), 2), client_identity into a
+// state initialized by preamble_init(), this prefix is fixed per user
+// and can be cached (see opaque_PrepareRecord())
+static void preamble_idU(crypto_hash_sha512_state *state,
+                         const uint8_t *idU, const uint16_t idU_len) {
+#ifdef TRACE
+  dump(idU, idU_len,"idU ");
+#endif
   //                   I2OSP(len(client_identity), 2), client_identity,
-  len = htons(ids.idU_len);
+  uint16_t len = htons(idU_len);
   crypto_hash_sha512_update(state, (uint8_t*) &len, 2);
-  crypto_hash_sha512_update(state, ids.idU, ids.idU_len);
+  crypto_hash_sha512_update(state, idU, idU_len);
+}
+
+// state must already contain the client identity (see preamble_idU())
+static void preamble_final(char preamble[crypto_hash_sha512_BYTES],
+                           crypto_hash_sha512_state *state,
+                           const uint8_t ke1[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                           const Opaque_ServerSession *ke2,
+                           const uint8_t *idS, const uint16_t idS_len) {
+#ifdef TRACE
+  dump(idS, idS_len,"idS ");
+  dump(ke1, OPAQUE_USER_SESSION_PUBLIC_LEN, "ke1");
+  dump((uint8_t*)ke2,
+       /* credential_response */
+       /*Z*/ crypto_core_ristretto255_BYTES +
+       /*masking_nonce*/ 32+
+       /*masked_response*/ crypto_scalarmult_BYTES+sizeof(Opaque_Envelope)+
+       /*nonceS*/OPAQUE_NONCE_BYTES+
+       /*X_s*/crypto_scalarmult_BYTES, "ke2");
+#endif
 
   //                   ke1,
   crypto_hash_sha512_update(state, ke1, OPAQUE_USER_SESSION_PUBLIC_LEN);
 
   //                   I2OSP(len(server_identity), 2), server_identity,
-  len = htons(ids.idS_len);
+  uint16_t len = htons(idS_len);
   crypto_hash_sha512_update(state, (uint8_t*) &len, 2);
-  crypto_hash_sha512_update(state, ids.idS, ids.idS_len);
+  crypto_hash_sha512_update(state, idS, idS_len);
 
   //                   ke2.credential_response,
   //                   ke2.AuthResponse.server_nonce, ke2.AuthResponse.server_keyshare)
@@ -787,39 +1527,69 @@ static void calc_preamble(char preamble[crypto_hash_sha512_BYTES],
   crypto_hash_sha512_final(&copied_state, (uint8_t *) preamble);
 }
 
-// implements server end of triple-dh
-static int server_3dh(Opaque_Keys *keys,
-               const uint8_t ix[crypto_scalarmult_SCALARBYTES],
-               const uint8_t ex[crypto_scalarmult_SCALARBYTES],
-               const uint8_t Ip[crypto_scalarmult_BYTES],
-               const uint8_t Ep[crypto_scalarmult_BYTES],
-               const char preamble[crypto_hash_sha512_BYTES]) {
-  uint8_t sec[crypto_scalarmult_BYTES * 3], *ptr = sec;
-  if(-1==sodium_mlock(sec, sizeof sec)) {
-    return -1;
-  }
+// state must be initialized by preamble_init() (or a copy of such a state)
+static void calc_preamble(char preamble[crypto_hash_sha512_BYTES],
+                          crypto_hash_sha512_state *state,
+                          const uint8_t pkU[crypto_scalarmult_BYTES],
+                          const uint8_t pkS[crypto_scalarmult_BYTES],
+                          const uint8_t ke1[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                          const Opaque_ServerSession *ke2,
+                          const Opaque_Ids *ids0) {
+  Opaque_Ids ids;
+  fix_ids(pkU, pkS, ids0, &ids);
+
+#ifdef TRACE
+  fprintf(stderr,"calc preamble\n");
+  dump(pkU, crypto_scalarmult_BYTES, "pkU");
+  dump(pkS,crypto_scalarmult_BYTES, "pkS");
+#endif
+
+  preamble_idU(state, ids.idU, ids.idU_len);
+  preamble_final(preamble, state, ke1, ke2, ids.idS, ids.idS_len);
+}
 
+// queues the scalar multiplications of a server session for
+// r255_scalarmult_batch(): the OPRF evaluation into resp->Z and the
+// three diffie-hellman secrets of the triple-dh into ikm
+static void server_mults(const uint8_t *k[4], const uint8_t *p[4], uint8_t *q[4],
+                         const Opaque_UserSession *pub,
+                         const Opaque_UserRecord *rec,
+                         const uint8_t skS[crypto_scalarmult_SCALARBYTES],
+                         const Opaque_ServerEphemeral *eph,
+                         Opaque_ServerSession *resp,
+                         uint8_t ikm[crypto_scalarmult_BYTES * 3]) {
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(ix, crypto_scalarmult_SCALARBYTES, "skS");
-  dump(ex, crypto_scalarmult_SCALARBYTES, "ekS");
-  dump(Ip, crypto_scalarmult_BYTES, "pkU");
-  dump(Ep, crypto_scalarmult_BYTES, "epkU");
+  dump(skS, crypto_scalarmult_SCALARBYTES, "skS");
+  dump(eph->x_s, crypto_scalarmult_SCALARBYTES, "ekS");
+  dump(rec->recU.client_public_key, crypto_scalarmult_BYTES, "pkU");
+  dump(pub->X_u, crypto_scalarmult_BYTES, "epkU");
 #endif
+  // computes β := α^k_s
+  // 1. Z = Evaluate(DeserializeScalar(credentialFile.kU), request.data)
+  // same as oprf_Evaluate(), but batched with the other multiplications
+  k[0]=rec->kU;   p[0]=pub->blinded; q[0]=resp->Z;
+  // 5. ikm = TripleDHIKM(server_secret, ke1.client_keyshare,
+  //                server_private_key, ke1.client_keyshare,
+  //                server_secret, client_public_key)
+  // the two multiplications of X_u are next to each other, so X_u is
+  // decoded only once
+  k[1]=eph->x_s;  p[1]=pub->X_u;     q[1]=ikm;
+  k[2]=skS;       p[2]=pub->X_u;     q[2]=ikm+crypto_scalarmult_BYTES;
+  k[3]=eph->x_s;  p[3]=rec->recU.client_public_key; q[3]=ikm+crypto_scalarmult_BYTES*2;
+}
 
-  if(0!=crypto_scalarmult_ristretto255(ptr,ex,Ep)) return 1;
-  ptr+=crypto_scalarmult_BYTES;
-  if(0!=crypto_scalarmult_ristretto255(ptr,ix,Ep)) return 1;
-  ptr+=crypto_scalarmult_BYTES;
-  if(0!=crypto_scalarmult_ristretto255(ptr,ex,Ip)) return 1;
+// implements server end of triple-dh, the ikm is calculated by
+// server_mults() together with the OPRF evaluation
+static int server_3dh(Opaque_Keys *keys,
+               const uint8_t ikm[crypto_scalarmult_BYTES * 3],
+               const char preamble[crypto_hash_sha512_BYTES]) {
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(sec, 96, "3dh s ikm");
+  dump(ikm, 96, "3dh s ikm");
 #endif
 
-  if(0!=derive_keys(keys, sec, preamble)) {
-    sodium_munlock(sec,sizeof(sec));
+  if(0!=derive_keys(keys, ikm, preamble)) {
     return -1;
   }
-  sodium_munlock(sec,sizeof(sec));
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump((uint8_t*) keys, sizeof(Opaque_Keys), "keys ");
 #endif
@@ -834,26 +1604,29 @@ static int user_3dh(Opaque_Keys *keys,
              const uint8_t Ip[crypto_scalarmult_BYTES],
              const uint8_t Ep[crypto_scalarmult_BYTES],
              const char preamble[crypto_hash_sha512_BYTES]) {
-  uint8_t sec[crypto_scalarmult_BYTES * 3], *ptr = sec;
-  if(-1==sodium_mlock(sec, sizeof sec)) {
+  uint8_t *sec = opaque_scratch_alloc(crypto_scalarmult_BYTES * 3), *ptr = sec;
+  if(sec==NULL) return -1;
+
+  // all three with one shared encoding of the results, the two
+  // multiplications of Ep are queued next to each other so that Ep is
+  // decoded only once, the ikm stays ex*Ep || ex*Ip || ix*Ep
+  uint8_t *q[3]={ptr, ptr+crypto_scalarmult_BYTES*2, ptr+crypto_scalarmult_BYTES};
+  const uint8_t *k[3]={ex, ix, ex}, *p[3]={Ep, Ep, Ip};
+  int ret[3];
+  if(0!=r255_scalarmult_batch(3, q, k, p, ret)) {
+    opaque_scratch_free(sec, crypto_scalarmult_BYTES * 3);
     return -1;
   }
-
-  if(0!=crypto_scalarmult_ristretto255(ptr,ex,Ep)) return 1;
-  ptr+=crypto_scalarmult_BYTES;
-  if(0!=crypto_scalarmult_ristretto255(ptr,ex,Ip)) return 1;
-  ptr+=crypto_scalarmult_BYTES;
-  if(0!=crypto_scalarmult_ristretto255(ptr,ix,Ep)) return 1;
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(sec, 96, "3dh u ikm");
 #endif
 
   // and hash for the result SK = f_K(0)
   if(0!=derive_keys(keys, sec, preamble)) {
-    sodium_munlock(sec,sizeof(sec));
+    opaque_scratch_free(sec, crypto_scalarmult_BYTES * 3);
     return -1;
   }
-  sodium_munlock(sec,sizeof(sec));
+  opaque_scratch_free(sec, crypto_scalarmult_BYTES * 3);
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump((uint8_t*) keys, sizeof(Opaque_Keys), "keys ");
 #endif
@@ -865,19 +1638,21 @@ static int skU_from_rwd(const uint8_t rwd[OPAQUE_RWDU_BYTES], const uint8_t nonc
   char info[OPAQUE_NONCE_BYTES+10];
   memcpy(info, nonce, OPAQUE_NONCE_BYTES);
   memcpy(info+OPAQUE_NONCE_BYTES, "PrivateKey", 10);
-  uint8_t seed[crypto_core_ristretto255_SCALARBYTES];
-  if(-1==sodium_mlock(seed, sizeof seed)) {
-    return -1;
-  }
-  crypto_kdf_hkdf_sha512_expand(seed, crypto_core_ristretto255_SCALARBYTES, info, sizeof info, rwd);
+  struct {
+    uint8_t seed[crypto_core_ristretto255_SCALARBYTES];
+    crypto_hash_sha512_state msg_state;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  crypto_kdf_hkdf_sha512_expand(s->seed, sizeof s->seed, info, sizeof info, rwd);
 
   uint8_t dst[24]="OPAQUE-DeriveAuthKeyPair";
-  if(0!=voprf_hash_to_scalar(seed, sizeof seed, dst, sizeof dst, skU)) {
-    sodium_munlock(seed, sizeof seed);
+  xmd_start(&s->msg_state, s->seed, sizeof s->seed);
+  if(0!=voprf_hash_to_scalar(&s->msg_state, dst, sizeof dst, skU)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
 
-  sodium_munlock(seed, sizeof seed);
+  opaque_scratch_free(s, sizeof *s);
   return 0;
 }
 
@@ -896,78 +1671,46 @@ static int create_envelope(const uint8_t rwdU[OPAQUE_RWDU_BYTES],
   randombytes(env->nonce, OPAQUE_ENVELOPE_NONCEBYTES);
 #endif
 
-  uint8_t concated[OPAQUE_ENVELOPE_NONCEBYTES+10],
-    *label = concated+OPAQUE_ENVELOPE_NONCEBYTES;
-  memcpy(concated, env->nonce, OPAQUE_ENVELOPE_NONCEBYTES);
-
-  // 2. masking_key = HKDF-Expand(randomized_pwd, "MaskingKey", Nh)
-  const uint8_t masking_key_info[10]="MaskingKey";
-  crypto_kdf_hkdf_sha512_expand(masking_key, crypto_hash_sha512_BYTES,
-                                (const char*) masking_key_info, sizeof masking_key_info,
-                                rwdU);
+  struct {
+    uint8_t auth_key[OPAQUE_HMAC_SHA512_KEYBYTES];
+    uint8_t seed[crypto_core_ristretto255_SCALARBYTES];
+    uint8_t client_secret_key[crypto_scalarmult_SCALARBYTES];
+    crypto_auth_hmacsha512_state keyed;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+
+  // all four keys are expanded from randomized_pwd
+  const Hkdf_Output outs[] = {
+    // 2. masking_key = HKDF-Expand(randomized_pwd, "MaskingKey", Nh)
+    { masking_key, crypto_hash_sha512_BYTES, "MaskingKey", 10, NULL, 0 },
+    // 3. auth_key = HKDF-Expand(randomized_pwd, concat(envelope_nonce, "AuthKey"), Nh)
+    { s->auth_key, sizeof s->auth_key,
+      env->nonce, OPAQUE_ENVELOPE_NONCEBYTES, (const uint8_t*) "AuthKey", 7 },
+    // 4. export_key = HKDF-Expand(randomized_pwd, concat(envelope_nonce, "ExportKey"), Nh)
+    { export_key, crypto_hash_sha512_BYTES,
+      env->nonce, OPAQUE_ENVELOPE_NONCEBYTES, (const uint8_t*) "ExportKey", 9 },
+    // 5. seed = Expand(randomized_pwd, concat(envelope_nonce, "PrivateKey"), Nseed)
+    { s->seed, crypto_core_ristretto255_SCALARBYTES,
+      env->nonce, OPAQUE_ENVELOPE_NONCEBYTES, (const uint8_t*) "PrivateKey", 10 },
+  };
+  hkdf_expand_multi(rwdU, &s->keyed, outs, sizeof outs / sizeof outs[0]);
 #if (defined CFRG_TEST_VEC || defined TRACE)
-  dump(masking_key_info, sizeof masking_key_info, "masking_key_info");
+  dump((const uint8_t*) "MaskingKey", 10, "masking_key_info");
   dump(rwdU, OPAQUE_RWDU_BYTES, "rwdU");
   dump(masking_key, crypto_hash_sha512_BYTES, "masking_key");
+  dump(s->auth_key,sizeof s->auth_key, "auth_key ");
+  if(NULL!=export_key) dump(export_key,crypto_hash_sha512_BYTES, "export_key ");
 #endif
 
-  // 3. auth_key = HKDF-Expand(randomized_pwd, concat(envelope_nonce, "AuthKey"), Nh)
-  uint8_t auth_key[OPAQUE_HMAC_SHA512_KEYBYTES];
-  if(-1==sodium_mlock(auth_key, sizeof auth_key)) {
-    return -1;
-  }
-  memcpy(label, "AuthKey", 7);
-  crypto_kdf_hkdf_sha512_expand(auth_key, sizeof auth_key,
-                                (const char*) concated, OPAQUE_ENVELOPE_NONCEBYTES+7,
-                                rwdU);
-
-#if (defined CFRG_TEST_VEC || defined TRACE)
-  dump(auth_key,sizeof auth_key, "auth_key ");
-#endif
-
-  // 4. export_key = HKDF-Expand(randomized_pwd, concat(envelope_nonce, "ExportKey"), Nh)
-  if(NULL!=export_key) {
-    memcpy(label, "ExportKey", 9);
-#if (defined CFRG_TEST_VEC || defined TRACE)
-    dump(concated, OPAQUE_ENVELOPE_NONCEBYTES+9, "export_key_info");
-#endif
-    crypto_kdf_hkdf_sha512_expand(export_key, crypto_hash_sha512_BYTES,
-                                  (const char*) concated, OPAQUE_ENVELOPE_NONCEBYTES+9,
-                                  rwdU);
-#if (defined CFRG_TEST_VEC || defined TRACE)
-    dump(export_key,crypto_hash_sha512_BYTES, "export_key ");
-#endif
-  }
-
-  // 5. seed = Expand(randomized_pwd, concat(envelope_nonce, "PrivateKey"), Nseed)
-  memcpy(label, "PrivateKey", 10);
-  uint8_t seed[crypto_core_ristretto255_SCALARBYTES];
-  if(-1==sodium_mlock(seed, sizeof seed)) {
-    sodium_munlock(auth_key, sizeof auth_key);
-    return -1;
-  }
-  crypto_kdf_hkdf_sha512_expand(seed, crypto_core_ristretto255_SCALARBYTES,
-                                (const char*) concated, OPAQUE_ENVELOPE_NONCEBYTES+10,
-                                rwdU);
-
   // 6. _, client_public_key = DeriveAuthKeyPair(seed)
-  uint8_t client_secret_key[crypto_scalarmult_SCALARBYTES];
-  if(-1==sodium_mlock(client_secret_key, sizeof client_secret_key)) {
-    sodium_munlock(auth_key, sizeof auth_key);
-    return -1;
-  }
   const uint8_t dst[24]="OPAQUE-DeriveAuthKeyPair";
-  if(0!=deriveKeyPair(seed, sizeof seed, dst, sizeof dst, client_secret_key, client_public_key)) {
-    sodium_munlock(seed, sizeof seed);
-    sodium_munlock(client_secret_key, sizeof client_secret_key);
-    sodium_munlock(auth_key, sizeof auth_key);
+  if(0!=deriveKeyPair(s->seed, sizeof s->seed, dst, sizeof dst, s->client_secret_key, client_public_key)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(seed, sizeof seed);
 #if (defined CFRG_TEST_VEC || defined TRACE)
-  dump(client_secret_key, crypto_scalarmult_SCALARBYTES, "client_secret_key");
+  dump(s->client_secret_key, crypto_scalarmult_SCALARBYTES, "client_secret_key");
 #endif
-  sodium_munlock(client_secret_key, sizeof client_secret_key);
 #if (defined CFRG_TEST_VEC || defined TRACE)
   dump(client_public_key, crypto_scalarmult_BYTES, "client_public_key");
 #endif
@@ -1000,17 +1743,17 @@ static int create_envelope(const uint8_t rwdU[OPAQUE_RWDU_BYTES],
   ptr+=2;
   memcpy(ptr,ids_completed.idU,ids_completed.idU_len);
 
-  opaque_hmacsha512(auth_key,             // key
+  opaque_hmacsha512(s->auth_key,             // key
                     authenticated,        // in
                     sizeof authenticated, // len(in)
                     env->auth_tag);       // out
 
 #if (defined CFRG_TEST_VEC || defined TRACE)
   dump(authenticated, sizeof authenticated, "authenticated");
-  dump(auth_key, sizeof auth_key, "auth_key");
+  dump(s->auth_key, sizeof s->auth_key, "auth_key");
   dump(env->auth_tag, crypto_auth_hmacsha512_BYTES, "auth_tag");
 #endif
-  sodium_munlock(auth_key, sizeof auth_key);
+  opaque_scratch_free(s, sizeof *s);
 
 #if (defined CFRG_TEST_VEC || defined TRACE)
   dump((uint8_t *)env, OPAQUE_ENVELOPE_BYTES, "envU");
@@ -1019,6 +1762,16 @@ static int create_envelope(const uint8_t rwdU[OPAQUE_RWDU_BYTES],
   return 0;
 }
 
+int opaque_init(void) {
+  // sodium_init() returns 1 if libsodium was already initialized
+  if(sodium_init() < 0) return -1;
+  const uint32_t cpu = opaque_cpu_features();
+  r255_select(cpu);
+  sha512mb_select(cpu);
+  argon2_select(cpu);
+  return 0;
+}
+
 // (StorePwdFile, sid , U, pw): S computes k_s ←_R Z_q , rw := F_k_s (pw),
 // p_s ←_R Z_q , p_u ←_R Z_q , P_s := g^p_s , P_u := g^p_u , c ← AuthEnc_rw (p_u, P_u, P_s);
 // it records file[sid] := {k_s, p_s, P_s, P_u, c}.
@@ -1027,6 +1780,15 @@ int opaque_Register(const uint8_t *pwdU, const uint16_t pwdU_len,
                     const Opaque_Ids *ids,
                     uint8_t _rec[OPAQUE_USER_RECORD_LEN],
                     uint8_t export_key[crypto_hash_sha512_BYTES]) {
+  return opaque_RegisterHarden(pwdU, pwdU_len, skS, ids, NULL, _rec, export_key);
+}
+
+int opaque_RegisterHarden(const uint8_t *pwdU, const uint16_t pwdU_len,
+                          const uint8_t skS[crypto_scalarmult_SCALARBYTES],
+                          const Opaque_Ids *ids,
+                          const uint8_t *harden,
+                          uint8_t _rec[OPAQUE_USER_RECORD_LEN],
+                          uint8_t export_key[crypto_hash_sha512_BYTES]) {
   Opaque_UserRecord *rec = (Opaque_UserRecord *)_rec;
 
 #ifdef TRACE
@@ -1039,17 +1801,19 @@ int opaque_Register(const uint8_t *pwdU, const uint16_t pwdU_len,
   oprf_KeyGen(rec->kU);
 
   // rw := F_k_s (pw),
-  uint8_t rwdU[OPAQUE_RWDU_BYTES];
-  if(-1==sodium_mlock(rwdU,sizeof rwdU)) {
-    return -1;
-  }
+  struct {
+    uint8_t rwdU[OPAQUE_RWDU_BYTES];
+    uint8_t client_private_key[crypto_scalarmult_SCALARBYTES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
 
-  if(prf(pwdU, pwdU_len, rec->kU, rwdU)!=0) {
-    sodium_munlock(rwdU,sizeof rwdU);
-    return -1;
+  const int ret = prf(pwdU, pwdU_len, rec->kU, harden, s->rwdU);
+  if(ret!=0) {
+    opaque_scratch_free(s, sizeof *s);
+    return ret;
   }
 #ifdef TRACE
-  dump(rwdU, sizeof rwdU, "rwdU");
+  dump(s->rwdU, sizeof s->rwdU, "rwdU");
 #endif
 
   // p_s ←_R Z_q
@@ -1063,25 +1827,18 @@ int opaque_Register(const uint8_t *pwdU, const uint16_t pwdU_len,
   uint8_t server_public_key[crypto_scalarmult_BYTES];
   crypto_scalarmult_ristretto255_base(server_public_key, rec->skS);
 
-  uint8_t client_private_key[crypto_scalarmult_SCALARBYTES];
-  if(-1==sodium_mlock(client_private_key,sizeof client_private_key)) {
-    sodium_munlock(rwdU,sizeof rwdU);
-    return -1;
-  }
-  if(0!=skU_from_rwd(rwdU, (uint8_t*) &rec->recU.envelope, client_private_key)) {
-    sodium_munlock(client_private_key,sizeof client_private_key);
-    sodium_munlock(rwdU, sizeof rwdU);
+  if(0!=skU_from_rwd(s->rwdU, (uint8_t*) &rec->recU.envelope, s->client_private_key)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
   // P_u := g^p_u
-  crypto_scalarmult_base(rec->recU.client_public_key, client_private_key);
-  sodium_munlock(client_private_key,sizeof client_private_key);
+  crypto_scalarmult_base(rec->recU.client_public_key, s->client_private_key);
 
-  if(0!=create_envelope(rwdU, server_public_key, ids, &rec->recU.envelope, rec->recU.client_public_key, rec->recU.masking_key, export_key)) {
-    sodium_munlock(rwdU, sizeof rwdU);
+  if(0!=create_envelope(s->rwdU, server_public_key, ids, &rec->recU.envelope, rec->recU.client_public_key, rec->recU.masking_key, export_key)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(rwdU, sizeof rwdU);
+  opaque_scratch_free(s, sizeof *s);
 
 #ifdef TRACE
   dump(_rec, OPAQUE_USER_RECORD_LEN, "user rec");
@@ -1139,6 +1896,158 @@ int opaque_CreateCredentialRequest(const uint8_t *pwdU, const uint16_t pwdU_len,
   return 0;
 }
 
+// generates the random values of n server sessions with one call to
+// the rng: the masking nonces, server nonces and the ephemeral keypairs
+static int gen_ephemerals(Opaque_ServerEphemeral *eph, const size_t n) {
+  size_t i;
+#ifdef CFRG_TEST_VEC
+  for(i=0;i<n;i++) {
+    memcpy(eph[i].masking_nonce, masking_nonce, masking_nonce_len);
+    memcpy(eph[i].nonceS, server_nonce, OPAQUE_NONCE_BYTES);
+    memcpy(eph[i].x_s, server_private_keyshare, crypto_scalarmult_SCALARBYTES);
+  }
+#else
+  randombytes((uint8_t*) eph, n*sizeof(Opaque_ServerEphemeral));
+#endif
+  for(i=0;i<n;i++) {
+#ifdef TRACE
+    dump(eph[i].x_s, crypto_scalarmult_SCALARBYTES, "session srv x_s ");
+#endif
+    // X_s := g^x_s;
+    if(0!=crypto_scalarmult_ristretto255_base(eph[i].X_s, eph[i].x_s)) return -1;
+  }
+  return 0;
+}
+
+// pool of pre-generated server ephemerals, see opaque_CreateEphemeralPool()
+struct Opaque_EphemeralPool {
+  atomic_flag lock;
+  long pid;        // process that generated the tuples
+  size_t capacity;
+  size_t count;
+  Opaque_ServerEphemeral eph[];
+};
+
+// the pool used by server_ephemerals(), set by opaque_SetEphemeralPool()
+static _Atomic(Opaque_EphemeralPool*) ephemeral_pool = NULL;
+
+static long pool_pid(void) {
+#if _WIN32 == 1 || _WIN64 == 1
+  return (long) _getpid();
+#else
+  return (long) getpid();
+#endif
+}
+
+static void pool_lock(Opaque_EphemeralPool *pool) {
+  opaque_spin_lock(&pool->lock);
+}
+
+static void pool_unlock(Opaque_EphemeralPool *pool) {
+  opaque_spin_unlock(&pool->lock);
+}
+
+#ifndef CFRG_TEST_VEC
+// takes at most n tuples out of the pool, each tuple is wiped from the
+// pool so that it is used only once. returns the number of tuples taken.
+static size_t pool_pop(Opaque_EphemeralPool *pool, Opaque_ServerEphemeral *eph, const size_t n) {
+  pool_lock(pool);
+  // a forked child must not reuse the tuples of its parent
+  if(pool->pid!=pool_pid()) {
+    sodium_memzero(pool->eph, pool->count*sizeof(Opaque_ServerEphemeral));
+    pool->count=0;
+  }
+  const size_t m = (pool->count < n) ? pool->count : n;
+  pool->count-=m;
+  memcpy(eph, &pool->eph[pool->count], m*sizeof(Opaque_ServerEphemeral));
+  sodium_memzero(&pool->eph[pool->count], m*sizeof(Opaque_ServerEphemeral));
+  pool_unlock(pool);
+  return m;
+}
+#endif
+
+// provides the random values of n server sessions, taken from the pool
+// set by opaque_SetEphemeralPool() as long as it has some, the rest is
+// generated by gen_ephemerals()
+static int server_ephemerals(Opaque_ServerEphemeral *eph, const size_t n) {
+  size_t m = 0;
+#ifndef CFRG_TEST_VEC
+  Opaque_EphemeralPool *pool = atomic_load(&ephemeral_pool);
+  if(pool!=NULL) m = pool_pop(pool, eph, n);
+#endif
+  if(m==n) return 0;
+  return gen_ephemerals(eph+m, n-m);
+}
+
+Opaque_EphemeralPool* opaque_CreateEphemeralPool(const size_t capacity) {
+  if(capacity==0 || capacity > (SIZE_MAX - sizeof(Opaque_EphemeralPool)) / sizeof(Opaque_ServerEphemeral)) return NULL;
+  Opaque_EphemeralPool *pool = opaque_locked_alloc(sizeof(Opaque_EphemeralPool) + capacity*sizeof(Opaque_ServerEphemeral), 16);
+  if(pool==NULL) return NULL;
+  atomic_flag_clear(&pool->lock);
+  pool->pid=pool_pid();
+  pool->capacity=capacity;
+  pool->count=0;
+  return pool;
+}
+
+int opaque_RefillEphemeralPool(Opaque_EphemeralPool *pool, const size_t max) {
+  const size_t eph_len = OPAQUE_BATCH_CHUNK*sizeof(Opaque_ServerEphemeral);
+  Opaque_ServerEphemeral *eph = opaque_scratch_alloc(eph_len);
+  if(eph==NULL) return -1;
+
+  size_t added=0;
+  while(added<max) {
+    pool_lock(pool);
+    const size_t room = (pool->pid==pool_pid()) ? pool->capacity - pool->count : pool->capacity;
+    pool_unlock(pool);
+    size_t m = max-added;
+    if(m>room) m=room;
+    if(m>OPAQUE_BATCH_CHUNK) m=OPAQUE_BATCH_CHUNK;
+    if(m==0) break;
+
+    // the expensive part is done without holding the lock
+    if(0!=gen_ephemerals(eph, m)) {
+      opaque_scratch_free(eph, eph_len);
+      return -1;
+    }
+
+    pool_lock(pool);
+    if(pool->pid!=pool_pid()) {
+      sodium_memzero(pool->eph, pool->count*sizeof(Opaque_ServerEphemeral));
+      pool->count=0;
+      pool->pid=pool_pid();
+    }
+    // others might have refilled the pool in the meantime
+    if(m>pool->capacity-pool->count) m=pool->capacity-pool->count;
+    memcpy(&pool->eph[pool->count], eph, m*sizeof(Opaque_ServerEphemeral));
+    pool->count+=m;
+    pool_unlock(pool);
+    added+=m;
+    if(m==0) break;
+  }
+  opaque_scratch_free(eph, eph_len);
+  return (int) added;
+}
+
+size_t opaque_EphemeralPoolCount(Opaque_EphemeralPool *pool) {
+  pool_lock(pool);
+  const size_t count = (pool->pid==pool_pid()) ? pool->count : 0;
+  pool_unlock(pool);
+  return count;
+}
+
+void opaque_SetEphemeralPool(Opaque_EphemeralPool *pool) {
+  atomic_store(&ephemeral_pool, pool);
+}
+
+void opaque_DestroyEphemeralPool(Opaque_EphemeralPool *pool) {
+  if(pool==NULL) return;
+  Opaque_EphemeralPool *expected = pool;
+  atomic_compare_exchange_strong(&ephemeral_pool, &expected, NULL);
+  // sodium_free() also wipes the tuples
+  sodium_free(pool);
+}
+
 // more or less corresponds to CreateCredentialResponse in the irtf draft
 // 2. (SvrSession, sid , ssid ): On input α from U, S proceeds as follows:
 // (a) Checks that α ∈ G^∗ If not, outputs (abort, sid , ssid ) and halts;
@@ -1147,80 +2056,69 @@ int opaque_CreateCredentialRequest(const uint8_t *pwdU, const uint16_t pwdU_len,
 // (d) Computes K := KE(p_s, x_s, P_u, X_u) and SK := f K (0);
 // (e) Sends β, X s and c to U;
 // (f) Outputs (sid , ssid , SK).
-int opaque_CreateCredentialResponse(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN], const uint8_t _rec[OPAQUE_USER_RECORD_LEN], const Opaque_Ids *ids, const uint8_t *ctx, const uint16_t ctx_len, uint8_t _resp[OPAQUE_SERVER_SESSION_LEN], uint8_t sk[OPAQUE_SHARED_SECRETBYTES], uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+//
+// prec is the record expanded by prepare_record(), eph are fresh
+// values from server_ephemerals(), resp->Z and ikm must be already
+// calculated by the multiplications queued in server_mults().
+static int finish_credential_response(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                      const Opaque_PreparedRecord *prec,
+                                      const Opaque_ServerEphemeral *eph,
+                                      const uint8_t ikm[crypto_scalarmult_BYTES * 3],
+                                      uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                      uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                      uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
 
-  Opaque_UserSession *pub = (Opaque_UserSession *) _pub;
-  Opaque_UserRecord *rec = (Opaque_UserRecord *) _rec;
   Opaque_ServerSession *resp = (Opaque_ServerSession *) _resp;
+  const Opaque_UserRecord *rec = (const Opaque_UserRecord *) prec->rec;
+  const uint8_t *pkS = prec->pkS;
 
 #ifdef TRACE
   dump(_pub, sizeof(Opaque_UserSession), "session srv pub ");
-  dump(_rec, OPAQUE_USER_RECORD_LEN, "session srv rec ");
+  dump((const uint8_t*) rec, OPAQUE_USER_RECORD_LEN, "session srv rec ");
 #endif
 
   // (a) Checks that α ∈ G^∗ . If not, outputs (abort, sid , ssid ) and halts;
-  if(crypto_core_ristretto255_is_valid_point(pub->blinded)!=1) return -1;
-
   // (b) Retrieves file[sid] = {k_s, p_s, P_s, P_u, c};
   // provided as parameter rec
-#ifdef TRACE
-  dump(rec->kU, sizeof(rec->kU), "session srv kU ");
-  dump(pub->blinded, sizeof(pub->blinded), "session srv blinded ");
-#endif
-
   // computes β := α^k_s
-  // 1. Z = Evaluate(DeserializeScalar(credentialFile.kU), request.data)
-  if (oprf_Evaluate(rec->kU, pub->blinded, resp->Z) != 0) {
-    return -1;
-  }
+  // all done by the batched multiplications from server_mults(), which
+  // fail for invalid points.
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(resp->Z, sizeof resp->Z, "EvaluationElement");
 #endif
 
   // 4. masking_nonce = random(Nn)
   // 5. credential_response_pad = Expand(record.masking_key, concat(masking_nonce, "CredentialResponsePad"), Npk + Ne)
-#ifdef CFRG_TEST_VEC
   struct {
     uint8_t nonce[32];
     uint8_t dst[21];
   } __attribute((packed)) masking_info = {
       .nonce = {0},
       .dst = "CredentialResponsePad"};
-  memcpy(masking_info.nonce, masking_nonce, masking_nonce_len);
-#else
+  memcpy(masking_info.nonce, eph->masking_nonce, sizeof masking_info.nonce);
   struct {
-    uint8_t nonce[32];
-    uint8_t dst[21];
-  } __attribute((packed)) masking_info = {
-      .nonce = {0},
-      .dst = "CredentialResponsePad"};
-  randombytes(masking_info.nonce, sizeof masking_info.nonce);
-#endif
-  uint8_t response_pad[crypto_scalarmult_BYTES+sizeof(Opaque_Envelope)];
-  if(-1==sodium_mlock(response_pad, sizeof response_pad)) {
-    return -1;
-  }
-  crypto_kdf_hkdf_sha512_expand(response_pad, sizeof response_pad,
-                                (const char*) &masking_info, sizeof masking_info,
-                                rec->recU.masking_key);
+    uint8_t response_pad[crypto_scalarmult_BYTES+sizeof(Opaque_Envelope)];
+    Opaque_Keys keys;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  // the hmac state keyed with record.masking_key is prepared already
+  hkdf_expand_keyed(s->response_pad, sizeof s->response_pad,
+                    (const uint8_t*) &masking_info, sizeof masking_info,
+                    NULL, 0, &prec->masking);
   memcpy(resp->masking_nonce, masking_info.nonce, sizeof masking_info.nonce);
 
-  // recalc server_public_key as we need it for the next step
-  uint8_t pkS[crypto_scalarmult_BYTES];
-  crypto_scalarmult_ristretto255_base(pkS, rec->skS);
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(pkS, sizeof pkS, "server_public_key");
+  dump(pkS, crypto_scalarmult_BYTES, "server_public_key");
 #endif
 
-  memcpy(resp->masked_response, pkS, sizeof pkS);
+  memcpy(resp->masked_response, pkS, crypto_scalarmult_BYTES);
 
   // 6. masked_response = xor(credential_response_pad, concat(server_public_key, record.envelope))
   unsigned i;
   for(i=0;i<crypto_scalarmult_BYTES;i++)
-    resp->masked_response[i] = response_pad[i] ^ resp->masked_response[i];
+    resp->masked_response[i] = s->response_pad[i] ^ resp->masked_response[i];
   for(;i<crypto_scalarmult_BYTES+sizeof(Opaque_Envelope);i++)
-    resp->masked_response[i] = response_pad[i] ^ ((uint8_t*)(&rec->recU.envelope))[i-crypto_scalarmult_BYTES];
-  sodium_munlock(response_pad, sizeof response_pad);
+    resp->masked_response[i] = s->response_pad[i] ^ ((uint8_t*)(&rec->recU.envelope))[i-crypto_scalarmult_BYTES];
 
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(_resp, sizeof (resp->Z) + crypto_scalarmult_BYTES+sizeof(Opaque_Envelope) + sizeof(masking_info.nonce), "resp(z+mn+mr)" );
@@ -1229,27 +2127,13 @@ int opaque_CreateCredentialResponse(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLI
   // this is the ake function Response() as per the irtf cfrg draft
   // 1. server_nonce = random(Nn)
   // nonceS
-#ifdef CFRG_TEST_VEC
-  memcpy(resp->nonceS, server_nonce, OPAQUE_NONCE_BYTES);
-#else
-  randombytes(resp->nonceS, OPAQUE_NONCE_BYTES);
-#endif
+  memcpy(resp->nonceS, eph->nonceS, OPAQUE_NONCE_BYTES);
 
   // 2. server_private_keyshare, server_keyshare = GenerateAuthKeyPair()
   // (c) Picks x_s ←_R Z_q
-  uint8_t x_s[crypto_scalarmult_SCALARBYTES];
-  if(-1==sodium_mlock(x_s,sizeof x_s)) return -1;
-#ifdef CFRG_TEST_VEC
-  memcpy(x_s, server_private_keyshare, sizeof x_s);
-#else
-  randombytes(x_s, crypto_scalarmult_SCALARBYTES);
-#endif
-
-#ifdef TRACE
-  dump(x_s, sizeof(x_s), "session srv x_s ");
-#endif
   // X_s := g^x_s;
-  crypto_scalarmult_ristretto255_base(resp->X_s, x_s);
+  // both precalculated in server_ephemerals()
+  memcpy(resp->X_s, eph->X_s, crypto_scalarmult_BYTES);
 
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(resp->X_s, sizeof(resp->X_s), "server_keyshare");
@@ -1259,46 +2143,36 @@ int opaque_CreateCredentialResponse(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLI
 
   // 4. preamble = Preamble(client_identity, ke1, server_identity, ike2)
   // mixing in things from the irtf cfrg spec
+  // the prepared state already contains the context and client_identity
   char preamble[crypto_hash_sha512_BYTES];
   crypto_hash_sha512_state preamble_state;
-  calc_preamble(preamble, &preamble_state, rec->recU.client_public_key, pkS, _pub, resp, ctx, ctx_len, (Opaque_Ids*) ids);
-  Opaque_Keys keys;
-  if(-1==sodium_mlock(&keys,sizeof(keys))) {
-    sodium_munlock(x_s,sizeof x_s);
-    return -1;
+  memcpy(&preamble_state, &prec->preamble, sizeof preamble_state);
+  if(prec->idS!=NULL) {
+    preamble_final(preamble, &preamble_state, _pub, resp, prec->idS, prec->idS_len);
+  } else {
+    preamble_final(preamble, &preamble_state, _pub, resp, pkS, crypto_scalarmult_BYTES);
   }
 
   // (d) Computes K := KE(p_s, x_s, P_u, X_u) and SK := f_K(0);
-#ifdef TRACE
-  dump(rec->skS,crypto_scalarmult_SCALARBYTES, "rec->skS ");
-  dump(x_s,crypto_scalarmult_SCALARBYTES, "x_s ");
-  //dump(rec->pkU,crypto_scalarmult_BYTES, "rec->pkU ");
-  dump(pub->X_u,crypto_scalarmult_BYTES, "pub->X_u ");
-#endif
-  // 5. ikm = TripleDHIKM(server_secret, ke1.client_keyshare,
-  //                server_private_key, ke1.client_keyshare,
-  //                server_secret, client_public_key)
   // 6. Km2, Km3, session_key = DeriveKeys(ikm, preamble)
-  if(0!=server_3dh(&keys, rec->skS, x_s, rec->recU.client_public_key, pub->X_u, preamble)) {
-    sodium_munlock(x_s, sizeof(x_s));
-    sodium_munlock(&keys,sizeof(keys));
+  if(0!=server_3dh(&s->keys, ikm, preamble)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(x_s, sizeof(x_s));
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(keys.sk, sizeof(keys.sk), "srv sk ");
-  dump(keys.km2,OPAQUE_HMAC_SHA512_KEYBYTES,"session srv km2 ");
-  dump(keys.km3,OPAQUE_HMAC_SHA512_KEYBYTES,"session srv km3 ");
+  dump(s->keys.sk, sizeof(s->keys.sk), "srv sk ");
+  dump(s->keys.km2,OPAQUE_HMAC_SHA512_KEYBYTES,"session srv km2 ");
+  dump(s->keys.km3,OPAQUE_HMAC_SHA512_KEYBYTES,"session srv km3 ");
 #endif
 
   // 7. server_mac = MAC(Km2, Hash(preamble))
-  opaque_hmacsha512(keys.km2,
+  opaque_hmacsha512(s->keys.km2,
                     (uint8_t*)preamble,                  // in
                     crypto_hash_sha512_BYTES,            // len(in)
                     resp->auth);                         // out
 #ifdef TRACE
   dump(resp->auth, sizeof resp->auth, "resp->auth ");
-  dump(keys.km2, sizeof keys.km2, "km2 ");
+  dump(s->keys.km2, sizeof s->keys.km2, "km2 ");
 #endif
 
   // 8. expected_client_mac = MAC(Km3, Hash(concat(preamble, server_mac))
@@ -1309,14 +2183,14 @@ int opaque_CreateCredentialResponse(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLI
   dump((uint8_t*)preamble, sizeof preamble, "auth preamble");
 #endif
   if(NULL!=authU) {
-    opaque_hmacsha512(keys.km3,                       // key
+    opaque_hmacsha512(s->keys.km3,                       // key
                      (uint8_t*)preamble,              // in
                      crypto_hash_sha512_BYTES,        // len(in)
                      authU);                          // out
   }
 
-  memcpy(sk,keys.sk,sizeof(keys.sk));
-  sodium_munlock(&keys,sizeof(keys));
+  memcpy(sk,s->keys.sk,sizeof(s->keys.sk));
+  opaque_scratch_free(s, sizeof *s);
 
 #ifdef TRACE
   dump(resp->auth, sizeof(resp->auth), "session srv auth ");
@@ -1327,75 +2201,477 @@ int opaque_CreateCredentialResponse(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLI
   return 0;
 }
 
-// more or less corresponds to RecoverCredentials in the irtf draft
-// 3. On β, X_s and c from S, U proceeds as follows:
-// (a) Checks that β ∈ G ∗ . If not, outputs (abort, sid , ssid ) and halts;
-// (b) Computes rw := H(key, pw|β^1/r );
-// (c) Computes AuthDec_rw(c). If the result is ⊥, outputs (abort, sid , ssid ) and halts.
-//     Otherwise sets (p_u, P_u, P_s ) := AuthDec_rw (c);
-// (d) Computes K := KE(p_u, x_u, P_s, X_s) and SK := f_K(0);
-// (e) Outputs (sid, ssid, SK).
-int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
-                              const uint8_t *_sec/*[OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len]*/,
-                              const uint8_t *ctx, const uint16_t ctx_len,
-                              const Opaque_Ids *ids0,
-                              uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
-                              uint8_t authU[crypto_auth_hmacsha512_BYTES],
-                              uint8_t export_key[crypto_hash_sha512_BYTES]) {
+// finish_credential_response() for m sessions of a batch, the hashes
+// of all of them run in lockstep through sha512mb. authU is either NULL
+// or has m entries.
+static int finish_credential_responses(const size_t m,
+                                       const uint8_t *const pub[],
+                                       const Opaque_PreparedRecord *const prec[],
+                                       const Opaque_ServerEphemeral *const eph[],
+                                       const uint8_t *const ikm[],
+                                       uint8_t *const _resp[],
+                                       uint8_t *const sk[],
+                                       uint8_t *const authU[]) {
+  struct {
+    uint8_t response_pad[OPAQUE_MB_LANES][crypto_scalarmult_BYTES+sizeof(Opaque_Envelope)];
+    crypto_hash_sha512_state preamble_state[OPAQUE_MB_LANES];
+    uint8_t preamble[OPAQUE_MB_LANES][crypto_hash_sha512_BYTES];
+    Opaque_Keys keys[OPAQUE_MB_LANES];
+    crypto_auth_hmacsha512_state st[OPAQUE_MB_LANES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
 
-  Opaque_ServerSession *resp = (Opaque_ServerSession *) _resp;
-  Opaque_UserSession_Secret *sec = (Opaque_UserSession_Secret *) _sec;
+  struct {
+    uint8_t nonce[32];
+    uint8_t dst[21];
+  } __attribute((packed)) masking_info[OPAQUE_MB_LANES];
+  const uint8_t *info[OPAQUE_MB_LANES], *preamble[OPAQUE_MB_LANES], *in[OPAQUE_MB_LANES], *key[OPAQUE_MB_LANES];
+  const crypto_auth_hmacsha512_state *masking[OPAQUE_MB_LANES];
+  crypto_auth_hmacsha512_state *st[OPAQUE_MB_LANES];
+  crypto_hash_sha512_state *preamble_state[OPAQUE_MB_LANES];
+  uint8_t *pad[OPAQUE_MB_LANES], *out[OPAQUE_MB_LANES];
+  Opaque_Keys *keys[OPAQUE_MB_LANES];
+  size_t i, j;
 
-#ifdef TRACE
-  dump(sec->pwdU,sec->pwdU_len, "session user finish pwdU ");
-  dump(_sec,OPAQUE_USER_SESSION_SECRET_LEN, "session user finish sec ");
-  dump(_resp,OPAQUE_SERVER_SESSION_LEN, "session user finish resp ");
-#endif
+  // 5. credential_response_pad = Expand(record.masking_key, concat(masking_nonce, "CredentialResponsePad"), Npk + Ne)
+  for(j=0;j<m;j++) {
+    memcpy(masking_info[j].nonce, eph[j]->masking_nonce, sizeof masking_info[j].nonce);
+    memcpy(masking_info[j].dst, "CredentialResponsePad", sizeof masking_info[j].dst);
+    info[j] = (const uint8_t*) &masking_info[j];
+    masking[j] = &prec[j]->masking;
+    st[j] = &s->st[j];
+    pad[j] = s->response_pad[j];
+  }
+  hkdf_expand_keyed_mb(m, pad, sizeof s->response_pad[0], info, sizeof masking_info[0],
+                       NULL, 0, masking, st);
+
+  for(j=0;j<m;j++) {
+    Opaque_ServerSession *resp = (Opaque_ServerSession *) _resp[j];
+    const Opaque_UserRecord *rec = (const Opaque_UserRecord *) prec[j]->rec;
+    memcpy(resp->masking_nonce, eph[j]->masking_nonce, sizeof resp->masking_nonce);
+    // 6. masked_response = xor(credential_response_pad, concat(server_public_key, record.envelope))
+    for(i=0;i<crypto_scalarmult_BYTES;i++)
+      resp->masked_response[i] = s->response_pad[j][i] ^ prec[j]->pkS[i];
+    for(;i<crypto_scalarmult_BYTES+sizeof(Opaque_Envelope);i++)
+      resp->masked_response[i] = s->response_pad[j][i] ^ ((const uint8_t*)(&rec->recU.envelope))[i-crypto_scalarmult_BYTES];
+    memcpy(resp->nonceS, eph[j]->nonceS, OPAQUE_NONCE_BYTES);
+    memcpy(resp->X_s, eph[j]->X_s, crypto_scalarmult_BYTES);
+
+    // 4. preamble = Preamble(client_identity, ke1, server_identity, ike2)
+    // the identities have different lengths, so this is done one by one
+    memcpy(&s->preamble_state[j], &prec[j]->preamble, sizeof s->preamble_state[j]);
+    if(prec[j]->idS!=NULL) {
+      preamble_final((char*) s->preamble[j], &s->preamble_state[j], pub[j], resp, prec[j]->idS, prec[j]->idS_len);
+    } else {
+      preamble_final((char*) s->preamble[j], &s->preamble_state[j], pub[j], resp, prec[j]->pkS, crypto_scalarmult_BYTES);
+    }
+    preamble[j] = s->preamble[j];
+    preamble_state[j] = &s->preamble_state[j];
+    keys[j] = &s->keys[j];
+  }
 
-  // 1. (client_private_key, server_public_key, export_key) =
-  //  RecoverCredentials(state.password, state.blind, ke2.CredentialResponse,
-  //                     server_identity, client_identity)
-  // 1.1. y = Finalize(password, blind, response.data, nil)
-  // 1.2. randomized_pwd = Extract("", concat(y, Harden(y, params)))
-  uint8_t N[crypto_core_ristretto255_BYTES];
-  if(-1==sodium_mlock(N, sizeof N)) return -1;
-  // 1. N = Unblind(blind, response.data)
-  if(0!=oprf_Unblind(sec->blind, resp->Z, N)) {
-    sodium_munlock(N, sizeof N);
+  // 6. Km2, Km3, session_key = DeriveKeys(ikm, preamble)
+  if(0!=derive_keys_mb(m, keys, ikm, preamble)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-#if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(N, sizeof N, "unblinded");
-#endif
 
-  // rw = H(pw, β^(1/r))
-  uint8_t rwdU[OPAQUE_RWDU_BYTES];
-  if(-1==sodium_mlock(rwdU,sizeof rwdU)) {
-    sodium_munlock(N, sizeof N);
+  // 7. server_mac = MAC(Km2, Hash(preamble))
+  for(j=0;j<m;j++) {
+    key[j] = s->keys[j].km2;
+    out[j] = ((Opaque_ServerSession *) _resp[j])->auth;
+  }
+  hmacsha512mb_init(m, st, key, OPAQUE_HMAC_SHA512_KEYBYTES);
+  hmacsha512mb_update(m, st, preamble, crypto_hash_sha512_BYTES);
+  hmacsha512mb_final(m, st, out);
+
+  // 8. expected_client_mac = MAC(Km3, Hash(concat(preamble, server_mac))
+  for(j=0;j<m;j++) {
+    in[j] = out[j];
+    pad[j] = s->preamble[j];
+  }
+  sha512mb_update(m, preamble_state, in, crypto_auth_hmacsha512_BYTES);
+  sha512mb_final(m, preamble_state, pad);
+  if(NULL!=authU) {
+    for(j=0;j<m;j++) key[j] = s->keys[j].km3;
+    hmacsha512mb_init(m, st, key, OPAQUE_HMAC_SHA512_KEYBYTES);
+    hmacsha512mb_update(m, st, preamble, crypto_hash_sha512_BYTES);
+    hmacsha512mb_final(m, st, authU);
+  }
+
+  for(j=0;j<m;j++) memcpy(sk[j], s->keys[j].sk, OPAQUE_SHARED_SECRETBYTES);
+  opaque_scratch_free(s, sizeof *s);
+  return 0;
+}
+
+// expands everything of a server session that only depends on the
+// record: pkS is the servers long-term public key belonging to rec and
+// prefix must be initialized by preamble_init() with the context.
+static void prepare_record(const Opaque_UserRecord *rec,
+                           const uint8_t pkS[crypto_scalarmult_BYTES],
+                           const Opaque_Ids *ids,
+                           const crypto_hash_sha512_state *prefix,
+                           Opaque_PreparedRecord *prec) {
+  memcpy(prec->rec, rec, OPAQUE_USER_RECORD_LEN);
+  memcpy(prec->pkS, pkS, crypto_scalarmult_BYTES);
+  // a missing idS defaults to pkS, which is resolved when it is used,
+  // so that prec stays valid when it is copied
+  if(ids->idS==NULL || ids->idS_len==0) {
+    prec->idS=NULL;
+    prec->idS_len=0;
+  } else {
+    prec->idS=ids->idS;
+    prec->idS_len=ids->idS_len;
+  }
+  // record.masking_key is the prk of credential_response_pad
+  crypto_auth_hmacsha512_init(&prec->masking, rec->recU.masking_key, crypto_hash_sha512_BYTES);
+
+  Opaque_Ids ids_completed;
+  fix_ids(rec->recU.client_public_key, pkS, ids, &ids_completed);
+  memcpy(&prec->preamble, prefix, sizeof prec->preamble);
+  preamble_idU(&prec->preamble, ids_completed.idU, ids_completed.idU_len);
+}
+
+// a single server session, eph are the values from server_ephemerals()
+// if they are already drawn, or NULL. the four scalar multiplications
+// still share the encoding of their results
+static int create_credential_response(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                      const Opaque_PreparedRecord *prec,
+                                      const Opaque_ServerEphemeral *eph,
+                                      uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                      uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                      uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  const Opaque_UserRecord *rec = (const Opaque_UserRecord *) prec->rec;
+  struct {
+    Opaque_ServerEphemeral eph;
+    uint8_t ikm[crypto_scalarmult_BYTES * 3];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  if(eph!=NULL) {
+    memcpy(&s->eph, eph, sizeof s->eph);
+  } else if(0!=server_ephemerals(&s->eph, 1)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  // 1.2. y = Finalize(pwdU, N, "OPAQUE01")
-  if(0!=oprf_Finalize(sec->pwdU, sec->pwdU_len, N, rwdU)) {
-    sodium_munlock(N, sizeof N);
-    sodium_munlock(rwdU,sizeof rwdU);
+
+  const uint8_t *k[4], *p[4];
+  uint8_t *q[4];
+  int mret[4];
+  server_mults(k, p, q, (const Opaque_UserSession *) _pub, rec, rec->skS, &s->eph,
+               (Opaque_ServerSession *) _resp, s->ikm);
+  if(0!=r255_scalarmult_batch(4, q, k, p, mret)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(N,sizeof N);
 
-#if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(rwdU, sizeof rwdU, "rwdU");
+  int ret = finish_credential_response(_pub, prec, &s->eph, s->ikm, _resp, sk, authU);
+  opaque_scratch_free(s, sizeof *s);
+  return ret;
+}
+
+// a single server session with a raw record
+static int create_credential_response_rec(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                          const uint8_t _rec[OPAQUE_USER_RECORD_LEN],
+                                          const Opaque_Ids *ids,
+                                          const uint8_t *ctx, const uint16_t ctx_len,
+                                          const Opaque_ServerEphemeral *eph,
+                                          uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                          uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                          uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  Opaque_UserRecord *rec = (Opaque_UserRecord *) _rec;
+
+  // recalc server_public_key as we need it for the response
+  uint8_t pkS[crypto_scalarmult_BYTES];
+  crypto_scalarmult_ristretto255_base(pkS, rec->skS);
+
+  crypto_hash_sha512_state preamble_state;
+  preamble_init(&preamble_state, ctx, ctx_len);
+
+  Opaque_PreparedRecord *prec = opaque_scratch_alloc(sizeof *prec);
+  if(prec==NULL) return -1;
+  prepare_record(rec, pkS, ids, &preamble_state, prec);
+
+  int ret = create_credential_response(_pub, prec, eph, _resp, sk, authU);
+  opaque_scratch_free(prec, sizeof *prec);
+  return ret;
+}
+
+int opaque_CreateCredentialResponse(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN], const uint8_t _rec[OPAQUE_USER_RECORD_LEN], const Opaque_Ids *ids, const uint8_t *ctx, const uint16_t ctx_len, uint8_t _resp[OPAQUE_SERVER_SESSION_LEN], uint8_t sk[OPAQUE_SHARED_SECRETBYTES], uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  return create_credential_response_rec(_pub, _rec, ids, ctx, ctx_len, NULL, _resp, sk, authU);
+}
+
+int opaque_CreateCredentialResponseBegin(const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                         uint8_t _pending[OPAQUE_SERVER_PENDING_LEN]) {
+  const Opaque_UserSession *pub = (const Opaque_UserSession *) _pub;
+  Opaque_ServerPending *pending = (Opaque_ServerPending *) _pending;
+
+  // (a) Checks that α ∈ G^∗ . If not, outputs (abort, sid , ssid ) and halts;
+  // also the keyshare of the user, so that invalid requests are rejected
+  // before the record is fetched
+  if(crypto_core_ristretto255_is_valid_point(pub->blinded)!=1 ||
+     crypto_core_ristretto255_is_valid_point(pub->X_u)!=1) {
+    return -1;
+  }
+
+  // (c) Picks x_s ←_R Z_q and computes X_s := g^x_s, together with the
+  // masking nonce and server nonce
+  if(0!=server_ephemerals(&pending->eph, 1)) {
+    sodium_memzero(_pending, OPAQUE_SERVER_PENDING_LEN);
+    return -1;
+  }
+  memcpy(pending->ke1, _pub, OPAQUE_USER_SESSION_PUBLIC_LEN);
+
+#ifdef TRACE
+  dump(_pending, OPAQUE_SERVER_PENDING_LEN, "server pending ");
 #endif
+  return 0;
+}
 
-  // 1.3. masking_key = HKDF-Expand(randomized_pwd, "MaskingKey", Nh)
-  const uint8_t masking_key_info[10]="MaskingKey";
-  uint8_t masking_key[crypto_hash_sha512_BYTES];
-  if(-1==sodium_mlock(masking_key,sizeof masking_key)) {
-    sodium_munlock(rwdU,sizeof rwdU);
+int opaque_CreateCredentialResponseFinish(const uint8_t _pending[OPAQUE_SERVER_PENDING_LEN],
+                                          const uint8_t _rec[OPAQUE_USER_RECORD_LEN],
+                                          const Opaque_Ids *ids,
+                                          const uint8_t *ctx, const uint16_t ctx_len,
+                                          uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                          uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                          uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  const Opaque_ServerPending *pending = (const Opaque_ServerPending *) _pending;
+  return create_credential_response_rec(pending->ke1, _rec, ids, ctx, ctx_len, &pending->eph, _resp, sk, authU);
+}
+
+int opaque_CreateServerContext(const uint8_t skS[crypto_scalarmult_SCALARBYTES],
+                               const uint8_t *idS, const uint16_t idS_len,
+                               const uint8_t *ctx, const uint16_t ctx_len,
+                               Opaque_ServerContext *sctx) {
+  memcpy(sctx->skS, skS, crypto_scalarmult_SCALARBYTES);
+  // P_s := g^p_s
+  if(0!=crypto_scalarmult_ristretto255_base(sctx->pkS, sctx->skS)) {
+    sodium_memzero(sctx->skS, sizeof sctx->skS);
+    return -1;
+  }
+  sctx->idS=(uint8_t*) idS;
+  sctx->idS_len=idS_len;
+  // hash "RFCXXXX" || I2OSP(len(context), 2) || context only once
+  preamble_init(&sctx->preamble, ctx, ctx_len);
+
+#ifdef TRACE
+  dump(sctx->pkS, sizeof sctx->pkS, "server ctx pkS ");
+#endif
+  return 0;
+}
+
+void opaque_DestroyServerContext(Opaque_ServerContext *sctx) {
+  sodium_memzero(sctx, sizeof(Opaque_ServerContext));
+}
+
+int opaque_CreateCredentialResponseCtx(const Opaque_ServerContext *sctx,
+                                       const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                       const uint8_t _rec[OPAQUE_USER_RECORD_LEN],
+                                       const uint8_t *idU, const uint16_t idU_len,
+                                       uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                       uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                       uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  Opaque_UserRecord *rec = (Opaque_UserRecord *) _rec;
+
+  // the context is only valid for records using the same long-term server key
+  if(0!=sodium_memcmp(rec->skS, sctx->skS, crypto_scalarmult_SCALARBYTES)) return -1;
+
+  const Opaque_Ids ids={idU_len, (uint8_t*) idU, sctx->idS_len, sctx->idS};
+
+  Opaque_PreparedRecord *prec = opaque_scratch_alloc(sizeof *prec);
+  if(prec==NULL) return -1;
+  prepare_record(rec, sctx->pkS, &ids, &sctx->preamble, prec);
+
+  int ret = create_credential_response(_pub, prec, NULL, _resp, sk, authU);
+  opaque_scratch_free(prec, sizeof *prec);
+  return ret;
+}
+
+int opaque_PrepareRecord(const uint8_t _rec[OPAQUE_USER_RECORD_LEN],
+                         const Opaque_Ids *ids,
+                         const uint8_t *ctx, const uint16_t ctx_len,
+                         Opaque_PreparedRecord *prec) {
+  const Opaque_UserRecord *rec = (const Opaque_UserRecord *) _rec;
+
+  // a record with an invalid client_public_key can never be used for a
+  // login, fail already here
+  if(crypto_core_ristretto255_is_valid_point(rec->recU.client_public_key)!=1) return -1;
+
+  if(-1==sodium_mlock(prec,sizeof(Opaque_PreparedRecord))) return -1;
+
+  // P_s := g^p_s
+  uint8_t pkS[crypto_scalarmult_BYTES];
+  if(0!=crypto_scalarmult_ristretto255_base(pkS, rec->skS)) {
+    sodium_munlock(prec,sizeof(Opaque_PreparedRecord));
     return -1;
   }
-  crypto_kdf_hkdf_sha512_expand(masking_key, crypto_hash_sha512_BYTES,
-                                (const char*) masking_key_info, sizeof masking_key_info,
-                                rwdU);
+
+  crypto_hash_sha512_state preamble_state;
+  preamble_init(&preamble_state, ctx, ctx_len);
+  prepare_record(rec, pkS, ids, &preamble_state, prec);
+
+#ifdef TRACE
+  dump(prec->pkS, sizeof prec->pkS, "prepared rec pkS ");
+#endif
+  return 0;
+}
+
+void opaque_DestroyPreparedRecord(Opaque_PreparedRecord *prec) {
+  // also wipes it
+  sodium_munlock(prec,sizeof(Opaque_PreparedRecord));
+}
+
+int opaque_CreateCredentialResponsePrepared(const Opaque_PreparedRecord *prec,
+                                            const uint8_t _pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                            uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                            uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                            uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  return create_credential_response(_pub, prec, NULL, _resp, sk, authU);
+}
+
+// a batch that could not be processed fails all its sessions, also the
+// ones answered already, and leaves no secret in the outputs
+static int batch_failed(const size_t n, uint8_t *sk, uint8_t *authU, int *ret) {
+  size_t k;
+  for(k=0;k<n;k++) ret[k]=-1;
+  sodium_memzero(sk, n*OPAQUE_SHARED_SECRETBYTES);
+  if(authU!=NULL) sodium_memzero(authU, n*crypto_auth_hmacsha512_BYTES);
+  return -1;
+}
+
+int opaque_CreateCredentialResponseBatch(const size_t n,
+                                         const uint8_t *_pub/*[n*OPAQUE_USER_SESSION_PUBLIC_LEN]*/,
+                                         const uint8_t *_rec/*[n*OPAQUE_USER_RECORD_LEN]*/,
+                                         const Opaque_Ids *ids/*[n]*/,
+                                         const uint8_t *ctx, const uint16_t ctx_len,
+                                         uint8_t *_resp/*[n*OPAQUE_SERVER_SESSION_LEN]*/,
+                                         uint8_t *sk/*[n*OPAQUE_SHARED_SECRETBYTES]*/,
+                                         uint8_t *authU/*[n*crypto_auth_hmacsha512_BYTES]*/,
+                                         int *ret/*[n]*/) {
+  // the context prefix of the preamble is the same for the whole batch
+  crypto_hash_sha512_state prefix;
+  preamble_init(&prefix, ctx, ctx_len);
+
+  // server_public_key is only recalculated if the server key changes
+  // between consecutive records, with a global server key only once.
+  uint8_t pkS[crypto_scalarmult_BYTES];
+  int have_pkS=0;
+
+  struct {
+    uint8_t skS[crypto_scalarmult_SCALARBYTES];
+    Opaque_ServerEphemeral eph[OPAQUE_BATCH_CHUNK];
+    uint8_t ikm[OPAQUE_BATCH_CHUNK][crypto_scalarmult_BYTES * 3];
+    Opaque_PreparedRecord prec[OPAQUE_MB_LANES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return batch_failed(n, sk, authU, ret);
+
+  // the scalar multiplications of a whole chunk are done together, all
+  // their results are encoded with one shared field inversion
+  const uint8_t *mk[4*OPAQUE_BATCH_CHUNK], *mp[4*OPAQUE_BATCH_CHUNK];
+  uint8_t *mq[4*OPAQUE_BATCH_CHUNK];
+  int mret[4*OPAQUE_BATCH_CHUNK];
+
+  // the sessions that are finished together
+  const uint8_t *lpub[OPAQUE_MB_LANES], *likm[OPAQUE_MB_LANES];
+  const Opaque_PreparedRecord *lprec[OPAQUE_MB_LANES];
+  const Opaque_ServerEphemeral *leph[OPAQUE_MB_LANES];
+  uint8_t *lresp[OPAQUE_MB_LANES], *lsk[OPAQUE_MB_LANES], *lauthU[OPAQUE_MB_LANES];
+  size_t lanes=0;
+
+  int failed=0;
+  size_t i, j, m;
+  for(i=0;i<n;i+=m) {
+    m = (n-i > OPAQUE_BATCH_CHUNK) ? OPAQUE_BATCH_CHUNK : n-i;
+    // all random values of this chunk with one call
+    if(0!=server_ephemerals(s->eph, m)) {
+      opaque_scratch_free(s, sizeof *s);
+      return batch_failed(n, sk, authU, ret);
+    }
+    for(j=0;j<m;j++) {
+      const size_t k=i+j;
+      const Opaque_UserRecord *rec = (const Opaque_UserRecord *) (_rec+k*OPAQUE_USER_RECORD_LEN);
+      server_mults(mk+4*j, mp+4*j, mq+4*j,
+                   (const Opaque_UserSession *) (_pub+k*OPAQUE_USER_SESSION_PUBLIC_LEN),
+                   rec, rec->skS, &s->eph[j],
+                   (Opaque_ServerSession *) (_resp+k*OPAQUE_SERVER_SESSION_LEN), s->ikm[j]);
+    }
+    r255_scalarmult_batch(4*m, mq, mk, mp, mret);
+
+    for(j=0;j<m;j++) {
+      const size_t k=i+j;
+      const Opaque_UserRecord *rec = (const Opaque_UserRecord *) (_rec+k*OPAQUE_USER_RECORD_LEN);
+      uint8_t *usk = sk+k*OPAQUE_SHARED_SECRETBYTES;
+      uint8_t *uauthU = (authU!=NULL)?authU+k*crypto_auth_hmacsha512_BYTES:NULL;
+
+      if(!have_pkS || 0!=sodium_memcmp(s->skS, rec->skS, sizeof s->skS)) {
+        memcpy(s->skS, rec->skS, sizeof s->skS);
+        have_pkS = (0==crypto_scalarmult_ristretto255_base(pkS, s->skS));
+      }
+      if(!have_pkS ||
+         (mret[4*j] | mret[4*j+1] | mret[4*j+2] | mret[4*j+3]) != 0) {
+        ret[k]=-1;
+        failed++;
+        // do not leave anything usable in the outputs of failed sessions
+        sodium_memzero(usk, OPAQUE_SHARED_SECRETBYTES);
+        if(uauthU!=NULL) sodium_memzero(uauthU, crypto_auth_hmacsha512_BYTES);
+      } else {
+        ret[k]=0;
+        prepare_record(rec, pkS, &ids[k], &prefix, &s->prec[lanes]);
+        lpub[lanes] = _pub+k*OPAQUE_USER_SESSION_PUBLIC_LEN;
+        lprec[lanes] = &s->prec[lanes];
+        leph[lanes] = &s->eph[j];
+        likm[lanes] = s->ikm[j];
+        lresp[lanes] = _resp+k*OPAQUE_SERVER_SESSION_LEN;
+        lsk[lanes] = usk;
+        lauthU[lanes] = uauthU;
+        lanes++;
+      }
+      // the ephemerals and ikms of the lanes belong to this chunk
+      if(lanes==OPAQUE_MB_LANES || (j+1==m && lanes>0)) {
+        if(0!=finish_credential_responses(lanes, lpub, lprec, leph, likm, lresp, lsk,
+                                          (authU!=NULL)?lauthU:NULL)) {
+          opaque_scratch_free(s, sizeof *s);
+          return batch_failed(n, sk, authU, ret);
+        }
+        lanes=0;
+      }
+    }
+  }
+  opaque_scratch_free(s, sizeof *s);
+
+  return failed;
+}
+
+// the rest of opaque_RecoverCredentials() once randomized_pwd is known
+static int recover_credentials(const Opaque_ServerSession *resp,
+                               const Opaque_UserSession_Secret *sec,
+                               const uint8_t *ctx, const uint16_t ctx_len,
+                               const Opaque_Ids *ids0,
+                               const uint8_t rwdU[OPAQUE_RWDU_BYTES],
+                               uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                               uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                               uint8_t export_key[crypto_hash_sha512_BYTES]) {
+  // all secrets of this function live in one block of the locked scratch arena
+  struct {
+    uint8_t masking_key[crypto_hash_sha512_BYTES];
+    uint8_t response_pad[crypto_scalarmult_BYTES+sizeof(Opaque_Envelope)];
+    Opaque_Envelope env;
+    uint8_t auth_key[OPAQUE_HMAC_SHA512_KEYBYTES];
+    uint8_t seed[crypto_core_ristretto255_SCALARBYTES];
+    uint8_t client_secret_key[crypto_scalarmult_SCALARBYTES];
+    Opaque_Keys keys;
+    crypto_auth_hmacsha512_state keyed;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+
+#if (defined TRACE || defined CFRG_TEST_VEC)
+  dump(rwdU, OPAQUE_RWDU_BYTES, "rwdU");
+#endif
+
+  // 1.3. masking_key = HKDF-Expand(randomized_pwd, "MaskingKey", Nh)
+  // the hmac keyed with randomized_pwd is kept for the envelope keys
+  const Hkdf_Output masking_key = {
+    s->masking_key, crypto_hash_sha512_BYTES, "MaskingKey", 10, NULL, 0 };
+  hkdf_expand_multi(rwdU, &s->keyed, &masking_key, 1);
 
   // 1.4. credential_response_pad = Expand(masking_key,
   //        concat(response.masking_nonce, "CredentialResponsePad"), Npk + Ne)
@@ -1409,107 +2685,57 @@ int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
       .dst = "CredentialResponsePad"};
   memcpy(masking_info.nonce, resp->masking_nonce, sizeof masking_info.nonce);
 
-  uint8_t response_pad[crypto_scalarmult_BYTES+sizeof(Opaque_Envelope)];
-  if(-1==sodium_mlock(response_pad,sizeof response_pad)) {
-    sodium_munlock(masking_key,sizeof masking_key);
-    sodium_munlock(rwdU,sizeof rwdU);
-    return -1;
-  }
-  crypto_kdf_hkdf_sha512_expand(response_pad, sizeof response_pad,
+  crypto_kdf_hkdf_sha512_expand(s->response_pad, sizeof s->response_pad,
                                 (const char*) &masking_info, sizeof masking_info,
-                                masking_key);
-  sodium_munlock(masking_key,sizeof masking_key);
+                                s->masking_key);
 
   // 1.5. concat(server_public_key, envelope) = xor(credential_response_pad,
   //                                            response.masked_response)
-  Opaque_Envelope env;
-  if(-1==sodium_mlock(&env,sizeof env)) {
-    sodium_mlock(response_pad,sizeof response_pad);
-    sodium_munlock(rwdU,sizeof rwdU);
-    return -1;
-  }
-  uint8_t server_public_key[crypto_scalarmult_BYTES], *env_ptr=(uint8_t*) &env;
+  uint8_t server_public_key[crypto_scalarmult_BYTES], *env_ptr=(uint8_t*) &s->env;
   unsigned i;
   for(i=0;i<crypto_scalarmult_BYTES;i++)
-    server_public_key[i] = response_pad[i] ^ resp->masked_response[i];
+    server_public_key[i] = s->response_pad[i] ^ resp->masked_response[i];
   for(;i<crypto_scalarmult_BYTES+sizeof(Opaque_Envelope);i++)
-    env_ptr[i-crypto_scalarmult_BYTES] = response_pad[i] ^ resp->masked_response[i];
-  sodium_mlock(response_pad,sizeof response_pad);
+    env_ptr[i-crypto_scalarmult_BYTES] = s->response_pad[i] ^ resp->masked_response[i];
 
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(server_public_key, sizeof server_public_key, "server_public_key");
-  dump(env.nonce, sizeof env.nonce, "env.nonce");
-  dump(env.auth_tag, sizeof env.auth_tag, "env.auth_tag");
+  dump(s->env.nonce, sizeof s->env.nonce, "env.nonce");
+  dump(s->env.auth_tag, sizeof s->env.auth_tag, "env.auth_tag");
 #endif
 
   // 1.6. (client_private_key, export_key) =
   //  Recover(randomized_pwd, server_public_key, envelope,
   //                  server_identity, client_identity)
 
-  uint8_t concated[OPAQUE_ENVELOPE_NONCEBYTES+10],
-    *label = concated+OPAQUE_ENVELOPE_NONCEBYTES;
-  memcpy(concated, env.nonce, OPAQUE_ENVELOPE_NONCEBYTES);
-
-  // 1.6.1. auth_key = Expand(randomized_pwd, concat(envelope.nonce, "AuthKey"), Nh)
-  uint8_t auth_key[OPAQUE_HMAC_SHA512_KEYBYTES];
-  if(-1==sodium_mlock(auth_key, sizeof auth_key)) {
-    sodium_munlock(rwdU,sizeof rwdU);
-    return -1;
-  }
-  memcpy(label, "AuthKey", 7);
-  crypto_kdf_hkdf_sha512_expand(auth_key, sizeof auth_key,
-                                (const char*) concated, OPAQUE_ENVELOPE_NONCEBYTES+7,
-                                rwdU);
-
-#ifdef TRACE
-  dump(auth_key,sizeof auth_key, "auth_key ");
-#endif
-
-  if(NULL!=export_key) {
+  // the hmac is still keyed with randomized_pwd from the masking key
+  const Hkdf_Output outs[] = {
+    // 1.6.1. auth_key = Expand(randomized_pwd, concat(envelope.nonce, "AuthKey"), Nh)
+    { s->auth_key, sizeof s->auth_key,
+      s->env.nonce, OPAQUE_ENVELOPE_NONCEBYTES, (const uint8_t*) "AuthKey", 7 },
     // 1.6.2. export_key = Expand(randomized_pwd, concat(envelope.nonce, "ExportKey", Nh)
-    memcpy(label, "ExportKey", 9);
-#if (defined TRACE || defined CFRG_TEST_VEC)
-    dump(concated, OPAQUE_ENVELOPE_NONCEBYTES+9, "export_key_info");
-#endif
-    crypto_kdf_hkdf_sha512_expand(export_key, crypto_hash_sha512_BYTES,
-                                  (const char*) concated, OPAQUE_ENVELOPE_NONCEBYTES+9,
-                                  rwdU);
+    { export_key, crypto_hash_sha512_BYTES,
+      s->env.nonce, OPAQUE_ENVELOPE_NONCEBYTES, (const uint8_t*) "ExportKey", 9 },
+    // 1.6.3. seed = Expand(randomized_pwd, concat(envelope.nonce, "PrivateKey"), Nseed)
+    { s->seed, crypto_core_ristretto255_SCALARBYTES,
+      s->env.nonce, OPAQUE_ENVELOPE_NONCEBYTES, (const uint8_t*) "PrivateKey", 10 },
+  };
+  hkdf_expand_multi(NULL, &s->keyed, outs, sizeof outs / sizeof outs[0]);
+
 #ifdef TRACE
-    dump(export_key,crypto_hash_sha512_BYTES, "export_key ");
+  dump(s->auth_key,sizeof s->auth_key, "auth_key ");
+  if(NULL!=export_key) dump(export_key,crypto_hash_sha512_BYTES, "export_key ");
 #endif
-  }
-
-  // 1.6.3. seed = Expand(randomized_pwd, concat(envelope.nonce, "PrivateKey"), Nseed)
-  memcpy(label, "PrivateKey", 10);
-  uint8_t seed[crypto_core_ristretto255_SCALARBYTES];
-  if(-1==sodium_mlock(seed, sizeof seed)) {
-    sodium_munlock(auth_key, sizeof auth_key);
-    sodium_munlock(rwdU,sizeof rwdU);
-    return -1;
-  }
-  crypto_kdf_hkdf_sha512_expand(seed, crypto_core_ristretto255_SCALARBYTES,
-                                (const char*) concated, OPAQUE_ENVELOPE_NONCEBYTES+10,
-                                rwdU);
-  sodium_munlock(rwdU,sizeof rwdU);
 
   // 1.6.4. client_private_key, client_public_key = DeriveAuthKeyPair(seed)
-  uint8_t client_secret_key[crypto_scalarmult_SCALARBYTES];
-  if(-1==sodium_mlock(client_secret_key, sizeof client_secret_key)) {
-    sodium_munlock(seed, sizeof seed);
-    sodium_munlock(auth_key, sizeof auth_key);
-    return -1;
-  }
   const uint8_t dst[24]="OPAQUE-DeriveAuthKeyPair";
   uint8_t client_public_key[crypto_scalarmult_BYTES];
-  if(0!=deriveKeyPair(seed, sizeof seed, dst, sizeof dst, client_secret_key, client_public_key)) {
-    sodium_munlock(seed, sizeof seed);
-    sodium_munlock(client_secret_key, sizeof client_secret_key);
-    sodium_munlock(auth_key, sizeof auth_key);
+  if(0!=deriveKeyPair(s->seed, sizeof s->seed, dst, sizeof dst, s->client_secret_key, client_public_key)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(seed, sizeof seed);
 #if (defined CFRG_TEST_VEC || defined TRACE)
-  dump(client_secret_key, crypto_scalarmult_SCALARBYTES, "client_secret_key");
+  dump(s->client_secret_key, crypto_scalarmult_SCALARBYTES, "client_secret_key");
 #endif
 #if (defined CFRG_TEST_VEC || defined TRACE)
   dump(client_public_key, crypto_scalarmult_BYTES, "client_public_key");
@@ -1527,7 +2753,7 @@ int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
          *ptr=authenticated;
 
   // nonce
-  memcpy(ptr, env.nonce, OPAQUE_NONCE_BYTES);
+  memcpy(ptr, s->env.nonce, OPAQUE_NONCE_BYTES);
   ptr+=OPAQUE_NONCE_BYTES;
   // server_public_key
   memcpy(ptr, server_public_key, crypto_scalarmult_BYTES);
@@ -1546,23 +2772,22 @@ int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
 
   // 1.6.6. expected_tag = MAC(auth_key, concat(envelope.nonce, cleartext_creds))
   uint8_t auth_tag[crypto_auth_hmacsha512_BYTES];
-  opaque_hmacsha512(auth_key,             // key
+  opaque_hmacsha512(s->auth_key,             // key
                     authenticated,        // in
                     sizeof authenticated, // len(in)
                     auth_tag);            // out
 
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(authenticated, sizeof authenticated, "authenticated");
-  dump(auth_key, sizeof auth_key, "auth_key");
-  dump(env.auth_tag, crypto_auth_hmacsha512_BYTES, "env auth_tag");
+  dump(s->auth_key, sizeof s->auth_key, "auth_key");
+  dump(s->env.auth_tag, crypto_auth_hmacsha512_BYTES, "env auth_tag");
   dump(auth_tag, crypto_hash_sha512_BYTES, "auth tag ");
 #endif
-  sodium_munlock(auth_key, sizeof auth_key);
 
   // 1.6.7. If !ct_equal(envelope.auth_tag, expected_tag),
   //   raise KeyRecoveryError
-  if(0!=sodium_memcmp(env.auth_tag, auth_tag, sizeof auth_tag)) {
-    sodium_munlock(client_secret_key, sizeof client_secret_key);
+  if(0!=sodium_memcmp(s->env.auth_tag, auth_tag, sizeof auth_tag)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
 
@@ -1572,26 +2797,20 @@ int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
   // 2.2. preamble = Preamble(client_identity, state.ke1, server_identity, ke2.inner_ke2)
   char preamble[crypto_hash_sha512_BYTES];
   crypto_hash_sha512_state preamble_state;
-  calc_preamble(preamble, &preamble_state, client_public_key, server_public_key, sec->ke1, resp, ctx, ctx_len, &ids);
+  preamble_init(&preamble_state, ctx, ctx_len);
+  calc_preamble(preamble, &preamble_state, client_public_key, server_public_key, sec->ke1, resp, &ids);
 
-  Opaque_Keys keys;
-  if(-1==sodium_mlock(&keys,sizeof(keys))) {
-    sodium_munlock(client_secret_key, sizeof client_secret_key);
-    return -1;
-  }
   // 2.1. ikm = TripleDHIKM(state.client_secret, ke2.server_keyshare,
   //  state.client_secret, server_public_key, client_private_key, ke2.server_keyshare)
   // 2.3. Km2, Km3, session_key = DeriveKeys(ikm, preamble)
-  if(0!=user_3dh(&keys, client_secret_key, sec->x_u, server_public_key, resp->X_s, preamble)) {
-    sodium_munlock(client_secret_key, sizeof client_secret_key);
-    sodium_munlock(&keys, sizeof(keys));
+  if(0!=user_3dh(&s->keys, s->client_secret_key, sec->x_u, server_public_key, resp->X_s, preamble)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(client_secret_key, sizeof client_secret_key);
 
   // 2.4. expected_server_mac = MAC(Km2, Hash(preamble))
   uint8_t authS[crypto_auth_hmacsha512_BYTES];
-  opaque_hmacsha512(keys.km2,
+  opaque_hmacsha512(s->keys.km2,
                     (uint8_t*)preamble,                  // in
                     crypto_hash_sha512_BYTES,            // len(in)
                     authS);                              // out
@@ -1599,7 +2818,7 @@ int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
   // 2.5. If !ct_equal(ke2.server_mac, expected_server_mac),
   //   raise HandshakeError
   if (sodium_memcmp(authS, resp->auth, sizeof authS)!=0) {
-    sodium_munlock(&keys, sizeof(keys));
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
 
@@ -1607,7 +2826,7 @@ int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
   crypto_hash_sha512_update(&preamble_state, authS, crypto_auth_hmacsha512_BYTES);
   crypto_hash_sha512_final(&preamble_state, (uint8_t *) preamble);
   if(NULL!=authU) {
-    opaque_hmacsha512(keys.km3,                         // key
+    opaque_hmacsha512(s->keys.km3,                         // key
                       (uint8_t*)preamble,               // in
                       crypto_hash_sha512_BYTES,         // len(in)
                       authU);                           // out
@@ -1615,12 +2834,237 @@ int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
 
   // 2.7. Create KE3 ke3 with client_mac
   // 2.8. Output (ke3, session_key)
-  memcpy(sk,keys.sk,sizeof(keys.sk));
+  memcpy(sk,s->keys.sk,sizeof(s->keys.sk));
 
-  sodium_munlock(&keys, sizeof(keys));
+  opaque_scratch_free(s, sizeof *s);
   return 0;
 }
 
+// more or less corresponds to RecoverCredentials in the irtf draft
+// 3. On β, X_s and c from S, U proceeds as follows:
+// (a) Checks that β ∈ G ∗ . If not, outputs (abort, sid , ssid ) and halts;
+// (b) Computes rw := H(key, pw|β^1/r );
+// (c) Computes AuthDec_rw(c). If the result is ⊥, outputs (abort, sid , ssid ) and halts.
+//     Otherwise sets (p_u, P_u, P_s ) := AuthDec_rw (c);
+// (d) Computes K := KE(p_u, x_u, P_s, X_s) and SK := f_K(0);
+// (e) Outputs (sid, ssid, SK).
+int opaque_RecoverCredentials(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                              const uint8_t *_sec/*[OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len]*/,
+                              const uint8_t *ctx, const uint16_t ctx_len,
+                              const Opaque_Ids *ids0,
+                              uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                              uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                              uint8_t export_key[crypto_hash_sha512_BYTES]) {
+  return opaque_RecoverCredentialsHarden(_resp, _sec, ctx, ctx_len, ids0, NULL, sk, authU, export_key);
+}
+
+int opaque_RecoverCredentialsHarden(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                    const uint8_t *_sec/*[OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len]*/,
+                                    const uint8_t *ctx, const uint16_t ctx_len,
+                                    const Opaque_Ids *ids0,
+                                    const uint8_t *harden,
+                                    uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                    uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                                    uint8_t export_key[crypto_hash_sha512_BYTES]) {
+
+  Opaque_ServerSession *resp = (Opaque_ServerSession *) _resp;
+  Opaque_UserSession_Secret *sec = (Opaque_UserSession_Secret *) _sec;
+
+#ifdef TRACE
+  dump(sec->pwdU,sec->pwdU_len, "session user finish pwdU ");
+  dump(_sec,OPAQUE_USER_SESSION_SECRET_LEN, "session user finish sec ");
+  dump(_resp,OPAQUE_SERVER_SESSION_LEN, "session user finish resp ");
+#endif
+
+  // 1. (client_private_key, server_public_key, export_key) =
+  //  RecoverCredentials(state.password, state.blind, ke2.CredentialResponse,
+  //                     server_identity, client_identity)
+  // 1.1. y = Finalize(password, blind, response.data, nil)
+  // 1.2. randomized_pwd = Extract("", concat(y, Harden(y, params)))
+  struct {
+    uint8_t N[crypto_core_ristretto255_BYTES];
+    uint8_t rwdU[OPAQUE_RWDU_BYTES];
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  // 1. N = Unblind(blind, response.data)
+  if(0!=oprf_Unblind(sec->blind, resp->Z, s->N)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+#if (defined TRACE || defined CFRG_TEST_VEC)
+  dump(s->N, sizeof s->N, "unblinded");
+#endif
+
+  // rw = H(pw, β^(1/r))
+  // 1.2. y = Finalize(pwdU, N, "OPAQUE01")
+  int ret = oprf_Finalize(sec->pwdU, sec->pwdU_len, s->N, harden, s->rwdU);
+  if(0!=ret) {
+    opaque_scratch_free(s, sizeof *s);
+    return ret;
+  }
+
+  ret = recover_credentials(resp, sec, ctx, ctx_len, ids0, s->rwdU, sk, authU, export_key);
+  opaque_scratch_free(s, sizeof *s);
+  return ret;
+}
+
+// a login whose hardening runs step by step, see opaque_RecoverCredentialsStart()
+struct Opaque_RecoverState {
+  Argon2_State *argon2;          // the hardening, NULL with the identity MHF of the test vectors
+  Opaque_HardenCtx *hctx;        // the context whose memory it uses, or NULL
+  size_t reserved;               // taken from the budget if not using hctx
+  // - concat(y, Harden(y, params))
+  uint8_t concated[2*crypto_hash_sha512_BYTES];
+  Opaque_ServerSession resp;
+  Opaque_Ids ids;
+  uint16_t ctx_len;
+  uint8_t *ctx;
+  Opaque_UserSession_Secret *sec;
+  // copies of sec, ctx, idU and idS, in this order
+  uint8_t buf[];
+};
+
+Opaque_RecoverState* opaque_RecoverCredentialsStart(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                                    const uint8_t *_sec/*[OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len]*/,
+                                                    const uint8_t *ctx, const uint16_t ctx_len,
+                                                    const Opaque_Ids *ids0,
+                                                    const uint8_t *harden) {
+  const Opaque_UserSession_Secret *sec = (const Opaque_UserSession_Secret *) _sec;
+  Harden_Params params;
+  if(0!=harden_decode(harden, &params)) return NULL;
+
+  // the state holds the password and secrets derived from it, it is
+  // locked and surrounded by guard pages like the ephemeral pool
+  const size_t sec_len = OPAQUE_USER_SESSION_SECRET_LEN+sec->pwdU_len;
+  const uint16_t idU_len = (ids0->idU==NULL) ? 0 : ids0->idU_len;
+  const uint16_t idS_len = (ids0->idS==NULL) ? 0 : ids0->idS_len;
+  Opaque_RecoverState *st = opaque_locked_alloc(sizeof(Opaque_RecoverState) + sec_len + ctx_len + idU_len + idS_len, 16);
+  if(st==NULL) return NULL;
+  st->argon2 = NULL;
+  st->hctx = NULL;
+  st->reserved = 0;
+  memcpy(&st->resp, _resp, sizeof st->resp);
+  uint8_t *ptr = st->buf;
+  st->sec = (Opaque_UserSession_Secret *) ptr;
+  memcpy(ptr, _sec, sec_len);
+  ptr+=sec_len;
+  st->ctx = ptr;
+  st->ctx_len = ctx_len;
+  if(ctx_len>0) memcpy(ptr, ctx, ctx_len);
+  ptr+=ctx_len;
+  st->ids.idU_len = idU_len;
+  st->ids.idU = (idU_len>0) ? ptr : NULL;
+  if(idU_len>0) memcpy(ptr, ids0->idU, idU_len);
+  ptr+=idU_len;
+  st->ids.idS_len = idS_len;
+  st->ids.idS = (idS_len>0) ? ptr : NULL;
+  if(idS_len>0) memcpy(ptr, ids0->idS, idS_len);
+
+  struct {
+    uint8_t N[crypto_core_ristretto255_BYTES];
+    crypto_hash_sha512_state state;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) {
+    sodium_free(st);
+    return NULL;
+  }
+  // 1. N = Unblind(blind, response.data)
+  if(0!=oprf_Unblind(st->sec->blind, st->resp.Z, s->N)) {
+    opaque_scratch_free(s, sizeof *s);
+    sodium_free(st);
+    return NULL;
+  }
+  // 1.2. y = Finalize(pwdU, N, "OPAQUE01")
+  uint8_t *y=st->concated;
+  oprf_finalize_y(st->sec->pwdU, st->sec->pwdU_len, s->N, &s->state, y);
+  opaque_scratch_free(s, sizeof *s);
+
+#ifdef CFRG_TEST_VEC
+  // testvectors use identity as MHF
+  memcpy(st->concated+crypto_hash_sha512_BYTES, y, crypto_hash_sha512_BYTES);
+#else
+  // only Argon2id runs step by step, the other functions harden here
+  if(params.alg!=OPAQUE_HARDEN_ARGON2ID) {
+    const int ret = harden_hash(&params, 0, 0, y, st->concated+crypto_hash_sha512_BYTES);
+    if(ret!=0) {
+      sodium_free(st);
+      if(ret==OPAQUE_BUSY) errno = EBUSY;
+      return NULL;
+    }
+    return st;
+  }
+  // Harden(y, params) is started here and filled by the steps, it
+  // always runs in argon2.c, which gives the same output as libsodium
+  // - salt - according to the irtf draft this could be all zeroes
+  const uint8_t salt[crypto_pwhash_SALTBYTES]={0};
+  st->hctx = harden_ctx_acquire(&params);
+  // an event loop must not block, there is no waiting for the budget
+  if(st->hctx==NULL) {
+    const int ret = harden_budget_acquire(params.memlimit, 0, &st->reserved);
+    if(ret!=0) {
+      sodium_free(st);
+      if(ret==OPAQUE_BUSY) errno = EBUSY;
+      return NULL;
+    }
+  }
+  st->argon2 = argon2id_start(crypto_hash_sha512_BYTES, y, crypto_hash_sha512_BYTES,
+                              salt, sizeof salt, NULL, 0, NULL, 0,
+                              (uint32_t) params.opslimit, (uint32_t) (params.memlimit / 1024),
+                              params.lanes,
+                              (st->hctx!=NULL) ? st->hctx->memory : NULL,
+                              (st->hctx!=NULL) ? st->hctx->size : 0);
+  if(st->argon2==NULL) {
+    /* out of memory */
+    harden_ctx_release(st->hctx);
+    harden_budget_release(st->reserved);
+    sodium_free(st);
+    return NULL;
+  }
+#endif
+  return st;
+}
+
+int opaque_RecoverCredentialsStep(Opaque_RecoverState *st, const uint32_t blocks) {
+  if(st->argon2==NULL) return 1;
+  return argon2id_step(st->argon2, blocks);
+}
+
+int opaque_RecoverCredentialsFinish(Opaque_RecoverState *st,
+                                    uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                    uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                                    uint8_t export_key[crypto_hash_sha512_BYTES]) {
+  if(st->argon2!=NULL) {
+    // also fills the blocks the steps did not get to
+    argon2id_finish(st->argon2, st->concated+crypto_hash_sha512_BYTES);
+    st->argon2=NULL;
+    harden_ctx_release(st->hctx);
+    st->hctx=NULL;
+    harden_budget_release(st->reserved);
+    st->reserved=0;
+  }
+  uint8_t *rwdU = opaque_scratch_alloc(OPAQUE_RWDU_BYTES);
+  if(rwdU==NULL) {
+    sodium_free(st);
+    return -1;
+  }
+  // 1.2. randomized_pwd = Extract("", concat(y, Harden(y, params)))
+  oprf_finalize_rwd(st->concated, rwdU);
+  const int ret = recover_credentials(&st->resp, st->sec, st->ctx, st->ctx_len, &st->ids,
+                                      rwdU, sk, authU, export_key);
+  opaque_scratch_free(rwdU, OPAQUE_RWDU_BYTES);
+  // also wipes it
+  sodium_free(st);
+  return ret;
+}
+
+void opaque_RecoverCredentialsAbort(Opaque_RecoverState *st) {
+  if(st==NULL) return;
+  argon2id_abort(st->argon2);
+  harden_ctx_release(st->hctx);
+  harden_budget_release(st->reserved);
+  sodium_free(st);
+}
+
 // extra function to implement the hmac based auth as defined in the irtf cfrg draft
 int opaque_UserAuth(const uint8_t authU0[crypto_auth_hmacsha512_BYTES], const uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
     return sodium_memcmp(authU0, authU, crypto_auth_hmacsha512_BYTES);
@@ -1696,40 +3140,56 @@ int opaque_FinalizeRequest(const uint8_t *_sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pw
                            const Opaque_Ids *ids,
                            uint8_t _rec[OPAQUE_REGISTRATION_RECORD_LEN],
                            uint8_t export_key[crypto_hash_sha512_BYTES]) {
+  return opaque_FinalizeRequestHarden(_sec, _pub, ids, NULL, _rec, export_key);
+}
+
+/*
+ * opaque_FinalizeRequestHarden(), also returning y and rwdU for the
+ * login that follows, if they are not NULL
+ */
+static int finalize_request(const uint8_t *_sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pwdU_len]*/,
+                            const uint8_t _pub[OPAQUE_REGISTER_PUBLIC_LEN],
+                            const Opaque_Ids *ids,
+                            const uint8_t *harden,
+                            uint8_t _rec[OPAQUE_REGISTRATION_RECORD_LEN],
+                            uint8_t export_key[crypto_hash_sha512_BYTES],
+                            uint8_t y[crypto_hash_sha512_BYTES],
+                            uint8_t rwdU[OPAQUE_RWDU_BYTES]) {
 
   Opaque_RegisterUserSec *sec = (Opaque_RegisterUserSec *) _sec;
   Opaque_RegisterSrvPub *pub = (Opaque_RegisterSrvPub *) _pub;
   Opaque_RegistrationRecord *rec = (Opaque_RegistrationRecord *) _rec;
 
-  uint8_t N[crypto_core_ristretto255_BYTES];
-  if(-1==sodium_mlock(N, sizeof N)) return -1;
+  struct {
+    uint8_t N[crypto_core_ristretto255_BYTES];
+    uint8_t rwdU[OPAQUE_RWDU_BYTES];
+    crypto_hash_sha512_state state;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
   // 1. N = Unblind(blind, response.data)
-  if(0!=oprf_Unblind(sec->blind, pub->Z, N)) {
-    sodium_munlock(N, sizeof N);
+  if(0!=oprf_Unblind(sec->blind, pub->Z, s->N)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
 #if (defined TRACE || defined CFRG_TEST_VEC)
-  dump(N, sizeof N, "unblinded");
+  dump(s->N, sizeof s->N, "unblinded");
 #endif
 
-  uint8_t rwdU[OPAQUE_RWDU_BYTES];
-  if(-1==sodium_mlock(rwdU, sizeof rwdU)) {
-    sodium_munlock(N, sizeof N);
-    return -1;
-  }
   // 2. y = Finalize(pwdU, N, "OPAQUE01")
-  if(0!=oprf_Finalize(sec->pwdU, sec->pwdU_len, N, rwdU)) {
-    sodium_munlock(N, sizeof N);
-    sodium_munlock(rwdU, sizeof(rwdU));
-    return -1;
+  const int ret = oprf_Finalize(sec->pwdU, sec->pwdU_len, s->N, harden, s->rwdU);
+  if(0!=ret) {
+    opaque_scratch_free(s, sizeof *s);
+    return ret;
   }
-  sodium_munlock(N,sizeof N);
 
-  if(0!=create_envelope(rwdU, pub->pkS, ids, &rec->envelope, rec->client_public_key, rec->masking_key, export_key)) {
-    sodium_munlock(rwdU, sizeof rwdU);
+  if(0!=create_envelope(s->rwdU, pub->pkS, ids, &rec->envelope, rec->client_public_key, rec->masking_key, export_key)) {
+    opaque_scratch_free(s, sizeof *s);
     return -1;
   }
-  sodium_munlock(rwdU, sizeof rwdU);
+  // y is cheap to compute again, only its hardening is not
+  if(y!=NULL) oprf_finalize_y(sec->pwdU, sec->pwdU_len, s->N, &s->state, y);
+  if(rwdU!=NULL) memcpy(rwdU, s->rwdU, OPAQUE_RWDU_BYTES);
+  opaque_scratch_free(s, sizeof *s);
 
 #if (defined TRACE || defined CFRG_TEST_VEC)
   dump(_rec, OPAQUE_REGISTRATION_RECORD_LEN, "record");
@@ -1742,6 +3202,69 @@ int opaque_FinalizeRequest(const uint8_t *_sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pw
   return 0;
 }
 
+int opaque_FinalizeRequestHarden(const uint8_t *_sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pwdU_len]*/,
+                                 const uint8_t _pub[OPAQUE_REGISTER_PUBLIC_LEN],
+                                 const Opaque_Ids *ids,
+                                 const uint8_t *harden,
+                                 uint8_t _rec[OPAQUE_REGISTRATION_RECORD_LEN],
+                                 uint8_t export_key[crypto_hash_sha512_BYTES]) {
+  return finalize_request(_sec, _pub, ids, harden, _rec, export_key, NULL, NULL);
+}
+
+int opaque_FinalizeRequestLogin(const uint8_t *_sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pwdU_len]*/,
+                                const uint8_t _pub[OPAQUE_REGISTER_PUBLIC_LEN],
+                                const Opaque_Ids *ids,
+                                const uint8_t *harden,
+                                uint8_t _rec[OPAQUE_REGISTRATION_RECORD_LEN],
+                                uint8_t export_key[crypto_hash_sha512_BYTES],
+                                uint8_t *_login_sec/*[OPAQUE_REGISTER_LOGIN_SEC_LEN+pwdU_len]*/,
+                                uint8_t login_pub[OPAQUE_USER_SESSION_PUBLIC_LEN]) {
+  const Opaque_RegisterUserSec *sec = (const Opaque_RegisterUserSec *) _sec;
+  Opaque_RegisterLoginSec *login_sec = (Opaque_RegisterLoginSec *) _login_sec;
+  const int ret = finalize_request(_sec, _pub, ids, harden, _rec, export_key, login_sec->y, login_sec->rwdU);
+  if(0!=ret) return ret;
+  // the ke1 of the login, sent along with the record
+  if(0!=opaque_CreateCredentialRequest(sec->pwdU, sec->pwdU_len, login_sec->session, login_pub)) {
+    sodium_memzero(login_sec, sizeof(Opaque_RegisterLoginSec));
+    return -1;
+  }
+  return 0;
+}
+
+int opaque_RecoverCredentialsRegistered(const uint8_t _resp[OPAQUE_SERVER_SESSION_LEN],
+                                        const uint8_t *_login_sec/*[OPAQUE_REGISTER_LOGIN_SEC_LEN+pwdU_len]*/,
+                                        const uint8_t *ctx, const uint16_t ctx_len,
+                                        const Opaque_Ids *ids,
+                                        uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                        uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                                        uint8_t export_key[crypto_hash_sha512_BYTES]) {
+  const Opaque_ServerSession *resp = (const Opaque_ServerSession *) _resp;
+  const Opaque_RegisterLoginSec *login_sec = (const Opaque_RegisterLoginSec *) _login_sec;
+  const Opaque_UserSession_Secret *sec = (const Opaque_UserSession_Secret *) login_sec->session;
+
+  struct {
+    uint8_t N[crypto_core_ristretto255_BYTES];
+    uint8_t y[crypto_hash_sha512_BYTES];
+    crypto_hash_sha512_state state;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  // 1. N = Unblind(blind, response.data)
+  if(0!=oprf_Unblind(sec->blind, resp->Z, s->N)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+  // the server must have evaluated with the key of the registration,
+  // then y is the one whose hardening is already known
+  oprf_finalize_y(sec->pwdU, sec->pwdU_len, s->N, &s->state, s->y);
+  if(0!=sodium_memcmp(s->y, login_sec->y, sizeof s->y)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+  opaque_scratch_free(s, sizeof *s);
+
+  return recover_credentials(resp, sec, ctx, ctx_len, ids, login_sec->rwdU, sk, authU, export_key);
+}
+
 // S records file[sid ] := {k_s, p_s, P_s, P_u, c}.
 // called StoreUserRecord in the irtf cfrg rfc draft
 void opaque_StoreUserRecord(const uint8_t _sec[OPAQUE_REGISTER_SECRET_LEN], const uint8_t recU[OPAQUE_REGISTRATION_RECORD_LEN], uint8_t _rec[OPAQUE_USER_RECORD_LEN]) {
@@ -1756,3 +3279,379 @@ void opaque_StoreUserRecord(const uint8_t _sec[OPAQUE_REGISTER_SECRET_LEN], cons
   dump((uint8_t*) rec, OPAQUE_USER_RECORD_LEN, "user rec ");
 #endif
 }
+
+int opaque_StoreUserRecordLogin(const uint8_t sec[OPAQUE_REGISTER_SECRET_LEN],
+                                const uint8_t recU[OPAQUE_REGISTRATION_RECORD_LEN],
+                                const uint8_t login_pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                const Opaque_Ids *ids,
+                                const uint8_t *ctx, const uint16_t ctx_len,
+                                uint8_t rec[OPAQUE_USER_RECORD_LEN],
+                                uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  opaque_StoreUserRecord(sec, recU, rec);
+  return opaque_CreateCredentialResponse(login_pub, rec, ids, ctx, ctx_len, resp, sk, authU);
+}
+
+// session resumption, see opaque_IssueTicket()
+
+// the plaintext of a ticket, sealed by the server under its ticket key
+typedef struct {
+  uint8_t expires[8];   // unix time, big endian
+  uint8_t info[OPAQUE_TICKET_INFO_BYTES];
+  uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES];
+} __attribute((packed)) Opaque_TicketPlain;
+
+typedef struct {
+  uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+  uint8_t sealed[sizeof(Opaque_TicketPlain)+crypto_aead_xchacha20poly1305_ietf_ABYTES];
+} __attribute((packed)) Opaque_Ticket;
+
+typedef struct {
+  uint8_t ticket[OPAQUE_TICKET_LEN];
+  uint8_t nonceU[OPAQUE_NONCE_BYTES];
+  uint8_t X_u[crypto_scalarmult_BYTES];
+  uint8_t binder[crypto_auth_hmacsha512_BYTES];
+} __attribute((packed)) Opaque_ResumeRequest;
+
+typedef struct {
+  uint8_t x_u[crypto_scalarmult_SCALARBYTES];
+  uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES];
+  uint8_t req[OPAQUE_RESUME_REQUEST_LEN];
+} __attribute((packed)) Opaque_ResumeSecret;
+
+typedef struct {
+  uint8_t nonceS[OPAQUE_NONCE_BYTES];
+  uint8_t X_s[crypto_scalarmult_BYTES];
+  uint8_t auth[crypto_auth_hmacsha512_BYTES];
+} __attribute((packed)) Opaque_ResumeResponse;
+
+// the associated data of the tickets, binds them to this use of the key
+static const uint8_t ticket_ad[] = "OPAQUE-Ticket";
+
+static uint64_t ticket_now(void) {
+  const time_t now = time(NULL);
+  return (now < 0) ? 0 : (uint64_t) now;
+}
+
+// slots of the replay cache, expires==0 marks a slot never used, a
+// slot whose ticket has expired can be taken again
+typedef struct {
+  uint8_t id[16];
+  uint64_t expires;
+} Opaque_TicketSlot;
+
+struct Opaque_TicketCache {
+  atomic_flag lock;
+  size_t mask;       // the number of slots minus one, a power of two
+  Opaque_TicketSlot slot[];
+};
+
+Opaque_TicketCache* opaque_CreateTicketCache(const size_t capacity) {
+  if(capacity==0 || capacity > (SIZE_MAX / 2 - sizeof(Opaque_TicketCache)) / sizeof(Opaque_TicketSlot)) return NULL;
+  size_t n = 1;
+  while(n < capacity) n <<= 1;
+  Opaque_TicketCache *cache = calloc(1, sizeof(Opaque_TicketCache) + n*sizeof(Opaque_TicketSlot));
+  if(cache==NULL) return NULL;
+  atomic_flag_clear(&cache->lock);
+  cache->mask = n - 1;
+  return cache;
+}
+
+void opaque_DestroyTicketCache(Opaque_TicketCache *cache) {
+  free(cache);
+}
+
+// records the ticket with the given id, fails if it has been seen
+// before or if the cache is full of tickets that are still valid
+static int ticket_cache_insert(Opaque_TicketCache *cache, const uint8_t id[16],
+                               const uint64_t expires, const uint64_t now) {
+  // the id is the random nonce of the ticket, its first bytes are as
+  // good as any hash of it
+  uint64_t h;
+  memcpy(&h, id, sizeof h);
+  Opaque_TicketSlot *free_slot = NULL;
+  int ret = -1;
+  size_t i;
+
+  opaque_spin_lock(&cache->lock);
+  for(i=0;i<=cache->mask;i++) {
+    Opaque_TicketSlot *slot = &cache->slot[(h + i) & cache->mask];
+    if(slot->expires==0) {
+      // end of the probe sequence, the ticket is new
+      if(free_slot==NULL) free_slot = slot;
+      break;
+    }
+    if(slot->expires < now) {
+      // expired, it cannot be replayed anymore
+      if(free_slot==NULL) free_slot = slot;
+      continue;
+    }
+    if(memcmp(slot->id, id, sizeof slot->id)==0) {
+      free_slot = NULL;
+      break;
+    }
+  }
+  if(free_slot!=NULL) {
+    memcpy(free_slot->id, id, sizeof free_slot->id);
+    free_slot->expires = expires;
+    ret = 0;
+  }
+  opaque_spin_unlock(&cache->lock);
+  return ret;
+}
+
+int opaque_ResumptionSecret(const uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                            uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES]) {
+  crypto_auth_hmacsha512_state *keyed = opaque_scratch_alloc(sizeof *keyed);
+  if(keyed==NULL) return -1;
+  // rms = HKDF-Expand-Label(sk, "ResumptionSecret", "", Nh)
+  HKDF_LABEL(resumption_label, OPAQUE_RESUMPTION_SECRETBYTES, "ResumptionSecret", 0);
+  const Hkdf_Output out = { rms, OPAQUE_RESUMPTION_SECRETBYTES,
+                            &resumption_label, sizeof resumption_label, NULL, 0 };
+  hkdf_expand_multi(sk, keyed, &out, 1);
+  opaque_scratch_free(keyed, sizeof *keyed);
+  return 0;
+}
+
+int opaque_IssueTicket(const uint8_t key[OPAQUE_TICKET_KEYBYTES],
+                       const uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                       const uint8_t info[OPAQUE_TICKET_INFO_BYTES],
+                       const uint32_t lifetime,
+                       uint8_t _ticket[OPAQUE_TICKET_LEN]) {
+  Opaque_Ticket *ticket = (Opaque_Ticket *) _ticket;
+  if(lifetime==0 || lifetime > OPAQUE_TICKET_MAX_LIFETIME) return -1;
+
+  Opaque_TicketPlain *plain = opaque_scratch_alloc(sizeof *plain);
+  if(plain==NULL) return -1;
+  const uint64_t expires = ticket_now() + lifetime;
+  size_t i;
+  for(i=0;i<sizeof plain->expires;i++) plain->expires[i] = (uint8_t) (expires >> (56 - 8*i));
+  if(info!=NULL) memcpy(plain->info, info, sizeof plain->info);
+  else memset(plain->info, 0, sizeof plain->info);
+  if(0!=opaque_ResumptionSecret(sk, plain->rms)) {
+    opaque_scratch_free(plain, sizeof *plain);
+    return -1;
+  }
+
+  randombytes(ticket->nonce, sizeof ticket->nonce);
+  crypto_aead_xchacha20poly1305_ietf_encrypt(ticket->sealed, NULL,
+                                             (const uint8_t*) plain, sizeof *plain,
+                                             ticket_ad, sizeof ticket_ad - 1,
+                                             NULL, ticket->nonce, key);
+  opaque_scratch_free(plain, sizeof *plain);
+  return 0;
+}
+
+// binder = MAC(HKDF-Expand-Label(rms, "ResumeBinder", "", Nh),
+//              ticket || nonceU || X_u)
+// only a holder of rms can make a request that uses up a ticket
+static int resume_binder(const uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES],
+                         const Opaque_ResumeRequest *req,
+                         uint8_t binder[crypto_auth_hmacsha512_BYTES]) {
+  struct {
+    uint8_t key[OPAQUE_HMAC_SHA512_KEYBYTES];
+    crypto_auth_hmacsha512_state keyed;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+  HKDF_LABEL(binder_label, OPAQUE_HMAC_SHA512_KEYBYTES, "ResumeBinder", 0);
+  const Hkdf_Output out = { s->key, sizeof s->key, &binder_label, sizeof binder_label, NULL, 0 };
+  hkdf_expand_multi(rms, &s->keyed, &out, 1);
+  opaque_hmacsha512(s->key, (const uint8_t*) req, offsetof(Opaque_ResumeRequest, binder), binder);
+  opaque_scratch_free(s, sizeof *s);
+  return 0;
+}
+
+int opaque_CreateResumeRequest(const uint8_t ticket[OPAQUE_TICKET_LEN],
+                               const uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES],
+                               uint8_t _sec[OPAQUE_RESUME_SECRET_LEN],
+                               uint8_t _req[OPAQUE_RESUME_REQUEST_LEN]) {
+  Opaque_ResumeSecret *sec = (Opaque_ResumeSecret *) _sec;
+  Opaque_ResumeRequest *req = (Opaque_ResumeRequest *) _req;
+
+  memcpy(req->ticket, ticket, OPAQUE_TICKET_LEN);
+  randombytes(req->nonceU, OPAQUE_NONCE_BYTES);
+  randombytes(sec->x_u, crypto_scalarmult_SCALARBYTES);
+  // X_u := g^x_u
+  if(0!=crypto_scalarmult_ristretto255_base(req->X_u, sec->x_u)) {
+    sodium_memzero(sec, sizeof *sec);
+    return -1;
+  }
+  memcpy(sec->rms, rms, OPAQUE_RESUMPTION_SECRETBYTES);
+  if(0!=resume_binder(rms, req, req->binder)) {
+    sodium_memzero(sec, sizeof *sec);
+    return -1;
+  }
+  // keep the request for the transcript
+  memcpy(sec->req, _req, OPAQUE_RESUME_REQUEST_LEN);
+#ifdef TRACE
+  dump(_req, OPAQUE_RESUME_REQUEST_LEN, "resume req ");
+#endif
+  return 0;
+}
+
+// the keys of a resumption: ikm = rms || DH(x, Y), with the transcript
+//   hash("RFCXXXX", I2OSP(len(context), 2), context,
+//        "OPAQUE-Resume", request, nonceS, X_s)
+// as info of derive_keys(), the state is left with the transcript
+// absorbed so that the client mac can be computed from it
+static int resume_keys(Opaque_Keys *keys,
+                       crypto_hash_sha512_state *state,
+                       char preamble[crypto_hash_sha512_BYTES],
+                       const uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES],
+                       const uint8_t x[crypto_scalarmult_SCALARBYTES],
+                       const uint8_t Y[crypto_scalarmult_BYTES],
+                       const uint8_t *ctx, const uint16_t ctx_len,
+                       const uint8_t req[OPAQUE_RESUME_REQUEST_LEN],
+                       const Opaque_ResumeResponse *resp) {
+  static const uint8_t resume_label[] = "OPAQUE-Resume";
+  uint8_t *ikm = opaque_scratch_alloc(crypto_scalarmult_BYTES * 3);
+  if(ikm==NULL) return -1;
+  memcpy(ikm, rms, OPAQUE_RESUMPTION_SECRETBYTES);
+  if(0!=crypto_scalarmult_ristretto255(ikm+OPAQUE_RESUMPTION_SECRETBYTES, x, Y)) {
+    opaque_scratch_free(ikm, crypto_scalarmult_BYTES * 3);
+    return -1;
+  }
+
+  preamble_init(state, ctx, ctx_len);
+  crypto_hash_sha512_update(state, resume_label, sizeof resume_label - 1);
+  crypto_hash_sha512_update(state, req, OPAQUE_RESUME_REQUEST_LEN);
+  crypto_hash_sha512_update(state, resp->nonceS, OPAQUE_NONCE_BYTES);
+  crypto_hash_sha512_update(state, resp->X_s, crypto_scalarmult_BYTES);
+  crypto_hash_sha512_state copy = *state;
+  crypto_hash_sha512_final(&copy, (uint8_t *) preamble);
+
+  const int ret = derive_keys(keys, ikm, preamble);
+  opaque_scratch_free(ikm, crypto_scalarmult_BYTES * 3);
+  return ret;
+}
+
+int opaque_CreateResumeResponse(const uint8_t key[OPAQUE_TICKET_KEYBYTES],
+                                Opaque_TicketCache *cache,
+                                const uint8_t _req[OPAQUE_RESUME_REQUEST_LEN],
+                                const uint8_t *ctx, const uint16_t ctx_len,
+                                uint8_t info[OPAQUE_TICKET_INFO_BYTES],
+                                uint8_t _resp[OPAQUE_RESUME_RESPONSE_LEN],
+                                uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  const Opaque_ResumeRequest *req = (const Opaque_ResumeRequest *) _req;
+  const Opaque_Ticket *ticket = (const Opaque_Ticket *) req->ticket;
+  Opaque_ResumeResponse *resp = (Opaque_ResumeResponse *) _resp;
+
+  struct {
+    Opaque_TicketPlain plain;
+    Opaque_ServerEphemeral eph;
+    Opaque_Keys keys;
+    uint8_t binder[crypto_auth_hmacsha512_BYTES];
+    uint8_t authU[crypto_auth_hmacsha512_BYTES];
+    char preamble[crypto_hash_sha512_BYTES];
+    crypto_hash_sha512_state state;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+
+  // only tickets sealed with our key, and not expired
+  if(0!=crypto_aead_xchacha20poly1305_ietf_decrypt((uint8_t*) &s->plain, NULL, NULL,
+                                                   ticket->sealed, sizeof ticket->sealed,
+                                                   ticket_ad, sizeof ticket_ad - 1,
+                                                   ticket->nonce, key)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+  uint64_t expires = 0;
+  size_t i;
+  for(i=0;i<sizeof s->plain.expires;i++) expires = (expires << 8) | s->plain.expires[i];
+  const uint64_t now = ticket_now();
+  if(expires < now) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+  // the client knows the rms of the ticket, and its keyshare is a
+  // valid point
+  if(crypto_core_ristretto255_is_valid_point(req->X_u)!=1 ||
+     0!=resume_binder(s->plain.rms, req, s->binder) ||
+     0!=sodium_memcmp(s->binder, req->binder, sizeof s->binder)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+
+  // a fresh ephemeral, so that the new session key is forward secret
+  if(0!=server_ephemerals(&s->eph, 1)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+  memcpy(resp->nonceS, s->eph.nonceS, OPAQUE_NONCE_BYTES);
+  memcpy(resp->X_s, s->eph.X_s, crypto_scalarmult_BYTES);
+
+  if(0!=resume_keys(&s->keys, &s->state, s->preamble, s->plain.rms, s->eph.x_s, req->X_u,
+                    ctx, ctx_len, _req, resp)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+
+  // server_mac = MAC(Km2, Hash(preamble))
+  opaque_hmacsha512(s->keys.km2, (uint8_t*) s->preamble, crypto_hash_sha512_BYTES, resp->auth);
+  // expected_client_mac = MAC(Km3, Hash(concat(preamble, server_mac))
+  crypto_hash_sha512_update(&s->state, resp->auth, crypto_auth_hmacsha512_BYTES);
+  crypto_hash_sha512_final(&s->state, (uint8_t *) s->preamble);
+  opaque_hmacsha512(s->keys.km3, (uint8_t*) s->preamble, crypto_hash_sha512_BYTES, s->authU);
+
+  // each ticket is accepted only once, recorded last so that a request
+  // failing before does not use up the ticket
+  if(cache!=NULL && 0!=ticket_cache_insert(cache, ticket->nonce, expires, now)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+
+  memcpy(sk, s->keys.sk, OPAQUE_SHARED_SECRETBYTES);
+  memcpy(authU, s->authU, crypto_auth_hmacsha512_BYTES);
+  if(info!=NULL) memcpy(info, s->plain.info, OPAQUE_TICKET_INFO_BYTES);
+#ifdef TRACE
+  dump(_resp, OPAQUE_RESUME_RESPONSE_LEN, "resume resp ");
+  dump(sk, OPAQUE_SHARED_SECRETBYTES, "resume srv sk ");
+#endif
+  opaque_scratch_free(s, sizeof *s);
+  return 0;
+}
+
+int opaque_RecoverResume(const uint8_t _resp[OPAQUE_RESUME_RESPONSE_LEN],
+                         const uint8_t _sec[OPAQUE_RESUME_SECRET_LEN],
+                         const uint8_t *ctx, const uint16_t ctx_len,
+                         uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                         uint8_t authU[crypto_auth_hmacsha512_BYTES]) {
+  const Opaque_ResumeResponse *resp = (const Opaque_ResumeResponse *) _resp;
+  const Opaque_ResumeSecret *sec = (const Opaque_ResumeSecret *) _sec;
+
+  struct {
+    Opaque_Keys keys;
+    uint8_t auth[crypto_auth_hmacsha512_BYTES];
+    char preamble[crypto_hash_sha512_BYTES];
+    crypto_hash_sha512_state state;
+  } *s = opaque_scratch_alloc(sizeof *s);
+  if(s==NULL) return -1;
+
+  if(0!=resume_keys(&s->keys, &s->state, s->preamble, sec->rms, sec->x_u, resp->X_s,
+                    ctx, ctx_len, sec->req, resp)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+
+  // the server knew the rms of the ticket
+  opaque_hmacsha512(s->keys.km2, (uint8_t*) s->preamble, crypto_hash_sha512_BYTES, s->auth);
+  if(0!=sodium_memcmp(s->auth, resp->auth, sizeof s->auth)) {
+    opaque_scratch_free(s, sizeof *s);
+    return -1;
+  }
+
+  // client_mac = MAC(Km3, Hash(concat(preamble, server_mac))
+  crypto_hash_sha512_update(&s->state, resp->auth, crypto_auth_hmacsha512_BYTES);
+  crypto_hash_sha512_final(&s->state, (uint8_t *) s->preamble);
+  if(authU!=NULL) {
+    opaque_hmacsha512(s->keys.km3, (uint8_t*) s->preamble, crypto_hash_sha512_BYTES, authU);
+  }
+  memcpy(sk, s->keys.sk, OPAQUE_SHARED_SECRETBYTES);
+#ifdef TRACE
+  dump(sk, OPAQUE_SHARED_SECRETBYTES, "resume usr sk ");
+#endif
+  opaque_scratch_free(s, sizeof *s);
+  return 0;
+}
@@ -54,6 +54,13 @@ extern "C" {
    /* envelope nonce */    OPAQUE_ENVELOPE_NONCEBYTES+ \
    /* envelope mac */      crypto_auth_hmacsha512_BYTES)
 
+#define OPAQUE_SERVER_PENDING_LEN (                    \
+   /* masking_nonce */ 32+                             \
+   /* nonceS */ OPAQUE_NONCE_BYTES+                    \
+   /* x_s */ crypto_scalarmult_SCALARBYTES+            \
+   /* X_s */ crypto_scalarmult_BYTES+                  \
+   /* ke1 */ OPAQUE_USER_SESSION_PUBLIC_LEN)
+
 #define OPAQUE_REGISTER_USER_SEC_LEN (                 \
    /* r */ crypto_core_ristretto255_SCALARBYTES+       \
    /* pwdU_len */ sizeof(uint16_t))
@@ -66,6 +73,51 @@ extern "C" {
    /* skS */ crypto_scalarmult_SCALARBYTES+            \
    /* kU */ crypto_core_ristretto255_SCALARBYTES)
 
+#define OPAQUE_REGISTER_LOGIN_SEC_LEN (                \
+   /* y */ crypto_hash_sha512_BYTES+                   \
+   /* rwdU */ crypto_hash_sha512_BYTES+                \
+   /* login */ OPAQUE_USER_SESSION_SECRET_LEN)
+
+/**
+ * Length of the resumption secret, see opaque_ResumptionSecret().
+ */
+#define OPAQUE_RESUMPTION_SECRETBYTES 64
+/**
+ * Length of the key with which a server seals its tickets.
+ */
+#define OPAQUE_TICKET_KEYBYTES 32
+/**
+ * Length of the data a server keeps in its tickets, see opaque_IssueTicket().
+ */
+#define OPAQUE_TICKET_INFO_BYTES 32
+/**
+ * The longest lifetime of a ticket in seconds, one week.
+ */
+#define OPAQUE_TICKET_MAX_LIFETIME (7*24*3600)
+
+#define OPAQUE_TICKET_LEN (                            \
+   /* nonce */ 24+                                     \
+   /* expires */ 8+                                    \
+   /* info */ OPAQUE_TICKET_INFO_BYTES+                \
+   /* rms */ OPAQUE_RESUMPTION_SECRETBYTES+            \
+   /* tag */ 16)
+
+#define OPAQUE_RESUME_REQUEST_LEN (                    \
+   /* ticket */ OPAQUE_TICKET_LEN+                     \
+   /* nonceU */ OPAQUE_NONCE_BYTES+                    \
+   /* X_u */ crypto_scalarmult_BYTES+                  \
+   /* binder */ crypto_auth_hmacsha512_BYTES)
+
+#define OPAQUE_RESUME_SECRET_LEN (                     \
+   /* x_u */ crypto_scalarmult_SCALARBYTES+            \
+   /* rms */ OPAQUE_RESUMPTION_SECRETBYTES+            \
+   /* request */ OPAQUE_RESUME_REQUEST_LEN)
+
+#define OPAQUE_RESUME_RESPONSE_LEN (                   \
+   /* nonceS */ OPAQUE_NONCE_BYTES+                    \
+   /* X_s */ crypto_scalarmult_BYTES+                  \
+   /* auth */ crypto_auth_hmacsha512_BYTES)
+
 /**
    struct to store the IDs of the user/server.
 
@@ -83,6 +135,263 @@ typedef struct {
   uint8_t *idS;        /**< pointer to the id of the server in the opaque protocol */
 } Opaque_Ids;
 
+/**
+ * Length of a descriptor of the hardening parameters, see opaque_HardenParams().
+ */
+#define OPAQUE_HARDEN_PARAMS_LEN 8
+/**
+ * The memory-hard function of a descriptor: Argon2id version 1.3.
+ */
+#define OPAQUE_HARDEN_ARGON2ID 1
+/**
+ * The memory-hard function of a descriptor: scrypt (RFC 7914), see
+ * opaque_HardenParamsScrypt(). Not available if libsodium is a minimal
+ * build.
+ */
+#define OPAQUE_HARDEN_SCRYPT 2
+/**
+ * The first algorithm of a descriptor that can be registered with
+ * opaque_SetHardenMHF(), up to OPAQUE_HARDEN_IDENTITY-1.
+ */
+#define OPAQUE_HARDEN_CUSTOM 128
+/**
+ * No hardening at all: Harden(y) = y. This is only accepted by a
+ * libopaque built with OPAQUE_BENCHMARK defined (make bench), so that
+ * load generators can run many logins against a server without the
+ * memory and time of the hardening. A password registered with it can
+ * be brute forced at the speed of SHA-512, never use it in production.
+ * The descriptor is this byte followed by seven zero bytes.
+ */
+#define OPAQUE_HARDEN_IDENTITY 255
+
+/**
+   Creates a descriptor of the parameters for the memory-hard function
+   (Argon2id) that hardens the password in every registration and
+   login.
+
+   The client must use the same parameters for every login as at the
+   registration, otherwise it cannot open its envelope. The descriptor
+   is compact (OPAQUE_HARDEN_PARAMS_LEN bytes) and public: the server
+   should store it next to the user record, and send it to the client
+   together with the response of opaque_CreateCredentialResponse().
+
+   Functions taking a descriptor accept NULL for the default
+   parameters, crypto_pwhash_OPSLIMIT_INTERACTIVE and
+   crypto_pwhash_MEMLIMIT_INTERACTIVE, which are also used by the
+   functions that take no descriptor.
+
+   With more than one lane the memory is split into that many lanes
+   which are filled by one thread each, this cuts the wall time of the
+   hardening on a host with idle cores at the same memory cost. The
+   output only depends on the parameters, a client with fewer cores
+   gets the same result, just slower.
+
+   @param [in] opslimit - the number of passes over the memory, at
+   most 65535
+   @param [in] memlimit - the memory to use in bytes, rounded down to
+   whole KiB, at least 8KiB per lane
+   @param [in] lanes - the parallelism of Argon2id, 1 to 255
+   @param [out] harden - the descriptor
+   @return the function returns 0 if the parameters are supported
+ */
+int opaque_HardenParams(const uint32_t opslimit, const size_t memlimit, const uint8_t lanes,
+                        uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN]);
+
+/**
+   Creates a descriptor for scrypt instead of Argon2id, for clients
+   that already budget for scrypt. It uses 128*r*(N+p) bytes of memory.
+
+   @param [in] log2_n - the binary logarithm of the cost parameter N
+   @param [in] r - the block size parameter
+   @param [in] p - the parallelization parameter
+   @param [out] harden - the descriptor
+   @return the function returns 0 if the parameters are supported: the
+   limits of RFC 7914, and 128*r*N at least crypto_pwhash_MEMLIMIT_MIN
+ */
+int opaque_HardenParamsScrypt(const uint8_t log2_n, const uint16_t r, const uint32_t p,
+                              uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN]);
+
+/**
+   Reads the parameters from a descriptor created by opaque_HardenParams().
+
+   @param [in] harden - the descriptor
+   @param [out] opslimit - the number of passes over the memory
+   @param [out] memlimit - the memory used in bytes
+   @param [out] lanes - the parallelism
+   @return the function returns 0 if the descriptor is a valid one of
+   Argon2id
+ */
+int opaque_HardenParamsGet(const uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN],
+                           uint32_t *opslimit, size_t *memlimit, uint8_t *lanes);
+
+/**
+   A memory-hard function supplied by the application, for descriptors
+   whose first byte is its algorithm. The other seven bytes are its
+   parameters, their meaning is up to the function.
+ */
+typedef struct {
+  /** checks the parameters, sets the memory in bytes a hardening uses
+      (counted against opaque_SetHardenBudget()), returns 0 if they
+      are valid */
+  int (*check)(const uint8_t params[OPAQUE_HARDEN_PARAMS_LEN-1], size_t *memlimit);
+  /** sets out = Harden(y, params), returns 0 on success */
+  int (*hash)(const uint8_t params[OPAQUE_HARDEN_PARAMS_LEN-1],
+              const uint8_t y[crypto_hash_sha512_BYTES],
+              uint8_t out[crypto_hash_sha512_BYTES]);
+} Opaque_HardenMHF;
+
+/**
+   Registers a memory-hard function for the descriptors of an
+   algorithm, process wide. Both functions may be called from any
+   thread. The registration is not part of a descriptor: every client
+   and server that uses it must register the same function.
+
+   @param [in] alg - OPAQUE_HARDEN_CUSTOM to OPAQUE_HARDEN_IDENTITY-1
+   @param [in] mhf - the function, must stay valid while registered,
+   or NULL to remove the registration
+   @return the function returns 0 on success, -1 if alg is not in the
+   range or a function is missing
+ */
+int opaque_SetHardenMHF(const uint8_t alg, const Opaque_HardenMHF *mhf);
+
+/**
+   Measures the hardening on this host and creates a descriptor of the
+   strongest parameters that fit into a time and memory budget: the
+   most memory up to memlimit_max with which one pass fits into
+   target_ms, then as many passes over it as fit.
+
+   This runs the hardening several times, so it takes a multiple of
+   target_ms. The result depends on the load of the host, calibrate
+   on an idle host of the class the clients run on.
+
+   The runs always allocate fresh memory, they do not use a context
+   set by opaque_SetHardenCtx() and do not count against the budget of
+   opaque_SetHardenBudget(). A hardening in the memory of a context is
+   faster, the parameters leave that speedup as a margin.
+
+   @param [in] target_ms - the wall time of one hardening in milliseconds
+   @param [in] memlimit_max - the most memory to use in bytes
+   @param [in] lanes - the parallelism, at most the number of cores
+   of the slowest client
+   @param [out] harden - the descriptor
+   @return the function returns 0 on success, -1 if not even the
+   minimal parameters fit into the budget
+ */
+int opaque_CalibrateHarden(const uint32_t target_ms, const size_t memlimit_max, const uint8_t lanes,
+                           uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN]);
+
+/**
+   Memory for the hardening, reused by all hardenings of a thread.
+
+   Without a context every hardening allocates its memory, faults it
+   in page by page, and returns it to the system. A context allocates
+   and faults in the memory once,
+   optionally on huge pages, which also saves TLB misses. The memory
+   is wiped after every hardening, and is excluded from core dumps
+   where the system supports that.
+
+   A context is used by one hardening at a time: if it is in use, or
+   smaller than the memory of the parameters, the hardening allocates
+   its own memory as without a context. The result is the same either
+   way.
+
+   Only Argon2id with more than one lane and the step by step
+   hardening of opaque_RecoverCredentialsStart() use a context. With a
+   single lane, as with the default parameters, libsodium is as fast in
+   fresh memory as argon2.c is in the memory of a context.
+ */
+typedef struct Opaque_HardenCtx Opaque_HardenCtx;
+
+/**
+   Flag of opaque_CreateHardenCtx(): place the memory on huge pages,
+   reserved ones (MAP_HUGETLB) if the system has some, otherwise
+   transparent huge pages are requested. Ignored where not supported.
+ */
+#define OPAQUE_HARDEN_HUGEPAGES 1
+
+/**
+   Allocates and faults in the memory of a hardening context.
+
+   @param [in] memlimit - the memory in bytes, at least the memlimit of
+   the parameters it should be used for
+   @param [in] flags - 0 or OPAQUE_HARDEN_HUGEPAGES
+   @return the context, or NULL on failure
+ */
+Opaque_HardenCtx* opaque_CreateHardenCtx(const size_t memlimit, const int flags);
+
+/**
+   Sets the context used by all functions that harden a password
+   (registration, opaque_FinalizeRequest*() and
+   opaque_RecoverCredentials*()) in the calling thread.
+
+   @param [in] ctx - the context to use, or NULL to allocate the memory
+   of each hardening
+ */
+void opaque_SetHardenCtx(Opaque_HardenCtx *ctx);
+
+/**
+   Frees a context, if it is the context of the calling thread it is
+   unset. The caller must make sure that no other thread has it set
+   anymore.
+
+   @param [in] ctx - the context to destroy
+ */
+void opaque_DestroyHardenCtx(Opaque_HardenCtx *ctx);
+
+/**
+   Returned by the functions that harden a password if the budget set
+   with opaque_SetHardenBudget() is used up, the caller may try again
+   later.
+ */
+#define OPAQUE_BUSY -2
+
+/**
+   Limits the memory of all hardenings that run concurrently in this
+   process, so that a burst of registrations or logins fails with
+   OPAQUE_BUSY instead of pushing the host into swap. Every function
+   that hardens a password reserves the memlimit of its parameters for
+   as long as it runs. A hardening that does not fit waits until
+   enough memory is released, if fewer than queue others are waiting
+   already, for at most timeout_ms; otherwise, and when the wait times
+   out, it returns OPAQUE_BUSY. opaque_RecoverCredentialsStart() never
+   waits.
+
+   A hardening in the memory of a context (see opaque_SetHardenCtx())
+   allocates nothing and is not counted. A hardening whose memlimit
+   alone exceeds the budget fails with -1. By default there is no
+   budget.
+
+   @param [in] budget - the memory in bytes, 0 to remove the limit
+   @param [in] queue - how many hardenings may wait, 0 to fail at once
+   @param [in] timeout_ms - the longest wait in milliseconds, 0 to
+   wait as long as it takes
+   @return the function returns 0 on success, -1 if budget is smaller
+   than crypto_pwhash_MEMLIMIT_MIN
+ */
+int opaque_SetHardenBudget(const size_t budget, const unsigned queue, const uint32_t timeout_ms);
+
+/**
+   @return the memory in bytes reserved by the hardenings running now
+ */
+size_t opaque_HardenBudgetUsed(void);
+
+/**
+   Initializes libopaque: initializes libsodium, probes the features of
+   the cpu once and selects the fastest implementation of each hot
+   kernel for them, so that one portable build runs the vector code
+   wherever the cpu has it.
+
+   Calling this before any other function of libopaque is recommended,
+   ideally before starting threads. Without it libsodium is initialized
+   and the kernels are selected on first use, which works as well but
+   may do so in the middle of a time-critical operation. Calling it
+   more than once is harmless.
+
+   @return the function returns 0 on success, -1 if libsodium could
+        not be initialized
+ */
+int opaque_init(void);
+
 /**
    This function implements the storePwdFile function from the paper
    it is not specified by the RFC. This function runs on the server
@@ -104,7 +413,8 @@ typedef struct {
    @param [out] export_key - optional pointer to pre-allocated (and
         protected) memory for an extra_key that can be used to
         encrypt/authenticate additional data.
-   @return the function returns 0 if everything is correct
+   @return the function returns 0 if everything is correct,
+   OPAQUE_BUSY if the budget of opaque_SetHardenBudget() is used up
  */
 int opaque_Register(const uint8_t *pwdU, const uint16_t pwdU_len,
                     const uint8_t skS[crypto_scalarmult_SCALARBYTES],
@@ -112,6 +422,21 @@ int opaque_Register(const uint8_t *pwdU, const uint16_t pwdU_len,
                     uint8_t rec[OPAQUE_USER_RECORD_LEN],
                     uint8_t export_key[crypto_hash_sha512_BYTES]);
 
+/**
+   Same as opaque_Register(), but hardening the password with the
+   parameters of a descriptor instead of the defaults.
+
+   @param [in] harden - a descriptor created by opaque_HardenParams(),
+   or NULL for the defaults. The same descriptor must be used for the
+   logins of this user.
+ */
+int opaque_RegisterHarden(const uint8_t *pwdU, const uint16_t pwdU_len,
+                          const uint8_t skS[crypto_scalarmult_SCALARBYTES],
+                          const Opaque_Ids *ids,
+                          const uint8_t *harden,
+                          uint8_t rec[OPAQUE_USER_RECORD_LEN],
+                          uint8_t export_key[crypto_hash_sha512_BYTES]);
+
 /**
    This function initiates a new OPAQUE session, is the same as the
    function defined in the paper with the name usrSession.
@@ -165,6 +490,299 @@ int opaque_CreateCredentialResponse(const uint8_t pub[OPAQUE_USER_SESSION_PUBLIC
                                     uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
                                     uint8_t authU[crypto_auth_hmacsha512_BYTES]);
 
+/**
+   First half of opaque_CreateCredentialResponse(), does all the work
+   that does not depend on the user record.
+
+   It generates the random values and the ephemeral keyshare of the
+   server and validates the request of the user. It can be called
+   while the record of the user is still being fetched from storage,
+   the response is completed by
+   opaque_CreateCredentialResponseFinish() once the record is
+   available.
+
+   @param [in] pub - the pub output of the opaque_CreateCredentialRequest()
+   @param [out] pending - the state of the session for
+   opaque_CreateCredentialResponseFinish(), it contains the ephemeral
+   secret key of the server, it should be protected (e.g. with
+   sodium_mlock()) and sanitized after usage.
+   @return the function returns 0 if everything is correct, it fails
+   if pub contains invalid elements, in which case the record does not
+   need to be fetched at all.
+ */
+int opaque_CreateCredentialResponseBegin(const uint8_t pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                         uint8_t pending[OPAQUE_SERVER_PENDING_LEN]);
+
+/**
+   Second half of opaque_CreateCredentialResponse(), completes the
+   response to a request processed by
+   opaque_CreateCredentialResponseBegin() using the record of the
+   user.
+
+   @param [in] pending - the output of opaque_CreateCredentialResponseBegin()
+   @param [in] rec - the recorded created during "registration" and stored by the server
+   @param [in] ids - the id if the client and server
+   @param [in] ctx - a context of this instantiation of this protocol, e.g. "AppABCv12.34"
+   @param [in] ctx_len - a context of this instantiation of this protocol
+   @param [out] resp - servers response to be sent to the client where
+   it is used as input into opaque_RecoverCredentials()
+   @param [out] sk - the shared secret established between the user & server
+   @param [out] authU - the expected authentication token of the user
+   to be used in opaque_UserAuth(), optional can be set to NULL
+   @return the function returns 0 if everything is correct
+ */
+int opaque_CreateCredentialResponseFinish(const uint8_t pending[OPAQUE_SERVER_PENDING_LEN],
+                                          const uint8_t rec[OPAQUE_USER_RECORD_LEN],
+                                          const Opaque_Ids *ids,
+                                          const uint8_t *ctx, const uint16_t ctx_len,
+                                          uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                          uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                          uint8_t authU[crypto_auth_hmacsha512_BYTES]);
+
+/**
+   Pool of pre-generated server ephemerals.
+
+   Each tuple holds the values of a server session that do not depend
+   on the request: the masking nonce, the server nonce and the
+   ephemeral keypair (x_s, X_s = g^x_s). Filling the pool at quiet
+   moments takes this fixed-base work off the login path. The pool is
+   allocated with sodium_malloc(), it is locked into memory and
+   surrounded by guard pages. All functions operating on a pool are
+   thread-safe, each tuple is handed out only once and is wiped from
+   the pool when taken. A forked child process discards the tuples it
+   inherited from its parent.
+ */
+typedef struct Opaque_EphemeralPool Opaque_EphemeralPool;
+
+/**
+   Allocates an empty pool of pre-generated server ephemerals.
+
+   @param [in] capacity - the maximum number of tuples held by the pool
+   @return the pool, or NULL on failure
+ */
+Opaque_EphemeralPool* opaque_CreateEphemeralPool(const size_t capacity);
+
+/**
+   Adds new tuples to the pool, to be called from a background thread
+   or during idle time. The lock of the pool is not held while the
+   tuples are generated.
+
+   @param [in] pool - the pool to refill
+   @param [in] max - the maximum number of tuples to add, the pool is
+   never filled beyond its capacity
+   @return the number of tuples added, or -1 on error
+ */
+int opaque_RefillEphemeralPool(Opaque_EphemeralPool *pool, const size_t max);
+
+/**
+   @param [in] pool - the pool to query
+   @return the number of tuples currently in the pool
+ */
+size_t opaque_EphemeralPoolCount(Opaque_EphemeralPool *pool);
+
+/**
+   Sets the pool used by all opaque_CreateCredentialResponse*()
+   functions. Sessions take their tuples from the pool as long as it
+   has some, and generate them inline when it is empty.
+
+   @param [in] pool - the pool to use, or NULL to always generate the
+   tuples inline
+ */
+void opaque_SetEphemeralPool(Opaque_EphemeralPool *pool);
+
+/**
+   Wipes and frees a pool, if it is the pool set by
+   opaque_SetEphemeralPool() it is unset. The caller must make sure no
+   other thread is using the pool anymore.
+
+   @param [in] pool - the pool to destroy
+ */
+void opaque_DestroyEphemeralPool(Opaque_EphemeralPool *pool);
+
+/**
+   struct holding the per-server state that does not change between
+   logins when a global long-term server key is used.
+
+   Create it once with opaque_CreateServerContext() and pass it to
+   opaque_CreateCredentialResponseCtx() for every login. This saves
+   the recalculation of the servers public key and the hashing of the
+   context string for each session. The struct contains the servers
+   private key, it should be protected (e.g. with sodium_mlock()) and
+   destroyed with opaque_DestroyServerContext() when not needed
+   anymore. The members of this struct are internal and should not be
+   modified.
+ */
+typedef struct {
+  uint8_t skS[crypto_scalarmult_SCALARBYTES];  /**< the servers long-term private key */
+  uint8_t pkS[crypto_scalarmult_BYTES];        /**< the servers long-term public key */
+  uint16_t idS_len;                            /**< length of idS */
+  uint8_t *idS;                                /**< pointer to the id of the server, NULL for the default pkS */
+  crypto_hash_sha512_state preamble;           /**< transcript hash state after absorbing the context */
+} Opaque_ServerContext;
+
+/**
+   Creates a long-lived server context for a global server key.
+
+   @param [in] skS - the servers long-term private key, the same that
+   was used to create the user records with opaque_Register() or
+   opaque_CreateRegistrationResponse().
+   @param [in] idS - the id of the server, or NULL if the default (the
+   servers public key) is used. The memory pointed to must stay valid
+   for the lifetime of the context.
+   @param [in] idS_len - length of idS
+   @param [in] ctx - a context of this instantiation of this protocol, e.g. "AppABCv12.34"
+   @param [in] ctx_len - a context of this instantiation of this protocol
+   @param [out] sctx - the server context to initialize
+   @return the function returns 0 if everything is correct
+ */
+int opaque_CreateServerContext(const uint8_t skS[crypto_scalarmult_SCALARBYTES],
+                               const uint8_t *idS, const uint16_t idS_len,
+                               const uint8_t *ctx, const uint16_t ctx_len,
+                               Opaque_ServerContext *sctx);
+
+/**
+   Wipes a server context created by opaque_CreateServerContext().
+
+   @param [in] sctx - the server context to destroy
+ */
+void opaque_DestroyServerContext(Opaque_ServerContext *sctx);
+
+/**
+   Same as opaque_CreateCredentialResponse(), but using a server
+   context created by opaque_CreateServerContext() instead of
+   recalculating the servers public key and the context string hash
+   for each session.
+
+   @param [in] sctx - the server context
+   @param [in] pub - the pub output of the opaque_CreateCredentialRequest()
+   @param [in] rec - the recorded created during "registration" and
+   stored by the server, it must have been created with the same skS
+   as sctx, otherwise this function fails.
+   @param [in] idU - the id of the user, or NULL if the default (the
+   users public key) is used.
+   @param [in] idU_len - length of idU
+   @param [out] resp - servers response to be sent to the client where
+   it is used as input into opaque_RecoverCredentials()
+   @param [out] sk - the shared secret established between the user & server
+   @param [out] authU - the expected authentication token of the user
+   to be used in opaque_UserAuth(), optional can be set to NULL
+   @return the function returns 0 if everything is correct
+ */
+int opaque_CreateCredentialResponseCtx(const Opaque_ServerContext *sctx,
+                                       const uint8_t pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                       const uint8_t rec[OPAQUE_USER_RECORD_LEN],
+                                       const uint8_t *idU, const uint16_t idU_len,
+                                       uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                       uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                       uint8_t authU[crypto_auth_hmacsha512_BYTES]);
+
+/**
+   Batch version of opaque_CreateCredentialResponse() for servers
+   handling many concurrent logins.
+
+   Processes n independent requests sharing the same context. The
+   random values of the sessions are drawn together, the context hash
+   is calculated only once, and the servers public key only when the
+   server key changes between consecutive records. All array
+   parameters are contiguous buffers of n elements of the given size.
+
+   @param [in] n - the number of sessions in the batch
+   @param [in] pub - n outputs of opaque_CreateCredentialRequest()
+   @param [in] rec - n records belonging to the requests in pub
+   @param [in] ids - n ids of the clients and server
+   @param [in] ctx - a context of this instantiation of this protocol, e.g. "AppABCv12.34"
+   @param [in] ctx_len - a context of this instantiation of this protocol
+   @param [out] resp - n server responses to be sent to the clients
+   @param [out] sk - n shared secrets
+   @param [out] authU - n expected authentication tokens of the users,
+   optional can be set to NULL
+   @param [out] ret - n status codes, 0 if the session succeeded, -1
+   if it failed. The sk and authU of failed sessions are zeroed.
+   @return the function returns the number of failed sessions, n if
+   all of them failed, or -1 if the batch could not be processed (out
+   of memory), then every ret is -1 and all sk and authU are zeroed,
+   also of the sessions answered already.
+ */
+int opaque_CreateCredentialResponseBatch(const size_t n,
+                                         const uint8_t *pub/*[n*OPAQUE_USER_SESSION_PUBLIC_LEN]*/,
+                                         const uint8_t *rec/*[n*OPAQUE_USER_RECORD_LEN]*/,
+                                         const Opaque_Ids *ids/*[n]*/,
+                                         const uint8_t *ctx, const uint16_t ctx_len,
+                                         uint8_t *resp/*[n*OPAQUE_SERVER_SESSION_LEN]*/,
+                                         uint8_t *sk/*[n*OPAQUE_SHARED_SECRETBYTES]*/,
+                                         uint8_t *authU/*[n*crypto_auth_hmacsha512_BYTES]*/,
+                                         int *ret/*[n]*/);
+
+/**
+   struct holding an expanded user record for accounts that log in
+   frequently.
+
+   Everything in the record that does not change between logins is
+   calculated once by opaque_PrepareRecord(): the servers public key,
+   the hmac state keyed with the masking key of the record and the
+   transcript hash state after absorbing the context and the id of the
+   user. The struct contains the secrets of the record, it is locked
+   into memory by opaque_PrepareRecord() and must be destroyed with
+   opaque_DestroyPreparedRecord(). The members of this struct are
+   internal and should not be modified.
+ */
+typedef struct {
+  uint8_t rec[OPAQUE_USER_RECORD_LEN];          /**< the user record */
+  uint8_t pkS[crypto_scalarmult_BYTES];         /**< the servers long-term public key */
+  uint16_t idS_len;                             /**< length of idS */
+  uint8_t *idS;                                 /**< pointer to the id of the server, NULL for the default pkS */
+  crypto_auth_hmacsha512_state masking;         /**< hmac state keyed with the masking key of the record */
+  crypto_hash_sha512_state preamble;            /**< transcript hash state after absorbing the context and idU */
+} Opaque_PreparedRecord;
+
+/**
+   Expands a user record for repeated use with
+   opaque_CreateCredentialResponsePrepared().
+
+   @param [in] rec - the recorded created during "registration" and stored by the server
+   @param [in] ids - the id of the client and server. The memory
+   pointed to by ids->idS must stay valid for the lifetime of prec,
+   ids->idU is only needed during this call.
+   @param [in] ctx - a context of this instantiation of this protocol, e.g. "AppABCv12.34"
+   @param [in] ctx_len - a context of this instantiation of this protocol
+   @param [out] prec - the prepared record, locked into memory
+   @return the function returns 0 if everything is correct, it fails if
+   the record contains an invalid client public key or if prec cannot
+   be locked into memory.
+ */
+int opaque_PrepareRecord(const uint8_t rec[OPAQUE_USER_RECORD_LEN],
+                         const Opaque_Ids *ids,
+                         const uint8_t *ctx, const uint16_t ctx_len,
+                         Opaque_PreparedRecord *prec);
+
+/**
+   Wipes and unlocks a record prepared by opaque_PrepareRecord().
+
+   @param [in] prec - the prepared record to destroy
+ */
+void opaque_DestroyPreparedRecord(Opaque_PreparedRecord *prec);
+
+/**
+   Same as opaque_CreateCredentialResponse(), but using a record
+   expanded by opaque_PrepareRecord(), the ids and the context are the
+   ones given when preparing the record. The prepared record is not
+   modified, it can be used by several threads concurrently.
+
+   @param [in] prec - the prepared user record
+   @param [in] pub - the pub output of the opaque_CreateCredentialRequest()
+   @param [out] resp - servers response to be sent to the client where
+   it is used as input into opaque_RecoverCredentials()
+   @param [out] sk - the shared secret established between the user & server
+   @param [out] authU - the expected authentication token of the user
+   to be used in opaque_UserAuth(), optional can be set to NULL
+   @return the function returns 0 if everything is correct
+ */
+int opaque_CreateCredentialResponsePrepared(const Opaque_PreparedRecord *prec,
+                                            const uint8_t pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                            uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                            uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                            uint8_t authU[crypto_auth_hmacsha512_BYTES]);
+
 /**
    This is the same function as defined in the paper with the
    usrSessionEnd name. It is run by the user and receives as input the
@@ -188,7 +806,8 @@ int opaque_CreateCredentialResponse(const uint8_t pub[OPAQUE_USER_SESSION_PUBLIC
    set to NULL if not needed
    @param [out] export_key - key used to encrypt/authenticate extra
    material not stored directly in the envelope
-   @return the function returns 0 if the protocol is executed correctly
+   @return the function returns 0 if the protocol is executed correctly,
+   OPAQUE_BUSY if the budget of opaque_SetHardenBudget() is used up
 */
 int opaque_RecoverCredentials(const uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
                               const uint8_t *sec/*[OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len]*/,
@@ -198,6 +817,88 @@ int opaque_RecoverCredentials(const uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
                               uint8_t authU[crypto_auth_hmacsha512_BYTES],
                               uint8_t export_key[crypto_hash_sha512_BYTES]);
 
+/**
+   Same as opaque_RecoverCredentials(), but hardening the password
+   with the parameters of a descriptor instead of the defaults.
+
+   @param [in] harden - the descriptor the user was registered with,
+   or NULL for the defaults
+ */
+int opaque_RecoverCredentialsHarden(const uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                    const uint8_t *sec/*[OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len]*/,
+                                    const uint8_t *ctx, const uint16_t ctx_len,
+                                    const Opaque_Ids *ids,
+                                    const uint8_t *harden,
+                                    uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                    uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                                    uint8_t export_key[crypto_hash_sha512_BYTES]);
+
+/**
+   A login of opaque_RecoverCredentialsHarden() split into steps, for
+   hosts that run an event loop and cannot block for the whole
+   hardening (about 100ms with the default parameters).
+
+   opaque_RecoverCredentialsStart() does the cheap part before the
+   hardening, each opaque_RecoverCredentialsStep() fills a number of
+   the 1KiB memory blocks of Argon2id, and
+   opaque_RecoverCredentialsFinish() does the rest. The results are
+   the same as those of opaque_RecoverCredentialsHarden().
+
+   The state holds copies of the inputs and is locked into memory, the
+   hardening uses the context of opaque_SetHardenCtx() of the thread
+   that started it, from start to finish. The lanes are filled one
+   after the other on the calling thread. Only Argon2id runs in steps,
+   the other functions of opaque_SetHardenMHF() and scrypt harden the
+   password in opaque_RecoverCredentialsStart() at once.
+ */
+typedef struct Opaque_RecoverState Opaque_RecoverState;
+
+/**
+   Starts a login, the parameters are those of
+   opaque_RecoverCredentialsHarden(). The inputs are copied, the
+   caller may free them once this returns.
+
+   @return the state of the login, or NULL on error, with errno set to
+   EBUSY if the budget of opaque_SetHardenBudget() is used up
+ */
+Opaque_RecoverState* opaque_RecoverCredentialsStart(const uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                                    const uint8_t *sec/*[OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len]*/,
+                                                    const uint8_t *ctx, const uint16_t ctx_len,
+                                                    const Opaque_Ids *ids,
+                                                    const uint8_t *harden);
+
+/**
+   Continues the hardening of a login. The memory of the default
+   parameters is 65536 blocks, with opslimit passes over it, each block
+   takes about 0.5µs on a current desktop cpu.
+
+   @param [in] st - the state of the login
+   @param [in] blocks - the number of blocks to fill in this step
+   @return 1 if the hardening is done, 0 if it needs more steps
+ */
+int opaque_RecoverCredentialsStep(Opaque_RecoverState *st, const uint32_t blocks);
+
+/**
+   Finishes a login, including what the steps did not get to, and
+   wipes and frees the state, also on failure.
+
+   @param [in] st - the state of the login
+   @param [out] sk, authU, export_key - as of opaque_RecoverCredentials()
+   @return the function returns 0 if the protocol is executed correctly
+ */
+int opaque_RecoverCredentialsFinish(Opaque_RecoverState *st,
+                                    uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                    uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                                    uint8_t export_key[crypto_hash_sha512_BYTES]);
+
+/**
+   Wipes and frees the state of a login that is not finished, e.g.
+   because the connection was lost. NULL is ignored.
+
+   @param [in] st - the state of the login
+ */
+void opaque_RecoverCredentialsAbort(Opaque_RecoverState *st);
+
 /**
    Explicit User Authentication.
 
@@ -295,7 +996,8 @@ int opaque_CreateRegistrationResponse(const uint8_t request[crypto_core_ristrett
    material not stored directly in the envelope. Optional, if not
    needed set to NULL.
 
-   @return the function returns 0 if everything is correct.
+   @return the function returns 0 if everything is correct,
+   OPAQUE_BUSY if the budget of opaque_SetHardenBudget() is used up.
  */
 int opaque_FinalizeRequest(
 		const uint8_t *sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pwdU_len]*/,
@@ -305,6 +1007,21 @@ int opaque_FinalizeRequest(
                            uint8_t reg_rec[OPAQUE_REGISTRATION_RECORD_LEN],
                            uint8_t export_key[crypto_hash_sha512_BYTES]);
 
+/**
+   Same as opaque_FinalizeRequest(), but hardening the password with
+   the parameters of a descriptor instead of the defaults.
+
+   @param [in] harden - a descriptor created by opaque_HardenParams(),
+   or NULL for the defaults. The same descriptor must be used for the
+   logins of this user.
+ */
+int opaque_FinalizeRequestHarden(const uint8_t *sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pwdU_len]*/,
+                                 const uint8_t pub[OPAQUE_REGISTER_PUBLIC_LEN],
+                                 const Opaque_Ids *ids,
+                                 const uint8_t *harden,
+                                 uint8_t reg_rec[OPAQUE_REGISTRATION_RECORD_LEN],
+                                 uint8_t export_key[crypto_hash_sha512_BYTES]);
+
 /**
    Final Registration step - server adds own info to the record to be stored.
 
@@ -327,6 +1044,341 @@ int opaque_FinalizeRequest(
 void opaque_StoreUserRecord(const uint8_t sec[OPAQUE_REGISTER_SECRET_LEN],
                             const uint8_t recU[OPAQUE_REGISTRATION_RECORD_LEN],
                             uint8_t rec[OPAQUE_USER_RECORD_LEN]);
+
+/**
+   A registration that logs the user in, hardening the password only
+   once. Instead of registering and then logging in, which hardens the
+   password in opaque_FinalizeRequest() and again in
+   opaque_RecoverCredentials(), the client keeps the hardened password
+   of the registration for the login that follows:
+
+   1. client: opaque_CreateRegistrationRequest(), as usual
+   2. server: opaque_CreateRegistrationResponse(), as usual
+   3. client: opaque_FinalizeRequestLogin() returns the record and the
+      ke1 of a login, both are sent to the server in one message
+   4. server: opaque_StoreUserRecordLogin() stores the record and
+      responds to the login like opaque_CreateCredentialResponse()
+   5. client: opaque_RecoverCredentialsRegistered() recovers the
+      credentials without hardening, the user is logged in
+   6. server: opaque_UserAuth(), as usual
+
+   The login is an ordinary one of the new record, step 4 is the same
+   as opaque_StoreUserRecord() followed by
+   opaque_CreateCredentialResponse() and the server needs nothing
+   else. This saves one round trip and one hardening compared to
+   registering and logging in.
+
+   The parameters are those of opaque_FinalizeRequestHarden(), and:
+
+   @param [out] login_sec - the secret of the client until
+   opaque_RecoverCredentialsRegistered(), holds the password and the
+   hardened password, must be protected and wiped like sec,
+   OPAQUE_REGISTER_LOGIN_SEC_LEN+pwdU_len bytes
+   @param [out] login_pub - the ke1 of the login, as pub of
+   opaque_CreateCredentialRequest()
+   @return the function returns 0 if everything is correct,
+   OPAQUE_BUSY if the budget of opaque_SetHardenBudget() is used up
+ */
+int opaque_FinalizeRequestLogin(const uint8_t *sec/*[OPAQUE_REGISTER_USER_SEC_LEN+pwdU_len]*/,
+                                const uint8_t pub[OPAQUE_REGISTER_PUBLIC_LEN],
+                                const Opaque_Ids *ids,
+                                const uint8_t *harden,
+                                uint8_t reg_rec[OPAQUE_REGISTRATION_RECORD_LEN],
+                                uint8_t export_key[crypto_hash_sha512_BYTES],
+                                uint8_t *login_sec/*[OPAQUE_REGISTER_LOGIN_SEC_LEN+pwdU_len]*/,
+                                uint8_t login_pub[OPAQUE_USER_SESSION_PUBLIC_LEN]);
+
+/**
+   Step 4 of a registration that logs the user in, see
+   opaque_FinalizeRequestLogin(): opaque_StoreUserRecord() and
+   opaque_CreateCredentialResponse() of the ke1 sent with the record.
+
+   @param [in] sec - the sec output of opaque_CreateRegistrationResponse()
+   @param [in] recU - the reg_rec output of opaque_FinalizeRequestLogin()
+   @param [in] login_pub - the login_pub output of opaque_FinalizeRequestLogin()
+   @param [in] ids, ctx, ctx_len - as of opaque_CreateCredentialResponse()
+   @param [out] rec - the record to store, as of opaque_StoreUserRecord()
+   @param [out] resp, sk, authU - as of opaque_CreateCredentialResponse()
+   @return the function returns 0 if everything is correct
+ */
+int opaque_StoreUserRecordLogin(const uint8_t sec[OPAQUE_REGISTER_SECRET_LEN],
+                                const uint8_t recU[OPAQUE_REGISTRATION_RECORD_LEN],
+                                const uint8_t login_pub[OPAQUE_USER_SESSION_PUBLIC_LEN],
+                                const Opaque_Ids *ids,
+                                const uint8_t *ctx, const uint16_t ctx_len,
+                                uint8_t rec[OPAQUE_USER_RECORD_LEN],
+                                uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                uint8_t authU[crypto_auth_hmacsha512_BYTES]);
+
+/**
+   Step 5 of a registration that logs the user in, see
+   opaque_FinalizeRequestLogin(): opaque_RecoverCredentials() with the
+   hardened password of the registration. It fails if the server did
+   not respond with the key of the registration.
+
+   @param [in] resp - the resp output of opaque_StoreUserRecordLogin()
+   @param [in] login_sec - the login_sec output of opaque_FinalizeRequestLogin()
+   @param [in] ctx, ctx_len, ids - as of opaque_RecoverCredentials()
+   @param [out] sk, authU, export_key - as of opaque_RecoverCredentials(),
+   export_key is the same as that of the registration
+   @return the function returns 0 if the protocol is executed correctly
+ */
+int opaque_RecoverCredentialsRegistered(const uint8_t resp[OPAQUE_SERVER_SESSION_LEN],
+                                        const uint8_t *login_sec/*[OPAQUE_REGISTER_LOGIN_SEC_LEN+pwdU_len]*/,
+                                        const uint8_t *ctx, const uint16_t ctx_len,
+                                        const Opaque_Ids *ids,
+                                        uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                        uint8_t authU[crypto_auth_hmacsha512_BYTES],
+                                        uint8_t export_key[crypto_hash_sha512_BYTES]);
+
+/**
+   Session resumption. After a login the server can hand the client a
+   ticket, with which the client opens later sessions in one round trip
+   without the password: no hardening on the client, and no lookup of
+   the user record on the server. Both sides derive the resumption
+   secret from the session key of the login, the ticket carries it
+   sealed under a key only the server knows. A resumption runs a fresh
+   Diffie-Hellman exchange keyed by the resumption secret, so its
+   session key is forward secret, and authenticates both sides with
+   the same macs as a login:
+
+   1. client: opaque_CreateResumeRequest() with the ticket and its
+      resumption secret
+   2. server: opaque_CreateResumeResponse() opens the ticket and
+      responds, it gets the session key and the expected authU
+   3. client: opaque_RecoverResume() checks the server and gets the
+      session key and authU
+   4. server: opaque_UserAuth(), as usual
+
+   After step 4 the server can issue a new ticket from the new session
+   key, and the client derives the matching resumption secret from it.
+   A ticket can be used only once if the server keeps a replay cache,
+   see opaque_CreateTicketCache().
+
+   Tickets are valid until their lifetime runs out, they cannot be
+   revoked one by one: changing the ticket key invalidates all of them.
+ */
+
+/**
+   Derives the resumption secret from the session key of a login or of
+   a resumption, the client keeps it with the ticket.
+
+   @param [in] sk - the session key
+   @param [out] rms - the resumption secret
+   @return the function returns 0 if everything is correct
+ */
+int opaque_ResumptionSecret(const uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                            uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES]);
+
+/**
+   Issues a ticket for the session with the session key sk, only after
+   opaque_UserAuth() has accepted the client.
+
+   @param [in] key - the ticket key of the server, random and secret
+   @param [in] sk - the session key of the login or resumption
+   @param [in] info - data of the server sealed into the ticket, for
+   example the id of the user, returned by opaque_CreateResumeResponse(),
+   may be NULL for all zeroes
+   @param [in] lifetime - seconds until the ticket expires, 1 to
+   OPAQUE_TICKET_MAX_LIFETIME
+   @param [out] ticket - the ticket to send to the client
+   @return the function returns 0 if everything is correct
+ */
+int opaque_IssueTicket(const uint8_t key[OPAQUE_TICKET_KEYBYTES],
+                       const uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                       const uint8_t info[OPAQUE_TICKET_INFO_BYTES],
+                       const uint32_t lifetime,
+                       uint8_t ticket[OPAQUE_TICKET_LEN]);
+
+/**
+   Replay cache of the tickets a server has accepted. It remembers each
+   ticket until it expires, a ticket seen before is rejected. When the
+   cache is full of tickets that have not expired yet, all new tickets
+   are rejected and the clients fall back to a login. All functions
+   operating on a cache are thread-safe. A cache only protects the
+   servers that share it, servers sharing a ticket key should share one
+   cache or use a key each.
+ */
+typedef struct Opaque_TicketCache Opaque_TicketCache;
+
+/**
+   @param [in] capacity - the number of tickets the cache holds at
+   least, rounded up to a power of two
+   @return the cache, or NULL on failure
+ */
+Opaque_TicketCache* opaque_CreateTicketCache(const size_t capacity);
+
+/**
+   Frees a cache, NULL is ignored. The caller must make sure no other
+   thread is using the cache anymore.
+ */
+void opaque_DestroyTicketCache(Opaque_TicketCache *cache);
+
+/**
+   Step 1 of a resumption.
+
+   @param [in] ticket - the ticket from opaque_IssueTicket()
+   @param [in] rms - the resumption secret of the session of the ticket
+   @param [out] sec - the secret of the client until
+   opaque_RecoverResume(), must be protected and wiped after use
+   @param [out] req - the request to send to the server
+   @return the function returns 0 if everything is correct
+ */
+int opaque_CreateResumeRequest(const uint8_t ticket[OPAQUE_TICKET_LEN],
+                               const uint8_t rms[OPAQUE_RESUMPTION_SECRETBYTES],
+                               uint8_t sec[OPAQUE_RESUME_SECRET_LEN],
+                               uint8_t req[OPAQUE_RESUME_REQUEST_LEN]);
+
+/**
+   Step 2 of a resumption. It fails if the ticket was not sealed with
+   key, has expired, or is in the replay cache, then the client has to
+   log in. The request carries a mac keyed by the resumption secret, a
+   ticket is recorded in the replay cache only once the request has
+   been checked and answered, so a request that fails, or one made by
+   someone who only saw the ticket, does not use it up.
+
+   @param [in] key - the ticket key of the server
+   @param [in] cache - the replay cache, or NULL to accept tickets more
+   than once until they expire
+   @param [in] req - the request from opaque_CreateResumeRequest()
+   @param [in] ctx, ctx_len - the context, as of opaque_CreateCredentialResponse()
+   @param [out] info - the info of the ticket, may be NULL
+   @param [out] resp - the response to send to the client
+   @param [out] sk - the new session key
+   @param [out] authU - the authU the client must send, for opaque_UserAuth()
+   @return the function returns 0 if everything is correct
+ */
+int opaque_CreateResumeResponse(const uint8_t key[OPAQUE_TICKET_KEYBYTES],
+                                Opaque_TicketCache *cache,
+                                const uint8_t req[OPAQUE_RESUME_REQUEST_LEN],
+                                const uint8_t *ctx, const uint16_t ctx_len,
+                                uint8_t info[OPAQUE_TICKET_INFO_BYTES],
+                                uint8_t resp[OPAQUE_RESUME_RESPONSE_LEN],
+                                uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                                uint8_t authU[crypto_auth_hmacsha512_BYTES]);
+
+/**
+   Step 3 of a resumption.
+
+   @param [in] resp - the response from opaque_CreateResumeResponse()
+   @param [in] sec - the sec output of opaque_CreateResumeRequest()
+   @param [in] ctx, ctx_len - the context, as of opaque_RecoverCredentials()
+   @param [out] sk - the new session key
+   @param [out] authU - the authentication code to send to the server,
+   may be NULL
+   @return the function returns 0 if the server is authenticated
+ */
+int opaque_RecoverResume(const uint8_t resp[OPAQUE_RESUME_RESPONSE_LEN],
+                         const uint8_t sec[OPAQUE_RESUME_SECRET_LEN],
+                         const uint8_t *ctx, const uint16_t ctx_len,
+                         uint8_t sk[OPAQUE_SHARED_SECRETBYTES],
+                         uint8_t authU[crypto_auth_hmacsha512_BYTES]);
+
+/**
+   Server engine, a pool of worker threads answering credential
+   requests, for servers that would otherwise build their own
+   concurrency around opaque_CreateCredentialResponse(). The caller
+   submits jobs, each holding a ke1 and the record of its user, and
+   collects them with the ke2 to send back, the session key and the
+   expected authU. The workers answer the jobs in batches with
+   opaque_CreateCredentialResponseBatch(), each worker has its own
+   queue and takes over the jobs of the others when its own is empty.
+   opaque_UserAuth() is only a comparison and is done by the caller.
+
+   Completed jobs are handed to a callback on the worker thread, or
+   queued until the caller collects them: opaque_ServerEngineFd() is
+   readable while there are jobs to collect, so the engine fits into
+   an event loop based on poll(), epoll or kqueue. Without thread
+   support, on windows and emscripten, the jobs are answered at once
+   by opaque_ServerEngineSubmit() on the calling thread.
+
+   The engine uses the ephemeral pool of opaque_SetEphemeralPool() if
+   one is set, like all other opaque_CreateCredentialResponse*()
+   functions.
+ */
+typedef struct Opaque_ServerEngine Opaque_ServerEngine;
+
+/**
+   A job of the server engine, the memory belongs to the caller and
+   must stay valid and untouched from opaque_ServerEngineSubmit()
+   until the job is completed. The job holds the record and the
+   session key, the caller should wipe it after use.
+ */
+typedef struct Opaque_EngineJob {
+  uint8_t ke1[OPAQUE_USER_SESSION_PUBLIC_LEN];   /**< [in] the pub output of opaque_CreateCredentialRequest() */
+  uint8_t rec[OPAQUE_USER_RECORD_LEN];           /**< [in] the record of the user */
+  Opaque_Ids ids;                                /**< [in] the ids, as of opaque_CreateCredentialResponse(), the memory they point to must stay valid too */
+  uint8_t ke2[OPAQUE_SERVER_SESSION_LEN];        /**< [out] the response to send to the client */
+  uint8_t sk[OPAQUE_SHARED_SECRETBYTES];         /**< [out] the shared secret */
+  uint8_t authU[crypto_auth_hmacsha512_BYTES];   /**< [out] the expected authU, for opaque_UserAuth() */
+  int ret;                                       /**< [out] 0 if the session succeeded, -1 if it failed */
+  void *user;                                    /**< free for the caller, for example its connection */
+  struct Opaque_EngineJob *next;                 /**< used by the engine */
+} Opaque_EngineJob;
+
+/**
+   Starts a server engine.
+
+   @param [in] workers - the number of worker threads, 0 for one per
+   online cpu, at most 256
+   @param [in] queue - the number of jobs each worker can hold queued,
+   rounded up to a power of two
+   @param [in] ctx - the context of all sessions, as of
+   opaque_CreateCredentialResponse(), it is copied
+   @param [in] ctx_len - the length of ctx
+   @param [in] done - called on the worker thread with each completed
+   job, it must not block for long. NULL to queue the completed jobs
+   for opaque_ServerEngineCollect().
+   @param [in] arg - passed to done
+   @return the engine, or NULL on failure
+ */
+Opaque_ServerEngine* opaque_CreateServerEngine(const unsigned workers, const size_t queue,
+                                               const uint8_t *ctx, const uint16_t ctx_len,
+                                               void (*done)(Opaque_EngineJob *job, void *arg),
+                                               void *arg);
+
+/**
+   Submits a job, thread-safe.
+
+   @param [in] engine - the engine
+   @param [in] job - the job, its inputs filled in
+   @return 0 if the job is queued, OPAQUE_BUSY if the queues of all
+   workers are full
+ */
+int opaque_ServerEngineSubmit(Opaque_ServerEngine *engine, Opaque_EngineJob *job);
+
+/**
+   @param [in] engine - an engine without done callback
+   @return a file descriptor that is readable while there are completed
+   jobs to collect, or -1 if there is none. It belongs to the engine,
+   the caller only polls it.
+ */
+int opaque_ServerEngineFd(const Opaque_ServerEngine *engine);
+
+/**
+   Takes completed jobs off the queue of an engine without done
+   callback. Only one thread at a time may collect.
+
+   @param [in] engine - the engine
+   @param [out] jobs - the completed jobs, in the order they completed
+   @param [in] max - the size of jobs
+   @param [in] timeout_ms - how long to wait if there is no completed
+   job, 0 not to wait, -1 to wait until there is one
+   @return the number of jobs in jobs
+ */
+size_t opaque_ServerEngineCollect(Opaque_ServerEngine *engine, Opaque_EngineJob **jobs, const size_t max,
+                                  const int timeout_ms);
+
+/**
+   Stops an engine after its workers have completed all submitted jobs,
+   and frees it, NULL is ignored. No thread may submit anymore. Jobs
+   completed but not collected are left as they are, they belong to
+   the caller.
+
+   @param [in] engine - the engine to destroy
+ */
+void opaque_DestroyServerEngine(Opaque_ServerEngine *engine);
 #ifdef __cplusplus
 }
 #endif
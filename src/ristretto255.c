@@ -0,0 +1,1324 @@
+/*
+    @copyright 2018-21, opaque@ctrlc.hu
+    This file is part of libopaque.
+
+    libopaque is free software: you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public License
+    as published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    libopaque is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libopaque. If not, see <http://www.gnu.org/licenses/>.
+
+    This file implements batched scalar multiplication in the
+    ristretto255 group. libsodium only exposes ristretto255 on encoded
+    points, every call decodes its input (one inverse square root) and
+    encodes its output (another one). Here the results of a whole batch
+    are encoded with the batched double-and-encode method from
+    https://ristretto.group/formulas/encoding.html which needs only one
+    field inversion for the whole batch (Montgomery's trick).
+
+    The field and group arithmetic follows the ref10 code in libsodium
+    (radix 2^51, signed radix 16 constant-time scalar multiplication),
+    and the results are bit-identical to crypto_scalarmult_ristretto255().
+    On x86_64 cpus with avx2 (detected at runtime) the multiplications of
+    a batch run four at a time in the lanes of the vector registers.
+    Without 128 bit integers the batch falls back to libsodium.
+*/
+
+#include "ristretto255.h"
+#include "common.h"
+#include <sodium.h>
+#include <string.h>
+
+// number of points encoded with one shared inversion
+#define R255_BATCH 32
+
+#ifndef __SIZEOF_INT128__
+
+void r255_select(const uint32_t cpu) {
+  (void) cpu;
+}
+
+int r255_scalarmult_batch(const size_t n,
+                          uint8_t *const q[],
+                          const uint8_t *const k[],
+                          const uint8_t *const p[],
+                          int ret[]) {
+  size_t i;
+  int failed=0;
+  for(i=0;i<n;i++) {
+    ret[i]=crypto_scalarmult_ristretto255(q[i], k[i], p[i]);
+    if(ret[i]!=0) {
+      sodium_memzero(q[i], crypto_core_ristretto255_BYTES);
+      ret[i]=-1;
+      failed++;
+    }
+  }
+  return failed;
+}
+
+#else // __SIZEOF_INT128__
+
+typedef unsigned __int128 uint128_t;
+typedef uint64_t fe[5];
+
+typedef struct {
+  fe X, Y, Z, T;
+} ge_p3;
+
+typedef struct {
+  fe X, Y, Z;
+} ge_p2;
+
+typedef struct {
+  fe X, Y, Z, T;
+} ge_p1p1;
+
+typedef struct {
+  fe YplusX, YminusX, Z, T2d;
+} ge_cached;
+
+static const fe fe_d = {
+  0x34dca135978a3ULL, 0x1a8283b156ebdULL, 0x5e7a26001c029ULL, 0x739c663a03cbbULL, 0x52036cee2b6ffULL
+};
+static const fe fe_d2 = {
+  0x69b9426b2f159ULL, 0x35050762add7aULL, 0x3cf44c0038052ULL, 0x6738cc7407977ULL, 0x2406d9dc56dffULL
+};
+static const fe fe_sqrtm1 = {
+  0x61b274a0ea0b0ULL, 0xd5a5fc8f189dULL, 0x7ef5e9cbd0c60ULL, 0x78595a6804c9eULL, 0x2b8324804fc1dULL
+};
+// 1/sqrt(a-d)
+static const fe fe_invsqrtamd = {
+  0xfdaa805d40eaULL, 0x2eb482e57d339ULL, 0x7610274bc58ULL, 0x6510b613dc8ffULL, 0x786c8905cfaffULL
+};
+// (l+1)/2, the inverse of 2 modulo the group order
+static const uint8_t sc_inv2[32] = {
+  0xf7, 0xe9, 0x7a, 0x2e, 0x8d, 0x31, 0x09, 0x2c, 0x6b, 0xce, 0x7b, 0x51, 0xef, 0x7c, 0x6f, 0x0a,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08
+};
+
+static uint64_t load64_le(const uint8_t *s) {
+  uint64_t w=0;
+  int i;
+  for(i=7;i>=0;i--) w = (w << 8) | s[i];
+  return w;
+}
+
+static void store64_le(uint8_t *d, uint64_t w) {
+  int i;
+  for(i=0;i<8;i++) {
+    d[i] = (uint8_t) w;
+    w >>= 8;
+  }
+}
+
+static inline void fe_0(fe h) {
+  memset(h, 0, sizeof(fe));
+}
+
+static inline void fe_1(fe h) {
+  h[0]=1; h[1]=0; h[2]=0; h[3]=0; h[4]=0;
+}
+
+static inline void fe_copy(fe h, const fe f) {
+  memcpy(h, f, sizeof(fe));
+}
+
+static inline void fe_add(fe h, const fe f, const fe g) {
+  int i;
+  for(i=0;i<5;i++) h[i] = f[i] + g[i];
+}
+
+// h = f - g, g is carried first so that the result cannot underflow
+static inline void fe_sub(fe h, const fe f, const fe g) {
+  const uint64_t mask = 0x7ffffffffffffULL;
+  uint64_t h0, h1, h2, h3, h4;
+
+  h0 = g[0]; h1 = g[1]; h2 = g[2]; h3 = g[3]; h4 = g[4];
+
+  h1 += h0 >> 51; h0 &= mask;
+  h2 += h1 >> 51; h1 &= mask;
+  h3 += h2 >> 51; h2 &= mask;
+  h4 += h3 >> 51; h3 &= mask;
+  h0 += 19ULL * (h4 >> 51); h4 &= mask;
+
+  // f + 2p - g
+  h[0] = (f[0] + 0xfffffffffffdaULL) - h0;
+  h[1] = (f[1] + 0xffffffffffffeULL) - h1;
+  h[2] = (f[2] + 0xffffffffffffeULL) - h2;
+  h[3] = (f[3] + 0xffffffffffffeULL) - h3;
+  h[4] = (f[4] + 0xffffffffffffeULL) - h4;
+}
+
+static void fe_neg(fe h, const fe f) {
+  fe zero;
+  fe_0(zero);
+  fe_sub(h, zero, f);
+}
+
+static inline void fe_carry(fe h, uint128_t r0, uint128_t r1, uint128_t r2, uint128_t r3, uint128_t r4) {
+  const uint64_t mask = 0x7ffffffffffffULL;
+  uint64_t r00, r01, r02, r03, r04, carry;
+
+  r1 += r0 >> 51; r00 = ((uint64_t) r0) & mask;
+  r2 += r1 >> 51; r01 = ((uint64_t) r1) & mask;
+  r3 += r2 >> 51; r02 = ((uint64_t) r2) & mask;
+  r4 += r3 >> 51; r03 = ((uint64_t) r3) & mask;
+  carry = (uint64_t) (r4 >> 51); r04 = ((uint64_t) r4) & mask;
+  r00 += 19ULL * carry;
+  carry = r00 >> 51; r00 &= mask;
+  r01 += carry;
+  carry = r01 >> 51; r01 &= mask;
+  r02 += carry;
+
+  h[0] = r00; h[1] = r01; h[2] = r02; h[3] = r03; h[4] = r04;
+}
+
+static inline void fe_mul(fe h, const fe f, const fe g) {
+  const uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+  const uint64_t g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+  const uint64_t g1_19 = 19ULL * g1, g2_19 = 19ULL * g2, g3_19 = 19ULL * g3, g4_19 = 19ULL * g4;
+  uint128_t r0, r1, r2, r3, r4;
+
+  r0 = ((uint128_t) f0) * g0 + ((uint128_t) f1) * g4_19 + ((uint128_t) f2) * g3_19
+     + ((uint128_t) f3) * g2_19 + ((uint128_t) f4) * g1_19;
+  r1 = ((uint128_t) f0) * g1 + ((uint128_t) f1) * g0 + ((uint128_t) f2) * g4_19
+     + ((uint128_t) f3) * g3_19 + ((uint128_t) f4) * g2_19;
+  r2 = ((uint128_t) f0) * g2 + ((uint128_t) f1) * g1 + ((uint128_t) f2) * g0
+     + ((uint128_t) f3) * g4_19 + ((uint128_t) f4) * g3_19;
+  r3 = ((uint128_t) f0) * g3 + ((uint128_t) f1) * g2 + ((uint128_t) f2) * g1
+     + ((uint128_t) f3) * g0 + ((uint128_t) f4) * g4_19;
+  r4 = ((uint128_t) f0) * g4 + ((uint128_t) f1) * g3 + ((uint128_t) f2) * g2
+     + ((uint128_t) f3) * g1 + ((uint128_t) f4) * g0;
+
+  fe_carry(h, r0, r1, r2, r3, r4);
+}
+
+static inline void fe_sq(fe h, const fe f) {
+  const uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+  const uint64_t f0_2 = f0 << 1, f1_2 = f1 << 1;
+  const uint64_t f1_38 = 38ULL * f1, f2_38 = 38ULL * f2, f3_38 = 38ULL * f3;
+  const uint64_t f3_19 = 19ULL * f3, f4_19 = 19ULL * f4;
+  uint128_t r0, r1, r2, r3, r4;
+
+  r0 = ((uint128_t) f0) * f0 + ((uint128_t) f1_38) * f4 + ((uint128_t) f2_38) * f3;
+  r1 = ((uint128_t) f0_2) * f1 + ((uint128_t) f2_38) * f4 + ((uint128_t) f3_19) * f3;
+  r2 = ((uint128_t) f0_2) * f2 + ((uint128_t) f1) * f1 + ((uint128_t) f3_38) * f4;
+  r3 = ((uint128_t) f0_2) * f3 + ((uint128_t) f1_2) * f2 + ((uint128_t) f4_19) * f4;
+  r4 = ((uint128_t) f0_2) * f4 + ((uint128_t) f1_2) * f3 + ((uint128_t) f2) * f2;
+
+  fe_carry(h, r0, r1, r2, r3, r4);
+}
+
+static void fe_sqn(fe h, const fe f, int n) {
+  fe_sq(h, f);
+  while(--n > 0) fe_sq(h, h);
+}
+
+static inline void fe_cmov(fe f, const fe g, const unsigned int b) {
+  const uint64_t mask = (uint64_t) (-(int64_t) b);
+  int i;
+  for(i=0;i<5;i++) f[i] ^= (f[i] ^ g[i]) & mask;
+}
+
+static void fe_frombytes(fe h, const uint8_t s[32]) {
+  const uint64_t mask = 0x7ffffffffffffULL;
+
+  h[0] = (load64_le(s     )      ) & mask;
+  h[1] = (load64_le(s +  6) >>  3) & mask;
+  h[2] = (load64_le(s + 12) >>  6) & mask;
+  h[3] = (load64_le(s + 19) >>  1) & mask;
+  h[4] = (load64_le(s + 24) >> 12) & mask;
+}
+
+// fully reduces f modulo p
+static void fe_reduce(fe h, const fe f) {
+  const uint64_t mask = 0x7ffffffffffffULL;
+  uint128_t t[5];
+  int i, j;
+
+  for(i=0;i<5;i++) t[i] = f[i];
+
+  for(j=0;j<2;j++) {
+    for(i=0;i<4;i++) {
+      t[i+1] += t[i] >> 51;
+      t[i] &= mask;
+    }
+    t[0] += 19 * (t[4] >> 51);
+    t[4] &= mask;
+  }
+
+  // t is now between 0 and 2^255-1, properly carried.
+  // adding 19 and carrying tells if it is >= p
+  t[0] += 19ULL;
+  for(i=0;i<4;i++) {
+    t[i+1] += t[i] >> 51;
+    t[i] &= mask;
+  }
+  t[0] += 19ULL * (t[4] >> 51);
+  t[4] &= mask;
+
+  // now between 19 and 2^255-1, offset by 19, subtract it again
+  t[0] += 0x8000000000000ULL - 19ULL;
+  for(i=1;i<5;i++) t[i] += 0x8000000000000ULL - 1ULL;
+
+  for(i=0;i<4;i++) {
+    t[i+1] += t[i] >> 51;
+    t[i] &= mask;
+  }
+  t[4] &= mask;
+
+  for(i=0;i<5;i++) h[i] = (uint64_t) t[i];
+}
+
+static void fe_tobytes(uint8_t s[32], const fe h) {
+  fe t;
+
+  fe_reduce(t, h);
+  store64_le(s,      t[0]        | (t[1] << 51));
+  store64_le(s +  8, (t[1] >> 13) | (t[2] << 38));
+  store64_le(s + 16, (t[2] >> 26) | (t[3] << 25));
+  store64_le(s + 24, (t[3] >> 39) | (t[4] << 12));
+}
+
+static unsigned int fe_isnegative(const fe f) {
+  uint8_t s[32];
+  fe_tobytes(s, f);
+  return s[0] & 1;
+}
+
+static unsigned int fe_iszero(const fe f) {
+  uint8_t s[32];
+  unsigned int d = 0;
+  int i;
+  fe_tobytes(s, f);
+  for(i=0;i<32;i++) d |= s[i];
+  return 1 & ((d - 1) >> 8);
+}
+
+static void fe_cneg(fe h, const fe f, const unsigned int b) {
+  fe negf;
+  fe_neg(negf, f);
+  fe_copy(h, f);
+  fe_cmov(h, negf, b);
+}
+
+static void fe_abs(fe h, const fe f) {
+  fe_cneg(h, f, fe_isnegative(f));
+}
+
+// out = z^(p-2)
+static void fe_invert(fe out, const fe z) {
+  fe t0, t1, t2, t3;
+
+  fe_sq(t0, z);
+  fe_sqn(t1, t0, 2);
+  fe_mul(t1, z, t1);
+  fe_mul(t0, t0, t1);
+  fe_sq(t2, t0);
+  fe_mul(t1, t1, t2);
+  fe_sqn(t2, t1, 5);
+  fe_mul(t1, t2, t1);
+  fe_sqn(t2, t1, 10);
+  fe_mul(t2, t2, t1);
+  fe_sqn(t3, t2, 20);
+  fe_mul(t2, t3, t2);
+  fe_sqn(t2, t2, 10);
+  fe_mul(t1, t2, t1);
+  fe_sqn(t2, t1, 50);
+  fe_mul(t2, t2, t1);
+  fe_sqn(t3, t2, 100);
+  fe_mul(t2, t3, t2);
+  fe_sqn(t2, t2, 50);
+  fe_mul(t1, t2, t1);
+  fe_sqn(t1, t1, 5);
+  fe_mul(out, t1, t0);
+}
+
+// out = z^((p-5)/8)
+static void fe_pow22523(fe out, const fe z) {
+  fe t0, t1, t2;
+
+  fe_sq(t0, z);
+  fe_sqn(t1, t0, 2);
+  fe_mul(t1, z, t1);
+  fe_mul(t0, t0, t1);
+  fe_sq(t0, t0);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t1, t0, 5);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t1, t0, 10);
+  fe_mul(t1, t1, t0);
+  fe_sqn(t2, t1, 20);
+  fe_mul(t1, t2, t1);
+  fe_sqn(t1, t1, 10);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t1, t0, 50);
+  fe_mul(t1, t1, t0);
+  fe_sqn(t2, t1, 100);
+  fe_mul(t1, t2, t1);
+  fe_sqn(t1, t1, 50);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t0, t0, 2);
+  fe_mul(out, t0, z);
+}
+
+// x = sqrt(u/v) if it exists, sqrt(i*u/v) otherwise, returns 1 if u/v was square
+static unsigned int sqrt_ratio_m1(fe x, const fe u, const fe v) {
+  fe v3, vxx, m_root_check, p_root_check, f_root_check, x_sqrtm1;
+  unsigned int has_m_root, has_p_root, has_f_root;
+
+  fe_sq(v3, v);
+  fe_mul(v3, v3, v);              // v3 = v^3
+  fe_sq(x, v3);
+  fe_mul(x, x, u);
+  fe_mul(x, x, v);                // x = uv^7
+
+  fe_pow22523(x, x);              // x = (uv^7)^((q-5)/8)
+  fe_mul(x, x, v3);
+  fe_mul(x, x, u);                // x = uv^3(uv^7)^((q-5)/8)
+
+  fe_sq(vxx, x);
+  fe_mul(vxx, vxx, v);            // vx^2
+  fe_sub(m_root_check, vxx, u);   // vx^2-u
+  fe_add(p_root_check, vxx, u);   // vx^2+u
+  fe_mul(f_root_check, u, fe_sqrtm1);
+  fe_add(f_root_check, vxx, f_root_check); // vx^2+u*sqrt(-1)
+  has_m_root = fe_iszero(m_root_check);
+  has_p_root = fe_iszero(p_root_check);
+  has_f_root = fe_iszero(f_root_check);
+  fe_mul(x_sqrtm1, x, fe_sqrtm1);
+
+  fe_cmov(x, x_sqrtm1, has_p_root | has_f_root);
+  fe_abs(x, x);
+
+  return has_m_root | has_p_root;
+}
+
+static void ge_p3_0(ge_p3 *h) {
+  fe_0(h->X);
+  fe_1(h->Y);
+  fe_1(h->Z);
+  fe_0(h->T);
+}
+
+static void ge_cached_0(ge_cached *h) {
+  fe_1(h->YplusX);
+  fe_1(h->YminusX);
+  fe_1(h->Z);
+  fe_0(h->T2d);
+}
+
+static void ge_p3_to_cached(ge_cached *r, const ge_p3 *p) {
+  fe_add(r->YplusX, p->Y, p->X);
+  fe_sub(r->YminusX, p->Y, p->X);
+  fe_copy(r->Z, p->Z);
+  fe_mul(r->T2d, p->T, fe_d2);
+}
+
+static void ge_p1p1_to_p2(ge_p2 *r, const ge_p1p1 *p) {
+  fe_mul(r->X, p->X, p->T);
+  fe_mul(r->Y, p->Y, p->Z);
+  fe_mul(r->Z, p->Z, p->T);
+}
+
+static void ge_p1p1_to_p3(ge_p3 *r, const ge_p1p1 *p) {
+  fe_mul(r->X, p->X, p->T);
+  fe_mul(r->Y, p->Y, p->Z);
+  fe_mul(r->Z, p->Z, p->T);
+  fe_mul(r->T, p->X, p->Y);
+}
+
+// r = p + q
+static void ge_add(ge_p1p1 *r, const ge_p3 *p, const ge_cached *q) {
+  fe t0;
+
+  fe_add(r->X, p->Y, p->X);
+  fe_sub(r->Y, p->Y, p->X);
+  fe_mul(r->Z, r->X, q->YplusX);
+  fe_mul(r->Y, r->Y, q->YminusX);
+  fe_mul(r->T, q->T2d, p->T);
+  fe_mul(r->X, p->Z, q->Z);
+  fe_add(t0, r->X, r->X);
+  fe_sub(r->X, r->Z, r->Y);
+  fe_add(r->Y, r->Z, r->Y);
+  fe_add(r->Z, t0, r->T);
+  fe_sub(r->T, t0, r->T);
+}
+
+// r = 2 * p
+static void ge_p2_dbl(ge_p1p1 *r, const ge_p2 *p) {
+  fe t0;
+
+  fe_sq(r->X, p->X);
+  fe_sq(r->Z, p->Y);
+  fe_sq(r->T, p->Z);
+  fe_add(r->T, r->T, r->T);
+  fe_add(r->Y, p->X, p->Y);
+  fe_sq(t0, r->Y);
+  fe_add(r->Y, r->Z, r->X);
+  fe_sub(r->Z, r->Z, r->X);
+  fe_sub(r->X, t0, r->Y);
+  fe_sub(r->T, r->T, r->Z);
+}
+
+static void ge_p3_dbl(ge_p1p1 *r, const ge_p3 *p) {
+  ge_p2 q;
+  fe_copy(q.X, p->X);
+  fe_copy(q.Y, p->Y);
+  fe_copy(q.Z, p->Z);
+  ge_p2_dbl(r, &q);
+}
+
+static void ge_cmov_cached(ge_cached *t, const ge_cached *u, const unsigned int b) {
+  fe_cmov(t->YplusX, u->YplusX, b);
+  fe_cmov(t->YminusX, u->YminusX, b);
+  fe_cmov(t->Z, u->Z, b);
+  fe_cmov(t->T2d, u->T2d, b);
+}
+
+static unsigned int equal(const signed char b, const signed char c) {
+  const uint8_t x = (uint8_t) b ^ (uint8_t) c;
+  return (unsigned int) (((uint32_t) x - 1U) >> 31);
+}
+
+// t = b * P in constant time, where P is the table of 1P..8P and -8 <= b <= 8
+static void ge_cmov8_cached(ge_cached *t, const ge_cached table[8], const signed char b) {
+  ge_cached minust;
+  const unsigned int bnegative = (unsigned int) (((uint8_t) b) >> 7);
+  const signed char babs = (signed char) (b - (signed char) (((-(int) bnegative) & b) * 2));
+  int i;
+
+  ge_cached_0(t);
+  for(i=0;i<8;i++) ge_cmov_cached(t, &table[i], equal(babs, (signed char) (i+1)));
+  fe_copy(minust.YplusX, t->YminusX);
+  fe_copy(minust.YminusX, t->YplusX);
+  fe_copy(minust.Z, t->Z);
+  fe_neg(minust.T2d, t->T2d);
+  ge_cmov_cached(t, &minust, bnegative);
+}
+
+// splits a into 64 signed radix 16 digits, a[31] <= 127
+static void recode(signed char e[64], const uint8_t a[32]) {
+  signed char carry;
+  int i;
+
+  for(i=0;i<32;i++) {
+    e[2 * i + 0] = (signed char) ((a[i] >> 0) & 15);
+    e[2 * i + 1] = (signed char) ((a[i] >> 4) & 15);
+  }
+  // each e[i] is between 0 and 15, e[63] is between 0 and 7
+  carry = 0;
+  for(i=0;i<63;i++) {
+    e[i] = (signed char) (e[i] + carry);
+    carry = (signed char) ((e[i] + 8) >> 4);
+    e[i] = (signed char) (e[i] - carry * 16);
+  }
+  e[63] = (signed char) (e[63] + carry);
+  // each e[i] is between -8 and 8
+}
+
+// pi[i] = (i+1) * p, even multiples by doubling, odd ones by adding p
+static void ge_table(ge_cached pi[8], const ge_p3 *p) {
+  ge_p1p1 r;
+  ge_p3 u, pp[4];
+  int i;
+
+  pp[0] = *p;
+  ge_p3_to_cached(&pi[0], p);
+  for(i=1;i<8;i++) {
+    if(i & 1) ge_p3_dbl(&r, &pp[i/2]);
+    else ge_add(&r, p, &pi[i-1]);
+    ge_p1p1_to_p3(&u, &r);
+    if(i<4) pp[i] = u;
+    ge_p3_to_cached(&pi[i], &u);
+  }
+
+  sodium_memzero(&r, sizeof r);
+  sodium_memzero(&u, sizeof u);
+  sodium_memzero(pp, sizeof pp);
+}
+
+// h = a * p, with pi the table of p from ge_table(), a[31] <= 127
+static void ge_scalarmult(ge_p3 *h, const uint8_t a[32], const ge_cached pi[8]) {
+  signed char e[64];
+  ge_cached t;
+  ge_p1p1 r;
+  ge_p2 s;
+  int i;
+
+  recode(e, a);
+
+  ge_p3_0(h);
+  for(i=63;i!=0;i--) {
+    ge_cmov8_cached(&t, pi, e[i]);
+    ge_add(&r, h, &t);
+
+    ge_p1p1_to_p2(&s, &r);
+    ge_p2_dbl(&r, &s);
+    ge_p1p1_to_p2(&s, &r);
+    ge_p2_dbl(&r, &s);
+    ge_p1p1_to_p2(&s, &r);
+    ge_p2_dbl(&r, &s);
+    ge_p1p1_to_p2(&s, &r);
+    ge_p2_dbl(&r, &s);
+
+    ge_p1p1_to_p3(h, &r);
+  }
+  ge_cmov8_cached(&t, pi, e[i]);
+  ge_add(&r, h, &t);
+  ge_p1p1_to_p3(h, &r);
+
+  sodium_memzero(e, sizeof e);
+  sodium_memzero(&t, sizeof t);
+  sodium_memzero(&r, sizeof r);
+  sodium_memzero(&s, sizeof s);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define R255_HAVE_AVX2 1
+#include <immintrin.h>
+
+// the avx2 backend runs four independent scalar multiplications in the
+// four 64 bit lanes of the ymm registers. field elements use ten limbs
+// in radix 2^25.5 so that limb products fit _mm256_mul_epu32().
+#define AVX2 __attribute__((target("avx2")))
+
+typedef struct {
+  __m256i v[10];
+} fe4;
+
+typedef struct {
+  fe4 X, Y, Z, T;
+} ge4_p3;
+
+typedef struct {
+  fe4 X, Y, Z;
+} ge4_p2;
+
+typedef struct {
+  fe4 X, Y, Z, T;
+} ge4_p1p1;
+
+typedef struct {
+  fe4 YplusX, YminusX, Z, T2d;
+} ge4_cached;
+
+static AVX2 inline void fe4_add(fe4 *h, const fe4 *f, const fe4 *g) {
+  int i;
+  for(i=0;i<10;i++) h->v[i] = _mm256_add_epi64(f->v[i], g->v[i]);
+}
+
+// propagates the carries, the limbs end up at 26 and 25 bits (h[1] a
+// bit more), the input limbs can be close to 2^63
+static AVX2 inline void fe4_carry(fe4 *h, __m256i *t) {
+  const __m256i m26 = _mm256_set1_epi64x((1 << 26) - 1);
+  const __m256i m25 = _mm256_set1_epi64x((1 << 25) - 1);
+  __m256i c;
+
+#define CARRY(i, bits, m) \
+  c = _mm256_srli_epi64(t[i], bits); \
+  t[i+1] = _mm256_add_epi64(t[i+1], c); \
+  t[i] = _mm256_and_si256(t[i], m);
+
+  CARRY(0, 26, m26) CARRY(4, 26, m26)
+  CARRY(1, 25, m25) CARRY(5, 25, m25)
+  CARRY(2, 26, m26) CARRY(6, 26, m26)
+  CARRY(3, 25, m25) CARRY(7, 25, m25)
+  CARRY(4, 26, m26) CARRY(8, 26, m26)
+  // t[9] wraps around to t[0] multiplied by 19
+  c = _mm256_srli_epi64(t[9], 25);
+  t[9] = _mm256_and_si256(t[9], m25);
+  t[0] = _mm256_add_epi64(t[0], _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(c, 4), _mm256_slli_epi64(c, 1)), c));
+  CARRY(0, 26, m26)
+#undef CARRY
+
+  memcpy(h->v, t, sizeof h->v);
+}
+
+// h = f - g without carrying, only for carried f and g (outputs of
+// fe4_mul() and fe4_sq()), the result may only be used as input of a
+// multiplication
+static AVX2 inline void fe4_sub(fe4 *h, const fe4 *f, const fe4 *g) {
+  const __m256i p2_0 = _mm256_set1_epi64x(0x7ffffdaLL);   // 2*(2^26-19)
+  const __m256i p2_odd = _mm256_set1_epi64x(0x3fffffeLL); // 2*(2^25-1)
+  const __m256i p2_even = _mm256_set1_epi64x(0x7fffffeLL);// 2*(2^26-1)
+  int i;
+
+  for(i=0;i<10;i++) {
+    const __m256i p2 = (i==0) ? p2_0 : ((i & 1) ? p2_odd : p2_even);
+    h->v[i] = _mm256_sub_epi64(_mm256_add_epi64(f->v[i], p2), g->v[i]);
+  }
+}
+
+// h = f - g, g must not exceed 4p in any limb, the result is carried
+static AVX2 inline void fe4_subc(fe4 *h, const fe4 *f, const fe4 *g) {
+  const __m256i p4_0 = _mm256_set1_epi64x(0xfffffb4LL);   // 4*(2^26-19)
+  const __m256i p4_odd = _mm256_set1_epi64x(0x7fffffcLL); // 4*(2^25-1)
+  const __m256i p4_even = _mm256_set1_epi64x(0xffffffcLL);// 4*(2^26-1)
+  __m256i t[10];
+  int i;
+
+  for(i=0;i<10;i++) {
+    const __m256i p4 = (i==0) ? p4_0 : ((i & 1) ? p4_odd : p4_even);
+    t[i] = _mm256_sub_epi64(_mm256_add_epi64(f->v[i], p4), g->v[i]);
+  }
+  fe4_carry(h, t);
+}
+
+// ref10 style multiplication, the limbs that wrap around 2^255 are
+// premultiplied by 19 and the odd*odd limb products are doubled because
+// of the alternating 26/25 bit limb sizes. the inputs may be the sum of
+// two carried elements, 19 times a limb still fits in 32 bits then.
+static AVX2 void fe4_mul(fe4 *h, const fe4 *f, const fe4 *g) {
+  const __m256i nineteen = _mm256_set1_epi64x(19);
+  const __m256i f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3], f4 = f->v[4];
+  const __m256i f5 = f->v[5], f6 = f->v[6], f7 = f->v[7], f8 = f->v[8], f9 = f->v[9];
+  const __m256i g0 = g->v[0], g1 = g->v[1], g2 = g->v[2], g3 = g->v[3], g4 = g->v[4];
+  const __m256i g5 = g->v[5], g6 = g->v[6], g7 = g->v[7], g8 = g->v[8], g9 = g->v[9];
+  const __m256i f1_2 = _mm256_add_epi64(f1, f1), f3_2 = _mm256_add_epi64(f3, f3), f5_2 = _mm256_add_epi64(f5, f5);
+  const __m256i f7_2 = _mm256_add_epi64(f7, f7), f9_2 = _mm256_add_epi64(f9, f9);
+  const __m256i g1_19 = _mm256_mul_epu32(g1, nineteen), g2_19 = _mm256_mul_epu32(g2, nineteen), g3_19 = _mm256_mul_epu32(g3, nineteen);
+  const __m256i g4_19 = _mm256_mul_epu32(g4, nineteen), g5_19 = _mm256_mul_epu32(g5, nineteen), g6_19 = _mm256_mul_epu32(g6, nineteen);
+  const __m256i g7_19 = _mm256_mul_epu32(g7, nineteen), g8_19 = _mm256_mul_epu32(g8, nineteen), g9_19 = _mm256_mul_epu32(g9, nineteen);
+  __m256i t[10];
+
+  t[0] = _mm256_mul_epu32(f0, g0);
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f1_2, g9_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f2, g8_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f3_2, g7_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f4, g6_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f5_2, g5_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f6, g4_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f7_2, g3_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f8, g2_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f9_2, g1_19));
+  t[1] = _mm256_mul_epu32(f0, g1);
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f1, g0));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f2, g9_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f3, g8_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f4, g7_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f5, g6_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f6, g5_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f7, g4_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f8, g3_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f9, g2_19));
+  t[2] = _mm256_mul_epu32(f0, g2);
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f1_2, g1));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f2, g0));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f3_2, g9_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f4, g8_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f5_2, g7_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f6, g6_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f7_2, g5_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f8, g4_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f9_2, g3_19));
+  t[3] = _mm256_mul_epu32(f0, g3);
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f1, g2));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f2, g1));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f3, g0));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f4, g9_19));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f5, g8_19));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f6, g7_19));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f7, g6_19));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f8, g5_19));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f9, g4_19));
+  t[4] = _mm256_mul_epu32(f0, g4);
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f1_2, g3));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f2, g2));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f3_2, g1));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f4, g0));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f5_2, g9_19));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f6, g8_19));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f7_2, g7_19));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f8, g6_19));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f9_2, g5_19));
+  t[5] = _mm256_mul_epu32(f0, g5);
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f1, g4));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f2, g3));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f3, g2));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f4, g1));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f5, g0));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f6, g9_19));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f7, g8_19));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f8, g7_19));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f9, g6_19));
+  t[6] = _mm256_mul_epu32(f0, g6);
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f1_2, g5));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f2, g4));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f3_2, g3));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f4, g2));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f5_2, g1));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f6, g0));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f7_2, g9_19));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f8, g8_19));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f9_2, g7_19));
+  t[7] = _mm256_mul_epu32(f0, g7);
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f1, g6));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f2, g5));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f3, g4));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f4, g3));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f5, g2));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f6, g1));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f7, g0));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f8, g9_19));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f9, g8_19));
+  t[8] = _mm256_mul_epu32(f0, g8);
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f1_2, g7));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f2, g6));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f3_2, g5));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f4, g4));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f5_2, g3));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f6, g2));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f7_2, g1));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f8, g0));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f9_2, g9_19));
+  t[9] = _mm256_mul_epu32(f0, g9);
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f1, g8));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f2, g7));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f3, g6));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f4, g5));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f5, g4));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f6, g3));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f7, g2));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f8, g1));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f9, g0));
+
+  fe4_carry(h, t);
+}
+
+static AVX2 void fe4_sq(fe4 *h, const fe4 *f) {
+  const __m256i nineteen = _mm256_set1_epi64x(19);
+  const __m256i f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3], f4 = f->v[4];
+  const __m256i f5 = f->v[5], f6 = f->v[6], f7 = f->v[7], f8 = f->v[8], f9 = f->v[9];
+  const __m256i f0_2 = _mm256_add_epi64(f0, f0), f1_2 = _mm256_add_epi64(f1, f1), f2_2 = _mm256_add_epi64(f2, f2), f3_2 = _mm256_add_epi64(f3, f3), f4_2 = _mm256_add_epi64(f4, f4);
+  const __m256i f5_2 = _mm256_add_epi64(f5, f5), f6_2 = _mm256_add_epi64(f6, f6), f7_2 = _mm256_add_epi64(f7, f7), f8_2 = _mm256_add_epi64(f8, f8), f9_2 = _mm256_add_epi64(f9, f9);
+  const __m256i f1_4 = _mm256_add_epi64(f1_2, f1_2), f3_4 = _mm256_add_epi64(f3_2, f3_2), f5_4 = _mm256_add_epi64(f5_2, f5_2), f7_4 = _mm256_add_epi64(f7_2, f7_2);
+  const __m256i f5_19 = _mm256_mul_epu32(f5, nineteen), f6_19 = _mm256_mul_epu32(f6, nineteen), f7_19 = _mm256_mul_epu32(f7, nineteen), f8_19 = _mm256_mul_epu32(f8, nineteen), f9_19 = _mm256_mul_epu32(f9, nineteen);
+  __m256i t[10];
+
+  t[0] = _mm256_mul_epu32(f0, f0);
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f1_4, f9_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f2_2, f8_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f3_4, f7_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f4_2, f6_19));
+  t[0] = _mm256_add_epi64(t[0], _mm256_mul_epu32(f5_2, f5_19));
+  t[1] = _mm256_mul_epu32(f0_2, f1);
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f2_2, f9_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f3_2, f8_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f4_2, f7_19));
+  t[1] = _mm256_add_epi64(t[1], _mm256_mul_epu32(f5_2, f6_19));
+  t[2] = _mm256_mul_epu32(f0_2, f2);
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f1_2, f1));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f3_4, f9_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f4_2, f8_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f5_4, f7_19));
+  t[2] = _mm256_add_epi64(t[2], _mm256_mul_epu32(f6, f6_19));
+  t[3] = _mm256_mul_epu32(f0_2, f3);
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f1_2, f2));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f4_2, f9_19));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f5_2, f8_19));
+  t[3] = _mm256_add_epi64(t[3], _mm256_mul_epu32(f6_2, f7_19));
+  t[4] = _mm256_mul_epu32(f0_2, f4);
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f1_4, f3));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f2, f2));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f5_4, f9_19));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f6_2, f8_19));
+  t[4] = _mm256_add_epi64(t[4], _mm256_mul_epu32(f7_2, f7_19));
+  t[5] = _mm256_mul_epu32(f0_2, f5);
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f1_2, f4));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f2_2, f3));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f6_2, f9_19));
+  t[5] = _mm256_add_epi64(t[5], _mm256_mul_epu32(f7_2, f8_19));
+  t[6] = _mm256_mul_epu32(f0_2, f6);
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f1_4, f5));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f2_2, f4));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f3_2, f3));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f7_4, f9_19));
+  t[6] = _mm256_add_epi64(t[6], _mm256_mul_epu32(f8, f8_19));
+  t[7] = _mm256_mul_epu32(f0_2, f7);
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f1_2, f6));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f2_2, f5));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f3_2, f4));
+  t[7] = _mm256_add_epi64(t[7], _mm256_mul_epu32(f8_2, f9_19));
+  t[8] = _mm256_mul_epu32(f0_2, f8);
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f1_4, f7));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f2_2, f6));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f3_4, f5));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f4, f4));
+  t[8] = _mm256_add_epi64(t[8], _mm256_mul_epu32(f9_2, f9_19));
+  t[9] = _mm256_mul_epu32(f0_2, f9);
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f1_2, f8));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f2_2, f7));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f3_2, f6));
+  t[9] = _mm256_add_epi64(t[9], _mm256_mul_epu32(f4_2, f5));
+
+  fe4_carry(h, t);
+}
+
+// packs one field element per lane into h, fully reduced first
+static AVX2 void fe4_pack(fe4 *h, const fe f0, const fe f1, const fe f2, const fe f3) {
+  const uint64_t *f[4] = {f0, f1, f2, f3};
+  uint64_t t[10][4];
+  fe r;
+  int i, l;
+
+  for(l=0;l<4;l++) {
+    fe_reduce(r, f[l]);
+    for(i=0;i<5;i++) {
+      t[2*i][l] = r[i] & ((1 << 26) - 1);
+      t[2*i+1][l] = r[i] >> 26;
+    }
+  }
+  for(i=0;i<10;i++) h->v[i] = _mm256_loadu_si256((const __m256i*) t[i]);
+}
+
+static AVX2 void fe4_unpack(fe h[4], const fe4 *f) {
+  uint64_t t[10][4];
+  int i, l;
+
+  for(i=0;i<10;i++) _mm256_storeu_si256((__m256i*) t[i], f->v[i]);
+  for(l=0;l<4;l++) {
+    for(i=0;i<5;i++) h[l][i] = t[2*i][l] + (t[2*i+1][l] << 26);
+  }
+}
+
+static AVX2 void ge4_p3_to_cached(ge4_cached *r, const ge4_p3 *p, const fe4 *d2) {
+  fe4_add(&r->YplusX, &p->Y, &p->X);
+  fe4_sub(&r->YminusX, &p->Y, &p->X);
+  r->Z = p->Z;
+  fe4_mul(&r->T2d, &p->T, d2);
+}
+
+static AVX2 void ge4_p1p1_to_p2(ge4_p2 *r, const ge4_p1p1 *p) {
+  fe4_mul(&r->X, &p->X, &p->T);
+  fe4_mul(&r->Y, &p->Y, &p->Z);
+  fe4_mul(&r->Z, &p->Z, &p->T);
+}
+
+static AVX2 void ge4_p1p1_to_p3(ge4_p3 *r, const ge4_p1p1 *p) {
+  fe4_mul(&r->X, &p->X, &p->T);
+  fe4_mul(&r->Y, &p->Y, &p->Z);
+  fe4_mul(&r->Z, &p->Z, &p->T);
+  fe4_mul(&r->T, &p->X, &p->Y);
+}
+
+static AVX2 void ge4_add(ge4_p1p1 *r, const ge4_p3 *p, const ge4_cached *q) {
+  fe4 t0;
+
+  fe4_add(&r->X, &p->Y, &p->X);
+  fe4_sub(&r->Y, &p->Y, &p->X);
+  fe4_mul(&r->Z, &r->X, &q->YplusX);
+  fe4_mul(&r->Y, &r->Y, &q->YminusX);
+  fe4_mul(&r->T, &q->T2d, &p->T);
+  fe4_mul(&r->X, &p->Z, &q->Z);
+  fe4_add(&t0, &r->X, &r->X);
+  fe4_sub(&r->X, &r->Z, &r->Y);
+  fe4_add(&r->Y, &r->Z, &r->Y);
+  fe4_add(&r->Z, &t0, &r->T);
+  fe4_subc(&r->T, &t0, &r->T);
+}
+
+static AVX2 void ge4_p2_dbl(ge4_p1p1 *r, const ge4_p2 *p) {
+  fe4 t0;
+
+  fe4_sq(&r->X, &p->X);
+  fe4_sq(&r->Z, &p->Y);
+  fe4_sq(&r->T, &p->Z);
+  fe4_add(&r->T, &r->T, &r->T);
+  fe4_add(&r->Y, &p->X, &p->Y);
+  fe4_sq(&t0, &r->Y);
+  fe4_add(&r->Y, &r->Z, &r->X);
+  fe4_sub(&r->Z, &r->Z, &r->X);
+  fe4_subc(&r->X, &t0, &r->Y);
+  fe4_subc(&r->T, &r->T, &r->Z);
+}
+
+static AVX2 void ge4_p3_dbl(ge4_p1p1 *r, const ge4_p3 *p) {
+  ge4_p2 q;
+  q.X = p->X;
+  q.Y = p->Y;
+  q.Z = p->Z;
+  ge4_p2_dbl(r, &q);
+}
+
+// t = b * P lane-wise in constant time, b holds the digit of each lane
+static AVX2 void ge4_cmov8_cached(ge4_cached *t, const ge4_cached table[8], const __m256i b) {
+  const __m256i bnegative = _mm256_cmpgt_epi64(_mm256_setzero_si256(), b);
+  const __m256i babs = _mm256_sub_epi64(_mm256_xor_si256(b, bnegative), bnegative);
+  const __m256i *tv = (const __m256i *) table;
+  __m256i *out = (__m256i *) t, eq[8], x, y;
+  fe4 negT2d;
+  int i, v;
+
+  for(i=0;i<8;i++) eq[i] = _mm256_cmpeq_epi64(babs, _mm256_set1_epi64x(i+1));
+  // each of the 40 limbs of the cached point is the or of the masked
+  // table entries, all of them are zero if the digit is zero
+  for(v=0;v<40;v++) {
+    x = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(tv[v], eq[0]),
+                                        _mm256_and_si256(tv[40+v], eq[1])),
+                        _mm256_or_si256(_mm256_and_si256(tv[80+v], eq[2]),
+                                        _mm256_and_si256(tv[120+v], eq[3])));
+    y = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(tv[160+v], eq[4]),
+                                        _mm256_and_si256(tv[200+v], eq[5])),
+                        _mm256_or_si256(_mm256_and_si256(tv[240+v], eq[6]),
+                                        _mm256_and_si256(tv[280+v], eq[7])));
+    out[v] = _mm256_or_si256(x, y);
+  }
+  // a zero digit selects the identity (1, 1, 1, 0)
+  x = _mm256_and_si256(_mm256_cmpeq_epi64(babs, _mm256_setzero_si256()), _mm256_set1_epi64x(1));
+  t->YplusX.v[0] = _mm256_or_si256(t->YplusX.v[0], x);
+  t->YminusX.v[0] = _mm256_or_si256(t->YminusX.v[0], x);
+  t->Z.v[0] = _mm256_or_si256(t->Z.v[0], x);
+
+  // negative digits swap YplusX and YminusX and negate T2d
+  memset(&negT2d, 0, sizeof negT2d);
+  fe4_sub(&negT2d, &negT2d, &t->T2d);
+  for(v=0;v<10;v++) {
+    x = t->YplusX.v[v];
+    y = t->YminusX.v[v];
+    t->YplusX.v[v] = _mm256_blendv_epi8(x, y, bnegative);
+    t->YminusX.v[v] = _mm256_blendv_epi8(y, x, bnegative);
+    t->T2d.v[v] = _mm256_blendv_epi8(t->T2d.v[v], negT2d.v[v], bnegative);
+  }
+}
+
+// h[l] = a[l] * p[l] for the four lanes, same algorithm as ge_scalarmult()
+static AVX2 void ge_scalarmult4(ge_p3 h[4], const uint8_t a[4][32], const ge_p3 p[4]) {
+  signed char e[4][64];
+  ge4_cached pi[8], t;
+  ge4_p1p1 r;
+  ge4_p2 s;
+  ge4_p3 P, H, u, pp[4];
+  fe4 d2, one;
+  fe fone, c[4];
+  int i, l;
+
+  fe_1(fone);
+  fe4_pack(&one, fone, fone, fone, fone);
+  fe4_pack(&d2, fe_d2, fe_d2, fe_d2, fe_d2);
+  fe4_pack(&P.X, p[0].X, p[1].X, p[2].X, p[3].X);
+  fe4_pack(&P.Y, p[0].Y, p[1].Y, p[2].Y, p[3].Y);
+  fe4_pack(&P.Z, p[0].Z, p[1].Z, p[2].Z, p[3].Z);
+  fe4_pack(&P.T, p[0].T, p[1].T, p[2].T, p[3].T);
+  for(l=0;l<4;l++) recode(e[l], a[l]);
+
+  pp[0] = P;
+  ge4_p3_to_cached(&pi[0], &P, &d2);
+  for(i=1;i<8;i++) {
+    if(i & 1) ge4_p3_dbl(&r, &pp[i/2]);
+    else ge4_add(&r, &P, &pi[i-1]);
+    ge4_p1p1_to_p3(&u, &r);
+    if(i<4) pp[i] = u;
+    ge4_p3_to_cached(&pi[i], &u, &d2);
+  }
+
+  memset(&H.X, 0, sizeof H.X);
+  H.Y = one;
+  H.Z = one;
+  memset(&H.T, 0, sizeof H.T);
+  for(i=63;;i--) {
+    const __m256i b = _mm256_set_epi64x(e[3][i], e[2][i], e[1][i], e[0][i]);
+    ge4_cmov8_cached(&t, pi, b);
+    ge4_add(&r, &H, &t);
+    if(i==0) break;
+
+    ge4_p1p1_to_p2(&s, &r);
+    ge4_p2_dbl(&r, &s);
+    ge4_p1p1_to_p2(&s, &r);
+    ge4_p2_dbl(&r, &s);
+    ge4_p1p1_to_p2(&s, &r);
+    ge4_p2_dbl(&r, &s);
+    ge4_p1p1_to_p2(&s, &r);
+    ge4_p2_dbl(&r, &s);
+
+    ge4_p1p1_to_p3(&H, &r);
+  }
+  ge4_p1p1_to_p3(&H, &r);
+
+  fe4_unpack(c, &H.X);
+  for(l=0;l<4;l++) fe_copy(h[l].X, c[l]);
+  fe4_unpack(c, &H.Y);
+  for(l=0;l<4;l++) fe_copy(h[l].Y, c[l]);
+  fe4_unpack(c, &H.Z);
+  for(l=0;l<4;l++) fe_copy(h[l].Z, c[l]);
+  fe4_unpack(c, &H.T);
+  for(l=0;l<4;l++) fe_copy(h[l].T, c[l]);
+
+  sodium_memzero(e, sizeof e);
+  sodium_memzero(pi, sizeof pi);
+  sodium_memzero(&t, sizeof t);
+  sodium_memzero(&r, sizeof r);
+  sodium_memzero(&s, sizeof s);
+  sodium_memzero(&u, sizeof u);
+  sodium_memzero(pp, sizeof pp);
+  sodium_memzero(&H, sizeof H);
+  sodium_memzero(c, sizeof c);
+}
+#endif // avx2
+
+// the four lane kernel, NULL if the cpu has none
+typedef void (*scalarmult4_fn)(ge_p3 h[4], const uint8_t a[4][32], const ge_p3 p[4]);
+static scalarmult4_fn scalarmult4 = NULL;
+static int selected = 0;
+
+void r255_select(const uint32_t cpu) {
+  scalarmult4_fn fn = NULL;
+#ifdef R255_HAVE_AVX2
+  if(cpu & OPAQUE_CPU_AVX2) fn = ge_scalarmult4;
+#else
+  (void) cpu;
+#endif
+  __atomic_store_n(&scalarmult4, fn, __ATOMIC_RELAXED);
+  __atomic_store_n(&selected, 1, __ATOMIC_RELEASE);
+}
+
+// without opaque_init() the kernel is selected on first use
+static scalarmult4_fn get_scalarmult4(void) {
+  if(!__atomic_load_n(&selected, __ATOMIC_ACQUIRE)) r255_select(opaque_cpu_features());
+  return __atomic_load_n(&scalarmult4, __ATOMIC_RELAXED);
+}
+
+static int ristretto255_is_canonical(const uint8_t s[32]) {
+  unsigned int c, d, e;
+  int i;
+
+  c = (s[31] & 0x7f) ^ 0x7f;
+  for(i=30;i>0;i--) c |= s[i] ^ 0xff;
+  c = (c - 1U) >> 8;
+  d = (0xed - 1U - (unsigned int) s[0]) >> 8;
+  e = s[31] >> 7;
+
+  return 1 - (((c & d) | e | s[0]) & 1);
+}
+
+static int ristretto255_decode(ge_p3 *h, const uint8_t s[32]) {
+  fe inv_sqrt, one, s_, ss, u1, u2, u1u1, u2u2, v, v_u2u2;
+  unsigned int was_square;
+
+  if(ristretto255_is_canonical(s)==0) return -1;
+
+  fe_frombytes(s_, s);
+  fe_sq(ss, s_);                  // ss = s^2
+
+  fe_1(u1);
+  fe_sub(u1, u1, ss);             // u1 = 1-ss
+  fe_sq(u1u1, u1);                // u1u1 = u1^2
+
+  fe_1(u2);
+  fe_add(u2, u2, ss);             // u2 = 1+ss
+  fe_sq(u2u2, u2);                // u2u2 = u2^2
+
+  fe_mul(v, fe_d, u1u1);          // v = d*u1^2
+  fe_neg(v, v);                   // v = -d*u1^2
+  fe_sub(v, v, u2u2);             // v = -(d*u1^2)-u2^2
+
+  fe_mul(v_u2u2, v, u2u2);        // v_u2u2 = v*u2^2
+
+  fe_1(one);
+  was_square = sqrt_ratio_m1(inv_sqrt, one, v_u2u2);
+  fe_mul(h->X, inv_sqrt, u2);
+  fe_mul(h->Y, inv_sqrt, h->X);
+  fe_mul(h->Y, h->Y, v);
+
+  fe_mul(h->X, h->X, s_);
+  fe_add(h->X, h->X, h->X);
+  fe_abs(h->X, h->X);
+  fe_mul(h->Y, u1, h->Y);
+  fe_1(h->Z);
+  fe_mul(h->T, h->X, h->Y);
+
+  if(((1 - was_square) | fe_isnegative(h->T) | fe_iszero(h->Y)) != 0) return -1;
+  return 0;
+}
+
+// the per point state of the batched double-and-encode
+typedef struct {
+  fe e, f, g, h, eg, fh;
+} encode_state;
+
+// s[i] = encode(2 * p[i]) for n <= R255_BATCH points with one inversion
+static void ristretto255_double_encode_batch(uint8_t *const s[], const ge_p3 p[], const size_t n) {
+  encode_state st[R255_BATCH];
+  fe acc[R255_BATCH], inv, tmp, one;
+  unsigned int zero[R255_BATCH];
+  size_t i;
+
+  fe_1(one);
+  for(i=0;i<n;i++) {
+    fe xx, yy, zz, dtt;
+    fe_sq(xx, p[i].X);
+    fe_sq(yy, p[i].Y);
+    fe_sq(zz, p[i].Z);
+    fe_sq(dtt, p[i].T);
+    fe_mul(dtt, dtt, fe_d);
+
+    fe_add(tmp, p[i].Y, p[i].Y);
+    fe_mul(st[i].e, p[i].X, tmp);   // e = 2*X*Y
+    fe_add(st[i].f, zz, dtt);       // f = Z^2 + d*T^2
+    fe_add(st[i].g, yy, xx);        // g = Y^2 - a*X^2
+    fe_sub(st[i].h, zz, dtt);       // h = Z^2 - d*T^2
+
+    fe_mul(st[i].eg, st[i].e, st[i].g);
+    fe_mul(st[i].fh, st[i].f, st[i].h);
+
+    // efgh is only zero if 2*p[i] is the identity (p[i] is in the
+    // 4-torsion), replace it with one so it does not spoil the batch
+    fe_mul(tmp, st[i].eg, st[i].fh);
+    zero[i] = fe_iszero(tmp);
+    fe_cmov(tmp, one, zero[i]);
+
+    // acc[i] = prod(efgh[0..i])
+    if(i==0) fe_copy(acc[0], tmp);
+    else fe_mul(acc[i], acc[i-1], tmp);
+  }
+
+  // Montgomery's trick: invert the product, then peel off each factor
+  fe_invert(inv, acc[n-1]);
+  for(i=n;i-->0;) {
+    fe efgh, zinv, tinv, magic, minus_e, f_sqrta, e, g, h, sv;
+    unsigned int negcheck1, negcheck2;
+
+    fe_mul(efgh, st[i].eg, st[i].fh);
+    fe_cmov(efgh, one, zero[i]);
+    if(i>0) {
+      fe_mul(tmp, inv, acc[i-1]);   // tmp = 1/efgh[i]
+      fe_mul(inv, inv, efgh);       // inv = 1/prod(efgh[0..i-1])
+    } else {
+      fe_copy(tmp, inv);
+    }
+
+    fe_mul(zinv, st[i].eg, tmp);
+    fe_mul(tinv, st[i].fh, tmp);
+
+    fe_copy(magic, fe_invsqrtamd);
+
+    fe_mul(tmp, st[i].eg, zinv);
+    negcheck1 = fe_isnegative(tmp);
+
+    fe_copy(e, st[i].e);
+    fe_copy(g, st[i].g);
+    fe_copy(h, st[i].h);
+
+    fe_neg(minus_e, e);
+    fe_mul(f_sqrta, st[i].f, fe_sqrtm1);
+
+    fe_cmov(e, st[i].g, negcheck1);
+    fe_cmov(g, minus_e, negcheck1);
+    fe_cmov(h, f_sqrta, negcheck1);
+
+    fe_cmov(magic, fe_sqrtm1, negcheck1);
+
+    fe_mul(tmp, h, e);
+    fe_mul(tmp, tmp, zinv);
+    negcheck2 = fe_isnegative(tmp);
+
+    fe_cneg(g, g, negcheck2);
+
+    fe_sub(sv, h, g);
+    fe_mul(tmp, g, tinv);
+    fe_mul(tmp, magic, tmp);
+    fe_mul(sv, sv, tmp);
+
+    fe_abs(sv, sv);
+    // the identity encodes to all zeroes
+    fe_0(tmp);
+    fe_cmov(sv, tmp, zero[i]);
+    fe_tobytes(s[i], sv);
+  }
+
+  sodium_memzero(st, sizeof st);
+  sodium_memzero(acc, sizeof acc);
+  sodium_memzero(inv, sizeof inv);
+  sodium_memzero(tmp, sizeof tmp);
+}
+
+int r255_scalarmult_batch(const size_t n,
+                          uint8_t *const q[],
+                          const uint8_t *const k[],
+                          const uint8_t *const p[],
+                          int ret[]) {
+  ge_p3 P[R255_BATCH], R[R255_BATCH];
+  ge_cached pi[8];
+  uint8_t kk[64], h[R255_BATCH][32];
+  size_t i, j, m;
+  const uint8_t *base;
+  const scalarmult4_fn sm4 = get_scalarmult4();
+  int failed=0;
+
+  for(i=0;i<n;i+=m) {
+    m = (n-i > R255_BATCH) ? R255_BATCH : n-i;
+    for(j=0;j<m;j++) {
+      // consecutive multiplications of the same point decode it only once
+      if(j>0 && p[i+j]==p[i+j-1]) {
+        ret[i+j]=ret[i+j-1];
+        P[j]=P[j-1];
+      } else {
+        ret[i+j]=0;
+        if(0!=ristretto255_decode(&P[j], p[i+j])) {
+          ret[i+j]=-1;
+          ge_p3_0(&P[j]);
+        }
+      }
+      // the batch encoding doubles its input, so multiply by k/2 mod l
+      // instead of k, the top bit of k is ignored just like libsodium does
+      memcpy(kk, k[i+j], 32);
+      kk[31] &= 127;
+      memset(kk+32, 0, 32);
+      crypto_core_ristretto255_scalar_reduce(h[j], kk);
+      crypto_core_ristretto255_scalar_mul(h[j], h[j], sc_inv2);
+    }
+    j=0;
+    // four lanes at a time, a last group of three is still faster with
+    // one unused lane than one by one
+    if(sm4!=NULL) {
+      for(;j+3<=m;j+=4) {
+        if(j+4<=m) {
+          sm4(&R[j], (const uint8_t (*)[32]) &h[j], &P[j]);
+        } else {
+          ge_p3 P4[4], R4[4];
+          uint8_t h4[4][32] = {{0}};
+          size_t l;
+          for(l=0;l<4;l++) ge_p3_0(&P4[l]);
+          memcpy(P4, &P[j], (m-j)*sizeof(ge_p3));
+          memcpy(h4, &h[j], (m-j)*32);
+          sm4(R4, (const uint8_t (*)[32]) h4, P4);
+          memcpy(&R[j], R4, (m-j)*sizeof(ge_p3));
+          sodium_memzero(h4, sizeof h4);
+          sodium_memzero(R4, sizeof R4);
+        }
+      }
+    }
+    // on the scalar path they also share the table of the point
+    for(base=NULL;j<m;j++) {
+      if(p[i+j]!=base) {
+        ge_table(pi, &P[j]);
+        base=p[i+j];
+      }
+      ge_scalarmult(&R[j], h[j], pi);
+    }
+
+    ristretto255_double_encode_batch(q+i, R, m);
+    for(j=0;j<m;j++) {
+      if(ret[i+j]!=0 || sodium_is_zero(q[i+j], crypto_core_ristretto255_BYTES)) {
+        sodium_memzero(q[i+j], crypto_core_ristretto255_BYTES);
+        ret[i+j]=-1;
+        failed++;
+      }
+    }
+  }
+
+  sodium_memzero(kk, sizeof kk);
+  sodium_memzero(h, sizeof h);
+  sodium_memzero(R, sizeof R);
+  sodium_memzero(pi, sizeof pi);
+  return failed;
+}
+
+#endif // __SIZEOF_INT128__
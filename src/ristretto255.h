@@ -0,0 +1,67 @@
+/*
+    @copyright 2018-21, opaque@ctrlc.hu
+    This file is part of libopaque.
+
+    libopaque is free software: you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public License
+    as published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    libopaque is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libopaque. If not, see <http://www.gnu.org/licenses/>.
+
+    internal batch interface to the ristretto255 group, not part of the
+    public api of libopaque.
+*/
+
+#ifndef RISTRETTO255_H
+#define RISTRETTO255_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Computes n independent scalar multiplications q[i] = k[i] * p[i].
+ *
+ * Every element behaves exactly like crypto_scalarmult_ristretto255():
+ * the top bit of the scalar is ignored, and the multiplication fails
+ * if p[i] is not a valid encoding or if the result is the identity
+ * element. Encodings with the top bit set are non-canonical and always
+ * rejected, libsodium only does so since version 1.0.19.
+ *
+ * Each input point is validated and decoded only once, and the encoding
+ * of all results shares one field inversion (batched double-and-encode),
+ * so the cost per point of the codec shrinks as n grows. Consecutive
+ * elements with the same p[i] pointer share the decoded point, and where
+ * possible also its precomputed window table, so callers multiplying one
+ * base with several scalars should queue them next to each other.
+ *
+ * @param [in] n - the number of multiplications
+ * @param [out] q - n pointers to 32 byte results, zeroed on failure
+ * @param [in] k - n pointers to 32 byte scalars
+ * @param [in] p - n pointers to 32 byte encoded points
+ * @param [out] ret - n results, 0 on success, -1 on failure
+ * @return The function returns the number of failed multiplications.
+ */
+int r255_scalarmult_batch(const size_t n,
+                          uint8_t *const q[],
+                          const uint8_t *const k[],
+                          const uint8_t *const p[],
+                          int ret[]);
+
+/**
+ * Selects the kernels used by r255_scalarmult_batch() for the cpu
+ * features in cpu (the OPAQUE_CPU_* flags of common.h). opaque_init()
+ * calls this with the probed features, otherwise that happens on first
+ * use.
+ *
+ * @param [in] cpu - the features the kernels may use
+ */
+void r255_select(const uint32_t cpu);
+
+#endif // RISTRETTO255_H
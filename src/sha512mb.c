@@ -0,0 +1,369 @@
+/*
+    @copyright 2018-21, opaque@ctrlc.hu
+    This file is part of libopaque.
+
+    libopaque is free software: you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public License
+    as published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    libopaque is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libopaque. If not, see <http://www.gnu.org/licenses/>.
+
+    This file implements multi-buffer SHA-512: independent messages
+    of the same length are hashed in lockstep, on x86_64 cpus with
+    avx2 (detected at runtime) four of them in the 64 bit lanes of the
+    ymm registers. The functions work directly on the states of
+    libsodium (crypto_hash_sha512_state) and follow its padding and
+    bit counting, so states can be moved freely between these functions
+    and libsodium, and the results are bit-identical. Everything not
+    handled by the vector code falls back to libsodium.
+*/
+
+#include "sha512mb.h"
+#include "common.h"
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA512MB_HAVE_AVX2 1
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+static const uint64_t K[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi64((x), (n)), _mm256_slli_epi64((x), 64-(n)))
+#define S0(x) _mm256_xor_si256(_mm256_xor_si256(ROTR(x, 28), ROTR(x, 34)), ROTR(x, 39))
+#define S1(x) _mm256_xor_si256(_mm256_xor_si256(ROTR(x, 14), ROTR(x, 18)), ROTR(x, 41))
+#define s0(x) _mm256_xor_si256(_mm256_xor_si256(ROTR(x, 1), ROTR(x, 8)), _mm256_srli_epi64((x), 7))
+#define s1(x) _mm256_xor_si256(_mm256_xor_si256(ROTR(x, 19), ROTR(x, 61)), _mm256_srli_epi64((x), 6))
+#define Ch(x, y, z) _mm256_xor_si256(_mm256_and_si256((x), (y)), _mm256_andnot_si256((x), (z)))
+#define Maj(x, y, z) _mm256_or_si256(_mm256_and_si256((x), (y)), _mm256_and_si256((z), _mm256_or_si256((x), (y))))
+
+// compresses one block into each of the four states
+static AVX2 void compress4_avx2(crypto_hash_sha512_state *const st[4],
+                                const uint8_t *const blk[4]) {
+  // swaps the bytes of each 64 bit lane, the blocks are big-endian
+  const __m256i bswap = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                        0, 1, 2, 3, 4, 5, 6, 7,
+                                        8, 9, 10, 11, 12, 13, 14, 15,
+                                        0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i W[16], S[8], T1, T2;
+  uint64_t w[4];
+  int i, t;
+
+  for(i=0;i<8;i++) {
+    S[i] = _mm256_set_epi64x((long long) st[3]->state[i], (long long) st[2]->state[i],
+                             (long long) st[1]->state[i], (long long) st[0]->state[i]);
+  }
+  for(t=0;t<16;t++) {
+    memcpy(&w[0], blk[0]+8*t, 8);
+    memcpy(&w[1], blk[1]+8*t, 8);
+    memcpy(&w[2], blk[2]+8*t, 8);
+    memcpy(&w[3], blk[3]+8*t, 8);
+    W[t] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) w), bswap);
+  }
+
+  __m256i a=S[0], b=S[1], c=S[2], d=S[3], e=S[4], f=S[5], g=S[6], h=S[7];
+  for(t=0;t<80;t++) {
+    // the message schedule is kept in a ring of 16 words
+    if(t>=16) {
+      W[t&15] = _mm256_add_epi64(_mm256_add_epi64(s1(W[(t-2)&15]), W[(t-7)&15]),
+                                 _mm256_add_epi64(s0(W[(t-15)&15]), W[t&15]));
+    }
+    T1 = _mm256_add_epi64(_mm256_add_epi64(h, S1(e)),
+                          _mm256_add_epi64(Ch(e, f, g),
+                                           _mm256_add_epi64(_mm256_set1_epi64x((long long) K[t]), W[t&15])));
+    T2 = _mm256_add_epi64(S0(a), Maj(a, b, c));
+    h = g;
+    g = f;
+    f = e;
+    e = _mm256_add_epi64(d, T1);
+    d = c;
+    c = b;
+    b = a;
+    a = _mm256_add_epi64(T1, T2);
+  }
+  S[0] = _mm256_add_epi64(S[0], a);
+  S[1] = _mm256_add_epi64(S[1], b);
+  S[2] = _mm256_add_epi64(S[2], c);
+  S[3] = _mm256_add_epi64(S[3], d);
+  S[4] = _mm256_add_epi64(S[4], e);
+  S[5] = _mm256_add_epi64(S[5], f);
+  S[6] = _mm256_add_epi64(S[6], g);
+  S[7] = _mm256_add_epi64(S[7], h);
+
+  for(i=0;i<8;i++) {
+    _mm256_storeu_si256((__m256i*) w, S[i]);
+    st[0]->state[i] = w[0];
+    st[1]->state[i] = w[1];
+    st[2]->state[i] = w[2];
+    st[3]->state[i] = w[3];
+  }
+  // the message schedule and working variables carry the input
+  sodium_memzero(W, sizeof W);
+  sodium_memzero(w, sizeof w);
+  a=b=c=d=e=f=g=h=T1=T2=_mm256_setzero_si256();
+  sodium_memzero(S, sizeof S);
+}
+#endif // avx2
+
+// compresses one block into each of four states, NULL if the cpu has
+// no kernel for that
+typedef void (*compress4_fn)(crypto_hash_sha512_state *const st[4],
+                             const uint8_t *const blk[4]);
+static compress4_fn compress4 = NULL;
+static int selected = 0;
+
+void sha512mb_select(const uint32_t cpu) {
+  compress4_fn fn = NULL;
+#ifdef SHA512MB_HAVE_AVX2
+  if(cpu & OPAQUE_CPU_AVX2) fn = compress4_avx2;
+#else
+  (void) cpu;
+#endif
+  __atomic_store_n(&compress4, fn, __ATOMIC_RELAXED);
+  __atomic_store_n(&selected, 1, __ATOMIC_RELEASE);
+}
+
+// without opaque_init() the kernel is selected on first use
+static compress4_fn get_compress4(void) {
+  if(!__atomic_load_n(&selected, __ATOMIC_ACQUIRE)) sha512mb_select(opaque_cpu_features());
+  return __atomic_load_n(&compress4, __ATOMIC_RELAXED);
+}
+
+// the bit count of libsodium: count[0] is the upper, count[1] the
+// lower half of a 128 bit number
+static void add_count(crypto_hash_sha512_state *st, const size_t len) {
+  const uint64_t bitlen = ((uint64_t) len) << 3;
+  if((st->count[1] += bitlen) < bitlen) st->count[0]++;
+  st->count[0] += ((uint64_t) len) >> 61;
+}
+
+// updates four states which have all absorbed the same number of bytes
+static void update4(const compress4_fn compress,
+                    crypto_hash_sha512_state *const st[4],
+                    const uint8_t *const in[4],
+                    const size_t len) {
+  const size_t r = (size_t) ((st[0]->count[1] >> 3) & 0x7f);
+  const uint8_t *blk[4];
+  size_t off=0;
+  int i;
+
+  for(i=0;i<4;i++) add_count(st[i], len);
+  if(len < 128 - r) {
+    for(i=0;i<4;i++) memcpy(&st[i]->buf[r], in[i], len);
+    return;
+  }
+  // first complete the buffered block
+  if(r>0) {
+    for(i=0;i<4;i++) {
+      memcpy(&st[i]->buf[r], in[i], 128 - r);
+      blk[i] = st[i]->buf;
+    }
+    compress(st, blk);
+    off = 128 - r;
+  }
+  // then the full blocks of the inputs directly
+  for(;len-off>=128;off+=128) {
+    for(i=0;i<4;i++) blk[i] = in[i] + off;
+    compress(st, blk);
+  }
+  for(i=0;i<4;i++) memcpy(st[i]->buf, in[i] + off, len - off);
+}
+
+// the padding of libsodium (SHA512_Pad) for four states with the same
+// bit count, followed by the big-endian output of the states
+static void final4(const compress4_fn compress,
+                   crypto_hash_sha512_state *const st[4], uint8_t *const out[4]) {
+  const size_t r = (size_t) ((st[0]->count[1] >> 3) & 0x7f);
+  const uint8_t *blk[4];
+  int i, j;
+
+  for(i=0;i<4;i++) {
+    st[i]->buf[r] = 0x80;
+    memset(&st[i]->buf[r+1], 0, 127 - r);
+    blk[i] = st[i]->buf;
+  }
+  if(r >= 112) {
+    compress(st, blk);
+    for(i=0;i<4;i++) memset(st[i]->buf, 0, 112);
+  }
+  for(i=0;i<4;i++) {
+    for(j=0;j<8;j++) {
+      st[i]->buf[112+j] = (uint8_t) (st[i]->count[0] >> (56-8*j));
+      st[i]->buf[120+j] = (uint8_t) (st[i]->count[1] >> (56-8*j));
+    }
+  }
+  compress(st, blk);
+  for(i=0;i<4;i++) {
+    for(j=0;j<64;j++) out[i][j] = (uint8_t) (st[i]->state[j/8] >> (56-8*(j%8)));
+    sodium_memzero(st[i], sizeof *st[i]);
+  }
+}
+
+// all states must have absorbed the same number of bytes
+static int same_count(const size_t n, crypto_hash_sha512_state *const st[]) {
+  size_t i;
+  for(i=1;i<n;i++) {
+    if(st[i]->count[0]!=st[0]->count[0] || st[i]->count[1]!=st[0]->count[1]) return 0;
+  }
+  return 1;
+}
+
+// below three states one by one with libsodium is about as fast as a
+// group of four with unused lanes
+#define SHA512MB_MIN_LANES 3
+
+void sha512mb_update(const size_t n,
+                     crypto_hash_sha512_state *const st[],
+                     const uint8_t *const in[],
+                     const size_t len) {
+  size_t i=0;
+  const compress4_fn compress = (n>=SHA512MB_MIN_LANES) ? get_compress4() : NULL;
+  if(compress!=NULL && same_count(n, st)) {
+    for(;i+SHA512MB_MIN_LANES<=n;i+=4) {
+      if(i+4<=n) {
+        update4(compress, &st[i], &in[i], len);
+      } else {
+        // the unused lanes hash a copy of the first state
+        crypto_hash_sha512_state dummy[4];
+        crypto_hash_sha512_state *st4[4];
+        const uint8_t *in4[4];
+        size_t l;
+        for(l=0;l<4;l++) {
+          st4[l] = (i+l<n) ? st[i+l] : &dummy[l];
+          in4[l] = (i+l<n) ? in[i+l] : in[i];
+          if(i+l>=n) memcpy(&dummy[l], st[i], sizeof dummy[l]);
+        }
+        update4(compress, st4, in4, len);
+        sodium_memzero(dummy, sizeof dummy);
+      }
+    }
+  }
+  for(;i<n;i++) crypto_hash_sha512_update(st[i], in[i], len);
+}
+
+void sha512mb_final(const size_t n,
+                    crypto_hash_sha512_state *const st[],
+                    uint8_t *const out[]) {
+  size_t i=0;
+  const compress4_fn compress = (n>=SHA512MB_MIN_LANES) ? get_compress4() : NULL;
+  if(compress!=NULL && same_count(n, st)) {
+    for(;i+SHA512MB_MIN_LANES<=n;i+=4) {
+      if(i+4<=n) {
+        final4(compress, &st[i], &out[i]);
+      } else {
+        crypto_hash_sha512_state dummy[4];
+        uint8_t dout[4][crypto_hash_sha512_BYTES];
+        crypto_hash_sha512_state *st4[4];
+        uint8_t *out4[4];
+        size_t l;
+        for(l=0;l<4;l++) {
+          st4[l] = (i+l<n) ? st[i+l] : &dummy[l];
+          out4[l] = (i+l<n) ? out[i+l] : dout[l];
+          if(i+l>=n) memcpy(&dummy[l], st[i], sizeof dummy[l]);
+        }
+        final4(compress, st4, out4);
+        sodium_memzero(dout, sizeof dout);
+      }
+    }
+  }
+  for(;i<n;i++) crypto_hash_sha512_final(st[i], out[i]);
+}
+
+// libsodium hashes keys longer than a block first, then xors the
+// padded key into the first block of the inner and outer hash
+void hmacsha512mb_init(const size_t n,
+                       crypto_auth_hmacsha512_state *const st[],
+                       const uint8_t *const key[],
+                       const size_t keylen) {
+  if(keylen > 128) {
+    size_t i;
+    for(i=0;i<n;i++) crypto_auth_hmacsha512_init(st[i], key[i], keylen);
+    return;
+  }
+  // in chunks to keep the pointer arrays on the stack
+  crypto_hash_sha512_state *ctx[32];
+  uint8_t pad[32][128];
+  const uint8_t *padp[32];
+  size_t i, j, l, m;
+  for(i=0;i<n;i+=m) {
+    m = (n-i > 32) ? 32 : n-i;
+    for(j=0;j<m;j++) {
+      memset(pad[j], 0x36, 128);
+      for(l=0;l<keylen;l++) pad[j][l] ^= key[i+j][l];
+      padp[j] = pad[j];
+      ctx[j] = &st[i+j]->ictx;
+      crypto_hash_sha512_init(ctx[j]);
+    }
+    sha512mb_update(m, ctx, padp, 128);
+    for(j=0;j<m;j++) {
+      for(l=0;l<128;l++) pad[j][l] ^= 0x36 ^ 0x5c;
+      ctx[j] = &st[i+j]->octx;
+      crypto_hash_sha512_init(ctx[j]);
+    }
+    sha512mb_update(m, ctx, padp, 128);
+  }
+  sodium_memzero(pad, sizeof pad);
+}
+
+void hmacsha512mb_update(const size_t n,
+                         crypto_auth_hmacsha512_state *const st[],
+                         const uint8_t *const in[],
+                         const size_t len) {
+  crypto_hash_sha512_state *ctx[32];
+  size_t i, j, m;
+  for(i=0;i<n;i+=m) {
+    m = (n-i > 32) ? 32 : n-i;
+    for(j=0;j<m;j++) ctx[j] = &st[i+j]->ictx;
+    sha512mb_update(m, ctx, &in[i], len);
+  }
+}
+
+void hmacsha512mb_final(const size_t n,
+                        crypto_auth_hmacsha512_state *const st[],
+                        uint8_t *const out[]) {
+  crypto_hash_sha512_state *ctx[32];
+  uint8_t ihash[32][crypto_hash_sha512_BYTES];
+  uint8_t *ihashp[32];
+  size_t i, j, m;
+  for(i=0;i<n;i+=m) {
+    m = (n-i > 32) ? 32 : n-i;
+    for(j=0;j<m;j++) {
+      ctx[j] = &st[i+j]->ictx;
+      ihashp[j] = ihash[j];
+    }
+    sha512mb_final(m, ctx, ihashp);
+    for(j=0;j<m;j++) ctx[j] = &st[i+j]->octx;
+    sha512mb_update(m, ctx, (const uint8_t *const *) ihashp, crypto_hash_sha512_BYTES);
+    sha512mb_final(m, ctx, &out[i]);
+  }
+  sodium_memzero(ihash, sizeof ihash);
+}
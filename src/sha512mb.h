@@ -0,0 +1,106 @@
+/*
+    @copyright 2018-21, opaque@ctrlc.hu
+    This file is part of libopaque.
+
+    libopaque is free software: you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public License
+    as published by the Free Software Foundation, either version 3 of
+    the License, or (at your option) any later version.
+
+    libopaque is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libopaque. If not, see <http://www.gnu.org/licenses/>.
+
+    internal multi-buffer interface to SHA-512 and HMAC-SHA512, not
+    part of the public api of libopaque.
+*/
+
+#ifndef SHA512MB_H
+#define SHA512MB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sodium.h>
+
+/**
+ * Absorbs in[i] into st[i] for n independent states, the same as
+ * calling crypto_hash_sha512_update(st[i], in[i], len) for each i.
+ *
+ * All inputs have the same length. If all states have also absorbed
+ * the same number of bytes so far, their blocks are compressed in
+ * lockstep, four at a time in the lanes of the vector registers on
+ * x86_64 cpus with avx2, see sha512mb_select(). Otherwise, and on
+ * other cpus, every state is updated by libsodium on its own.
+ *
+ * @param [in] n - the number of states
+ * @param [in,out] st - n pointers to hash states
+ * @param [in] in - n pointers to len bytes of input
+ * @param [in] len - the length of every input
+ */
+void sha512mb_update(const size_t n,
+                     crypto_hash_sha512_state *const st[],
+                     const uint8_t *const in[],
+                     const size_t len);
+
+/**
+ * Finalizes n independent states, the same as calling
+ * crypto_hash_sha512_final(st[i], out[i]) for each i, including
+ * wiping the states.
+ *
+ * @param [in] n - the number of states
+ * @param [in,out] st - n pointers to hash states
+ * @param [out] out - n pointers to 64 byte digests
+ */
+void sha512mb_final(const size_t n,
+                    crypto_hash_sha512_state *const st[],
+                    uint8_t *const out[]);
+
+/**
+ * Keys n independent hmac states, the same as calling
+ * crypto_auth_hmacsha512_init(st[i], key[i], keylen) for each i.
+ *
+ * @param [in] n - the number of states
+ * @param [out] st - n pointers to hmac states
+ * @param [in] key - n pointers to keylen bytes of keys
+ * @param [in] keylen - the length of every key
+ */
+void hmacsha512mb_init(const size_t n,
+                       crypto_auth_hmacsha512_state *const st[],
+                       const uint8_t *const key[],
+                       const size_t keylen);
+
+/**
+ * The same as calling crypto_auth_hmacsha512_update(st[i], in[i], len)
+ * for each i, see sha512mb_update().
+ */
+void hmacsha512mb_update(const size_t n,
+                         crypto_auth_hmacsha512_state *const st[],
+                         const uint8_t *const in[],
+                         const size_t len);
+
+/**
+ * The same as calling crypto_auth_hmacsha512_final(st[i], out[i]) for
+ * each i, including wiping the states.
+ *
+ * @param [in] n - the number of states
+ * @param [in,out] st - n pointers to hmac states
+ * @param [out] out - n pointers to 64 byte macs
+ */
+void hmacsha512mb_final(const size_t n,
+                        crypto_auth_hmacsha512_state *const st[],
+                        uint8_t *const out[]);
+
+/**
+ * Selects the kernel of the lockstep hashing for the cpu features in
+ * cpu (the OPAQUE_CPU_* flags of common.h). opaque_init() calls this
+ * with the probed features, otherwise that happens on first use.
+ *
+ * @param [in] cpu - the features the kernel may use
+ */
+void sha512mb_select(const uint32_t cpu);
+
+#endif // SHA512MB_H
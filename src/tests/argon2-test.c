@@ -0,0 +1,175 @@
+/*
+    checks the multi-lane Argon2id of argon2.c against the test vector
+    of RFC 9106 and against libsodium, with every block function, and
+    compares their speed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sodium.h>
+#include "../argon2.h"
+#include "../common.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// RFC 9106, 5.3. Argon2id Test Vectors
+static int check_rfc9106(void) {
+  static const uint8_t expected[32] = {
+    0x0d, 0x64, 0x0d, 0xf5, 0x8d, 0x78, 0x76, 0x6c, 0x08, 0xc0, 0x37, 0xa3, 0x4a, 0x8b, 0x53, 0xc9,
+    0xd0, 0x1e, 0xf0, 0x45, 0x2d, 0x75, 0xb6, 0x5e, 0xb5, 0x25, 0x20, 0xe9, 0x6b, 0x01, 0xe6, 0x59
+  };
+  uint8_t pwd[32], salt[16], secret[8], ad[12], tag[32];
+  memset(pwd, 1, sizeof pwd);
+  memset(salt, 2, sizeof salt);
+  memset(secret, 3, sizeof secret);
+  memset(ad, 4, sizeof ad);
+  if(0!=argon2id(tag, sizeof tag, pwd, sizeof pwd, salt, sizeof salt,
+                 secret, sizeof secret, ad, sizeof ad, 3, 32, 4, NULL, 0)) return 1;
+  return memcmp(tag, expected, sizeof tag)!=0;
+}
+
+// with one lane the same as libsodium
+static int check_sodium(const uint32_t t, const uint32_t m, const size_t pwdlen, const uint32_t outlen) {
+  uint8_t pwd[128], salt[crypto_pwhash_SALTBYTES], out[256], ref[256];
+  randombytes_buf(pwd, pwdlen);
+  randombytes_buf(salt, sizeof salt);
+  if(0!=crypto_pwhash_argon2id(ref, outlen, (const char*) pwd, pwdlen, salt, t, (size_t) m * 1024,
+                               crypto_pwhash_argon2id_ALG_ARGON2ID13)) return 1;
+  if(0!=argon2id(out, outlen, pwd, pwdlen, salt, sizeof salt, NULL, 0, NULL, 0, t, m, 1, NULL, 0)) return 1;
+  return memcmp(out, ref, outlen)!=0;
+}
+
+// the same hardening in memory of the caller, which must be wiped after
+static int check_memory(void) {
+  const size_t len = 64 * 1024;
+  uint8_t pwd[64]={0}, salt[crypto_pwhash_SALTBYTES]={0}, out[64], ref[64];
+  uint8_t *memory = malloc(len);
+  if(memory==NULL) return 1;
+  int ret = argon2id(ref, sizeof ref, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0, 2, 64, 2, NULL, 0) ||
+            argon2id(out, sizeof out, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0, 2, 64, 2, memory, len) ||
+            memcmp(out, ref, sizeof out)!=0 || !sodium_is_zero(memory, len) ||
+            // too small
+            0==argon2id(out, sizeof out, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0, 2, 64, 2, memory, len - 1024);
+  free(memory);
+  return ret;
+}
+
+// step by step in chunks of any size gives the same tag
+static int check_steps(void) {
+  static const uint64_t steps[] = {1, 7, 128, 1000, UINT64_MAX};
+  static const uint32_t lanes[] = {1, 2, 3};
+  uint8_t pwd[64], salt[crypto_pwhash_SALTBYTES], out[64], ref[64];
+  size_t i, l;
+  randombytes_buf(pwd, sizeof pwd);
+  randombytes_buf(salt, sizeof salt);
+  for(l=0;l<sizeof lanes / sizeof lanes[0];l++) {
+    if(argon2id(ref, sizeof ref, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0, 2, 300, lanes[l], NULL, 0)) return 1;
+    for(i=0;i<sizeof steps / sizeof steps[0];i++) {
+      Argon2_State *st = argon2id_start(sizeof out, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0,
+                                        2, 300, lanes[l], NULL, 0);
+      if(st==NULL) return 1;
+      unsigned n = 0;
+      while(!argon2id_step(st, steps[i])) n++;
+      // the number of steps fits the blocks, 300KiB are 296 blocks with 2
+      // lanes of which 2 per lane come from H0, and 2 passes
+      const uint64_t blocks = 2 * (300 / (4 * lanes[l]) * 4 * lanes[l]) - 2 * lanes[l];
+      if(steps[i] < blocks && n != (blocks + steps[i] - 1) / steps[i] - 1) return 1;
+      if(argon2id_finish(st, out) || memcmp(out, ref, sizeof out)!=0) return 1;
+    }
+    // finish without any steps, and abort halfway
+    Argon2_State *st = argon2id_start(sizeof out, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0,
+                                      2, 300, lanes[l], NULL, 0);
+    if(st==NULL || argon2id_finish(st, out) || memcmp(out, ref, sizeof out)!=0) return 1;
+    st = argon2id_start(sizeof out, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0,
+                        2, 300, lanes[l], NULL, 0);
+    if(st==NULL || argon2id_step(st, 100)) return 1;
+    argon2id_abort(st);
+  }
+  return 0;
+}
+
+// lanes==0 is libsodium, memory!=NULL reuses that memory
+static double bench(const uint32_t lanes, void *memory) {
+  uint8_t pwd[64]={0}, salt[crypto_pwhash_SALTBYTES]={0}, out[64];
+  double t0 = now();
+  if(lanes==0) {
+    if(0!=crypto_pwhash_argon2id(out, sizeof out, (const char*) pwd, sizeof pwd, salt,
+                                 crypto_pwhash_OPSLIMIT_INTERACTIVE, crypto_pwhash_MEMLIMIT_INTERACTIVE,
+                                 crypto_pwhash_argon2id_ALG_ARGON2ID13)) return -1;
+  } else {
+    if(0!=argon2id(out, sizeof out, pwd, sizeof pwd, salt, sizeof salt, NULL, 0, NULL, 0,
+                   crypto_pwhash_OPSLIMIT_INTERACTIVE, crypto_pwhash_MEMLIMIT_INTERACTIVE / 1024, lanes,
+                   memory, crypto_pwhash_MEMLIMIT_INTERACTIVE)) return -1;
+  }
+  return (now() - t0) * 1e3;
+}
+
+int main(void) {
+  // with the block function for this cpu, and the portable one
+  const uint32_t cpus[2] = {opaque_cpu_features(), 0};
+  size_t c, i, j;
+
+  if(sodium_init() < 0) return 1;
+
+  for(c=0;c<2;c++) {
+    argon2_select(cpus[c]);
+    if(check_rfc9106()) {
+      fprintf(stderr, "rfc 9106 test vector failed with cpu features %x\n", cpus[c]);
+      return 1;
+    }
+
+    static const uint32_t ts[] = {1, 2, 3}, ms[] = {8, 9, 64, 257, 1024};
+    for(i=0;i<sizeof ts / sizeof ts[0];i++) {
+      for(j=0;j<sizeof ms / sizeof ms[0];j++) {
+        if(check_sodium(ts[i], ms[j], 64, 64) ||
+           check_sodium(ts[i], ms[j], j * 10, 16) ||
+           check_sodium(ts[i], ms[j], 5, 200)) {
+          fprintf(stderr, "differs from libsodium with t=%u m=%u cpu features %x\n", ts[i], ms[j], cpus[c]);
+          return 1;
+        }
+      }
+    }
+    if(check_steps()) {
+      fprintf(stderr, "step by step hardening differs\n");
+      return 1;
+    }
+    if(check_memory()) {
+      fprintf(stderr, "hardening in the memory of the caller failed\n");
+      return 1;
+    }
+    printf("interactive limits, cpu features %x: libsodium %.0fms, 1 lane %.0fms, 2 lanes %.0fms, 4 lanes %.0fms\n",
+           cpus[c], bench(0, NULL), bench(1, NULL), bench(2, NULL), bench(4, NULL));
+  }
+  argon2_select(cpus[0]);
+
+  // invalid parameters
+  uint8_t out[64];
+  if(0==argon2id(out, sizeof out, out, 1, out, 8, NULL, 0, NULL, 0, 0, 64, 1, NULL, 0) ||
+     0==argon2id(out, sizeof out, out, 1, out, 8, NULL, 0, NULL, 0, 1, 31, 4, NULL, 0) ||
+     0==argon2id(out, sizeof out, out, 1, out, 8, NULL, 0, NULL, 0, 1, 64, 0, NULL, 0) ||
+     0==argon2id(out, 8, out, 1, out, 8, NULL, 0, NULL, 0, 1, 64, 1, NULL, 0)) {
+    fprintf(stderr, "invalid parameters accepted\n");
+    return 1;
+  }
+
+  // fresh memory is faulted in and zeroed by the kernel on every call
+  void *memory;
+  if(0!=posix_memalign(&memory, 64, crypto_pwhash_MEMLIMIT_INTERACTIVE)) return 1;
+  memset(memory, 0, crypto_pwhash_MEMLIMIT_INTERACTIVE);
+  double fresh = 0, reused = 0;
+  for(i=0;i<3;i++) {
+    fresh += bench(1, NULL);
+    reused += bench(1, memory);
+  }
+  free(memory);
+  printf("interactive limits, 1 lane: fresh memory %.0fms, reused memory %.0fms\n", fresh / 3, reused / 3);
+
+  printf("all ok\n");
+  return 0;
+}
@@ -0,0 +1,221 @@
+/*
+    checks the server engine of engine.c: the responses of its workers
+    open on the client, jobs complete through the callback and through
+    the fd, full queues are reported, queued jobs are completed when
+    the engine is destroyed, and compares the throughput of different
+    numbers of workers.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sodium.h>
+#include "../opaque.h"
+
+#define JOBS 256
+#define BENCH_JOBS 2048
+
+static const uint8_t pwdU[] = "simple guessable dictionary password";
+static const uint8_t context[] = "engine-test";
+static const Opaque_Ids ids = {4, (uint8_t*) "user", 6, (uint8_t*) "server"};
+static uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN];
+static uint8_t rec[OPAQUE_USER_RECORD_LEN];
+
+// a job of the server with the session of the client it answers
+typedef struct {
+  Opaque_EngineJob job;
+  uint8_t sec[OPAQUE_USER_SESSION_SECRET_LEN+sizeof pwdU-1];
+  int seen;
+} Session;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void prepare(Session *s) {
+  opaque_CreateCredentialRequest(pwdU, sizeof pwdU-1, s->sec, s->job.ke1);
+  memcpy(s->job.rec, rec, sizeof rec);
+  s->job.ids = ids;
+  s->job.ret = 1;
+  s->job.user = s;
+  s->seen = 0;
+}
+
+// the client opens the response and both sides have the same keys
+static int check(const Session *s) {
+  uint8_t sk[OPAQUE_SHARED_SECRETBYTES], authU[crypto_auth_hmacsha512_BYTES], export_key[crypto_hash_sha512_BYTES];
+  if(s->job.ret!=0) return 1;
+  if(0!=opaque_RecoverCredentialsHarden(s->job.ke2, s->sec, context, sizeof context-1, &ids, harden,
+                                        sk, authU, export_key)) return 1;
+  return sodium_memcmp(sk, s->job.sk, sizeof sk)!=0 || opaque_UserAuth(s->job.authU, authU)!=0;
+}
+
+static atomic_int completed;
+static void count_done(Opaque_EngineJob *job, void *arg) {
+  (void) arg;
+  ((Session *) job->user)->seen++;
+  atomic_fetch_add(&completed, 1);
+}
+
+// completions through the callback, all submitted before the engine
+// is destroyed, one of them with an invalid ke1
+static int check_callback(Session *s, const unsigned workers) {
+  size_t i;
+  atomic_store(&completed, 0);
+  Opaque_ServerEngine *engine = opaque_CreateServerEngine(workers, JOBS, context, sizeof context-1, count_done, NULL);
+  if(engine==NULL || opaque_ServerEngineFd(engine)!=-1) return 1;
+  for(i=0;i<JOBS;i++) {
+    prepare(&s[i]);
+    if(i==JOBS/2) memset(s[i].job.ke1, 0xff, crypto_core_ristretto255_BYTES);
+    if(0!=opaque_ServerEngineSubmit(engine, &s[i].job)) return 1;
+  }
+  opaque_DestroyServerEngine(engine);
+  if(atomic_load(&completed)!=JOBS) return 1;
+  for(i=0;i<JOBS;i++) {
+    if(s[i].seen!=1) return 1;
+    if(i==JOBS/2) {
+      if(s[i].job.ret!=-1) return 1;
+    } else if(check(&s[i])) return 1;
+  }
+  return 0;
+}
+
+// completions collected by the caller after polling the fd
+static int check_collect(Session *s, const unsigned workers) {
+  Opaque_EngineJob *jobs[16];
+  size_t i, n, total = 0;
+  Opaque_ServerEngine *engine = opaque_CreateServerEngine(workers, JOBS, context, sizeof context-1, NULL, NULL);
+  if(engine==NULL) return 1;
+  for(i=0;i<JOBS;i++) {
+    prepare(&s[i]);
+    if(0!=opaque_ServerEngineSubmit(engine, &s[i].job)) return 1;
+  }
+  const int fd = opaque_ServerEngineFd(engine);
+  while(total<JOBS) {
+    if(fd!=-1 && total%2==0) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if(1!=poll(&pfd, 1, 10000)) return 1;
+      n = opaque_ServerEngineCollect(engine, jobs, sizeof jobs / sizeof jobs[0], 0);
+    } else {
+      n = opaque_ServerEngineCollect(engine, jobs, sizeof jobs / sizeof jobs[0], 10000);
+    }
+    if(n==0) return 1;
+    for(i=0;i<n;i++) ((Session *) jobs[i]->user)->seen++;
+    total+=n;
+  }
+  if(0!=opaque_ServerEngineCollect(engine, jobs, 1, 0)) return 1;
+  opaque_DestroyServerEngine(engine);
+  for(i=0;i<JOBS;i++) {
+    if(s[i].seen!=1 || check(&s[i])) return 1;
+  }
+  return 0;
+}
+
+// a worker held in the callback lets the queue fill up
+static atomic_int entered, gate;
+static void hold_done(Opaque_EngineJob *job, void *arg) {
+  (void) job;
+  (void) arg;
+  atomic_store(&entered, 1);
+  while(!atomic_load(&gate)) {
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+static int check_busy(Session *s) {
+  atomic_store(&entered, 0);
+  atomic_store(&gate, 0);
+  Opaque_ServerEngine *engine = opaque_CreateServerEngine(1, 1, context, sizeof context-1, hold_done, NULL);
+  if(engine==NULL) return 1;
+  prepare(&s[0]);
+  prepare(&s[1]);
+  prepare(&s[2]);
+  if(0!=opaque_ServerEngineSubmit(engine, &s[0].job)) return 1;
+  while(!atomic_load(&entered));
+  const int r1 = opaque_ServerEngineSubmit(engine, &s[1].job);
+  const int r2 = opaque_ServerEngineSubmit(engine, &s[2].job);
+  atomic_store(&gate, 1);
+  opaque_DestroyServerEngine(engine);
+  return r1!=0 || r2!=OPAQUE_BUSY || check(&s[0]) || check(&s[1]) || s[2].job.ret!=1;
+}
+
+static void nop_done(Opaque_EngineJob *job, void *arg) {
+  (void) job;
+  (void) arg;
+}
+
+// logins per second of an engine, or of opaque_CreateCredentialResponse()
+// in a loop
+static double bench(Session *s, const int engine, const unsigned workers) {
+  size_t i;
+  for(i=0;i<BENCH_JOBS;i++) prepare(&s[i]);
+  const double t0 = now();
+  if(!engine) {
+    for(i=0;i<BENCH_JOBS;i++) {
+      if(0!=opaque_CreateCredentialResponse(s[i].job.ke1, s[i].job.rec, &ids, context, sizeof context-1,
+                                            s[i].job.ke2, s[i].job.sk, s[i].job.authU)) return -1;
+    }
+  } else {
+    Opaque_ServerEngine *e = opaque_CreateServerEngine(workers, BENCH_JOBS, context, sizeof context-1, nop_done, NULL);
+    if(e==NULL) return -1;
+    for(i=0;i<BENCH_JOBS;i++) {
+      if(0!=opaque_ServerEngineSubmit(e, &s[i].job)) return -1;
+    }
+    opaque_DestroyServerEngine(e);
+  }
+  return BENCH_JOBS / (now() - t0);
+}
+
+int main(void) {
+  static const unsigned workers[] = {1, 2, 4, 0};
+  size_t i;
+
+  if(0!=opaque_init()) return 1;
+  // the cheapest hardening, the test is about the server
+  if(0!=opaque_HardenParams(1, crypto_pwhash_MEMLIMIT_MIN, 1, harden) ||
+     0!=opaque_RegisterHarden(pwdU, sizeof pwdU-1, NULL, &ids, harden, rec, NULL)) {
+    fprintf(stderr, "registration failed\n");
+    return 1;
+  }
+
+  Session *s = calloc(BENCH_JOBS, sizeof *s);
+  if(s==NULL) return 1;
+
+  for(i=0;i<sizeof workers / sizeof workers[0];i++) {
+    if(check_callback(s, workers[i])) {
+      fprintf(stderr, "engine with %u workers and callback failed\n", workers[i]);
+      return 1;
+    }
+    if(check_collect(s, workers[i])) {
+      fprintf(stderr, "engine with %u workers and completion queue failed\n", workers[i]);
+      return 1;
+    }
+  }
+  if(check_busy(s)) {
+    fprintf(stderr, "full engine did not report busy\n");
+    return 1;
+  }
+  if(opaque_CreateServerEngine(1, 0, context, sizeof context-1, NULL, NULL)!=NULL ||
+     opaque_CreateServerEngine(257, 1, context, sizeof context-1, NULL, NULL)!=NULL) {
+    fprintf(stderr, "invalid parameters accepted\n");
+    return 1;
+  }
+
+  printf("logins/s: sequential %.0f", bench(s, 0, 0));
+  for(i=0;i<sizeof workers / sizeof workers[0];i++) {
+    if(workers[i]==0) printf(", a worker per cpu %.0f", bench(s, 1, 0));
+    else printf(", %u workers %.0f", workers[i], bench(s, 1, workers[i]));
+  }
+  printf("\n");
+
+  sodium_memzero(s, BENCH_JOBS * sizeof *s);
+  free(s);
+  printf("all ok\n");
+  return 0;
+}
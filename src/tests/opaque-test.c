@@ -17,10 +17,42 @@
 */
 
 #include <stdio.h>
+#include <errno.h>
 #include <assert.h>
 #include "../opaque.h"
 #include "../common.h"
 
+// a stand-in for a memory-hard function of the application: one
+// SHA-512 over its first parameter byte and y, which must be 1
+static int test_mhf_calls = 0;
+static int test_mhf_check(const uint8_t params[OPAQUE_HARDEN_PARAMS_LEN-1], size_t *memlimit) {
+  *memlimit = 1024;
+  return (params[0]==1) ? 0 : -1;
+}
+static int test_mhf_hash(const uint8_t params[OPAQUE_HARDEN_PARAMS_LEN-1],
+                         const uint8_t y[crypto_hash_sha512_BYTES],
+                         uint8_t out[crypto_hash_sha512_BYTES]) {
+  crypto_hash_sha512_state state;
+  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_update(&state, params, 1);
+  crypto_hash_sha512_update(&state, y, crypto_hash_sha512_BYTES);
+  crypto_hash_sha512_final(&state, out);
+  test_mhf_calls++;
+  return 0;
+}
+static const Opaque_HardenMHF test_mhf = {test_mhf_check, test_mhf_hash};
+
+#ifdef __GLIBC__
+// lets calloc() of the library fail, the fallback of a full scratch
+// arena, to run out of memory on purpose
+extern void *__libc_calloc(size_t nmemb, size_t size);
+static int fail_calloc = 0;
+void *calloc(size_t nmemb, size_t size) {
+  if(fail_calloc) return NULL;
+  return __libc_calloc(nmemb, size);
+}
+#endif
+
 int main(void) {
   const uint8_t pwdU[]="asdf";
   const uint16_t pwdU_len=strlen((char*) pwdU);
@@ -37,6 +69,11 @@ int main(void) {
   uint8_t authU1[crypto_auth_hmacsha512_BYTES];
   const uint8_t context[4]="test";
 
+  if(0!=opaque_init()) {
+    fprintf(stderr, "opaque_init failed.\n");
+    return 1;
+  }
+
   fprintf(stderr, "\n\nprivate registration\n\n");
 
   // variant where user registration does not leak secrets to server
@@ -118,6 +155,660 @@ int main(void) {
     return 1;
   }
 
+  // two-phase response, the record is only needed in the second step
+  fprintf(stderr, "\nopaque_CreateCredentialRequest\n");
+  opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+  fprintf(stderr, "\nopaque_CreateCredentialResponseBegin\n");
+  uint8_t pending[OPAQUE_SERVER_PENDING_LEN];
+  if(0!=opaque_CreateCredentialResponseBegin(pub, pending)) {
+    fprintf(stderr, "opaque_CreateCredentialResponseBegin failed.\n");
+    return 1;
+  }
+  fprintf(stderr, "\nopaque_CreateCredentialResponseFinish\n");
+  if(0!=opaque_CreateCredentialResponseFinish(pending, rec0, &ids, context, sizeof context, resp, sk, authU0)) {
+    fprintf(stderr, "opaque_CreateCredentialResponseFinish failed.\n");
+    return 1;
+  }
+  sodium_memzero(pending, sizeof pending);
+  fprintf(stderr, "\nopaque_RecoverCredentials\n");
+  if(0!=opaque_RecoverCredentials(resp, sec, context, sizeof context, &ids, pk, authU1, export_key)) return 1;
+  assert(sodium_memcmp(sk,pk,sizeof sk)==0);
+  if(-1==opaque_UserAuth(authU0, authU1)) {
+    fprintf(stderr, "failed authenticating user\n");
+    return 1;
+  }
+  // invalid requests are rejected before the record is needed
+  uint8_t bad[OPAQUE_USER_SESSION_PUBLIC_LEN];
+  memcpy(bad, pub, sizeof bad);
+  memset(bad, 0xff, crypto_core_ristretto255_BYTES);
+  if(0==opaque_CreateCredentialResponseBegin(bad, pending)) {
+    fprintf(stderr, "opaque_CreateCredentialResponseBegin accepted invalid request.\n");
+    return 1;
+  }
+
+  // global server key with a server context
+  uint8_t skS[crypto_scalarmult_SCALARBYTES];
+  randombytes(skS, sizeof skS);
+  fprintf(stderr, "\nopaque_Register\n");
+  if(0!=opaque_Register(pwdU, pwdU_len, skS, &ids, rec0, export_key0)) {
+    fprintf(stderr, "opaque_Register failed.\n");
+    return 1;
+  }
+  fprintf(stderr, "\nopaque_CreateServerContext\n");
+  Opaque_ServerContext sctx;
+  if(0!=opaque_CreateServerContext(skS, ids.idS, ids.idS_len, context, sizeof context, &sctx)) {
+    fprintf(stderr, "opaque_CreateServerContext failed.\n");
+    return 1;
+  }
+  fprintf(stderr, "\nopaque_CreateCredentialRequest\n");
+  opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+  fprintf(stderr, "\nopaque_CreateCredentialResponseCtx\n");
+  if(0!=opaque_CreateCredentialResponseCtx(&sctx, pub, rec0, ids.idU, ids.idU_len, resp, sk, authU0)) {
+    fprintf(stderr, "opaque_CreateCredentialResponseCtx failed.\n");
+    return 1;
+  }
+  fprintf(stderr, "\nopaque_RecoverCredentials\n");
+  if(0!=opaque_RecoverCredentials(resp, sec, context, sizeof context, &ids, pk, authU1, export_key)) return 1;
+  assert(sodium_memcmp(sk,pk,sizeof sk)==0);
+  assert(memcmp(export_key, export_key0, sizeof export_key)==0);
+  if(-1==opaque_UserAuth(authU0, authU1)) {
+    fprintf(stderr, "failed authenticating user\n");
+    return 1;
+  }
+#ifndef NORANDOM
+  // records of other server keys must be rejected
+  if(0==opaque_CreateCredentialResponseCtx(&sctx, pub, rec, ids.idU, ids.idU_len, resp, sk, authU0)) {
+    fprintf(stderr, "opaque_CreateCredentialResponseCtx accepted foreign record.\n");
+    return 1;
+  }
+#endif
+  opaque_DestroyServerContext(&sctx);
+
+  // batch of sessions, the second one with a corrupted request, the
+  // others fill more than one group of lockstep hashing lanes
+  enum { BATCH = 12 };
+  fprintf(stderr, "\nopaque_CreateCredentialResponseBatch\n");
+  uint8_t bsec[BATCH][OPAQUE_USER_SESSION_SECRET_LEN+pwdU_len], bpub[BATCH][OPAQUE_USER_SESSION_PUBLIC_LEN];
+  uint8_t brec[BATCH][OPAQUE_USER_RECORD_LEN];
+  Opaque_Ids bids[BATCH];
+  uint8_t bresp[BATCH][OPAQUE_SERVER_SESSION_LEN];
+  uint8_t bsk[BATCH][OPAQUE_SHARED_SECRETBYTES];
+  uint8_t bauthU[BATCH][crypto_auth_hmacsha512_BYTES];
+  int bret[BATCH];
+  unsigned i;
+  for(i=0;i<BATCH;i++) {
+    bids[i]=ids;
+    opaque_CreateCredentialRequest(pwdU, pwdU_len, bsec[i], bpub[i]);
+    memcpy(brec[i], rec0, sizeof rec0);
+  }
+  memset(bpub[1], 0xff, crypto_core_ristretto255_BYTES);
+  if(1!=opaque_CreateCredentialResponseBatch(BATCH, (uint8_t*) bpub, (uint8_t*) brec, bids, context, sizeof context,
+                                             (uint8_t*) bresp, (uint8_t*) bsk, (uint8_t*) bauthU, bret)) {
+    fprintf(stderr, "opaque_CreateCredentialResponseBatch failed.\n");
+    return 1;
+  }
+  for(i=0;i<BATCH;i++) {
+    assert(bret[i]==((i==1)?-1:0));
+    if(i==1) continue;
+    if(0!=opaque_RecoverCredentials(bresp[i], bsec[i], context, sizeof context, &ids, pk, authU1, export_key)) return 1;
+    assert(sodium_memcmp(bsk[i],pk,sizeof pk)==0);
+    if(-1==opaque_UserAuth(bauthU[i], authU1)) {
+      fprintf(stderr, "failed authenticating user\n");
+      return 1;
+    }
+  }
+#ifdef __GLIBC__
+  // out of memory the batch fails every session and zeroes all secrets,
+  // the whole arena is taken, without NOARENA it is free and 64KiB
+  fail_calloc = 1;
+  void *hold = opaque_scratch_alloc(64*1024);
+  memset(bret, 0, sizeof bret);
+  memset(bsk, 0xaa, sizeof bsk);
+  memset(bauthU, 0xaa, sizeof bauthU);
+  const int bfail = opaque_CreateCredentialResponseBatch(BATCH, (uint8_t*) bpub, (uint8_t*) brec, bids, context, sizeof context,
+                                                         (uint8_t*) bresp, (uint8_t*) bsk, (uint8_t*) bauthU, bret);
+  if(hold!=NULL) opaque_scratch_free(hold, 64*1024);
+  fail_calloc = 0;
+  if(bfail!=-1 || !sodium_is_zero((uint8_t*) bsk, sizeof bsk) || !sodium_is_zero((uint8_t*) bauthU, sizeof bauthU)) {
+    fprintf(stderr, "opaque_CreateCredentialResponseBatch out of memory left secrets.\n");
+    return 1;
+  }
+  for(i=0;i<BATCH;i++) assert(bret[i]==-1);
+#endif
+
+  // prepared record, used for several logins, with the given and
+  // with the default ids
+  const Opaque_Ids nids={0};
+  const Opaque_Ids *pids[2]={&ids, &nids};
+  unsigned j;
+  for(j=0;j<2;j++) {
+    // the ids are also bound by the envelope
+    if(j>0 && 0!=opaque_Register(pwdU, pwdU_len, skS, pids[j], rec0, export_key0)) {
+      fprintf(stderr, "opaque_Register failed.\n");
+      return 1;
+    }
+    fprintf(stderr, "\nopaque_PrepareRecord\n");
+    Opaque_PreparedRecord prec;
+    if(0!=opaque_PrepareRecord(rec0, pids[j], context, sizeof context, &prec)) {
+      fprintf(stderr, "opaque_PrepareRecord failed.\n");
+      return 1;
+    }
+    for(i=0;i<2;i++) {
+      fprintf(stderr, "\nopaque_CreateCredentialResponsePrepared\n");
+      opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+      if(0!=opaque_CreateCredentialResponsePrepared(&prec, pub, resp, sk, authU0)) {
+        fprintf(stderr, "opaque_CreateCredentialResponsePrepared failed.\n");
+        return 1;
+      }
+      if(0!=opaque_RecoverCredentials(resp, sec, context, sizeof context, pids[j], pk, authU1, export_key)) return 1;
+      assert(sodium_memcmp(sk,pk,sizeof sk)==0);
+      if(-1==opaque_UserAuth(authU0, authU1)) {
+        fprintf(stderr, "failed authenticating user\n");
+        return 1;
+      }
+    }
+    opaque_DestroyPreparedRecord(&prec);
+  }
+
+  // sessions take their ephemerals from the pool while it is not empty
+  fprintf(stderr, "\nopaque_CreateEphemeralPool\n");
+  Opaque_EphemeralPool *pool = opaque_CreateEphemeralPool(2);
+  if(pool==NULL) {
+    fprintf(stderr, "opaque_CreateEphemeralPool failed.\n");
+    return 1;
+  }
+  if(2!=opaque_RefillEphemeralPool(pool, 5) || 2!=opaque_EphemeralPoolCount(pool)) {
+    fprintf(stderr, "opaque_RefillEphemeralPool failed.\n");
+    return 1;
+  }
+  opaque_SetEphemeralPool(pool);
+  for(i=0;i<3;i++) {
+    fprintf(stderr, "\nopaque_CreateCredentialResponse with pool\n");
+    opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+    if(0!=opaque_CreateCredentialResponse(pub, rec0, &nids, context, sizeof context, resp, sk, authU0)) {
+      fprintf(stderr, "opaque_CreateCredentialResponse failed.\n");
+      return 1;
+    }
+    if(0!=opaque_RecoverCredentials(resp, sec, context, sizeof context, &nids, pk, authU1, export_key)) return 1;
+    assert(sodium_memcmp(sk,pk,sizeof sk)==0);
+    assert(opaque_EphemeralPoolCount(pool)==(i<2?1-i:0));
+  }
+  opaque_DestroyEphemeralPool(pool);
+
+  // hardening parameters from a descriptor, for the registration and
+  // the logins of a user
+  fprintf(stderr, "\nopaque_HardenParams\n");
+  uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN], harden4[OPAQUE_HARDEN_PARAMS_LEN], bad_harden[OPAQUE_HARDEN_PARAMS_LEN];
+  uint32_t opslimit;
+  size_t memlimit;
+  uint8_t lanes;
+  if(0!=opaque_HardenParams(1, 1<<20, 1, harden) ||
+     0!=opaque_HardenParamsGet(harden, &opslimit, &memlimit, &lanes) ||
+     opslimit!=1 || memlimit!=1<<20 || lanes!=1) {
+    fprintf(stderr, "opaque_HardenParams failed.\n");
+    return 1;
+  }
+  if(0!=opaque_HardenParams(1, 1<<20, 4, harden4) ||
+     0!=opaque_HardenParamsGet(harden4, &opslimit, &memlimit, &lanes) ||
+     opslimit!=1 || memlimit!=1<<20 || lanes!=4) {
+    fprintf(stderr, "opaque_HardenParams with 4 lanes failed.\n");
+    return 1;
+  }
+  memcpy(bad_harden, harden, sizeof harden);
+  bad_harden[0]=0x7f;
+  if(0==opaque_HardenParams(0, 1<<20, 1, bad_harden) ||
+     0==opaque_HardenParams(0x10000, 1<<20, 1, bad_harden) ||
+     0==opaque_HardenParams(1, 1024, 1, bad_harden) ||
+     0==opaque_HardenParams(1, 1<<20, 0, bad_harden) ||
+     0==opaque_HardenParams(1, 8<<10, 2, bad_harden) ||
+     0==opaque_HardenParamsGet(bad_harden, &opslimit, &memlimit, &lanes)) {
+    fprintf(stderr, "opaque_HardenParams accepted invalid parameters.\n");
+    return 1;
+  }
+  fprintf(stderr, "\nopaque_CalibrateHarden\n");
+  uint8_t calibrated[OPAQUE_HARDEN_PARAMS_LEN];
+  for(i=1;i<=2;i++) {
+    if(0!=opaque_CalibrateHarden(50, 8<<20, (uint8_t) i, calibrated) ||
+       0!=opaque_HardenParamsGet(calibrated, &opslimit, &memlimit, &lanes) ||
+       opslimit<1 || memlimit>8<<20 || lanes!=i) {
+      fprintf(stderr, "opaque_CalibrateHarden failed.\n");
+      return 1;
+    }
+    fprintf(stderr, "50ms, 8MiB and %u lanes: opslimit %u, memlimit %zu\n", lanes, opslimit, memlimit);
+  }
+  fprintf(stderr, "\nopaque_FinalizeRequestHarden\n");
+  if(0!=opaque_CreateRegistrationRequest(pwdU, pwdU_len, usr_ctx, M) ||
+     0!=opaque_CreateRegistrationResponse(M, NULL, rsec, rpub) ||
+     0!=opaque_FinalizeRequestHarden(usr_ctx, rpub, &ids, harden, rrec, export_key)) {
+    fprintf(stderr, "registration with a descriptor failed.\n");
+    return 1;
+  }
+  opaque_StoreUserRecord(rsec, rrec, rec);
+  fprintf(stderr, "\nopaque_RegisterHarden\n");
+  if(0!=opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, harden, rec0, export_key0)) {
+    fprintf(stderr, "opaque_RegisterHarden failed.\n");
+    return 1;
+  }
+#ifdef NORANDOM
+  assert(memcmp(rec, rec0, sizeof rec)==0);
+  assert(memcmp(export_key, export_key0, sizeof export_key)==0);
+#endif
+  // only the descriptor of the registration opens the envelope, the
+  // same memory in 4 lanes is a different hardening
+  const uint8_t *hardens[4]={harden, NULL, bad_harden, harden4};
+  for(j=0;j<4;j++) {
+    fprintf(stderr, "\nopaque_RecoverCredentialsHarden\n");
+    opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+    if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0)) {
+      fprintf(stderr, "opaque_CreateCredentialResponse failed.\n");
+      return 1;
+    }
+    const int r = opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, hardens[j], pk, authU1, export_key);
+    if((j==0) != (r==0)) {
+      fprintf(stderr, "opaque_RecoverCredentialsHarden %s.\n", (j==0)?"failed":"accepted other parameters");
+      return 1;
+    }
+    if(j==0) assert(sodium_memcmp(sk,pk,sizeof sk)==0);
+  }
+  fprintf(stderr, "\nlogin hardened with 4 lanes\n");
+  if(0!=opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, harden4, rec0, export_key0)) {
+    fprintf(stderr, "opaque_RegisterHarden with 4 lanes failed.\n");
+    return 1;
+  }
+  opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+  if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+     0!=opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, harden4, pk, authU1, export_key) ||
+     0!=opaque_UserAuth(authU0, authU1)) {
+    fprintf(stderr, "login with 4 lanes failed.\n");
+    return 1;
+  }
+  assert(sodium_memcmp(sk,pk,sizeof sk)==0);
+  assert(sodium_memcmp(export_key,export_key0,sizeof export_key)==0);
+
+  // a reused hardening context gives the same results, one that is too
+  // small is ignored
+  fprintf(stderr, "\nopaque_CreateHardenCtx\n");
+  Opaque_HardenCtx *hctx[3] = {
+    opaque_CreateHardenCtx(crypto_pwhash_MEMLIMIT_INTERACTIVE, OPAQUE_HARDEN_HUGEPAGES),
+    opaque_CreateHardenCtx(1<<20, 0),
+    opaque_CreateHardenCtx(1<<19, 0),
+  };
+  assert(opaque_CreateHardenCtx(1024, 0)==NULL);
+  for(i=0;i<3;i++) {
+    if(hctx[i]==NULL) {
+      fprintf(stderr, "opaque_CreateHardenCtx failed.\n");
+      return 1;
+    }
+    for(j=0;j<3;j++) {
+      const uint8_t *h = (j==0) ? NULL : (j==1) ? harden : harden4;
+      // registered with the context, logged in without it and the other
+      // way around
+      opaque_SetHardenCtx(hctx[i]);
+      if(0!=opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, h, rec0, export_key0)) {
+        fprintf(stderr, "opaque_RegisterHarden with a context failed.\n");
+        return 1;
+      }
+      opaque_SetHardenCtx(NULL);
+      opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+      if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+         0!=opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, h, pk, authU1, export_key)) {
+        fprintf(stderr, "login without the context of the registration failed.\n");
+        return 1;
+      }
+      assert(sodium_memcmp(export_key,export_key0,sizeof export_key)==0);
+      opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+      opaque_SetHardenCtx(hctx[i]);
+      if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+         0!=opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, h, pk, authU1, export_key)) {
+        fprintf(stderr, "login with a context failed.\n");
+        return 1;
+      }
+      assert(sodium_memcmp(export_key,export_key0,sizeof export_key)==0);
+    }
+    opaque_DestroyHardenCtx(hctx[i]);
+  }
+
+  // a login step by step gives the same results as in one go, with and
+  // without a context
+  fprintf(stderr, "\nopaque_RecoverCredentialsStart\n");
+  hctx[0] = opaque_CreateHardenCtx(1<<20, 0);
+  if(hctx[0]==NULL) return 1;
+  for(i=0;i<2;i++) {
+    opaque_SetHardenCtx(i==0 ? NULL : hctx[0]);
+    for(j=0;j<3;j++) {
+      const uint8_t *h = (j==0) ? NULL : (j==1) ? harden : harden4;
+      static const uint32_t steps[] = {0, 1000, 0xffffffff};
+      uint8_t sk1[OPAQUE_SHARED_SECRETBYTES], export_key1[crypto_hash_sha512_BYTES];
+      size_t k;
+      if(0!=opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, h, rec0, export_key0)) return 1;
+      opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+      if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+         0!=opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, h, pk, authU1, export_key)) {
+        fprintf(stderr, "opaque_RecoverCredentialsHarden failed.\n");
+        return 1;
+      }
+      for(k=0;k<sizeof steps / sizeof steps[0];k++) {
+        Opaque_RecoverState *rst = opaque_RecoverCredentialsStart(resp, sec, context, sizeof context, &ids, h);
+        if(rst==NULL) {
+          fprintf(stderr, "opaque_RecoverCredentialsStart failed.\n");
+          return 1;
+        }
+        unsigned n=0;
+        if(steps[k]>0) while(!opaque_RecoverCredentialsStep(rst, steps[k])) n++;
+        uint8_t authU2[crypto_auth_hmacsha512_BYTES];
+        if(0!=opaque_RecoverCredentialsFinish(rst, sk1, authU2, export_key1)) {
+          fprintf(stderr, "opaque_RecoverCredentialsFinish failed.\n");
+          return 1;
+        }
+        if(steps[k]==1000) fprintf(stderr, "%u steps of 1000 blocks\n", n+1);
+        assert(sodium_memcmp(sk1,pk,sizeof sk1)==0);
+        assert(sodium_memcmp(authU2,authU1,sizeof authU2)==0);
+        assert(sodium_memcmp(export_key1,export_key,sizeof export_key1)==0);
+      }
+      // a wrong password fails, and a login can be given up halfway
+      opaque_CreateCredentialRequest((const uint8_t*) "wrong", 5, sec, pub);
+      if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0)) return 1;
+      Opaque_RecoverState *rst = opaque_RecoverCredentialsStart(resp, sec, context, sizeof context, &ids, h);
+      if(rst==NULL || 0==opaque_RecoverCredentialsFinish(rst, sk1, NULL, export_key1)) {
+        fprintf(stderr, "opaque_RecoverCredentialsFinish accepted a wrong password.\n");
+        return 1;
+      }
+      rst = opaque_RecoverCredentialsStart(resp, sec, context, sizeof context, &ids, h);
+      if(rst==NULL || opaque_RecoverCredentialsStep(rst, 100)) return 1;
+      opaque_RecoverCredentialsAbort(rst);
+    }
+  }
+  assert(opaque_RecoverCredentialsStart(resp, sec, context, sizeof context, &ids, bad_harden)==NULL);
+  opaque_DestroyHardenCtx(hctx[0]);
+
+  // a memory budget for one default hardening: a started login holds
+  // it, so everything else is busy until the login is done
+  fprintf(stderr, "\nopaque_SetHardenBudget\n");
+  assert(opaque_SetHardenBudget(1024, 0, 0)==-1);
+  if(0!=opaque_Register(pwdU, pwdU_len, NULL, &ids, rec, export_key0)) return 1;
+  if(0!=opaque_SetHardenBudget(crypto_pwhash_MEMLIMIT_INTERACTIVE, 0, 0)) return 1;
+  opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+  if(0!=opaque_CreateCredentialResponse(pub, rec, &ids, context, sizeof context, resp, sk, authU0)) return 1;
+  Opaque_RecoverState *rst = opaque_RecoverCredentialsStart(resp, sec, context, sizeof context, &ids, NULL);
+  if(rst==NULL || opaque_HardenBudgetUsed()!=crypto_pwhash_MEMLIMIT_INTERACTIVE) return 1;
+  if(OPAQUE_BUSY!=opaque_Register(pwdU, pwdU_len, NULL, &ids, rec0, export_key0) ||
+     OPAQUE_BUSY!=opaque_RecoverCredentials(resp, sec, context, sizeof context, &ids, pk, authU1, export_key)) {
+    fprintf(stderr, "hardening over the budget did not fail with OPAQUE_BUSY.\n");
+    return 1;
+  }
+  errno = 0;
+  assert(opaque_RecoverCredentialsStart(resp, sec, context, sizeof context, &ids, NULL)==NULL && errno==EBUSY);
+  // waiting in the queue times out
+  if(0!=opaque_SetHardenBudget(crypto_pwhash_MEMLIMIT_INTERACTIVE, 1, 20)) return 1;
+  assert(OPAQUE_BUSY==opaque_Register(pwdU, pwdU_len, NULL, &ids, rec0, export_key0));
+  // more than the whole budget can never run
+  uint8_t big[OPAQUE_HARDEN_PARAMS_LEN];
+  if(0!=opaque_HardenParams(1, 2*crypto_pwhash_MEMLIMIT_INTERACTIVE, 1, big)) return 1;
+  assert(-1==opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, big, rec0, export_key0));
+  // the memory of a context is not counted
+  hctx[0] = opaque_CreateHardenCtx(crypto_pwhash_MEMLIMIT_INTERACTIVE, 0);
+  if(hctx[0]==NULL) return 1;
+  opaque_SetHardenCtx(hctx[0]);
+  if(0!=opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, harden4, rec0, export_key0)) {
+    fprintf(stderr, "hardening with a context counted against the budget.\n");
+    return 1;
+  }
+  opaque_DestroyHardenCtx(hctx[0]);
+  if(0!=opaque_RecoverCredentialsFinish(rst, pk, authU1, export_key) ||
+     sodium_memcmp(sk,pk,sizeof sk)!=0 || opaque_HardenBudgetUsed()!=0) return 1;
+  if(0!=opaque_Register(pwdU, pwdU_len, NULL, &ids, rec0, export_key0)) {
+    fprintf(stderr, "opaque_Register failed after the budget was released.\n");
+    return 1;
+  }
+  if(0!=opaque_SetHardenBudget(0, 0, 0)) return 1;
+
+  // scrypt, a function of the application and the identity of
+  // benchmark builds instead of Argon2id
+  fprintf(stderr, "\nopaque_HardenParamsScrypt, opaque_SetHardenMHF\n");
+  uint8_t scrypt[OPAQUE_HARDEN_PARAMS_LEN], custom[OPAQUE_HARDEN_PARAMS_LEN] = {OPAQUE_HARDEN_CUSTOM, 1},
+    identity[OPAQUE_HARDEN_PARAMS_LEN] = {OPAQUE_HARDEN_IDENTITY};
+  if(0!=opaque_HardenParamsScrypt(14, 8, 1, scrypt)) return 1;
+  if(0==opaque_HardenParamsScrypt(0, 8, 1, big) || 0==opaque_HardenParamsScrypt(14, 0, 1, big) ||
+     0==opaque_HardenParamsScrypt(14, 8, 0, big) || 0==opaque_HardenParamsScrypt(5, 1, 1, big) ||
+     0==opaque_HardenParamsScrypt(14, 8, 1<<27, big) || 0==opaque_HardenParamsGet(scrypt, &opslimit, &memlimit, &lanes)) {
+    fprintf(stderr, "invalid scrypt parameters accepted.\n");
+    return 1;
+  }
+  assert(opaque_SetHardenMHF(OPAQUE_HARDEN_SCRYPT, &test_mhf)==-1);
+  assert(opaque_SetHardenMHF(OPAQUE_HARDEN_IDENTITY, &test_mhf)==-1);
+  assert(opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, custom, rec0, export_key0)==-1);
+  if(0!=opaque_SetHardenMHF(OPAQUE_HARDEN_CUSTOM, &test_mhf)) return 1;
+  const uint8_t *mhfs[3] = {scrypt, custom, identity};
+  for(i=0;i<3;i++) {
+#ifndef OPAQUE_BENCHMARK
+    if(mhfs[i]==identity) {
+      assert(opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, identity, rec0, export_key0)==-1);
+      continue;
+    }
+#endif
+    test_mhf_calls = 0;
+    if(0!=opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, mhfs[i], rec0, export_key0)) {
+      fprintf(stderr, "opaque_RegisterHarden failed with algorithm %d.\n", mhfs[i][0]);
+      return 1;
+    }
+    opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+    if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+       0!=opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, mhfs[i], pk, authU1, export_key) ||
+       sodium_memcmp(sk,pk,sizeof sk)!=0 || sodium_memcmp(export_key,export_key0,sizeof export_key)!=0) {
+      fprintf(stderr, "login failed with algorithm %d.\n", mhfs[i][0]);
+      return 1;
+    }
+    // done at once by the start of a stepwise login
+    rst = opaque_RecoverCredentialsStart(resp, sec, context, sizeof context, &ids, mhfs[i]);
+    if(rst==NULL || 1!=opaque_RecoverCredentialsStep(rst, 1) ||
+       0!=opaque_RecoverCredentialsFinish(rst, pk, authU1, export_key) || sodium_memcmp(sk,pk,sizeof sk)!=0) {
+      fprintf(stderr, "stepwise login failed with algorithm %d.\n", mhfs[i][0]);
+      return 1;
+    }
+    // another function with the same password does not open the envelope
+    assert(0!=opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, NULL, pk, authU1, export_key));
+    if(mhfs[i]==custom && test_mhf_calls!=3) return 1;
+  }
+
+  // a registration that logs in hardens the password once
+  fprintf(stderr, "\nopaque_FinalizeRequestLogin\n");
+  uint8_t login_sec[OPAQUE_REGISTER_LOGIN_SEC_LEN+pwdU_len], login_pub[OPAQUE_USER_SESSION_PUBLIC_LEN];
+  test_mhf_calls = 0;
+  if(0!=opaque_CreateRegistrationRequest(pwdU, pwdU_len, usr_ctx, M) ||
+     0!=opaque_CreateRegistrationResponse(M, NULL, rsec, rpub) ||
+     0!=opaque_FinalizeRequestLogin(usr_ctx, rpub, &ids, custom, rrec, export_key0, login_sec, login_pub) ||
+     0!=opaque_StoreUserRecordLogin(rsec, rrec, login_pub, &ids, context, sizeof context, rec0, resp, sk, authU0) ||
+     0!=opaque_RecoverCredentialsRegistered(resp, login_sec, context, sizeof context, &ids, pk, authU1, export_key) ||
+     0!=opaque_UserAuth(authU0, authU1)) {
+    fprintf(stderr, "registration with login failed.\n");
+    return 1;
+  }
+  if(test_mhf_calls!=1 || sodium_memcmp(sk,pk,sizeof sk)!=0 ||
+     sodium_memcmp(export_key,export_key0,sizeof export_key)!=0) {
+    fprintf(stderr, "registration with login hardened %d times, or keys differ.\n", test_mhf_calls);
+    return 1;
+  }
+  // the record is an ordinary one for later logins
+  opaque_CreateCredentialRequest(pwdU, pwdU_len, sec, pub);
+  if(0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+     0!=opaque_RecoverCredentialsHarden(resp, sec, context, sizeof context, &ids, custom, pk, authU1, export_key) ||
+     sodium_memcmp(sk,pk,sizeof sk)!=0 || sodium_memcmp(export_key,export_key0,sizeof export_key)!=0) {
+    fprintf(stderr, "login after registration with login failed.\n");
+    return 1;
+  }
+  // a response from another record fails
+  if(0!=opaque_CreateRegistrationRequest(pwdU, pwdU_len, usr_ctx, M) ||
+     0!=opaque_CreateRegistrationResponse(M, NULL, rsec, rpub) ||
+     0!=opaque_FinalizeRequestLogin(usr_ctx, rpub, &ids, custom, rrec, export_key0, login_sec, login_pub) ||
+     0!=opaque_RegisterHarden((const uint8_t*) "wrong", 5, NULL, &ids, custom, rec0, NULL) ||
+     0!=opaque_CreateCredentialResponse(login_pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+     0==opaque_RecoverCredentialsRegistered(resp, login_sec, context, sizeof context, &ids, pk, authU1, export_key)) {
+    fprintf(stderr, "registration with login accepted a response of another record.\n");
+    return 1;
+  }
+  // resuming the last session with a ticket
+  fprintf(stderr, "\nopaque_CreateResumeRequest\n");
+  uint8_t tkey[OPAQUE_TICKET_KEYBYTES], tinfo[OPAQUE_TICKET_INFO_BYTES], tinfo0[OPAQUE_TICKET_INFO_BYTES]={0};
+  uint8_t ticket[OPAQUE_TICKET_LEN], rms[OPAQUE_RESUMPTION_SECRETBYTES];
+  uint8_t rsm_sec[OPAQUE_RESUME_SECRET_LEN], rsm_req[OPAQUE_RESUME_REQUEST_LEN], rsm_resp[OPAQUE_RESUME_RESPONSE_LEN];
+  Opaque_TicketCache *tcache = opaque_CreateTicketCache(4);
+  // the replay cache tells tickets apart by their random nonce
+#ifndef NORANDOM
+  Opaque_TicketCache *rcache = tcache;
+#else
+  Opaque_TicketCache *rcache = NULL;
+#endif
+  randombytes_buf(tkey, sizeof tkey);
+  memcpy(tinfo0, "user", 4);
+  uint8_t wsec[OPAQUE_USER_SESSION_SECRET_LEN+5];
+  opaque_CreateCredentialRequest((const uint8_t*) "wrong", 5, wsec, pub);
+  if(tcache==NULL ||
+     0!=opaque_CreateCredentialResponse(pub, rec0, &ids, context, sizeof context, resp, sk, authU0) ||
+     0!=opaque_RecoverCredentialsHarden(resp, wsec, context, sizeof context, &ids, custom, pk, authU1, export_key) ||
+     0!=opaque_IssueTicket(tkey, sk, tinfo0, 60, ticket) ||
+     0!=opaque_ResumptionSecret(pk, rms) ||
+     0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req) ||
+     0!=opaque_CreateResumeResponse(tkey, tcache, rsm_req, context, sizeof context, tinfo, rsm_resp, sk, authU0) ||
+     0!=opaque_RecoverResume(rsm_resp, rsm_sec, context, sizeof context, pk, authU1) ||
+     0!=opaque_UserAuth(authU0, authU1) ||
+     sodium_memcmp(sk,pk,sizeof sk)!=0 || memcmp(tinfo,tinfo0,sizeof tinfo)!=0) {
+    fprintf(stderr, "resumption failed.\n");
+    return 1;
+  }
+  // requests that fail, with an invalid keyshare or from someone
+  // without the resumption secret, do not use up the ticket
+  if(0!=opaque_IssueTicket(tkey, sk, tinfo0, 60, ticket) ||
+     0!=opaque_ResumptionSecret(pk, rms) ||
+     0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req)) return 1;
+  uint8_t bad_req[OPAQUE_RESUME_REQUEST_LEN], wrong_rms[OPAQUE_RESUMPTION_SECRETBYTES];
+  memcpy(bad_req, rsm_req, sizeof bad_req);
+  memset(bad_req+OPAQUE_TICKET_LEN+OPAQUE_NONCE_BYTES, 0xff, crypto_scalarmult_BYTES);
+  if(0==opaque_CreateResumeResponse(tkey, rcache, bad_req, context, sizeof context, NULL, rsm_resp, sk, authU0)) {
+    fprintf(stderr, "resumption with an invalid keyshare succeeded.\n");
+    return 1;
+  }
+  memset(wrong_rms, 0, sizeof wrong_rms);
+  if(0!=opaque_CreateResumeRequest(ticket, wrong_rms, rsm_sec, bad_req) ||
+     0==opaque_CreateResumeResponse(tkey, rcache, bad_req, context, sizeof context, NULL, rsm_resp, sk, authU0)) {
+    fprintf(stderr, "resumption without the resumption secret succeeded.\n");
+    return 1;
+  }
+  if(0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req) ||
+     0!=opaque_CreateResumeResponse(tkey, rcache, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0) ||
+     0!=opaque_RecoverResume(rsm_resp, rsm_sec, context, sizeof context, pk, authU1) ||
+     sodium_memcmp(sk,pk,sizeof sk)!=0) {
+    fprintf(stderr, "ticket used up by a failed resumption.\n");
+    return 1;
+  }
+  // a ticket is accepted only once
+  if(0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req) ||
+     0==opaque_CreateResumeResponse(tkey, tcache, rsm_req, context, sizeof context, tinfo, rsm_resp, sk, authU0)) {
+    fprintf(stderr, "replayed ticket accepted.\n");
+    return 1;
+  }
+  // the ticket of the resumed session, a new secret each time
+  if(0!=opaque_IssueTicket(tkey, sk, NULL, 60, ticket) ||
+     0!=opaque_ResumptionSecret(pk, rms) ||
+     0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req) ||
+     0!=opaque_CreateResumeResponse(tkey, rcache, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0) ||
+     0!=opaque_RecoverResume(rsm_resp, rsm_sec, context, sizeof context, pk, authU1) ||
+     sodium_memcmp(sk,pk,sizeof sk)!=0) {
+    fprintf(stderr, "resumption of a resumed session failed.\n");
+    return 1;
+  }
+#ifndef NORANDOM
+  // the cache is full of valid tickets, so new ones are refused
+  if(0!=opaque_IssueTicket(tkey, sk, NULL, 60, ticket) ||
+     0!=opaque_ResumptionSecret(pk, rms) ||
+     0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req) ||
+     0!=opaque_CreateResumeResponse(tkey, tcache, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0) ||
+     0!=opaque_RecoverResume(rsm_resp, rsm_sec, context, sizeof context, pk, authU1) ||
+     0!=opaque_IssueTicket(tkey, sk, NULL, 60, ticket) ||
+     0!=opaque_ResumptionSecret(pk, rms) ||
+     0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req) ||
+     0==opaque_CreateResumeResponse(tkey, tcache, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0)) {
+    fprintf(stderr, "full ticket cache accepted a ticket.\n");
+    return 1;
+  }
+#endif
+  opaque_DestroyTicketCache(tcache);
+  // without a cache tickets can be used until they expire
+  if(0!=opaque_CreateResumeResponse(tkey, NULL, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0) ||
+     0!=opaque_CreateResumeResponse(tkey, NULL, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0)) {
+    fprintf(stderr, "resumption without ticket cache failed.\n");
+    return 1;
+  }
+  // the wrong client secret, or another context, fail
+  if(0==opaque_RecoverResume(rsm_resp, rsm_sec, context, sizeof context - 1, pk, authU1)) return 1;
+  rsm_sec[crypto_scalarmult_SCALARBYTES] ^= 1;
+  if(0==opaque_RecoverResume(rsm_resp, rsm_sec, context, sizeof context, pk, authU1)) {
+    fprintf(stderr, "resumption with the wrong secret succeeded.\n");
+    return 1;
+  }
+  // a ticket of another key, a tampered one, and an expired one are refused
+  uint8_t tkey1[OPAQUE_TICKET_KEYBYTES];
+  randombytes_buf(tkey1, sizeof tkey1);
+  if(0==opaque_CreateResumeResponse(tkey1, NULL, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0)) return 1;
+  rsm_req[OPAQUE_TICKET_LEN-1] ^= 1;
+  if(0==opaque_CreateResumeResponse(tkey, NULL, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0)) return 1;
+  rsm_req[OPAQUE_TICKET_LEN-1] ^= 1;
+  {
+    // reseal the ticket with an expiry in the past
+    static const uint8_t ad[] = "OPAQUE-Ticket";
+    uint8_t plain[OPAQUE_TICKET_LEN-24-16];
+    if(0!=crypto_aead_xchacha20poly1305_ietf_decrypt(plain, NULL, NULL, rsm_req+24, OPAQUE_TICKET_LEN-24,
+                                                     ad, sizeof ad - 1, rsm_req, tkey)) return 1;
+    memset(plain, 0, 8);
+    plain[7] = 1;
+    crypto_aead_xchacha20poly1305_ietf_encrypt(rsm_req+24, NULL, plain, sizeof plain, ad, sizeof ad - 1,
+                                               NULL, rsm_req, tkey);
+    memcpy(ticket, rsm_req, sizeof ticket);
+    if(0!=opaque_CreateResumeRequest(ticket, rms, rsm_sec, rsm_req)) return 1;
+    if(0==opaque_CreateResumeResponse(tkey, NULL, rsm_req, context, sizeof context, NULL, rsm_resp, sk, authU0)) {
+      fprintf(stderr, "expired ticket accepted.\n");
+      return 1;
+    }
+  }
+  assert(0!=opaque_IssueTicket(tkey, sk, NULL, 0, ticket) &&
+         0!=opaque_IssueTicket(tkey, sk, NULL, OPAQUE_TICKET_MAX_LIFETIME+1, ticket));
+
+  if(0!=opaque_SetHardenMHF(OPAQUE_HARDEN_CUSTOM, NULL)) return 1;
+  assert(opaque_RegisterHarden(pwdU, pwdU_len, NULL, &ids, custom, rec0, export_key0)==-1);
+
+  // passphrases longer than a byte can count, up to the limit of the
+  // api, differing only in their last byte
+  static const uint16_t long_lens[] = {256, 300, 65535};
+  for(i=0;i<sizeof long_lens / sizeof long_lens[0];i++) {
+    fprintf(stderr, "\nlogin with a %d byte password\n", long_lens[i]);
+    const uint16_t lpwd_len = long_lens[i];
+    uint8_t *lpwd = malloc(lpwd_len), *lsec = malloc(OPAQUE_USER_SESSION_SECRET_LEN+lpwd_len);
+    if(lpwd==NULL || lsec==NULL) return 1;
+    memset(lpwd, 'a', lpwd_len);
+    if(0!=opaque_Register(lpwd, lpwd_len, NULL, &ids, rec, export_key0)) {
+      fprintf(stderr, "opaque_Register failed.\n");
+      return 1;
+    }
+    for(j=0;j<2;j++) {
+      lpwd[lpwd_len-1] = (j==0) ? 'a' : 'b';
+      opaque_CreateCredentialRequest(lpwd, lpwd_len, lsec, pub);
+      if(0!=opaque_CreateCredentialResponse(pub, rec, &ids, context, sizeof context, resp, sk, authU0)) {
+        fprintf(stderr, "opaque_CreateCredentialResponse failed.\n");
+        return 1;
+      }
+      const int r = opaque_RecoverCredentials(resp, lsec, context, sizeof context, &ids, pk, authU1, export_key);
+      if(j==0 && (r!=0 || sodium_memcmp(sk,pk,sizeof sk)!=0 || sodium_memcmp(export_key,export_key0,sizeof export_key)!=0)) {
+        fprintf(stderr, "login with a long password failed.\n");
+        return 1;
+      }
+      if(j==1 && r==0) {
+        fprintf(stderr, "login with a wrong long password succeeded.\n");
+        return 1;
+      }
+    }
+    free(lpwd);
+    free(lsec);
+  }
+
   fprintf(stderr, "\nall ok\n\n");
 
   return 0;
@@ -139,6 +139,45 @@ int main(void) {
     exit(1);
   }
 
+  // the same using a server context
+  Opaque_ServerContext sctx;
+  if(0!=opaque_CreateServerContext(server_private_key, NULL, 0, context, sizeof context, &sctx)) {
+    return -1;
+  }
+  uint8_t cresp1[OPAQUE_SERVER_SESSION_LEN];
+  uint8_t sk1[OPAQUE_SHARED_SECRETBYTES];
+  uint8_t authU1[crypto_auth_hmacsha512_BYTES];
+  if(0!=opaque_CreateCredentialResponseCtx(&sctx, req, rec, NULL, 0, cresp1, sk1, authU1)) {
+    return -1;
+  }
+  opaque_DestroyServerContext(&sctx);
+  if(memcmp(ke2, cresp1, sizeof cresp1)!=0 ||
+     memcmp(session_key, sk1, sizeof session_key)!=0 ||
+     memcmp(authU, authU1, sizeof authU)!=0) {
+    fprintf(stderr,"failed to reproduce ke2 with server context\n");
+    dump(cresp1, sizeof cresp1, "resp");
+    dump(ke2, sizeof ke2, "ke2");
+    exit(1);
+  }
+
+  // and as a batch
+  uint8_t bpub[2*OPAQUE_USER_SESSION_PUBLIC_LEN], brec[2*OPAQUE_USER_RECORD_LEN];
+  uint8_t bresp[2*OPAQUE_SERVER_SESSION_LEN], bsk[2*OPAQUE_SHARED_SECRETBYTES];
+  Opaque_Ids bids[2]={ids, ids};
+  int bret[2];
+  memcpy(bpub, req, sizeof req); memcpy(bpub+sizeof req, req, sizeof req);
+  memcpy(brec, rec, sizeof rec); memcpy(brec+sizeof rec, rec, sizeof rec);
+  if(0!=opaque_CreateCredentialResponseBatch(2, bpub, brec, bids, context, sizeof context, bresp, bsk, NULL, bret)) {
+    return -1;
+  }
+  if(memcmp(ke2, bresp, sizeof ke2)!=0 || memcmp(ke2, bresp+sizeof cresp, sizeof ke2)!=0 ||
+     memcmp(session_key, bsk, sizeof session_key)!=0 || memcmp(session_key, bsk+sizeof sk, sizeof session_key)!=0) {
+    fprintf(stderr,"failed to reproduce ke2 in batch\n");
+    dump(bresp, sizeof bresp, "resp");
+    dump(ke2, sizeof ke2, "ke2");
+    exit(1);
+  }
+
   uint8_t skU[OPAQUE_SHARED_SECRETBYTES];
   uint8_t authUu[crypto_auth_hmacsha512_BYTES];
   uint8_t export_keyU[crypto_hash_sha512_BYTES];
@@ -166,6 +205,18 @@ int main(void) {
     exit(1);
   }
 
+  // the same login step by step
+  Opaque_RecoverState *rst = opaque_RecoverCredentialsStart(cresp, sec, context, sizeof context, &ids1, NULL);
+  if(rst==NULL ||
+     opaque_RecoverCredentialsStep(rst, 1)!=1 ||
+     0!=opaque_RecoverCredentialsFinish(rst, skU, authUu, export_keyU) ||
+     memcmp(session_key, skU, sizeof session_key)!=0 ||
+     memcmp(export_key, export_keyU, sizeof export_key)!=0 ||
+     memcmp(authU, authUu, sizeof authU)!=0) {
+    fprintf(stderr,"failed to reproduce the login step by step\n");
+    exit(1);
+  }
+
   fprintf(stderr,"all ok\n");
   return 0;
 }
@@ -0,0 +1,148 @@
+/*
+    checks the per-thread drbg of common.c and compares its speed to
+    calling randombytes_buf() of libsodium directly.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../common.h"
+
+#ifdef NORANDOM
+int main(void) {
+  // the drbg is replaced by the deterministic shim
+  printf("all ok\n");
+  return 0;
+}
+#else
+
+#define ROUNDS 200000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the random calls of one server login: masking nonce, nonceS and x_s
+static double bench(void (*rnd)(void* const buf, const size_t len)) {
+  uint8_t buf[32];
+  size_t i;
+  double t = now();
+  for(i=0;i<ROUNDS;i++) {
+    rnd(buf, 32);
+    rnd(buf, 32);
+    rnd(buf, 32);
+  }
+  return (now() - t) / ROUNDS * 1e9;
+}
+
+static void sodium_rnd(void* const buf, const size_t len) {
+  randombytes_buf(buf, len);
+}
+
+#ifdef __linux__
+#define THREADS 8
+
+// the locked memory of the process in KiB, -1 if unknown
+static long locked_kib(void) {
+  char line[128];
+  long kib = -1;
+  FILE *f = fopen("/proc/self/status", "r");
+  if(f==NULL) return -1;
+  while(fgets(line, sizeof line, f)!=NULL) {
+    if(strncmp(line, "VmLck:", 6)==0) kib = strtol(line+6, NULL, 10);
+  }
+  fclose(f);
+  return kib;
+}
+
+// all threads hold their state at the same time, so they cannot share
+// a reused stack
+static pthread_barrier_t barrier;
+static void* thread(void *arg) {
+  uint8_t buf[32];
+  (void) arg;
+  opaque_randombytes(buf, sizeof buf);
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+// the states of exited threads are unlocked
+static int check_exit(void) {
+  pthread_t t[THREADS];
+  size_t i;
+  const long before = locked_kib();
+  if(0!=pthread_barrier_init(&barrier, NULL, THREADS)) return 1;
+  for(i=0;i<THREADS;i++) {
+    if(0!=pthread_create(&t[i], NULL, thread, NULL)) return 1;
+  }
+  for(i=0;i<THREADS;i++) pthread_join(t[i], NULL);
+  pthread_barrier_destroy(&barrier);
+  return locked_kib() > before;
+}
+#endif
+
+int main(void) {
+  uint8_t a[64], b[64], big[5000];
+
+  if(sodium_init() < 0) return 1;
+
+  // consecutive outputs, short and long ones, differ
+  opaque_randombytes(a, sizeof a);
+  opaque_randombytes(b, sizeof b);
+  if(memcmp(a, b, sizeof a)==0) {
+    fprintf(stderr, "repeated output\n");
+    return 1;
+  }
+  opaque_randombytes(big, sizeof big);
+  if(memcmp(big, big+2500, 2500)==0 || sodium_is_zero(big+4900, 100)) {
+    fprintf(stderr, "bad long output\n");
+    return 1;
+  }
+
+  // a forked child must not repeat the output of its parent
+  int fd[2];
+  if(pipe(fd)!=0) return 1;
+  pid_t pid = fork();
+  if(pid==-1) return 1;
+  if(pid==0) {
+    opaque_randombytes(a, sizeof a);
+    if(write(fd[1], a, sizeof a)!=sizeof a) _exit(1);
+    _exit(0);
+  }
+  opaque_randombytes(a, sizeof a);
+  if(read(fd[0], b, sizeof b)!=sizeof b) return 1;
+  waitpid(pid, NULL, 0);
+  if(memcmp(a, b, sizeof a)==0) {
+    fprintf(stderr, "forked child repeated the output of its parent\n");
+    return 1;
+  }
+
+  // scalars are reduced and never zero
+  memset(a, 0, sizeof a);
+  opaque_randomscalar(a);
+  crypto_core_ristretto255_scalar_reduce(b, a);
+  if(memcmp(a, b, 32)!=0 || sodium_is_zero(a, 32)) {
+    fprintf(stderr, "bad scalar\n");
+    return 1;
+  }
+
+#ifdef __linux__
+  if(check_exit()) {
+    fprintf(stderr, "exited threads left their state locked\n");
+    return 1;
+  }
+#endif
+
+  const double sod = bench(sodium_rnd), drbg = bench(opaque_randombytes);
+  printf("3x32 bytes per login: randombytes_buf %.0fns, drbg %.0fns\n", sod, drbg);
+
+  printf("all ok\n");
+  return 0;
+}
+#endif // NORANDOM
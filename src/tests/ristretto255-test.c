@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+#include <sodium.h>
+#include "../ristretto255.h"
+#include "../common.h"
+
+#define MAXN 70
+
+// compares r255_scalarmult_batch() against crypto_scalarmult_ristretto255(),
+// with share set some consecutive elements use the very same point
+static int check(const size_t n, uint8_t k[][32], uint8_t p[][32], const int share) {
+  uint8_t q[MAXN][32], ref[32];
+  uint8_t *qp[MAXN]={0};
+  const uint8_t *kp[MAXN]={0}, *pp[MAXN]={0};
+  int ret[MAXN];
+  size_t i;
+  int failed=0;
+
+  for(i=0;i<n;i++) {
+    qp[i]=q[i];
+    kp[i]=k[i];
+    pp[i]=(share && i>0 && randombytes_uniform(2)) ? pp[i-1] : p[i];
+  }
+  int f = r255_scalarmult_batch(n, qp, kp, pp, ret);
+  for(i=0;i<n;i++) {
+    int r = crypto_scalarmult_ristretto255(ref, k[i], pp[i]);
+    // libsodium before 1.0.19 ignores the top bit of the encoding
+    if(pp[i][31] & 0x80) r=-1;
+    if(r!=0) {
+      failed++;
+      if(ret[i]!=-1) {
+        fprintf(stderr, "element %zu of %zu should have failed\n", i, n);
+        return 1;
+      }
+    } else if(ret[i]!=0 || memcmp(ref, q[i], 32)!=0) {
+      fprintf(stderr, "element %zu of %zu differs\n", i, n);
+      return 1;
+    }
+  }
+  if(f!=failed) {
+    fprintf(stderr, "batch of %zu reported %d failures instead of %d\n", n, f, failed);
+    return 1;
+  }
+  return 0;
+}
+
+static int run(void) {
+  static const size_t sizes[] = {1, 2, 3, 4, 31, 32, 33, MAXN};
+  uint8_t k[MAXN][32], p[MAXN][32];
+  size_t i, j, s;
+
+  // random points and scalars
+  for(j=0;j<64;j++) {
+    for(s=0;s<sizeof sizes / sizeof sizes[0];s++) {
+      for(i=0;i<sizes[s];i++) {
+        crypto_core_ristretto255_random(p[i]);
+        randombytes_buf(k[i], 32);
+      }
+      if(check(sizes[s], k, p, j&1)) return 1;
+    }
+  }
+
+  // invalid encodings, the identity, zero scalars and the group order
+  // mixed into batches of valid points
+  static const uint8_t l[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+  };
+  for(j=0;j<64;j++) {
+    for(i=0;i<MAXN;i++) {
+      crypto_core_ristretto255_random(p[i]);
+      randombytes_buf(k[i], 32);
+      switch(randombytes_uniform(8)) {
+      case 0: randombytes_buf(p[i], 32); break;
+      case 1: memset(p[i], 0, 32); break;
+      case 2: memset(k[i], 0, 32); break;
+      case 3: memcpy(k[i], l, 32); break;
+      case 4: k[i][31] |= 0x80; break;
+      case 5: p[i][31] |= 0x80; break;
+      default: break;
+      }
+    }
+    if(check(MAXN, k, p, j&1)) return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  if(sodium_init() < 0) return 1;
+
+  // with the kernels for this cpu, and with the portable code only
+  r255_select(opaque_cpu_features());
+  if(run()) return 1;
+  r255_select(0);
+  if(run()) return 1;
+
+  printf("all ok\n");
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+    checks the locked scratch arena of common.c and compares its speed
+    to locking each temporary on the stack with sodium_mlock().
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "../common.h"
+
+#define ROUNDS 200000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(void) {
+  // allocations are zeroed, even when reusing released memory
+  uint8_t *a = opaque_scratch_alloc(100);
+  if(a==NULL || !sodium_is_zero(a, 100)) return 1;
+  memset(a, 0xaa, 100);
+  opaque_scratch_free(a, 100);
+  uint8_t *b = opaque_scratch_alloc(100);
+  if(b==NULL || !sodium_is_zero(b, 100)) return 1;
+
+  // nested allocations do not overlap, and are aligned
+  uint8_t *c = opaque_scratch_alloc(33);
+  if(c==NULL || (c < b+100 && b < c+33) || ((uintptr_t) c & 15)!=0) return 1;
+  memset(b, 1, 100);
+  memset(c, 2, 33);
+  if(b[99]!=1) return 1;
+
+  // released in reverse order the memory is reused
+  opaque_scratch_free(c, 33);
+  uint8_t *d = opaque_scratch_alloc(33);
+#ifndef NOARENA
+  if(d!=c) return 1;
+#endif
+  opaque_scratch_free(d, 33);
+
+  // requests larger than the arena fall back to single allocations
+  uint8_t *e = opaque_scratch_alloc(65*1024);
+  if(e==NULL || !sodium_is_zero(e, 65*1024)) return 1;
+  opaque_scratch_free(e, 65*1024);
+
+  // out of order releases leave the arena empty in the end
+  c = opaque_scratch_alloc(64);
+  opaque_scratch_free(b, 100);
+  opaque_scratch_free(c, 64);
+  b = opaque_scratch_alloc(100);
+#ifndef NOARENA
+  if(b!=a) return 1;
+#endif
+  opaque_scratch_free(b, 100);
+  return 0;
+}
+
+// check() expects an empty arena, each thread starts with its own
+static void* thread(void *arg) {
+  uint8_t **p = (uint8_t**) arg;
+  if(check()!=0) return NULL;
+  *p = opaque_scratch_alloc(64);
+  opaque_scratch_free(*p, 64);
+  return NULL;
+}
+
+int main(void) {
+  if(sodium_init() < 0) return 1;
+
+  if(check()!=0) {
+    fprintf(stderr, "arena check failed\n");
+    return 1;
+  }
+
+  // every thread has its own arena
+  uint8_t *mine = opaque_scratch_alloc(64), *other=NULL;
+  pthread_t t;
+  if(0!=pthread_create(&t, NULL, thread, &other)) return 1;
+  pthread_join(t, NULL);
+  if(mine==NULL || other==NULL || mine==other) {
+    fprintf(stderr, "threads share their arena\n");
+    return 1;
+  }
+  opaque_scratch_free(mine, 64);
+
+  // the temporaries of one server login
+  uint8_t buf[1024];
+  size_t i;
+  double t0 = now();
+  for(i=0;i<ROUNDS;i++) {
+    if(-1==sodium_mlock(buf, sizeof buf)) return 1;
+    sodium_munlock(buf, sizeof buf);
+  }
+  const double mlock = (now() - t0) / ROUNDS * 1e9;
+  t0 = now();
+  for(i=0;i<ROUNDS;i++) {
+    uint8_t *p = opaque_scratch_alloc(sizeof buf);
+    if(p==NULL) return 1;
+    opaque_scratch_free(p, sizeof buf);
+  }
+  const double arena = (now() - t0) / ROUNDS * 1e9;
+  printf("1KB temporary: sodium_mlock %.0fns, arena %.0fns\n", mlock, arena);
+
+  printf("all ok\n");
+  return 0;
+}
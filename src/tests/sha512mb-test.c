@@ -0,0 +1,154 @@
+/*
+    compares the multi-buffer sha512 and hmac of sha512mb.c against
+    libsodium, and measures their throughput for several batch sizes.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sodium.h>
+#include "../sha512mb.h"
+#include "../common.h"
+
+#define MAXN 9
+#define MAXLEN 300
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// hashes n messages after a prefix of pre bytes, pre==-1 uses a
+// different prefix length per state
+static int check_hash(const size_t n, const int pre, const size_t len) {
+  static uint8_t msg[MAXN][MAXLEN], prefix[MAXN][MAXLEN];
+  crypto_hash_sha512_state st[MAXN], ref;
+  crypto_hash_sha512_state *stp[MAXN];
+  const uint8_t *in[MAXN];
+  uint8_t out[MAXN][64], *outp[MAXN], expected[64];
+  size_t i, plen[MAXN];
+
+  for(i=0;i<n;i++) {
+    randombytes_buf(msg[i], len);
+    plen[i] = (pre==-1) ? randombytes_uniform(MAXLEN) : (size_t) pre;
+    randombytes_buf(prefix[i], plen[i]);
+    crypto_hash_sha512_init(&st[i]);
+    crypto_hash_sha512_update(&st[i], prefix[i], plen[i]);
+    stp[i]=&st[i];
+    in[i]=msg[i];
+    outp[i]=out[i];
+  }
+  sha512mb_update(n, stp, in, len);
+  sha512mb_final(n, stp, outp);
+  for(i=0;i<n;i++) {
+    crypto_hash_sha512_init(&ref);
+    crypto_hash_sha512_update(&ref, prefix[i], plen[i]);
+    crypto_hash_sha512_update(&ref, msg[i], len);
+    crypto_hash_sha512_final(&ref, expected);
+    if(memcmp(expected, out[i], 64)!=0) {
+      fprintf(stderr, "hash %zu of %zu differs (prefix %zu, len %zu)\n", i, n, plen[i], len);
+      return 1;
+    }
+    if(!sodium_is_zero((const uint8_t*) &st[i], sizeof st[i])) {
+      fprintf(stderr, "state %zu of %zu not wiped\n", i, n);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int check_hmac(const size_t n, const size_t keylen, const size_t len) {
+  static uint8_t key[MAXN][MAXLEN], msg[MAXN][MAXLEN];
+  crypto_auth_hmacsha512_state st[MAXN], ref;
+  crypto_auth_hmacsha512_state *stp[MAXN];
+  const uint8_t *keyp[MAXN], *in[MAXN];
+  uint8_t out[MAXN][64], *outp[MAXN], expected[64];
+  size_t i;
+
+  for(i=0;i<n;i++) {
+    randombytes_buf(key[i], keylen);
+    randombytes_buf(msg[i], len);
+    stp[i]=&st[i];
+    keyp[i]=key[i];
+    in[i]=msg[i];
+    outp[i]=out[i];
+  }
+  hmacsha512mb_init(n, stp, keyp, keylen);
+  hmacsha512mb_update(n, stp, in, len);
+  hmacsha512mb_final(n, stp, outp);
+  for(i=0;i<n;i++) {
+    crypto_auth_hmacsha512_init(&ref, key[i], keylen);
+    crypto_auth_hmacsha512_update(&ref, msg[i], len);
+    crypto_auth_hmacsha512_final(&ref, expected);
+    if(memcmp(expected, out[i], 64)!=0) {
+      fprintf(stderr, "hmac %zu of %zu differs (key %zu, len %zu)\n", i, n, keylen, len);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// hmac with a 64 byte key over 64 bytes, like the macs of a login
+static double bench(const size_t n, const int multi) {
+  enum { ROUNDS = 20000 };
+  static uint8_t key[32][64], msg[32][64], out[32][64];
+  crypto_auth_hmacsha512_state st[32];
+  crypto_auth_hmacsha512_state *stp[32];
+  const uint8_t *keyp[32], *in[32];
+  uint8_t *outp[32];
+  size_t i, r;
+  for(i=0;i<n;i++) {
+    stp[i]=&st[i];
+    keyp[i]=key[i];
+    in[i]=msg[i];
+    outp[i]=out[i];
+  }
+  double t = now();
+  for(r=0;r<ROUNDS/n;r++) {
+    if(multi) {
+      hmacsha512mb_init(n, stp, keyp, 64);
+      hmacsha512mb_update(n, stp, in, 64);
+      hmacsha512mb_final(n, stp, outp);
+    } else {
+      for(i=0;i<n;i++) {
+        crypto_auth_hmacsha512_init(&st[i], key[i], 64);
+        crypto_auth_hmacsha512_update(&st[i], msg[i], 64);
+        crypto_auth_hmacsha512_final(&st[i], out[i]);
+      }
+    }
+  }
+  return (now() - t) / (double) (r*n) * 1e9;
+}
+
+int main(void) {
+  static const size_t lens[] = {0, 1, 63, 64, 111, 112, 127, 128, 129, 200, 255, 256, MAXLEN};
+  // with the kernel for this cpu, and with libsodium only
+  const uint32_t cpus[2] = {opaque_cpu_features(), 0};
+  size_t n, l, c;
+
+  if(sodium_init() < 0) return 1;
+
+  for(c=0;c<2;c++) {
+    sha512mb_select(cpus[c]);
+    for(n=1;n<=MAXN;n++) {
+      for(l=0;l<sizeof lens / sizeof lens[0];l++) {
+        if(check_hash(n, 0, lens[l])) return 1;
+        if(check_hash(n, (int) randombytes_uniform(MAXLEN), lens[l])) return 1;
+        if(check_hash(n, -1, lens[l])) return 1;
+        if(check_hmac(n, 64, lens[l])) return 1;
+        if(check_hmac(n, lens[l], 64)) return 1;
+      }
+    }
+  }
+  sha512mb_select(cpus[0]);
+
+  static const size_t sizes[] = {1, 2, 3, 4, 8, 32};
+  for(n=0;n<sizeof sizes / sizeof sizes[0];n++) {
+    const double single = bench(sizes[n], 0), multi = bench(sizes[n], 1);
+    printf("hmac batch of %2zu: libsodium %4.0fns, multi-buffer %4.0fns per message\n", sizes[n], single, multi);
+  }
+
+  printf("all ok\n");
+  return 0;
+}
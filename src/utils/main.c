@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <opaque.h>
 
 #define MAX_PWD_LEN 1024
@@ -17,6 +19,17 @@ int is_fd_open(int fd) {
 }
 #endif
 
+// exit status of a failed hardening: 75 (EX_TEMPFAIL) if the memory
+// budget was used up, see opaque_SetHardenBudget(), 1 otherwise
+static int harden_failed(const char *what, const int ret) {
+  if(ret==OPAQUE_BUSY) {
+    fprintf(stderr, "error: %s: memory budget for hardening used up, try again later\n", what);
+    return 75;
+  }
+  fprintf(stderr, "%s failed.\n", what);
+  return 1;
+}
+
 static void usage(const char *self) {
   fprintf(stderr, "%s - libopaque commandline frontend\n(c) Stefan Marsiske 2021-22\n\n", self);
   fprintf(stderr, "Create new OPAQUE records\n");
@@ -30,6 +43,8 @@ static void usage(const char *self) {
   fprintf(stderr, "\nRun OPAQUE\n");
   fprintf(stderr, "socat | %s server idU idS context 3<record 4>shared_key                                   - server portion of OPAQUE session\n", self);
   fprintf(stderr, "socat | %s user idU idS context 3< <(echo -n password) 4>export_key 5>shared_key [6<pkS]  - server portion of OPAQUE session\n", self);
+  fprintf(stderr, "\nTune the password hardening\n");
+  fprintf(stderr, "%s calibrate milliseconds max-MiB [lanes]                                                  - print the strongest parameters for this host as json\n", self);
 }
 
 static int init(const char** argv) {
@@ -77,9 +92,8 @@ static int init(const char** argv) {
   int ret = opaque_Register((const uint8_t*)pwd, pwd_len, skS, &ids, rec, export_key);
   sodium_munlock(pwd,sizeof pwd);
   if(0!=ret) {
-    fprintf(stderr,"error: failed to initialize reccord\n");
     fclose(ek_fd);
-    return 1;
+    return harden_failed("opaque_Register", ret);
   };
 
   if(1!=fwrite(export_key, sizeof export_key, 1, ek_fd)) {
@@ -253,10 +267,10 @@ static int finalize(const char** argv) {
   uint8_t export_key[crypto_hash_sha512_BYTES];
   unsigned char rrec[OPAQUE_REGISTRATION_RECORD_LEN]={0};
 
-  if(0!=opaque_FinalizeRequest((uint8_t*) usr_ctx, rpub, &ids, rrec, export_key)) {
-    fprintf(stderr, "opaque_FinalizeRequest failed.\n");
+  const int ret = opaque_FinalizeRequest((uint8_t*) usr_ctx, rpub, &ids, rrec, export_key);
+  if(0!=ret) {
     fclose(ek_fd);
-    return 1;
+    return harden_failed("opaque_FinalizeRequest", ret);
   }
 
   if(1!=fwrite(export_key, sizeof export_key, 1, ek_fd)) {
@@ -384,10 +398,10 @@ static int user_reg(const char** argv) {
   uint8_t export_key[crypto_hash_sha512_BYTES];
   uint8_t rec[OPAQUE_REGISTRATION_RECORD_LEN]={0};
 
-  if(0!=opaque_FinalizeRequest((uint8_t*) usr_ctx, rpub, &ids, rec, export_key)) {
-    fprintf(stderr, "opaque_FinalizeRequest failed.\n");
+  ret = opaque_FinalizeRequest((uint8_t*) usr_ctx, rpub, &ids, rec, export_key);
+  if(0!=ret) {
     fclose(ek_fd);
-    return 1;
+    return harden_failed("opaque_FinalizeRequest", ret);
   }
 
   if(1!=fwrite(export_key, sizeof export_key, 1, ek_fd)) {
@@ -557,12 +571,11 @@ static int user(const char** argv) {
 
   int ret = opaque_RecoverCredentials(resp, sec, context, context_len, &ids, sk, authU, export_key);
   if(0!=ret) {
-    fprintf(stderr, "opaque_RecoverCredentials failed.\n");
     sodium_munlock(sk, sizeof sk);
     sodium_munlock(export_key, sizeof export_key);
     fclose(ek_fd);
     fclose(sk_fd);
-    return 1;
+    return harden_failed("opaque_RecoverCredentials", ret);
   }
 
   ret = fwrite(export_key, sizeof export_key, 1, ek_fd);
@@ -676,12 +689,54 @@ static int server(const char** argv) {
   return 0;
 }
 
+static int calibrate(const int argc, const char** argv) {
+  char *end;
+  const unsigned long ms = strtoul(argv[2], &end, 10);
+  if(*argv[2]=='\0' || *end!='\0' || ms==0 || ms>UINT32_MAX) {
+    fprintf(stderr, "error: invalid time: %s\n", argv[2]);
+    return 1;
+  }
+  const unsigned long long mib = strtoull(argv[3], &end, 10);
+  if(*argv[3]=='\0' || *end!='\0' || mib==0 || mib > SIZE_MAX / (1024*1024)) {
+    fprintf(stderr, "error: invalid memory size: %s\n", argv[3]);
+    return 1;
+  }
+  unsigned long lanes_arg = 1;
+  if(argc==5) {
+    lanes_arg = strtoul(argv[4], &end, 10);
+    if(*argv[4]=='\0' || *end!='\0' || lanes_arg==0 || lanes_arg>255) {
+      fprintf(stderr, "error: invalid number of lanes: %s\n", argv[4]);
+      return 1;
+    }
+  }
+
+  uint8_t harden[OPAQUE_HARDEN_PARAMS_LEN];
+  uint32_t opslimit;
+  size_t memlimit;
+  uint8_t lanes;
+  if(0!=opaque_CalibrateHarden((uint32_t) ms, (size_t) mib * 1024 * 1024, (uint8_t) lanes_arg, harden) ||
+     0!=opaque_HardenParamsGet(harden, &opslimit, &memlimit, &lanes)) {
+    fprintf(stderr, "error: no parameters fit into %lums and %lluMiB\n", ms, mib);
+    return 1;
+  }
+  char hex[OPAQUE_HARDEN_PARAMS_LEN*2+1];
+  sodium_bin2hex(hex, sizeof hex, harden, sizeof harden);
+  printf("{\"alg\": \"argon2id\", \"opslimit\": %u, \"memlimit\": %zu, \"lanes\": %u, \"descriptor\": \"%s\"}\n",
+         opslimit, memlimit, lanes, hex);
+  return 0;
+}
+
 int main(const int argc, const char **argv) {
   if(argc<2) {
     usage(argv[0]);
     return 0;
   }
 
+  if(0!=opaque_init()) {
+    fprintf(stderr, "failed to initialize libopaque\n");
+    return 1;
+  }
+
   if(strcmp(argv[1],"init")==0) {
     if(argc<4) {
       usage(argv[0]);
@@ -745,6 +800,13 @@ int main(const int argc, const char **argv) {
     }
     return server(argv);
   }
+  if(strcmp(argv[1],"calibrate")==0) {
+    if(argc!=4 && argc!=5) {
+      usage(argv[0]);
+      return 1;
+    }
+    return calibrate(argc, argv);
+  }
 
   usage(argv[0]);
   return 1;